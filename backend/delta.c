@@ -0,0 +1,116 @@
+#include <string.h>
+#include <stdlib.h>
+#include <git2.h>
+#include <git2/sys/errors.h>
+#include "delta.h"
+
+/* Little-endian base-128 size used in the delta header */
+static int delta_varint(size_t *out, const unsigned char **p, const unsigned char *end)
+{
+    size_t v = 0;
+    int shift = 0;
+    unsigned char c;
+
+    do {
+        if (*p >= end || shift > 56)
+            return -1;
+        c = *(*p)++;
+        v |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    *out = v;
+    return 0;
+}
+
+int git_delta_target_size(size_t *out, const unsigned char *delta, size_t delta_len)
+{
+    const unsigned char *p = delta, *end = delta + delta_len;
+    size_t base_size;
+
+    if (delta_varint(&base_size, &p, end) < 0 ||
+        delta_varint(out, &p, end) < 0) {
+        git_error_set_str(GIT_ERROR_INVALID, "truncated delta header");
+        return -1;
+    }
+    return 0;
+}
+
+int git_delta_apply_buf(unsigned char **out, size_t *out_len,
+                        const unsigned char *base, size_t base_len,
+                        const unsigned char *delta, size_t delta_len)
+{
+    const unsigned char *p = delta, *end = delta + delta_len;
+    size_t base_size, target_size;
+
+    if (delta_varint(&base_size, &p, end) < 0 ||
+        delta_varint(&target_size, &p, end) < 0) {
+        git_error_set_str(GIT_ERROR_INVALID, "truncated delta header");
+        return -1;
+    }
+
+    if (base_size != base_len) {
+        git_error_set_str(GIT_ERROR_INVALID, "delta base size mismatch");
+        return -1;
+    }
+
+    unsigned char *result = malloc(target_size ? target_size : 1);
+    if (!result) {
+        git_error_set_oom();
+        return -1;
+    }
+
+    size_t pos = 0;
+    while (p < end) {
+        unsigned char cmd = *p++;
+
+        if (cmd & 0x80) {
+            /* copy from base: bits 0-3 select offset bytes, 4-6 size bytes */
+            size_t off = 0, len = 0;
+            int i;
+
+            for (i = 0; i < 4; i++) {
+                if (cmd & (1 << i)) {
+                    if (p >= end)
+                        goto corrupt;
+                    off |= (size_t)*p++ << (8 * i);
+                }
+            }
+            for (i = 0; i < 3; i++) {
+                if (cmd & (0x10 << i)) {
+                    if (p >= end)
+                        goto corrupt;
+                    len |= (size_t)*p++ << (8 * i);
+                }
+            }
+            if (len == 0)
+                len = 0x10000;
+
+            if (off > base_len || len > base_len - off || len > target_size - pos)
+                goto corrupt;
+            memcpy(result + pos, base + off, len);
+            pos += len;
+        } else if (cmd) {
+            /* insert cmd literal bytes */
+            if ((size_t)(end - p) < cmd || cmd > target_size - pos)
+                goto corrupt;
+            memcpy(result + pos, p, cmd);
+            p += cmd;
+            pos += cmd;
+        } else {
+            goto corrupt;
+        }
+    }
+
+    if (pos != target_size)
+        goto corrupt;
+
+    *out = result;
+    *out_len = target_size;
+    return 0;
+
+corrupt:
+    free(result);
+    git_error_set_str(GIT_ERROR_INVALID, "corrupt delta");
+    return -1;
+}
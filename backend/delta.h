@@ -0,0 +1,18 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+
+/*
+ * Apply a git delta (as found in OFS_DELTA/REF_DELTA pack entries) to
+ * base.  On success *out is a malloc'd buffer of *out_len bytes that the
+ * caller frees.  Returns 0 or -1 with a libgit2 error set.
+ */
+int git_delta_apply_buf(unsigned char **out, size_t *out_len,
+                        const unsigned char *base, size_t base_len,
+                        const unsigned char *delta, size_t delta_len);
+
+/* Read the target size from a delta header without applying it */
+int git_delta_target_size(size_t *out, const unsigned char *delta, size_t delta_len);
+
+#endif
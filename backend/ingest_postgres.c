@@ -0,0 +1,385 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <git2/sys/errors.h>
+#include "ingest_postgres.h"
+
+struct pg_ingest {
+    PGconn *conn;
+    int repo_id;
+    size_t batch_objects;
+    size_t flush_bytes;
+    size_t chunk_bytes; /* blobs above this go to object_chunks */
+
+    int own_tx;         /* we issued BEGIN and must COMMIT/ROLLBACK */
+    int in_tx;
+    int in_copy;
+    int failed;
+
+    size_t batch_count; /* objects in the current (unmerged) batch */
+    size_t total_count; /* objects handed to pg_ingest_add overall */
+
+    char *buf;          /* pending COPY data not yet sent */
+    size_t buf_len;
+    size_t buf_cap;
+};
+
+/* Binary COPY file header: signature, flags, header extension length */
+static const char copy_header[19] = {
+    'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0',
+    0, 0, 0, 0,
+    0, 0, 0, 0
+};
+
+static int ingest_exec(pg_ingest *ing, const char *sql)
+{
+    PGresult *res = PQexec(ing->conn, sql);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        ing->failed = 1;
+        return -1;
+    }
+    PQclear(res);
+    return 0;
+}
+
+static int buf_reserve(pg_ingest *ing, size_t extra)
+{
+    if (ing->buf_len + extra <= ing->buf_cap)
+        return 0;
+
+    size_t cap = ing->buf_cap ? ing->buf_cap : 64 * 1024;
+    while (cap < ing->buf_len + extra)
+        cap *= 2;
+
+    char *nbuf = realloc(ing->buf, cap);
+    if (!nbuf) {
+        git_error_set_oom();
+        ing->failed = 1;
+        return -1;
+    }
+    ing->buf = nbuf;
+    ing->buf_cap = cap;
+    return 0;
+}
+
+static void buf_put(pg_ingest *ing, const void *data, size_t len)
+{
+    memcpy(ing->buf + ing->buf_len, data, len);
+    ing->buf_len += len;
+}
+
+static void buf_put_int16(pg_ingest *ing, int16_t v)
+{
+    uint16_t n = htons((uint16_t)v);
+    buf_put(ing, &n, sizeof(n));
+}
+
+static void buf_put_int32(pg_ingest *ing, int32_t v)
+{
+    uint32_t n = htonl((uint32_t)v);
+    buf_put(ing, &n, sizeof(n));
+}
+
+static int send_buffer(pg_ingest *ing)
+{
+    if (ing->buf_len == 0)
+        return 0;
+
+    if (PQputCopyData(ing->conn, ing->buf, (int)ing->buf_len) != 1) {
+        git_error_set_str(GIT_ERROR_ODB, PQerrorMessage(ing->conn));
+        ing->failed = 1;
+        return -1;
+    }
+    ing->buf_len = 0;
+    return 0;
+}
+
+static int start_copy(pg_ingest *ing)
+{
+    PGresult *res = PQexec(ing->conn,
+        "COPY gitgres_ingest (oid, type, size, content, base_oid, depth, chunk_no) "
+        "FROM STDIN (FORMAT binary)");
+
+    if (PQresultStatus(res) != PGRES_COPY_IN) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        ing->failed = 1;
+        return -1;
+    }
+    PQclear(res);
+
+    ing->in_copy = 1;
+    if (buf_reserve(ing, sizeof(copy_header)) < 0)
+        return -1;
+    buf_put(ing, copy_header, sizeof(copy_header));
+    return 0;
+}
+
+static int end_copy(pg_ingest *ing)
+{
+    PGresult *res;
+    int error = 0;
+
+    if (buf_reserve(ing, 2) < 0)
+        return -1;
+    buf_put_int16(ing, -1); /* file trailer */
+
+    if (send_buffer(ing) < 0)
+        return -1;
+
+    ing->in_copy = 0;
+    if (PQputCopyEnd(ing->conn, NULL) != 1) {
+        git_error_set_str(GIT_ERROR_ODB, PQerrorMessage(ing->conn));
+        ing->failed = 1;
+        return -1;
+    }
+
+    while ((res = PQgetResult(ing->conn)) != NULL) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK && error == 0) {
+            git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+            ing->failed = 1;
+            error = -1;
+        }
+        PQclear(res);
+    }
+    return error;
+}
+
+int pg_ingest_new(pg_ingest **out, PGconn *conn, int repo_id,
+                  size_t batch_objects, size_t flush_bytes, size_t chunk_bytes)
+{
+    pg_ingest *ing = calloc(1, sizeof(pg_ingest));
+    if (!ing) {
+        git_error_set_oom();
+        return -1;
+    }
+
+    ing->conn = conn;
+    ing->repo_id = repo_id;
+    ing->batch_objects = batch_objects ? batch_objects : 10000;
+    ing->flush_bytes = flush_bytes ? flush_bytes : 1024 * 1024;
+    ing->chunk_bytes = chunk_bytes ? chunk_bytes : 1024 * 1024;
+
+    /* Join an enclosing transaction if the caller already opened one */
+    if (PQtransactionStatus(conn) == PQTRANS_IDLE) {
+        if (ingest_exec(ing, "BEGIN") < 0) {
+            free(ing);
+            return -1;
+        }
+        ing->own_tx = 1;
+    }
+    ing->in_tx = 1;
+
+    if (ingest_exec(ing,
+            "CREATE TEMP TABLE IF NOT EXISTS gitgres_ingest ("
+            "oid bytea, type smallint, size integer, content bytea, "
+            "base_oid bytea, depth smallint, chunk_no integer"
+            ") ON COMMIT DROP") < 0 ||
+        ingest_exec(ing, "TRUNCATE gitgres_ingest") < 0) {
+        pg_ingest_free(ing);
+        return -1;
+    }
+
+    *out = ing;
+    return 0;
+}
+
+/*
+ * Stage one row.  Object rows have chunk_no -1.  A chunked blob is an
+ * object row with NULL content followed by one row per chunk.
+ */
+static int add_row(pg_ingest *ing, const git_oid *oid, git_object_t type,
+                   size_t size, const void *data, size_t len,
+                   const git_oid *base_oid, int depth, int chunk_no)
+{
+    if (ing->failed)
+        return -1;
+
+    if (size > INT32_MAX - 64 || len > INT32_MAX - 64) {
+        git_error_set(GIT_ERROR_ODB, "object %s too large for postgres storage",
+            git_oid_tostr_s(oid));
+        return -1;
+    }
+
+    if (!ing->in_copy && start_copy(ing) < 0)
+        return -1;
+
+    /* field count, then (length, value) per column; -1 length is NULL */
+    if (buf_reserve(ing, 2 + 4 + GIT_OID_SHA1_SIZE + 4 + 2 + 4 + 4 + 4 + len +
+            4 + GIT_OID_SHA1_SIZE + 4 + 2 + 4 + 4) < 0)
+        return -1;
+
+    buf_put_int16(ing, 7);
+    buf_put_int32(ing, GIT_OID_SHA1_SIZE);
+    buf_put(ing, oid->id, GIT_OID_SHA1_SIZE);
+    buf_put_int32(ing, 2);
+    buf_put_int16(ing, (int16_t)type);
+    buf_put_int32(ing, 4);
+    buf_put_int32(ing, (int32_t)size);
+    if (data) {
+        buf_put_int32(ing, (int32_t)len);
+        buf_put(ing, data, len);
+    } else {
+        buf_put_int32(ing, -1);
+    }
+    if (base_oid) {
+        buf_put_int32(ing, GIT_OID_SHA1_SIZE);
+        buf_put(ing, base_oid->id, GIT_OID_SHA1_SIZE);
+    } else {
+        buf_put_int32(ing, -1);
+    }
+    buf_put_int32(ing, 2);
+    buf_put_int16(ing, (int16_t)depth);
+    buf_put_int32(ing, 4);
+    buf_put_int32(ing, chunk_no);
+
+    ing->batch_count++;
+    if (chunk_no < 0)
+        ing->total_count++;
+
+    if (ing->buf_len >= ing->flush_bytes && send_buffer(ing) < 0)
+        return -1;
+
+    if (ing->batch_count >= ing->batch_objects)
+        return pg_ingest_flush(ing);
+
+    return 0;
+}
+
+int pg_ingest_add(pg_ingest *ing, const git_oid *oid, git_object_t type,
+                  const void *data, size_t len)
+{
+    if (type != GIT_OBJECT_BLOB || len <= ing->chunk_bytes)
+        return add_row(ing, oid, type, len, data, len, NULL, 0, -1);
+
+    if (add_row(ing, oid, type, len, NULL, 0, NULL, 0, -1) < 0)
+        return -1;
+    for (size_t off = 0; off < len; off += ing->chunk_bytes) {
+        size_t n = len - off < ing->chunk_bytes ? len - off : ing->chunk_bytes;
+        if (add_row(ing, oid, type, len, (const unsigned char *)data + off, n,
+                NULL, 0, (int)(off / ing->chunk_bytes)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int pg_ingest_add_delta(pg_ingest *ing, const git_oid *oid, git_object_t type,
+                        size_t size, const void *delta, size_t delta_len,
+                        const git_oid *base_oid, int depth)
+{
+    return add_row(ing, oid, type, size, delta, delta_len, base_oid, depth, -1);
+}
+
+/*
+ * End the running COPY (if any) and merge the staged batch into
+ * objects.  After a flush, other queries can run on the connection
+ * again and will see the merged rows.
+ */
+int pg_ingest_flush(pg_ingest *ing)
+{
+    char rid[16];
+    const char *params[1];
+    PGresult *res;
+
+    if (ing->failed)
+        return -1;
+
+    if (ing->in_copy && end_copy(ing) < 0)
+        return -1;
+
+    if (ing->batch_count == 0)
+        return 0;
+
+    snprintf(rid, sizeof(rid), "%d", ing->repo_id);
+    params[0] = rid;
+
+    /*
+     * Objects an alternate of the repository already stores are not
+     * stored again; git_share_objects copies their parsed rows instead.
+     * Chunks can arrive in a later batch than their object row, so they
+     * join against objects rather than the staged row.  Chunks of objects
+     * that were already stored whole, or shared, are dropped.
+     */
+    static const char *const merge[] = {
+        "INSERT INTO objects (repo_id, oid, type, size, content, base_oid, depth, chunked) "
+        "SELECT $1, oid, type, size, coalesce(content, ''), base_oid, depth, content IS NULL "
+        "FROM gitgres_ingest WHERE chunk_no < 0 "
+        "AND oid NOT IN (SELECT git_share_objects($1::integer, "
+        "ARRAY(SELECT oid FROM gitgres_ingest WHERE chunk_no < 0))) "
+        "ON CONFLICT (repo_id, oid) DO NOTHING",
+
+        "INSERT INTO object_chunks (repo_id, oid, chunk_no, data) "
+        "SELECT $1, g.oid, g.chunk_no, g.content FROM gitgres_ingest g "
+        "JOIN objects o ON o.repo_id = $1 AND o.oid = g.oid AND o.chunked "
+        "WHERE g.chunk_no >= 0 "
+        "ON CONFLICT (repo_id, oid, chunk_no) DO NOTHING"
+    };
+
+    for (size_t i = 0; i < sizeof(merge) / sizeof(merge[0]); i++) {
+        res = PQexecParams(ing->conn, merge[i], 1, NULL, params, NULL, NULL, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+            PQclear(res);
+            ing->failed = 1;
+            return -1;
+        }
+        PQclear(res);
+    }
+
+    if (ingest_exec(ing, "TRUNCATE gitgres_ingest") < 0)
+        return -1;
+
+    ing->batch_count = 0;
+    return 0;
+}
+
+int pg_ingest_pause(pg_ingest *ing)
+{
+    if (ing->failed)
+        return -1;
+    return ing->in_copy ? end_copy(ing) : 0;
+}
+
+int pg_ingest_commit(pg_ingest *ing)
+{
+    if (pg_ingest_flush(ing) < 0)
+        return -1;
+
+    if (ing->own_tx) {
+        if (ingest_exec(ing, "COMMIT") < 0)
+            return -1;
+    }
+    ing->in_tx = 0;
+    return 0;
+}
+
+size_t pg_ingest_count(const pg_ingest *ing)
+{
+    return ing->total_count;
+}
+
+void pg_ingest_free(pg_ingest *ing)
+{
+    if (!ing)
+        return;
+
+    if (ing->in_copy) {
+        PGresult *res;
+        PQputCopyEnd(ing->conn, "ingest aborted");
+        while ((res = PQgetResult(ing->conn)) != NULL)
+            PQclear(res);
+    }
+
+    if (ing->in_tx && ing->own_tx) {
+        PGresult *res = PQexec(ing->conn, "ROLLBACK");
+        PQclear(res);
+    }
+
+    free(ing->buf);
+    free(ing);
+}
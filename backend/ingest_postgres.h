@@ -0,0 +1,37 @@
+#ifndef INGEST_POSTGRES_H
+#define INGEST_POSTGRES_H
+
+#include <git2.h>
+#include <libpq-fe.h>
+
+/*
+ * Bulk object ingest.  Objects are streamed into a temporary staging
+ * table with binary COPY and merged into `objects` with a single
+ * INSERT ... SELECT per batch, all inside one transaction.
+ */
+typedef struct pg_ingest pg_ingest;
+
+int pg_ingest_new(pg_ingest **out, PGconn *conn, int repo_id,
+                  size_t batch_objects, size_t flush_bytes, size_t chunk_bytes);
+/* Blobs larger than chunk_bytes are staged as object_chunks rows */
+int pg_ingest_add(pg_ingest *ing, const git_oid *oid, git_object_t type,
+                  const void *data, size_t len);
+/*
+ * Stage an object stored as a git delta against base_oid.  size is the
+ * full (resolved) object size; depth is the chain length below it.
+ */
+int pg_ingest_add_delta(pg_ingest *ing, const git_oid *oid, git_object_t type,
+                        size_t size, const void *delta, size_t delta_len,
+                        const git_oid *base_oid, int depth);
+int pg_ingest_flush(pg_ingest *ing);
+/*
+ * End the COPY in progress, if any, so the connection can run other
+ * queries.  Staged rows stay staged, unmerged; the next add starts a
+ * new COPY.
+ */
+int pg_ingest_pause(pg_ingest *ing);
+int pg_ingest_commit(pg_ingest *ing);
+size_t pg_ingest_count(const pg_ingest *ing);
+void pg_ingest_free(pg_ingest *ing);
+
+#endif
@@ -4,15 +4,20 @@
  *
  * Usage:
  *   gitgres-backend init     <conninfo> <reponame>
- *   gitgres-backend push     <conninfo> <reponame> <local-repo-path>
- *   gitgres-backend clone    <conninfo> <reponame> <dest-dir>
- *   gitgres-backend ls-refs  <conninfo> <reponame>
+ *   gitgres-backend push     [--jobs N] <conninfo> <reponame> <local-repo-path>
+ *   gitgres-backend clone    [--jobs N] <conninfo> <reponame> <dest-dir>
+ *   gitgres-backend import   [--jobs N] <conninfo> <reponame> <local-repo-path>
+ *   gitgres-backend pack-cache <conninfo> <reponame>
+ *   gitgres-backend ls-refs  <conninfo> <reponame> [<glob>]
+ *   gitgres-backend cat-file [--pipeline | --batch-check] <conninfo> <reponame> < oids
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 #include <git2.h>
 #include <git2/sys/repository.h>
 #include <git2/sys/odb_backend.h>
@@ -20,6 +25,10 @@
 #include <libpq-fe.h>
 #include "odb_postgres.h"
 #include "refdb_postgres.h"
+#include "transfer.h"
+#include "parallel.h"
+#include "pack_cache.h"
+#include "stats.h"
 
 static void die(const char *fmt, ...) {
 	va_list ap;
@@ -39,7 +48,7 @@ static void check_lg2(int error, const char *msg) {
 }
 
 static PGconn *pg_connect(const char *conninfo) {
-	PGconn *conn = PQconnectdb(conninfo);
+	PGconn *conn = gitgres_connect(conninfo);
 	if (PQstatus(conn) != CONNECTION_OK)
 		die("connection to database failed: %s", PQerrorMessage(conn));
 	return conn;
@@ -95,7 +104,9 @@ static git_repository *open_pg_repo(PGconn *conn, int repo_id) {
 	check_lg2(git_repository_new(&repo), "create repo");
 
 	check_lg2(git_odb_new(&odb), "create odb");
-	check_lg2(git_odb_backend_postgres(&odb_backend, conn, repo_id),
+	git_odb_backend_postgres_options opts;
+	git_odb_backend_postgres_options_from_env(&opts);
+	check_lg2(git_odb_backend_postgres_ext(&odb_backend, conn, repo_id, &opts),
 		"create odb backend");
 	check_lg2(git_odb_add_backend(odb, odb_backend, 1),
 		"add odb backend");
@@ -129,41 +140,103 @@ static void cmd_init(const char *conninfo, const char *reponame) {
 /* push: copy objects and refs from a local repo into postgres        */
 /* ------------------------------------------------------------------ */
 
-struct copy_ctx {
-	git_odb *src;
-	git_odb *dst;
-	int count;
-	int errors;
-};
+static void add_oid(git_oid **list, size_t *n, size_t *cap, const git_oid *oid) {
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 32;
+		*list = realloc(*list, *cap * sizeof(git_oid));
+		if (!*list)
+			die("out of memory");
+	}
+	git_oid_cpy(&(*list)[(*n)++], oid);
+}
 
-static int copy_object_cb(const git_oid *oid, void *payload) {
-	struct copy_ctx *ctx = (struct copy_ctx *)payload;
-	git_odb_object *obj = NULL;
+/* Every OID a ref in postgres points at, direct refs only */
+static void collect_pg_tips(PGconn *conn, int repo_id,
+	git_oid **tips, size_t *ntips, size_t *cap)
+{
+	uint32_t repo_id_n = htonl((uint32_t)repo_id);
+	const char *params[1] = { (const char *)&repo_id_n };
+	int lengths[1] = { sizeof(repo_id_n) };
+	int formats[1] = { 1 };
 
-	int err = git_odb_read(&obj, ctx->src, oid);
-	if (err < 0) {
-		fprintf(stderr, "warning: could not read object %s\n",
-			git_oid_tostr_s(oid));
-		ctx->errors++;
-		return 0; /* keep going */
+	PGresult *res = PQexecParams(conn,
+		"SELECT DISTINCT oid FROM refs "
+		"WHERE repo_id = $1 AND oid IS NOT NULL",
+		1, NULL, params, lengths, formats, 1);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		die("list remote tips: %s", PQerrorMessage(conn));
+
+	for (int i = 0; i < PQntuples(res); i++) {
+		git_oid oid;
+		if (PQgetlength(res, i, 0) != GIT_OID_SHA1_SIZE)
+			continue;
+		git_oid_fromraw(&oid, (const unsigned char *)PQgetvalue(res, i, 0));
+		add_oid(tips, ntips, cap, &oid);
 	}
+	PQclear(res);
+}
 
-	git_oid written;
-	err = git_odb_write(&written, ctx->dst,
-		git_odb_object_data(obj),
-		git_odb_object_size(obj),
-		git_odb_object_type(obj));
-	git_odb_object_free(obj);
+/* Local refs to copy into postgres, held open until they are written */
+struct ref_list {
+	git_reference **refs;
+	size_t n;
+	size_t cap;
+};
 
-	if (err < 0) {
-		fprintf(stderr, "warning: could not write object %s\n",
-			git_oid_tostr_s(oid));
-		ctx->errors++;
-		return 0;
+static void add_ref(struct ref_list *list, git_reference *ref) {
+	if (list->n == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 32;
+		list->refs = realloc(list->refs, list->cap * sizeof(git_reference *));
+		if (!list->refs)
+			die("out of memory");
 	}
+	list->refs[list->n++] = ref;
+}
 
-	ctx->count++;
-	return 0;
+static void free_ref_list(struct ref_list *list) {
+	for (size_t i = 0; i < list->n; i++)
+		git_reference_free(list->refs[i]);
+	free(list->refs);
+}
+
+/*
+ * Point every ref in the list at its local value, direct or symbolic,
+ * in one forced git_refdb_postgres_update_refs batch.  That takes the
+ * refs' locks in key order and writes their reflog rows in the same
+ * transaction, so either every ref moves or none do.
+ */
+static void write_refs(PGconn *conn, int repo_id, git_repository *local_repo,
+	const struct ref_list *list, const char *message)
+{
+	if (list->n == 0)
+		return;
+
+	git_refdb_postgres_update *updates = calloc(list->n,
+		sizeof(git_refdb_postgres_update));
+	if (!updates)
+		die("out of memory");
+
+	for (size_t i = 0; i < list->n; i++) {
+		git_reference *ref = list->refs[i];
+		updates[i].name = git_reference_name(ref);
+		if (git_reference_type(ref) == GIT_REFERENCE_DIRECT)
+			updates[i].new_oid = git_reference_target(ref);
+		else
+			updates[i].symbolic = git_reference_symbolic_target(ref);
+	}
+
+	git_signature *who = NULL;
+	if (git_signature_default(&who, local_repo) < 0)
+		who = NULL;
+
+	check_lg2(git_refdb_postgres_update_refs(conn, repo_id, updates, list->n,
+		1, who, message), "update refs");
+	for (size_t i = 0; i < list->n; i++)
+		if (updates[i].status != 0)
+			die("update refs: %s was not updated", updates[i].name);
+
+	git_signature_free(who);
+	free(updates);
 }
 
 static void push_head(PGconn *conn, int repo_id, git_repository *local_repo) {
@@ -191,7 +264,7 @@ static void push_head(PGconn *conn, int repo_id, git_repository *local_repo) {
 }
 
 static void cmd_push(const char *conninfo, const char *reponame,
-	const char *local_path)
+	const char *local_path, int jobs)
 {
 	PGconn *conn = pg_connect(conninfo);
 	int repo_id = get_or_create_repo(conn, reponame);
@@ -201,75 +274,115 @@ static void cmd_push(const char *conninfo, const char *reponame,
 	check_lg2(git_repository_open(&local_repo, local_path),
 		"open local repo");
 
-	/* Copy all objects */
-	git_odb *local_odb = NULL;
+	/*
+	 * Send the objects reachable from local refs that the refs already
+	 * in postgres don't cover, as one pack through the writepack.
+	 */
+	git_oid *wants = NULL, *haves = NULL;
+	size_t nwants = 0, wants_cap = 0, nhaves = 0, haves_cap = 0;
+	struct ref_list refs = {0};
+	git_reference_iterator *iter = NULL;
+	git_reference *ref = NULL;
+
+	check_lg2(git_reference_iterator_new(&iter, local_repo),
+		"create ref iterator");
+	while (git_reference_next(&ref, iter) == 0) {
+		if (git_reference_type(ref) == GIT_REFERENCE_DIRECT)
+			add_oid(&wants, &nwants, &wants_cap, git_reference_target(ref));
+		add_ref(&refs, ref);
+	}
+	git_reference_iterator_free(iter);
+
+	collect_pg_tips(conn, repo_id, &haves, &nhaves, &haves_cap);
+
 	git_odb *pg_odb = NULL;
-	check_lg2(git_repository_odb(&local_odb, local_repo), "get local odb");
 	check_lg2(git_repository_odb(&pg_odb, pg_repo), "get pg odb");
 
-	struct copy_ctx ctx = { .src = local_odb, .dst = pg_odb,
-		.count = 0, .errors = 0 };
-	check_lg2(git_odb_foreach(local_odb, copy_object_cb, &ctx),
-		"iterate local objects");
+	if (jobs > 1) {
+		gitgres_parallel_stats stats;
+		check_lg2(gitgres_parallel_push(&stats, conninfo, repo_id, local_path,
+			wants, nwants, haves, nhaves, jobs), "transfer objects");
+		printf("Pushed %zu objects\n", stats.objects);
+	} else {
+		gitgres_transfer_stats stats;
+		check_lg2(gitgres_transfer_pack(&stats, local_repo, pg_odb,
+			wants, nwants, haves, nhaves), "transfer objects");
+		printf("Pushed %zu objects\n", stats.objects);
+	}
 
-	printf("Pushed %d objects", ctx.count);
-	if (ctx.errors > 0)
-		printf(" (%d errors)", ctx.errors);
-	printf("\n");
+	free(wants);
+	free(haves);
 
 	/* Copy refs (not HEAD -- handled separately) */
+	write_refs(conn, repo_id, local_repo, &refs, "push");
+
+	/* Push HEAD as a symbolic ref directly via SQL */
+	push_head(conn, repo_id, local_repo);
+
+	printf("Pushed %zu refs\n", refs.n);
+
+	free_ref_list(&refs);
+	git_odb_free(pg_odb);
+	git_repository_free(local_repo);
+	git_repository_free(pg_repo);
+	PQfinish(conn);
+}
+
+/* ------------------------------------------------------------------ */
+/* import: bulk load a local repo, resumable                          */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Load every object reachable from local refs, then all refs in one
+ * batch.  Objects are committed a batch at a time and the ones
+ * already stored are skipped, so rerunning after a failure resumes.
+ * Refs go in last, so they never point at objects that aren't there.
+ */
+static void cmd_import(const char *conninfo, const char *reponame,
+	const char *local_path, int jobs)
+{
+	PGconn *conn = pg_connect(conninfo);
+	int repo_id = get_or_create_repo(conn, reponame);
+
+	git_repository *local_repo = NULL;
+	check_lg2(git_repository_open(&local_repo, local_path),
+		"open local repo");
+
+	git_oid *wants = NULL;
+	size_t nwants = 0, wants_cap = 0;
+	struct ref_list refs = {0};
 	git_reference_iterator *iter = NULL;
 	git_reference *ref = NULL;
-	int ref_count = 0;
 
 	check_lg2(git_reference_iterator_new(&iter, local_repo),
 		"create ref iterator");
-
 	while (git_reference_next(&ref, iter) == 0) {
-		const char *name = git_reference_name(ref);
-
-		if (git_reference_type(ref) == GIT_REFERENCE_DIRECT) {
-			const git_oid *oid = git_reference_target(ref);
-			git_reference *new_ref = NULL;
-			int err = git_reference_create(&new_ref, pg_repo,
-				name, oid, 1, "push");
-			if (err < 0) {
-				fprintf(stderr, "warning: could not push ref %s: %s\n",
-					name,
-					git_error_last() ? git_error_last()->message
-						: "unknown");
-			} else {
-				ref_count++;
-				git_reference_free(new_ref);
-			}
-		} else if (git_reference_type(ref) == GIT_REFERENCE_SYMBOLIC) {
-			const char *target = git_reference_symbolic_target(ref);
-			git_reference *new_ref = NULL;
-			int err = git_reference_symbolic_create(&new_ref, pg_repo,
-				name, target, 1, "push");
-			if (err < 0) {
-				fprintf(stderr, "warning: could not push ref %s: %s\n",
-					name,
-					git_error_last() ? git_error_last()->message
-						: "unknown");
-			} else {
-				ref_count++;
-				git_reference_free(new_ref);
-			}
-		}
-		git_reference_free(ref);
+		if (git_reference_type(ref) == GIT_REFERENCE_DIRECT)
+			add_oid(&wants, &nwants, &wants_cap, git_reference_target(ref));
+		add_ref(&refs, ref);
 	}
 	git_reference_iterator_free(iter);
 
-	/* Push HEAD as a symbolic ref directly via SQL */
-	push_head(conn, repo_id, local_repo);
+	if (git_reference_lookup(&ref, local_repo, "HEAD") == 0) {
+		if (git_reference_type(ref) == GIT_REFERENCE_DIRECT)
+			add_oid(&wants, &nwants, &wants_cap, git_reference_target(ref));
+		add_ref(&refs, ref);
+	}
 
-	printf("Pushed %d refs\n", ref_count);
+	gitgres_parallel_stats stats;
+	check_lg2(gitgres_parallel_import(&stats, conninfo, repo_id, local_path,
+		wants, nwants, jobs), "import objects");
+	printf("Imported %zu objects", stats.objects);
+	if (stats.skipped > 0)
+		printf(" (%zu already stored)", stats.skipped);
+	printf("\n");
 
-	git_odb_free(local_odb);
-	git_odb_free(pg_odb);
+	write_refs(conn, repo_id, local_repo, &refs, "import");
+	printf("Imported %zu refs\n", refs.n);
+
+	free_ref_list(&refs);
+	free(wants);
 	git_repository_free(local_repo);
-	git_repository_free(pg_repo);
 	PQfinish(conn);
 }
 
@@ -277,26 +390,31 @@ static void cmd_push(const char *conninfo, const char *reponame,
 /* clone: copy objects and refs from postgres into a new local repo   */
 /* ------------------------------------------------------------------ */
 
-static int clone_object_cb(const git_oid *oid, void *payload) {
-	struct copy_ctx *ctx = (struct copy_ctx *)payload;
-	git_odb_object *obj = NULL;
+struct copy_ctx {
+	git_odb *dst;
+	int count;
+	int errors;
+};
 
-	int err = git_odb_read(&obj, ctx->src, oid);
-	if (err < 0) {
-		fprintf(stderr, "warning: could not read object %s from pg\n",
-			git_oid_tostr_s(oid));
-		ctx->errors++;
-		return 0;
-	}
+struct oid_list {
+	git_oid *oids;
+	size_t n;
+	size_t cap;
+};
+
+static int collect_oid_cb(const git_oid *oid, void *payload) {
+	struct oid_list *list = (struct oid_list *)payload;
+	add_oid(&list->oids, &list->n, &list->cap, oid);
+	return 0;
+}
 
+static int clone_object_cb(const git_oid *oid, const void *data, size_t len,
+	git_object_t type, void *payload)
+{
+	struct copy_ctx *ctx = (struct copy_ctx *)payload;
 	git_oid written;
-	err = git_odb_write(&written, ctx->dst,
-		git_odb_object_data(obj),
-		git_odb_object_size(obj),
-		git_odb_object_type(obj));
-	git_odb_object_free(obj);
 
-	if (err < 0) {
+	if (git_odb_write(&written, ctx->dst, data, len, type) < 0) {
 		fprintf(stderr, "warning: could not write object %s to local\n",
 			git_oid_tostr_s(oid));
 		ctx->errors++;
@@ -308,7 +426,7 @@ static int clone_object_cb(const git_oid *oid, void *payload) {
 }
 
 static void cmd_clone(const char *conninfo, const char *reponame,
-	const char *dest_path)
+	const char *dest_path, int jobs)
 {
 	PGconn *conn = pg_connect(conninfo);
 	int repo_id = get_repo(conn, reponame);
@@ -328,15 +446,71 @@ static void cmd_clone(const char *conninfo, const char *reponame,
 	check_lg2(git_repository_odb(&pg_odb, pg_repo), "get pg odb");
 	check_lg2(git_repository_odb(&local_odb, local_repo), "get local odb");
 
-	struct copy_ctx ctx = { .src = pg_odb, .dst = local_odb,
-		.count = 0, .errors = 0 };
-	check_lg2(git_odb_foreach(pg_odb, clone_object_cb, &ctx),
-		"iterate pg objects");
+	char objects_dir[4096];
+	snprintf(objects_dir, sizeof(objects_dir), "%sobjects",
+		git_repository_path(local_repo));
 
-	printf("Cloned %d objects", ctx.count);
-	if (ctx.errors > 0)
-		printf(" (%d errors)", ctx.errors);
-	printf("\n");
+	/*
+	 * A cached pack (see pack-cache) covers the repo as of its tips in
+	 * one read.  Only objects newer than those tips are packed here.
+	 */
+	gitgres_pack_cache_stats cache;
+	git_oid *cache_tips = NULL;
+	size_t ncache_tips = 0;
+	int cache_err = gitgres_pack_cache_fetch(&cache, &cache_tips, &ncache_tips,
+		conn, repo_id, objects_dir);
+
+	if (cache_err == 0) {
+		git_oid *wants = NULL;
+		size_t nwants = 0, wants_cap = 0;
+		gitgres_transfer_stats stats;
+
+		printf("Cloned %zu objects from cached pack\n", cache.objects);
+		check_lg2(git_odb_refresh(local_odb), "refresh local odb");
+
+		collect_pg_tips(conn, repo_id, &wants, &nwants, &wants_cap);
+		check_lg2(gitgres_transfer_pack(&stats, pg_repo, local_odb,
+			wants, nwants, cache_tips, ncache_tips), "transfer newer objects");
+		printf("Cloned %zu newer objects\n", stats.objects);
+
+		free(wants);
+		free(cache_tips);
+	} else {
+		if (cache_err != GIT_ENOTFOUND) {
+			const git_error *e = git_error_last();
+			fprintf(stderr, "warning: not using cached pack: %s\n",
+				e ? e->message : "unknown");
+		}
+
+		if (jobs > 1) {
+			/* Each job reads an oid range and writes it as its own pack */
+			size_t count;
+			check_lg2(gitgres_parallel_clone(&count, conninfo, repo_id,
+				objects_dir, jobs), "read pg objects");
+			printf("Cloned %zu objects\n", count);
+		} else {
+			/*
+			 * List every oid first, then read them back in pipelined batches
+			 * rather than one round trip per object.
+			 */
+			struct oid_list all = { NULL, 0, 0 };
+			check_lg2(git_odb_foreach(pg_odb, collect_oid_cb, &all),
+				"iterate pg objects");
+
+			git_odb_backend *pg_backend = NULL;
+			check_lg2(git_odb_get_backend(&pg_backend, pg_odb, 0), "get pg backend");
+
+			struct copy_ctx ctx = { .dst = local_odb, .count = 0, .errors = 0 };
+			check_lg2(git_odb_backend_postgres_read_many(pg_backend, all.oids, all.n,
+				clone_object_cb, &ctx), "read pg objects");
+			free(all.oids);
+
+			printf("Cloned %d objects", ctx.count);
+			if (ctx.errors > 0)
+				printf(" (%d errors)", ctx.errors);
+			printf("\n");
+		}
+	}
 
 	git_odb_free(pg_odb);
 	git_odb_free(local_odb);
@@ -433,42 +607,265 @@ static void cmd_clone(const char *conninfo, const char *reponame,
 	PQfinish(conn);
 }
 
+/* ------------------------------------------------------------------ */
+/* pack-cache: build the pack that clones start from                  */
+/* ------------------------------------------------------------------ */
+
+static void cmd_pack_cache(const char *conninfo, const char *reponame) {
+	PGconn *conn = pg_connect(conninfo);
+	int repo_id = get_repo(conn, reponame);
+	if (repo_id < 0)
+		die("repository '%s' not found", reponame);
+
+	git_repository *pg_repo = open_pg_repo(conn, repo_id);
+	const char *tmpdir = getenv("TMPDIR");
+	if (!tmpdir || !*tmpdir)
+		tmpdir = "/tmp";
+
+	gitgres_pack_cache_stats stats;
+	check_lg2(gitgres_pack_cache_build(&stats, conn, repo_id, pg_repo, tmpdir),
+		"build cached pack");
+	printf("Cached pack of %zu objects (%zu bytes)\n", stats.objects, stats.bytes);
+
+	git_repository_free(pg_repo);
+	PQfinish(conn);
+}
+
 /* ------------------------------------------------------------------ */
 /* ls-refs: list all refs stored in postgres for a repo               */
 /* ------------------------------------------------------------------ */
 
-static void cmd_ls_refs(const char *conninfo, const char *reponame) {
+/*
+ * Refs are read through the refdb backend's iterator, a page at a time
+ * in name order; with a glob, only the refs matching it.
+ */
+static void cmd_ls_refs(const char *conninfo, const char *reponame,
+	const char *glob)
+{
 	PGconn *conn = pg_connect(conninfo);
 	int repo_id = get_repo(conn, reponame);
 	if (repo_id < 0)
 		die("repository '%s' not found", reponame);
 
-	char repo_id_str[32];
-	snprintf(repo_id_str, sizeof(repo_id_str), "%d", repo_id);
-	const char *params[1] = { repo_id_str };
-	PGresult *res = PQexecParams(conn,
-		"SELECT name, encode(oid, 'hex'), symbolic FROM refs "
-		"WHERE repo_id = $1 ORDER BY name",
-		1, NULL, params, NULL, NULL, 0);
+	git_repository *pg_repo = open_pg_repo(conn, repo_id);
+	git_reference_iterator *iter = NULL;
+	git_reference *ref = NULL;
+	int error;
 
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
-		die("query refs: %s", PQerrorMessage(conn));
+	if (glob)
+		check_lg2(git_reference_iterator_glob_new(&iter, pg_repo, glob),
+			"create ref iterator");
+	else
+		check_lg2(git_reference_iterator_new(&iter, pg_repo),
+			"create ref iterator");
 
-	for (int i = 0; i < PQntuples(res); i++) {
-		const char *name = PQgetvalue(res, i, 0);
-		int oid_null = PQgetisnull(res, i, 1);
-		const char *oid_hex = PQgetvalue(res, i, 1);
-		int sym_null = PQgetisnull(res, i, 2);
-		const char *symbolic = PQgetvalue(res, i, 2);
+	while ((error = git_reference_next(&ref, iter)) == 0) {
+		const char *name = git_reference_name(ref);
 
-		if (!sym_null && strlen(symbolic) > 0) {
-			printf("-> %-40s %s\n", symbolic, name);
-		} else if (!oid_null && strlen(oid_hex) > 0) {
-			printf("%-42s %s\n", oid_hex, name);
+		if (git_reference_type(ref) == GIT_REFERENCE_SYMBOLIC) {
+			printf("-> %-40s %s\n", git_reference_symbolic_target(ref), name);
+		} else {
+			char hex[GIT_OID_SHA1_HEXSIZE + 1];
+			git_oid_tostr(hex, sizeof(hex), git_reference_target(ref));
+			printf("%-42s %s\n", hex, name);
 		}
+		git_reference_free(ref);
 	}
+	if (error != GIT_ITEROVER)
+		check_lg2(error, "list refs");
 
-	PQclear(res);
+	git_reference_iterator_free(iter);
+	git_repository_free(pg_repo);
+	PQfinish(conn);
+}
+
+/* ------------------------------------------------------------------ */
+/* cat-file: print stored objects, as git cat-file --batch does       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * How cat-file reads: each object through the repository's odb, so the
+ * object cache and delta chains apply as they do for any other reader;
+ * all of them with pipelined queries; or only their headers, noting
+ * the objects that come from an alternate.
+ */
+enum cat_mode { CAT_EACH, CAT_PIPELINE, CAT_CHECK };
+
+struct cat_object {
+	git_oid oid;
+	size_t index;	/* position in the input */
+};
+
+/* Contents read_many hands back, filed by input position */
+struct cat_batch {
+	struct cat_object *sorted;
+	size_t n;
+	void **data;
+	size_t *lens;
+};
+
+static int compare_cat_objects(const void *a, const void *b) {
+	return git_oid_cmp(&((const struct cat_object *)a)->oid,
+		&((const struct cat_object *)b)->oid);
+}
+
+static int cat_collect_cb(const git_oid *oid, const void *data, size_t len,
+	git_object_t type, void *payload)
+{
+	struct cat_batch *batch = payload;
+	struct cat_object key, *hit;
+	(void)type;
+
+	git_oid_cpy(&key.oid, oid);
+	hit = bsearch(&key, batch->sorted, batch->n, sizeof(key), compare_cat_objects);
+	if (!hit)
+		return 0;
+	while (hit > batch->sorted && git_oid_equal(&hit[-1].oid, oid))
+		hit--;
+
+	/* An oid given twice is read twice; the first copy serves both */
+	for (; hit < batch->sorted + batch->n && git_oid_equal(&hit->oid, oid); hit++) {
+		if (batch->data[hit->index])
+			continue;
+		batch->data[hit->index] = malloc(len ? len : 1);
+		if (!batch->data[hit->index])
+			die("out of memory");
+		memcpy(batch->data[hit->index], data, len);
+		batch->lens[hit->index] = len;
+	}
+	return 0;
+}
+
+static void print_object(const char *name, git_object_t type,
+	const void *data, size_t len)
+{
+	printf("%s %s %zu\n", name, git_object_type2string(type), len);
+	fwrite(data, 1, len, stdout);
+	printf("\n");
+}
+
+/*
+ * Read one OID per line from stdin and print "<oid> <type> <size>",
+ * the content and a newline for each, or "<oid> missing", in input
+ * order.  CAT_CHECK prints the first line only, with " alternate" after
+ * the objects the repository takes from an alternate.
+ */
+static void cmd_cat_file(const char *conninfo, const char *reponame,
+	enum cat_mode mode)
+{
+	PGconn *conn = pg_connect(conninfo);
+	int repo_id = get_repo(conn, reponame);
+	if (repo_id < 0)
+		die("repository '%s' not found", reponame);
+
+	git_repository *pg_repo = open_pg_repo(conn, repo_id);
+	git_odb *odb = NULL;
+	check_lg2(git_repository_odb(&odb, pg_repo), "get pg odb");
+
+	/* Lines that aren't an oid get the zero oid, which nothing stores */
+	char **names = NULL;
+	git_oid *oids = NULL;
+	size_t n = 0, oids_cap = 0;
+	char line[256];
+
+	while (fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0')
+			continue;
+
+		git_oid oid;
+		if (git_oid_fromstr(&oid, line) < 0)
+			memset(&oid, 0, sizeof(oid));
+		add_oid(&oids, &n, &oids_cap, &oid);
+		names = realloc(names, oids_cap * sizeof(char *));
+		if (!names || !(names[n - 1] = strdup(line)))
+			die("out of memory");
+	}
+
+	if (mode == CAT_EACH) {
+		for (size_t i = 0; i < n; i++) {
+			git_odb_object *obj = NULL;
+			if (git_oid_is_zero(&oids[i]) ||
+			    git_odb_read(&obj, odb, &oids[i]) < 0) {
+				printf("%s missing\n", names[i]);
+				continue;
+			}
+			print_object(names[i], git_odb_object_type(obj),
+				git_odb_object_data(obj), git_odb_object_size(obj));
+			git_odb_object_free(obj);
+		}
+	} else {
+		git_odb_backend *pg_backend = NULL;
+		size_t slots = n ? n : 1;
+		size_t *sizes = calloc(slots, sizeof(size_t));
+		git_object_t *types = calloc(slots, sizeof(git_object_t));
+		unsigned char *missing = calloc(slots, 1);
+		if (!sizes || !types || !missing)
+			die("out of memory");
+
+		check_lg2(git_odb_get_backend(&pg_backend, odb, 0), "get pg backend");
+		check_lg2(git_odb_backend_postgres_read_headers(pg_backend, oids, n,
+			sizes, types), "read object headers");
+
+		if (mode == CAT_CHECK) {
+			check_lg2(git_odb_backend_postgres_missing(pg_backend, oids, n,
+				missing), "check objects");
+			for (size_t i = 0; i < n; i++) {
+				if (types[i] == GIT_OBJECT_INVALID)
+					printf("%s missing\n", names[i]);
+				else
+					printf("%s %s %zu%s\n", names[i],
+						git_object_type2string(types[i]), sizes[i],
+						missing[i] ? " alternate" : "");
+			}
+		} else {
+			/* Read only what is stored; read_many fails on the rest */
+			struct cat_batch batch = { NULL, 0, NULL, NULL };
+			git_oid *found = malloc(slots * sizeof(git_oid));
+			batch.sorted = malloc(slots * sizeof(struct cat_object));
+			batch.data = calloc(slots, sizeof(void *));
+			batch.lens = calloc(slots, sizeof(size_t));
+			if (!found || !batch.sorted || !batch.data || !batch.lens)
+				die("out of memory");
+
+			for (size_t i = 0; i < n; i++) {
+				if (types[i] == GIT_OBJECT_INVALID)
+					continue;
+				git_oid_cpy(&found[batch.n], &oids[i]);
+				git_oid_cpy(&batch.sorted[batch.n].oid, &oids[i]);
+				batch.sorted[batch.n++].index = i;
+			}
+			qsort(batch.sorted, batch.n, sizeof(struct cat_object),
+				compare_cat_objects);
+
+			check_lg2(git_odb_backend_postgres_read_many(pg_backend, found,
+				batch.n, cat_collect_cb, &batch), "read objects");
+
+			for (size_t i = 0; i < n; i++) {
+				if (types[i] == GIT_OBJECT_INVALID)
+					printf("%s missing\n", names[i]);
+				else
+					print_object(names[i], types[i], batch.data[i], batch.lens[i]);
+				free(batch.data[i]);
+			}
+
+			free(found);
+			free(batch.sorted);
+			free(batch.data);
+			free(batch.lens);
+		}
+
+		free(sizes);
+		free(types);
+		free(missing);
+	}
+
+	for (size_t i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+	free(oids);
+	git_odb_free(odb);
+	git_repository_free(pg_repo);
 	PQfinish(conn);
 }
 
@@ -482,9 +879,12 @@ static void usage(void) {
 		"\n"
 		"Commands:\n"
 		"    init     <conninfo> <reponame>\n"
-		"    push     <conninfo> <reponame> <local-repo-path>\n"
-		"    clone    <conninfo> <reponame> <dest-dir>\n"
-		"    ls-refs  <conninfo> <reponame>\n");
+		"    push     [--jobs N] <conninfo> <reponame> <local-repo-path>\n"
+		"    clone    [--jobs N] <conninfo> <reponame> <dest-dir>\n"
+		"    import   [--jobs N] <conninfo> <reponame> <local-repo-path>\n"
+		"    pack-cache <conninfo> <reponame>\n"
+		"    ls-refs  <conninfo> <reponame> [<glob>]\n"
+		"    cat-file [--pipeline | --batch-check] <conninfo> <reponame> < oids\n");
 	exit(1);
 }
 
@@ -493,21 +893,47 @@ int main(int argc, char **argv) {
 		usage();
 
 	git_libgit2_init();
+	gitgres_set_application_name("gitgres-backend");
 
 	const char *cmd = argv[1];
 
+	/* --jobs N: move objects over N connections at once */
+	int jobs = 1;
+	if (argc >= 4 && strcmp(argv[2], "--jobs") == 0) {
+		jobs = atoi(argv[3]);
+		if (jobs < 1)
+			usage();
+		argv += 2;
+		argc -= 2;
+	}
+
 	if (strcmp(cmd, "init") == 0) {
 		if (argc != 4) usage();
 		cmd_init(argv[2], argv[3]);
 	} else if (strcmp(cmd, "push") == 0) {
 		if (argc != 5) usage();
-		cmd_push(argv[2], argv[3], argv[4]);
+		cmd_push(argv[2], argv[3], argv[4], jobs);
 	} else if (strcmp(cmd, "clone") == 0) {
 		if (argc != 5) usage();
-		cmd_clone(argv[2], argv[3], argv[4]);
-	} else if (strcmp(cmd, "ls-refs") == 0) {
+		cmd_clone(argv[2], argv[3], argv[4], jobs);
+	} else if (strcmp(cmd, "import") == 0) {
+		if (argc != 5) usage();
+		cmd_import(argv[2], argv[3], argv[4], jobs);
+	} else if (strcmp(cmd, "pack-cache") == 0) {
 		if (argc != 4) usage();
-		cmd_ls_refs(argv[2], argv[3]);
+		cmd_pack_cache(argv[2], argv[3]);
+	} else if (strcmp(cmd, "ls-refs") == 0) {
+		if (argc != 4 && argc != 5) usage();
+		cmd_ls_refs(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+	} else if (strcmp(cmd, "cat-file") == 0) {
+		enum cat_mode mode = CAT_EACH;
+		if (argc == 5 && strcmp(argv[2], "--pipeline") == 0)
+			mode = CAT_PIPELINE;
+		else if (argc == 5 && strcmp(argv[2], "--batch-check") == 0)
+			mode = CAT_CHECK;
+		else if (argc != 4)
+			usage();
+		cmd_cat_file(argv[argc - 2], argv[argc - 1], mode);
 	} else {
 		fprintf(stderr, "Unknown command: %s\n", cmd);
 		usage();
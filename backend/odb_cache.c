@@ -0,0 +1,204 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <git2/sys/errors.h>
+#include "odb_cache.h"
+
+typedef struct cache_entry {
+    git_oid oid;
+    git_object_t type;
+    size_t len;
+    struct cache_entry *hash_next;
+    struct cache_entry *prev;     /* towards most recently used */
+    struct cache_entry *next;     /* towards least recently used */
+    unsigned char data[];
+} cache_entry;
+
+struct pg_odb_cache {
+    cache_entry **buckets;
+    size_t nbuckets;              /* always a power of two */
+    cache_entry *head;            /* most recently used */
+    cache_entry *tail;            /* least recently used */
+    pg_odb_cache_stats stats;
+};
+
+/* OIDs are already uniformly distributed, so any 8 bytes make a fine hash */
+static size_t oid_hash(const git_oid *oid)
+{
+    uint64_t h;
+    memcpy(&h, oid->id, sizeof(h));
+    return (size_t)h;
+}
+
+static cache_entry **bucket_for(pg_odb_cache *cache, const git_oid *oid)
+{
+    return &cache->buckets[oid_hash(oid) & (cache->nbuckets - 1)];
+}
+
+static void lru_unlink(pg_odb_cache *cache, cache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(pg_odb_cache *cache, cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+        cache->head->prev = e;
+    cache->head = e;
+    if (!cache->tail)
+        cache->tail = e;
+}
+
+static void remove_entry(pg_odb_cache *cache, cache_entry *e)
+{
+    cache_entry **pp = bucket_for(cache, &e->oid);
+    while (*pp != e)
+        pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+
+    lru_unlink(cache, e);
+    cache->stats.objects--;
+    cache->stats.bytes -= e->len;
+    free(e);
+}
+
+static void grow_buckets(pg_odb_cache *cache)
+{
+    size_t nbuckets = cache->nbuckets * 2;
+    cache_entry **buckets = calloc(nbuckets, sizeof(cache_entry *));
+    if (!buckets)
+        return; /* keep the longer chains rather than fail */
+
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        cache_entry *e = cache->buckets[i];
+        while (e) {
+            cache_entry *next = e->hash_next;
+            size_t b = oid_hash(&e->oid) & (nbuckets - 1);
+            e->hash_next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+int pg_odb_cache_new(pg_odb_cache **out, size_t max_bytes)
+{
+    pg_odb_cache *cache = calloc(1, sizeof(pg_odb_cache));
+    if (!cache) {
+        git_error_set_oom();
+        return -1;
+    }
+
+    cache->nbuckets = 1024;
+    cache->buckets = calloc(cache->nbuckets, sizeof(cache_entry *));
+    if (!cache->buckets) {
+        free(cache);
+        git_error_set_oom();
+        return -1;
+    }
+
+    cache->stats.max_bytes = max_bytes;
+    *out = cache;
+    return 0;
+}
+
+int pg_odb_cache_get(pg_odb_cache *cache, const git_oid *oid,
+                     const void **data, size_t *len, git_object_t *type)
+{
+    cache_entry *e = *bucket_for(cache, oid);
+
+    while (e && !git_oid_equal(&e->oid, oid))
+        e = e->hash_next;
+
+    if (!e) {
+        cache->stats.misses++;
+        return 0;
+    }
+
+    if (cache->head != e) {
+        lru_unlink(cache, e);
+        lru_push_front(cache, e);
+    }
+
+    cache->stats.hits++;
+    if (data)
+        *data = e->data;
+    if (len)
+        *len = e->len;
+    if (type)
+        *type = e->type;
+    return 1;
+}
+
+void pg_odb_cache_put(pg_odb_cache *cache, const git_oid *oid,
+                      const void *data, size_t len, git_object_t type)
+{
+    size_t budget = cache->stats.max_bytes;
+    cache_entry **bucket = bucket_for(cache, oid);
+
+    if (len > budget / 4)
+        return;
+
+    for (cache_entry *e = *bucket; e; e = e->hash_next) {
+        if (git_oid_equal(&e->oid, oid))
+            return;
+    }
+
+    while (cache->tail && cache->stats.bytes + len > budget) {
+        remove_entry(cache, cache->tail);
+        cache->stats.evictions++;
+    }
+
+    cache_entry *e = malloc(sizeof(cache_entry) + len);
+    if (!e)
+        return;
+
+    git_oid_cpy(&e->oid, oid);
+    e->type = type;
+    e->len = len;
+    memcpy(e->data, data, len);
+
+    e->hash_next = *bucket;
+    *bucket = e;
+    lru_push_front(cache, e);
+    cache->stats.objects++;
+    cache->stats.bytes += len;
+
+    if (cache->stats.objects > cache->nbuckets)
+        grow_buckets(cache);
+}
+
+void pg_odb_cache_get_stats(const pg_odb_cache *cache, pg_odb_cache_stats *out)
+{
+    *out = cache->stats;
+}
+
+void pg_odb_cache_free(pg_odb_cache *cache)
+{
+    if (!cache)
+        return;
+
+    cache_entry *e = cache->head;
+    while (e) {
+        cache_entry *next = e->next;
+        free(e);
+        e = next;
+    }
+
+    free(cache->buckets);
+    free(cache);
+}
@@ -0,0 +1,39 @@
+#ifndef ODB_CACHE_H
+#define ODB_CACHE_H
+
+#include <git2.h>
+
+/*
+ * Size-bounded LRU cache of object contents keyed by OID.  Git objects
+ * are immutable, so entries never need invalidating; they only leave
+ * when the byte budget forces the least recently used ones out.
+ */
+typedef struct pg_odb_cache pg_odb_cache;
+
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t objects;     /* entries currently cached */
+    size_t bytes;       /* content bytes currently cached */
+    size_t max_bytes;
+} pg_odb_cache_stats;
+
+int pg_odb_cache_new(pg_odb_cache **out, size_t max_bytes);
+
+/*
+ * Look up oid.  On a hit, *data points at the cached content, valid
+ * until the next put, and the entry becomes most recently used.
+ * Returns 1 on a hit, 0 on a miss.
+ */
+int pg_odb_cache_get(pg_odb_cache *cache, const git_oid *oid,
+                     const void **data, size_t *len, git_object_t *type);
+
+/* Copy an object into the cache.  Objects over a quarter of the budget are skipped. */
+void pg_odb_cache_put(pg_odb_cache *cache, const git_oid *oid,
+                      const void *data, size_t len, git_object_t type);
+
+void pg_odb_cache_get_stats(const pg_odb_cache *cache, pg_odb_cache_stats *out);
+void pg_odb_cache_free(pg_odb_cache *cache);
+
+#endif
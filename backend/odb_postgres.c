@@ -1,14 +1,10 @@
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <arpa/inet.h>
 #include <git2/sys/errors.h>
 #include "odb_postgres.h"
-
-typedef struct {
-    git_odb_backend parent;
-    PGconn *conn;
-    int repo_id;
-} postgres_odb_backend;
+#include "delta.h"
 
 /* Forward declaration for writepack constructor */
 int pg_odb_writepack(
@@ -18,26 +14,132 @@ int pg_odb_writepack(
     git_indexer_progress_cb progress_cb,
     void *progress_payload);
 
-static int pg_odb_read(
+/* Chunked storage for large blobs, in stream_postgres.c */
+int pg_odb_readstream(git_odb_stream **out, size_t *len_p, git_object_t *type_p,
+                      git_odb_backend *backend, const git_oid *oid);
+int pg_odb_writestream(git_odb_stream **out, git_odb_backend *backend,
+                       git_object_size_t size, git_object_t type);
+int pg_odb_write_chunked(postgres_odb_backend *pg, const git_oid *oid,
+                         const void *data, size_t len, git_object_t type);
+int pg_odb_read_chunks(postgres_odb_backend *pg, int repo_id, const git_oid *oid,
+                       unsigned char *buf, size_t size);
+
+/* Bound on delta chain walks, far above any depth the writepack creates */
+#define MAX_DELTA_CHAIN 1000
+
+/* OIDs per array in a missing() query */
+#define MISSING_BATCH 1000
+
+/* Reads in flight per pipeline sync in read_many() */
+#define PIPELINE_DEPTH 256
+
+/*
+ * The per-object queries are prepared once per connection.  They take
+ * repo_id as a parameter, so every backend on the connection shares them.
+ * Reads take the repository and its alternates as an int[] ($1, see
+ * repo_ids) and go through git_object_find, which probes one repository
+ * at a time so even the generic plan prunes to one partition per probe.
+ * Writes and missing() only look at the repository itself; read_headers()
+ * looks at the alternates too but not at the order they come in, since
+ * the type and size of an object are the same wherever it is stored.
+ */
+static const struct {
+    const char *name;
+    const char *sql;
+} statements[] = {
+    { "gitgres_odb_read",
+      "SELECT type, size, content, base_oid, chunked, repo_id "
+      "FROM git_object_find($1::int[], $2)" },
+    { "gitgres_odb_read_header",
+      "SELECT type, size FROM git_object_find($1::int[], $2)" },
+    { "gitgres_odb_read_depth",
+      "SELECT depth FROM git_object_find($1::int[], $2)" },
+    { "gitgres_odb_exists",
+      "SELECT 1 FROM git_object_find($1::int[], $2)" },
+    { "gitgres_odb_write",
+      "INSERT INTO objects (repo_id, oid, type, size, content) "
+      "VALUES ($1, $2, $3, $4, $5) "
+      "ON CONFLICT (repo_id, oid) DO NOTHING" },
+    { "gitgres_odb_missing",
+      "SELECT u.i FROM unnest($2::bytea[]) WITH ORDINALITY AS u(oid, i) "
+      "WHERE NOT EXISTS (SELECT 1 FROM objects o WHERE o.repo_id=$1 AND o.oid=u.oid)" },
+    { "gitgres_odb_read_headers",
+      "SELECT DISTINCT ON (u.i) u.i, o.type, o.size "
+      "FROM unnest($2::bytea[]) WITH ORDINALITY AS u(oid, i) "
+      "JOIN objects o ON o.repo_id = ANY($1::int[]) AND o.oid = u.oid "
+      "ORDER BY u.i" },
+};
+
+/*
+ * Prepare whatever statements the connection doesn't have yet.  Checking
+ * pg_prepared_statements first, rather than preparing and ignoring
+ * duplicate_prepared_statement, keeps an enclosing transaction usable.
+ */
+static int prepare_statements(PGconn *conn)
+{
+    PGresult *res = PQexec(conn,
+        "SELECT name FROM pg_prepared_statements WHERE name LIKE 'gitgres\\_odb\\_%'");
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++) {
+        int have = 0;
+        for (int r = 0; r < PQntuples(res) && !have; r++)
+            have = strcmp(PQgetvalue(res, r, 0), statements[i].name) == 0;
+        if (have)
+            continue;
+
+        PGresult *prep = PQprepare(conn, statements[i].name, statements[i].sql, 0, NULL);
+        if (PQresultStatus(prep) != PGRES_COMMAND_OK) {
+            git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(prep));
+            PQclear(prep);
+            PQclear(res);
+            return -1;
+        }
+        PQclear(prep);
+    }
+
+    PQclear(res);
+    return 0;
+}
+
+static int read_object(
+    postgres_odb_backend *pg,
     void **data_p,
     size_t *len_p,
     git_object_t *type_p,
-    git_odb_backend *backend,
-    const git_oid *oid)
+    const git_oid *oid,
+    int chain)
 {
-    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
-    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
+    git_odb_backend *backend = &pg->parent;
+    const void *cached;
+    size_t cached_len;
+    git_object_t cached_type;
+
+    if (pg_odb_cache_get(pg->cache, oid, &cached, &cached_len, &cached_type)) {
+        void *buf = git_odb_backend_data_alloc(backend, cached_len);
+        if (!buf)
+            return -1;
+        memcpy(buf, cached, cached_len);
+        *data_p = buf;
+        *len_p = cached_len;
+        *type_p = cached_type;
+        return 0;
+    }
 
     const char *paramValues[2] = {
-        (const char *)&repo_id_n,
+        pg->repo_ids,
         (const char *)oid->id
     };
-    int paramLengths[2] = { sizeof(repo_id_n), GIT_OID_SHA1_SIZE };
-    int paramFormats[2] = { 1, 1 };
+    int paramLengths[2] = { 0, GIT_OID_SHA1_SIZE };
+    int paramFormats[2] = { 0, 1 };
 
-    PGresult *res = PQexecParams(pg->conn,
-        "SELECT type, size, content FROM objects WHERE repo_id=$1 AND oid=$2",
-        2, NULL, paramValues, paramLengths, paramFormats, 1);
+    PGresult *res = PQexecPrepared(pg->conn, "gitgres_odb_read",
+        2, paramValues, paramLengths, paramFormats, 1);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
@@ -60,13 +162,77 @@ static int pg_odb_read(
 
     int content_len = PQgetlength(res, 0, 2);
     void *content = PQgetvalue(res, 0, 2);
+    void *buf;
 
-    void *buf = git_odb_backend_data_alloc(backend, content_len);
-    if (!buf) {
-        PQclear(res);
-        return -1;
+    if (*PQgetvalue(res, 0, 4)) {
+        /* content lives in object_chunks */
+        buf = git_odb_backend_data_alloc(backend, size_val);
+        if (!buf) {
+            PQclear(res);
+            return -1;
+        }
+        /* from the repository the row came from */
+        int32_t row_repo;
+        memcpy(&row_repo, PQgetvalue(res, 0, 5), sizeof(row_repo));
+        if (pg_odb_read_chunks(pg, (int)ntohl(row_repo), oid, buf, (size_t)size_val) < 0) {
+            git_odb_backend_data_free(backend, buf);
+            PQclear(res);
+            return -1;
+        }
+        content_len = size_val;
+    } else if (PQgetisnull(res, 0, 3)) {
+        buf = git_odb_backend_data_alloc(backend, content_len);
+        if (!buf) {
+            PQclear(res);
+            return -1;
+        }
+        memcpy(buf, content, content_len);
+    } else {
+        /* content is a delta against base_oid: resolve the base first */
+        git_oid base_oid;
+        void *base_data;
+        size_t base_len;
+        git_object_t base_type;
+        unsigned char *full;
+        size_t full_len;
+
+        if (chain >= MAX_DELTA_CHAIN) {
+            git_error_set(GIT_ERROR_ODB, "delta chain too deep at %s", git_oid_tostr_s(oid));
+            PQclear(res);
+            return -1;
+        }
+
+        git_oid_fromraw(&base_oid, (const unsigned char *)PQgetvalue(res, 0, 3));
+        int error = read_object(pg, &base_data, &base_len, &base_type, &base_oid, chain + 1);
+        if (error == GIT_ENOTFOUND) {
+            git_error_set(GIT_ERROR_ODB, "missing delta base %s", git_oid_tostr_s(&base_oid));
+            error = -1;
+        }
+        if (error < 0) {
+            PQclear(res);
+            return error;
+        }
+
+        error = git_delta_apply_buf(&full, &full_len, base_data, base_len,
+            content, content_len);
+        git_odb_backend_data_free(backend, base_data);
+        if (error < 0) {
+            PQclear(res);
+            return -1;
+        }
+
+        buf = git_odb_backend_data_alloc(backend, full_len);
+        if (!buf) {
+            free(full);
+            PQclear(res);
+            return -1;
+        }
+        memcpy(buf, full, full_len);
+        free(full);
+        content_len = (int)full_len;
     }
-    memcpy(buf, content, content_len);
+
+    pg_odb_cache_put(pg->cache, oid, buf, content_len, (git_object_t)type_val);
 
     *data_p = buf;
     *len_p = (size_t)size_val;
@@ -76,25 +242,40 @@ static int pg_odb_read(
     return 0;
 }
 
-static int pg_odb_read_header(
+static int pg_odb_read(
+    void **data_p,
     size_t *len_p,
     git_object_t *type_p,
     git_odb_backend *backend,
     const git_oid *oid)
 {
     postgres_odb_backend *pg = (postgres_odb_backend *)backend;
-    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
+    uint64_t t = gitgres_stats_start(pg->stats);
+
+    int error = read_object(pg, data_p, len_p, type_p, oid, 0);
+    gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_READ, t,
+        error == 0, error == 0 ? *len_p : 0);
+    return error;
+}
+
+static int read_header(
+    postgres_odb_backend *pg,
+    size_t *len_p,
+    git_object_t *type_p,
+    const git_oid *oid)
+{
+    if (pg_odb_cache_get(pg->cache, oid, NULL, len_p, type_p))
+        return 0;
 
     const char *paramValues[2] = {
-        (const char *)&repo_id_n,
+        pg->repo_ids,
         (const char *)oid->id
     };
-    int paramLengths[2] = { sizeof(repo_id_n), GIT_OID_SHA1_SIZE };
-    int paramFormats[2] = { 1, 1 };
+    int paramLengths[2] = { 0, GIT_OID_SHA1_SIZE };
+    int paramFormats[2] = { 0, 1 };
 
-    PGresult *res = PQexecParams(pg->conn,
-        "SELECT type, size FROM objects WHERE repo_id=$1 AND oid=$2",
-        2, NULL, paramValues, paramLengths, paramFormats, 1);
+    PGresult *res = PQexecPrepared(pg->conn, "gitgres_odb_read_header",
+        2, paramValues, paramLengths, paramFormats, 1);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
@@ -122,97 +303,121 @@ static int pg_odb_read_header(
     return 0;
 }
 
-static int pg_odb_read_prefix(
-    git_oid *out_oid,
-    void **data_p,
+static int pg_odb_read_header(
     size_t *len_p,
     git_object_t *type_p,
     git_odb_backend *backend,
-    const git_oid *short_oid,
-    size_t prefix_len)
+    const git_oid *oid)
 {
     postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    uint64_t t = gitgres_stats_start(pg->stats);
 
-    /* Full OID lookup: use exact match */
-    if (prefix_len == GIT_OID_SHA1_HEXSIZE)
-        return pg_odb_read(data_p, len_p, type_p, backend, short_oid);
-
-    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
-
-    /* prefix_len is in hex chars; byte length for the prefix */
-    int byte_len = (int)((prefix_len + 1) / 2);
-    int32_t byte_len_n = htonl((uint32_t)byte_len);
-
-    const char *paramValues[3] = {
-        (const char *)&repo_id_n,
-        (const char *)&byte_len_n,
-        (const char *)short_oid->id
-    };
-    int paramLengths[3] = {
-        sizeof(repo_id_n),
-        sizeof(byte_len_n),
-        byte_len
-    };
-    int paramFormats[3] = { 1, 1, 1 };
-
-    PGresult *res = PQexecParams(pg->conn,
-        "SELECT oid, type, size, content FROM objects "
-        "WHERE repo_id=$1 AND substring(oid from 1 for $2) = $3",
-        3, NULL, paramValues, paramLengths, paramFormats, 1);
+    int error = read_header(pg, len_p, type_p, oid);
+    gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_READ_HEADER, t, error == 0, 0);
+    return error;
+}
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
-        PQclear(res);
-        return -1;
+/*
+ * Abbreviated OIDs are looked up as a [lo, hi) range on the (repo_id, oid)
+ * primary key rather than comparing a substring, which no index can serve.
+ * An odd trailing hex digit only fixes the high nibble of the next byte.
+ * hi is lo with its last digit incremented, dropping trailing bytes that
+ * overflow; *hi_len is 0 when the prefix is all f's and has no upper bound.
+ */
+static void prefix_range(
+    unsigned char *lo, int *lo_len,
+    unsigned char *hi, int *hi_len,
+    const git_oid *short_oid, size_t prefix_len)
+{
+    int full = (int)(prefix_len / 2);
+    int step = 1;
+
+    memcpy(lo, short_oid->id, full);
+    *lo_len = full;
+    if (prefix_len % 2) {
+        lo[full] = short_oid->id[full] & 0xf0;
+        *lo_len = full + 1;
+        step = 0x10;
     }
 
-    int nrows = PQntuples(res);
-    if (nrows == 0) {
-        PQclear(res);
-        return GIT_ENOTFOUND;
-    }
-    if (nrows > 1) {
-        PQclear(res);
-        return GIT_EAMBIGUOUS;
+    memcpy(hi, lo, *lo_len);
+    for (int i = *lo_len - 1; i >= 0; i--) {
+        if (hi[i] + step < 0x100) {
+            hi[i] += step;
+            *hi_len = i + 1;
+            return;
+        }
+        step = 1;
     }
+    *hi_len = 0;
+}
 
-    /* Copy out the full OID */
-    memcpy(out_oid->id, PQgetvalue(res, 0, 0), GIT_OID_SHA1_SIZE);
-
-    int16_t type_val;
-    memcpy(&type_val, PQgetvalue(res, 0, 1), sizeof(type_val));
-    type_val = ntohs(type_val);
+/* Look up at most two objects matching a prefix: enough to detect ambiguity */
+static PGresult *prefix_query(
+    postgres_odb_backend *pg,
+    const char *columns,
+    const git_oid *short_oid,
+    size_t prefix_len)
+{
+    unsigned char lo[GIT_OID_SHA1_SIZE], hi[GIT_OID_SHA1_SIZE];
+    int lo_len, hi_len;
+    char sql[256];
 
-    int32_t size_val;
-    memcpy(&size_val, PQgetvalue(res, 0, 2), sizeof(size_val));
-    size_val = ntohl(size_val);
+    prefix_range(lo, &lo_len, hi, &hi_len, short_oid, prefix_len);
 
-    int content_len = PQgetlength(res, 0, 3);
-    void *content = PQgetvalue(res, 0, 3);
+    const char *paramValues[3] = {
+        pg->repo_ids,
+        (const char *)lo,
+        (const char *)hi
+    };
+    int paramLengths[3] = { 0, lo_len, hi_len };
+    int paramFormats[3] = { 0, 1, 1 };
+
+    /* DISTINCT, as a repository and an alternate can both store an oid */
+    snprintf(sql, sizeof(sql),
+        "SELECT DISTINCT o.%s FROM unnest($1::int[]) AS r(id) "
+        "CROSS JOIN LATERAL (SELECT * FROM objects "
+        "WHERE repo_id = r.id AND oid >= $2::bytea%s ORDER BY oid LIMIT 2) o "
+        "ORDER BY o.oid LIMIT 2",
+        columns, hi_len ? " AND oid < $3::bytea" : "");
+
+    return PQexecParams(pg->conn, sql,
+        hi_len ? 3 : 2, NULL, paramValues, paramLengths, paramFormats, 1);
+}
 
-    void *buf = git_odb_backend_data_alloc(backend, content_len);
-    if (!buf) {
-        PQclear(res);
-        return -1;
-    }
-    memcpy(buf, content, content_len);
+static int pg_odb_exists_prefix(
+    git_oid *out_oid,
+    git_odb_backend *backend,
+    const git_oid *short_oid,
+    size_t prefix_len);
 
-    *data_p = buf;
-    *len_p = (size_t)size_val;
-    *type_p = (git_object_t)type_val;
+static int pg_odb_read_prefix(
+    git_oid *out_oid,
+    void **data_p,
+    size_t *len_p,
+    git_object_t *type_p,
+    git_odb_backend *backend,
+    const git_oid *short_oid,
+    size_t prefix_len)
+{
+    /* Resolve the OID first so delta chains and the cache apply as usual */
+    int error = pg_odb_exists_prefix(out_oid, backend, short_oid, prefix_len);
+    if (error < 0)
+        return error;
 
-    PQclear(res);
-    return 0;
+    return pg_odb_read(data_p, len_p, type_p, backend, out_oid);
 }
 
-static int pg_odb_write(
-    git_odb_backend *backend,
+static int write_object(
+    postgres_odb_backend *pg,
     const git_oid *oid,
     const void *data,
     size_t len,
     git_object_t type)
 {
-    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    if (len > pg->opts.chunk_bytes && type == GIT_OBJECT_BLOB)
+        return pg_odb_write_chunked(pg, oid, data, len, type);
+
     uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
     int16_t type_n = htons((int16_t)type);
     uint32_t size_n = htonl((uint32_t)len);
@@ -233,11 +438,8 @@ static int pg_odb_write(
     };
     int paramFormats[5] = { 1, 1, 1, 1, 1 };
 
-    PGresult *res = PQexecParams(pg->conn,
-        "INSERT INTO objects (repo_id, oid, type, size, content) "
-        "VALUES ($1, $2, $3, $4, $5) "
-        "ON CONFLICT (repo_id, oid) DO NOTHING",
-        5, NULL, paramValues, paramLengths, paramFormats, 0);
+    PGresult *res = PQexecPrepared(pg->conn, "gitgres_odb_write",
+        5, paramValues, paramLengths, paramFormats, 0);
 
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
@@ -249,21 +451,35 @@ static int pg_odb_write(
     return 0;
 }
 
-static int pg_odb_exists(git_odb_backend *backend, const git_oid *oid)
+static int pg_odb_write(
+    git_odb_backend *backend,
+    const git_oid *oid,
+    const void *data,
+    size_t len,
+    git_object_t type)
 {
     postgres_odb_backend *pg = (postgres_odb_backend *)backend;
-    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
+    uint64_t t = gitgres_stats_start(pg->stats);
+
+    int error = write_object(pg, oid, data, len, type);
+    gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_WRITE, t, error == 0, error == 0 ? len : 0);
+    return error;
+}
+
+static int object_exists(postgres_odb_backend *pg, const git_oid *oid)
+{
+    if (pg_odb_cache_get(pg->cache, oid, NULL, NULL, NULL))
+        return 1;
 
     const char *paramValues[2] = {
-        (const char *)&repo_id_n,
+        pg->repo_ids,
         (const char *)oid->id
     };
-    int paramLengths[2] = { sizeof(repo_id_n), GIT_OID_SHA1_SIZE };
-    int paramFormats[2] = { 1, 1 };
+    int paramLengths[2] = { 0, GIT_OID_SHA1_SIZE };
+    int paramFormats[2] = { 0, 1 };
 
-    PGresult *res = PQexecParams(pg->conn,
-        "SELECT 1 FROM objects WHERE repo_id=$1 AND oid=$2",
-        2, NULL, paramValues, paramLengths, paramFormats, 1);
+    PGresult *res = PQexecPrepared(pg->conn, "gitgres_odb_exists",
+        2, paramValues, paramLengths, paramFormats, 1);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
@@ -276,42 +492,31 @@ static int pg_odb_exists(git_odb_backend *backend, const git_oid *oid)
     return found;
 }
 
-static int pg_odb_exists_prefix(
+static int pg_odb_exists(git_odb_backend *backend, const git_oid *oid)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    uint64_t t = gitgres_stats_start(pg->stats);
+
+    int found = object_exists(pg, oid);
+    gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_EXISTS, t, found, 0);
+    return found;
+}
+
+static int exists_prefix(
+    postgres_odb_backend *pg,
     git_oid *out_oid,
-    git_odb_backend *backend,
     const git_oid *short_oid,
     size_t prefix_len)
 {
-    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
-
     /* Full OID: exact match */
     if (prefix_len == GIT_OID_SHA1_HEXSIZE) {
-        if (!pg_odb_exists(backend, short_oid))
+        if (!object_exists(pg, short_oid))
             return GIT_ENOTFOUND;
         git_oid_cpy(out_oid, short_oid);
         return 0;
     }
 
-    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
-    int byte_len = (int)((prefix_len + 1) / 2);
-    int32_t byte_len_n = htonl((uint32_t)byte_len);
-
-    const char *paramValues[3] = {
-        (const char *)&repo_id_n,
-        (const char *)&byte_len_n,
-        (const char *)short_oid->id
-    };
-    int paramLengths[3] = {
-        sizeof(repo_id_n),
-        sizeof(byte_len_n),
-        byte_len
-    };
-    int paramFormats[3] = { 1, 1, 1 };
-
-    PGresult *res = PQexecParams(pg->conn,
-        "SELECT oid FROM objects "
-        "WHERE repo_id=$1 AND substring(oid from 1 for $2) = $3",
-        3, NULL, paramValues, paramLengths, paramFormats, 1);
+    PGresult *res = prefix_query(pg, "oid", short_oid, prefix_len);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
@@ -334,21 +539,34 @@ static int pg_odb_exists_prefix(
     return 0;
 }
 
+static int pg_odb_exists_prefix(
+    git_oid *out_oid,
+    git_odb_backend *backend,
+    const git_oid *short_oid,
+    size_t prefix_len)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    uint64_t t = gitgres_stats_start(pg->stats);
+
+    int error = exists_prefix(pg, out_oid, short_oid, prefix_len);
+    gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_EXISTS_PREFIX, t, error == 0, 0);
+    return error;
+}
+
 static int pg_odb_foreach(
     git_odb_backend *backend,
     git_odb_foreach_cb cb,
     void *payload)
 {
     postgres_odb_backend *pg = (postgres_odb_backend *)backend;
-    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
+    uint64_t t = gitgres_stats_start(pg->stats);
 
-    const char *paramValues[1] = { (const char *)&repo_id_n };
-    int paramLengths[1] = { sizeof(repo_id_n) };
-    int paramFormats[1] = { 1 };
+    const char *paramValues[1] = { pg->repo_ids };
 
     PGresult *res = PQexecParams(pg->conn,
-        "SELECT oid FROM objects WHERE repo_id=$1",
-        1, NULL, paramValues, paramLengths, paramFormats, 1);
+        "SELECT DISTINCT o.oid FROM unnest($1::int[]) AS r(id) "
+        "CROSS JOIN LATERAL (SELECT oid FROM objects WHERE repo_id = r.id) o",
+        1, NULL, paramValues, NULL, NULL, 1);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
@@ -357,6 +575,7 @@ static int pg_odb_foreach(
     }
 
     int nrows = PQntuples(res);
+    gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_FOREACH, t, nrows, 0);
     for (int i = 0; i < nrows; i++) {
         git_oid oid;
         memcpy(oid.id, PQgetvalue(res, i, 0), GIT_OID_SHA1_SIZE);
@@ -374,10 +593,373 @@ static int pg_odb_foreach(
 
 static void pg_odb_free(git_odb_backend *backend)
 {
-    free(backend);
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+
+    /* The cache keeps its own counters; they go in the stats once */
+    if (pg->stats) {
+        pg_odb_cache_stats cache;
+        pg_odb_cache_get_stats(pg->cache, &cache);
+        gitgres_stats_count(pg->stats, GITGRES_STAT_ODB_CACHE_HIT, cache.hits, 0, 0);
+        gitgres_stats_count(pg->stats, GITGRES_STAT_ODB_CACHE_MISS, cache.misses, 0, 0);
+        gitgres_stats_count(pg->stats, GITGRES_STAT_ODB_CACHE_EVICT, cache.evictions, 0, 0);
+    }
+
+    pg_odb_cache_free(pg->cache);
+    gitgres_stats_free(pg->stats);
+    free(pg->repo_ids);
+    free(pg);
+}
+
+/*
+ * Encode oids as a binary one-dimensional bytea[] (element type 17):
+ * ndim, has-nulls, element oid, then dimension length and lower bound,
+ * then a length word and the bytes for each element.
+ */
+static char *encode_oid_array(const git_oid *oids, size_t n, int *len_out)
+{
+    size_t len = 20 + n * (4 + GIT_OID_SHA1_SIZE);
+    char *buf = malloc(len);
+    uint32_t header[5] = { htonl(1), htonl(0), htonl(17), htonl((uint32_t)n), htonl(1) };
+    char *p = buf;
+
+    if (!buf) {
+        git_error_set_oom();
+        return NULL;
+    }
+
+    memcpy(p, header, sizeof(header));
+    p += sizeof(header);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t elem_len = htonl(GIT_OID_SHA1_SIZE);
+        memcpy(p, &elem_len, 4);
+        memcpy(p + 4, oids[i].id, GIT_OID_SHA1_SIZE);
+        p += 4 + GIT_OID_SHA1_SIZE;
+    }
+
+    *len_out = (int)len;
+    return buf;
+}
+
+int git_odb_backend_postgres_missing(git_odb_backend *backend, const git_oid *oids,
+                                     size_t n, unsigned char *missing)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
+    int nmissing = 0;
+
+    memset(missing, 0, n);
+
+    for (size_t start = 0; start < n; start += MISSING_BATCH) {
+        size_t count = n - start < MISSING_BATCH ? n - start : MISSING_BATCH;
+        uint64_t t = gitgres_stats_start(pg->stats);
+        int array_len;
+        char *array = encode_oid_array(oids + start, count, &array_len);
+        if (!array)
+            return -1;
+
+        const char *paramValues[2] = { (const char *)&repo_id_n, array };
+        int paramLengths[2] = { sizeof(repo_id_n), array_len };
+        int paramFormats[2] = { 1, 1 };
+
+        PGresult *res = PQexecPrepared(pg->conn, "gitgres_odb_missing",
+            2, paramValues, paramLengths, paramFormats, 1);
+        free(array);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+            PQclear(res);
+            return -1;
+        }
+
+        /* ordinality is a 1-based int8 */
+        for (int i = 0; i < PQntuples(res); i++) {
+            uint32_t half[2];
+            memcpy(half, PQgetvalue(res, i, 0), sizeof(half));
+            size_t ord = ((size_t)ntohl(half[0]) << 32) | ntohl(half[1]);
+            if (ord >= 1 && ord <= count) {
+                missing[start + ord - 1] = 1;
+                nmissing++;
+            }
+        }
+        gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_MISSING, t, PQntuples(res),
+            count * GIT_OID_SHA1_SIZE);
+        PQclear(res);
+    }
+
+    return nmissing;
+}
+
+int git_odb_backend_postgres_read_headers(git_odb_backend *backend, const git_oid *oids,
+                                          size_t n, size_t *sizes, git_object_t *types)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    int nfound = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        sizes[i] = 0;
+        types[i] = GIT_OBJECT_INVALID;
+    }
+
+    for (size_t start = 0; start < n; start += MISSING_BATCH) {
+        size_t count = n - start < MISSING_BATCH ? n - start : MISSING_BATCH;
+        uint64_t t = gitgres_stats_start(pg->stats);
+        int array_len;
+        char *array = encode_oid_array(oids + start, count, &array_len);
+        if (!array)
+            return -1;
+
+        const char *paramValues[2] = { pg->repo_ids, array };
+        int paramLengths[2] = { 0, array_len };
+        int paramFormats[2] = { 0, 1 };
+
+        PGresult *res = PQexecPrepared(pg->conn, "gitgres_odb_read_headers",
+            2, paramValues, paramLengths, paramFormats, 1);
+        free(array);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+            PQclear(res);
+            return -1;
+        }
+
+        for (int i = 0; i < PQntuples(res); i++) {
+            uint32_t half[2], size_val;
+            int16_t type_val;
+            memcpy(half, PQgetvalue(res, i, 0), sizeof(half));
+            memcpy(&type_val, PQgetvalue(res, i, 1), sizeof(type_val));
+            memcpy(&size_val, PQgetvalue(res, i, 2), sizeof(size_val));
+            size_t ord = ((size_t)ntohl(half[0]) << 32) | ntohl(half[1]);
+            if (ord >= 1 && ord <= count) {
+                types[start + ord - 1] = (git_object_t)(int16_t)ntohs(type_val);
+                sizes[start + ord - 1] = ntohl(size_val);
+                nfound++;
+            }
+        }
+        gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_READ_HEADERS, t, PQntuples(res),
+            count * GIT_OID_SHA1_SIZE);
+        PQclear(res);
+    }
+
+    return nfound;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+ * Send up to PIPELINE_DEPTH reads, then collect them.  Whole objects go
+ * straight to cb.  Deltas and chunked objects need further queries, so
+ * their indexes are left in *slow for the caller to read afterwards.
+ */
+static int read_pipelined(postgres_odb_backend *pg, const git_oid *oids, size_t n,
+                          git_odb_backend_postgres_read_cb cb, void *payload,
+                          size_t *slow, size_t *nslow)
+{
+    PGconn *conn = pg->conn;
+    int error = 0;
+    PGresult *res;
+
+    *nslow = 0;
+    if (!PQenterPipelineMode(conn)) {
+        git_error_set_str(GIT_ERROR_ODB, PQerrorMessage(conn));
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        const char *paramValues[2] = { pg->repo_ids, (const char *)oids[i].id };
+        int paramLengths[2] = { 0, GIT_OID_SHA1_SIZE };
+        int paramFormats[2] = { 0, 1 };
+
+        if (!PQsendQueryPrepared(conn, "gitgres_odb_read",
+                2, paramValues, paramLengths, paramFormats, 1)) {
+            git_error_set_str(GIT_ERROR_ODB, PQerrorMessage(conn));
+            error = -1;
+            n = i;
+            break;
+        }
+    }
+
+    if (!PQpipelineSync(conn)) {
+        git_error_set_str(GIT_ERROR_ODB, PQerrorMessage(conn));
+        PQexitPipelineMode(conn);
+        return -1;
+    }
+
+    /* Each query yields its result and then NULL; the sync comes last */
+    for (size_t i = 0; i < n; i++) {
+        while ((res = PQgetResult(conn)) != NULL) {
+            ExecStatusType status = PQresultStatus(res);
+
+            if (status == PGRES_TUPLES_OK && error == 0) {
+                if (PQntuples(res) == 0) {
+                    git_error_set(GIT_ERROR_ODB, "object %s not found",
+                        git_oid_tostr_s(&oids[i]));
+                    error = GIT_ENOTFOUND;
+                } else if (!PQgetisnull(res, 0, 3) || *PQgetvalue(res, 0, 4)) {
+                    slow[(*nslow)++] = i;
+                } else {
+                    int16_t type_val;
+                    memcpy(&type_val, PQgetvalue(res, 0, 0), sizeof(type_val));
+                    error = cb(&oids[i], PQgetvalue(res, 0, 2),
+                        (size_t)PQgetlength(res, 0, 2),
+                        (git_object_t)ntohs(type_val), payload);
+                }
+            } else if (status != PGRES_TUPLES_OK && error == 0) {
+                git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+                error = -1;
+            }
+            PQclear(res);
+        }
+    }
+
+    while ((res = PQgetResult(conn)) != NULL) {
+        int done = PQresultStatus(res) == PGRES_PIPELINE_SYNC;
+        PQclear(res);
+        if (done)
+            break;
+    }
+
+    if (!PQexitPipelineMode(conn) && error == 0) {
+        git_error_set_str(GIT_ERROR_ODB, PQerrorMessage(conn));
+        error = -1;
+    }
+    return error;
+}
+#endif
+
+/*
+ * Read many objects, calling cb with each one's content in no particular
+ * order.  With pipeline support in libpq the reads go out PIPELINE_DEPTH
+ * at a time instead of one round trip each.  A non-zero return from cb
+ * stops the read and is returned.
+ */
+typedef struct {
+    git_odb_backend_postgres_read_cb cb;
+    void *payload;
+    size_t rows;
+    size_t bytes;
+} read_many_count;
+
+static int count_read(const git_oid *oid, const void *data, size_t len,
+                      git_object_t type, void *payload)
+{
+    read_many_count *c = payload;
+    c->rows++;
+    c->bytes += len;
+    return c->cb(oid, data, len, type, c->payload);
+}
+
+int git_odb_backend_postgres_read_many(git_odb_backend *backend, const git_oid *oids,
+                                       size_t n, git_odb_backend_postgres_read_cb cb,
+                                       void *payload)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    size_t slow[PIPELINE_DEPTH];
+    int error = 0;
+    read_many_count counted = { cb, payload, 0, 0 };
+    uint64_t t = gitgres_stats_start(pg->stats);
+
+    /* Count what reaches the caller, for the stats */
+    if (pg->stats) {
+        cb = count_read;
+        payload = &counted;
+    }
+
+    for (size_t start = 0; start < n && error == 0; start += PIPELINE_DEPTH) {
+        size_t count = n - start < PIPELINE_DEPTH ? n - start : PIPELINE_DEPTH;
+        size_t nslow = 0;
+
+#ifdef LIBPQ_HAS_PIPELINING
+        error = read_pipelined(pg, oids + start, count, cb, payload, slow, &nslow);
+#else
+        for (size_t i = 0; i < count; i++)
+            slow[nslow++] = i;
+#endif
+
+        for (size_t i = 0; i < nslow && error == 0; i++) {
+            const git_oid *oid = &oids[start + slow[i]];
+            void *data;
+            size_t len;
+            git_object_t type;
+
+            error = read_object(pg, &data, &len, &type, oid, 0);
+            if (error < 0)
+                break;
+            error = cb(oid, data, len, type, payload);
+            git_odb_backend_data_free(backend, data);
+        }
+    }
+
+    gitgres_stats_end(pg->stats, GITGRES_STAT_ODB_READ_MANY, t, counted.rows, counted.bytes);
+    return error;
+}
+
+/*
+ * The repository followed by its alternates, nearest first, as an int[]
+ * literal for the reads' $1.
+ */
+static char *load_repo_ids(PGconn *conn, int repo_id)
+{
+    char rid[16];
+    const char *params[1] = { rid };
+    char *ids;
+
+    snprintf(rid, sizeof(rid), "%d", repo_id);
+    PGresult *res = PQexecParams(conn, "SELECT git_object_repos($1)::text",
+        1, NULL, params, NULL, NULL, 0);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        return NULL;
+    }
+
+    ids = strdup(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    if (!ids)
+        git_error_set_oom();
+    return ids;
+}
+
+void git_odb_backend_postgres_cache_stats(git_odb_backend *backend, pg_odb_cache_stats *out)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    pg_odb_cache_get_stats(pg->cache, out);
+}
+
+static size_t env_size(const char *name, size_t fallback)
+{
+    const char *val = getenv(name);
+    if (!val || !*val)
+        return fallback;
+
+    char *end;
+    unsigned long long n = strtoull(val, &end, 10);
+    if (*end != '\0' || n == 0)
+        return fallback;
+    return (size_t)n;
+}
+
+void git_odb_backend_postgres_options_from_env(git_odb_backend_postgres_options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->ingest_batch_objects = env_size("GITGRES_INGEST_BATCH",
+        GITGRES_DEFAULT_INGEST_BATCH_OBJECTS);
+    opts->ingest_flush_bytes = env_size("GITGRES_INGEST_FLUSH_BYTES",
+        GITGRES_DEFAULT_INGEST_FLUSH_BYTES);
+    opts->writepack_cache_bytes = env_size("GITGRES_WRITEPACK_CACHE_BYTES",
+        GITGRES_DEFAULT_WRITEPACK_CACHE_BYTES);
+    opts->writepack_spool = env_size("GITGRES_WRITEPACK_SPOOL", 0) != 0;
+    opts->cache_bytes = env_size("GITGRES_CACHE_BYTES", GITGRES_DEFAULT_CACHE_BYTES);
+    opts->delta_depth = (int)env_size("GITGRES_DELTA_DEPTH", 0);
+    opts->chunk_bytes = env_size("GITGRES_CHUNK_BYTES", GITGRES_DEFAULT_CHUNK_BYTES);
 }
 
 int git_odb_backend_postgres(git_odb_backend **out, PGconn *conn, int repo_id)
+{
+    return git_odb_backend_postgres_ext(out, conn, repo_id, NULL);
+}
+
+int git_odb_backend_postgres_ext(git_odb_backend **out, PGconn *conn, int repo_id,
+                                 const git_odb_backend_postgres_options *opts)
 {
     postgres_odb_backend *backend = calloc(1, sizeof(postgres_odb_backend));
     if (!backend)
@@ -388,6 +970,8 @@ int git_odb_backend_postgres(git_odb_backend **out, PGconn *conn, int repo_id)
     backend->parent.read_header = pg_odb_read_header;
     backend->parent.read_prefix = pg_odb_read_prefix;
     backend->parent.write = pg_odb_write;
+    backend->parent.readstream = pg_odb_readstream;
+    backend->parent.writestream = pg_odb_writestream;
     backend->parent.exists = pg_odb_exists;
     backend->parent.exists_prefix = pg_odb_exists_prefix;
     backend->parent.foreach = pg_odb_foreach;
@@ -397,6 +981,32 @@ int git_odb_backend_postgres(git_odb_backend **out, PGconn *conn, int repo_id)
     backend->conn = conn;
     backend->repo_id = repo_id;
 
+    if (opts)
+        backend->opts = *opts;
+    if (!backend->opts.ingest_batch_objects)
+        backend->opts.ingest_batch_objects = GITGRES_DEFAULT_INGEST_BATCH_OBJECTS;
+    if (!backend->opts.ingest_flush_bytes)
+        backend->opts.ingest_flush_bytes = GITGRES_DEFAULT_INGEST_FLUSH_BYTES;
+    if (!backend->opts.writepack_cache_bytes)
+        backend->opts.writepack_cache_bytes = GITGRES_DEFAULT_WRITEPACK_CACHE_BYTES;
+    if (!backend->opts.cache_bytes)
+        backend->opts.cache_bytes = GITGRES_DEFAULT_CACHE_BYTES;
+    if (!backend->opts.chunk_bytes)
+        backend->opts.chunk_bytes = GITGRES_DEFAULT_CHUNK_BYTES;
+
+    if (prepare_statements(conn) < 0 ||
+        !(backend->repo_ids = load_repo_ids(conn, repo_id))) {
+        free(backend);
+        return -1;
+    }
+
+    if (pg_odb_cache_new(&backend->cache, backend->opts.cache_bytes) < 0) {
+        free(backend->repo_ids);
+        free(backend);
+        return -1;
+    }
+    backend->stats = gitgres_stats_new();
+
     *out = &backend->parent;
     return 0;
 }
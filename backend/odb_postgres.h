@@ -4,7 +4,80 @@
 #include <git2.h>
 #include <git2/sys/odb_backend.h>
 #include <libpq-fe.h>
+#include "odb_cache.h"
+#include "stats.h"
+
+/* Tunables for the postgres ODB backend.  Zero means "use the default". */
+typedef struct {
+    size_t ingest_batch_objects; /* objects per COPY batch before merging */
+    size_t ingest_flush_bytes;   /* buffered COPY bytes before sending */
+    size_t writepack_cache_bytes; /* delta base cache for streaming writepack */
+    int writepack_spool;         /* spool packs to a temp dir and index them */
+    size_t cache_bytes;          /* object cache budget */
+    int delta_depth;             /* keep pack deltas for blobs up to this chain depth; 0 stores whole */
+    size_t chunk_bytes;          /* blobs larger than this are split into chunks of this size */
+} git_odb_backend_postgres_options;
+
+#define GITGRES_DEFAULT_INGEST_BATCH_OBJECTS 10000
+#define GITGRES_DEFAULT_INGEST_FLUSH_BYTES   (1024 * 1024)
+#define GITGRES_DEFAULT_WRITEPACK_CACHE_BYTES (32 * 1024 * 1024)
+#define GITGRES_DEFAULT_CACHE_BYTES (64 * 1024 * 1024)
+#define GITGRES_DEFAULT_CHUNK_BYTES (1024 * 1024)
+
+/* Shared with writepack_postgres.c, which works on the same connection */
+typedef struct {
+    git_odb_backend parent;
+    PGconn *conn;
+    int repo_id;
+    char *repo_ids;              /* repo_id and its alternates, as an int[] literal */
+    git_odb_backend_postgres_options opts;
+    pg_odb_cache *cache;
+    gitgres_stats *stats;        /* NULL unless GITGRES_STATS is set */
+} postgres_odb_backend;
 
 int git_odb_backend_postgres(git_odb_backend **out, PGconn *conn, int repo_id);
+int git_odb_backend_postgres_ext(git_odb_backend **out, PGconn *conn, int repo_id,
+                                 const git_odb_backend_postgres_options *opts);
+
+/*
+ * Fill opts from GITGRES_INGEST_BATCH, GITGRES_INGEST_FLUSH_BYTES,
+ * GITGRES_WRITEPACK_CACHE_BYTES, GITGRES_WRITEPACK_SPOOL, GITGRES_CACHE_BYTES,
+ * GITGRES_DELTA_DEPTH and GITGRES_CHUNK_BYTES
+ */
+void git_odb_backend_postgres_options_from_env(git_odb_backend_postgres_options *opts);
+
+/*
+ * Set missing[i] to 1 for each of the n oids not stored in the
+ * repository, using one array query per thousand oids.  Objects only its
+ * alternates store count as missing, so they are sent and ingest can
+ * give the repository their parsed rows.  Returns the number missing, or
+ * -1 on error.
+ */
+int git_odb_backend_postgres_missing(git_odb_backend *backend, const git_oid *oids,
+                                     size_t n, unsigned char *missing);
+
+/*
+ * Look up the type and size of each of the n oids in the repository or
+ * its alternates, one array query per thousand oids.  Objects that
+ * aren't stored get GIT_OBJECT_INVALID.  Returns the number found, or
+ * -1 on error.
+ */
+int git_odb_backend_postgres_read_headers(git_odb_backend *backend, const git_oid *oids,
+                                          size_t n, size_t *sizes, git_object_t *types);
+
+/* Called with each object read by git_odb_backend_postgres_read_many */
+typedef int (*git_odb_backend_postgres_read_cb)(const git_oid *oid, const void *data,
+                                                 size_t len, git_object_t type, void *payload);
+
+/*
+ * Read n objects with pipelined queries, calling cb for each.  Fails with
+ * GIT_ENOTFOUND if any is absent.
+ */
+int git_odb_backend_postgres_read_many(git_odb_backend *backend, const git_oid *oids,
+                                       size_t n, git_odb_backend_postgres_read_cb cb,
+                                       void *payload);
+
+/* Object cache hit/miss counters and occupancy */
+void git_odb_backend_postgres_cache_stats(git_odb_backend *backend, pg_odb_cache_stats *out);
 
 #endif
@@ -0,0 +1,419 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <git2/sys/errors.h>
+#include <libpq-fe.h>
+#include <libpq/libpq-fs.h>
+#include "transfer.h"
+#include "pack_cache.h"
+
+#define LO_BUF_SIZE (1024 * 1024)
+
+static int pg_error(PGconn *conn, const char *what)
+{
+    git_error_set(GIT_ERROR_ODB, "pack cache: %s: %s", what, PQerrorMessage(conn));
+    return -1;
+}
+
+static void end_transaction(PGconn *conn, const char *how)
+{
+    PQclear(PQexec(conn, how));
+}
+
+static int read_file(const char *path, char **out, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    char *data = NULL;
+    long size;
+
+    if (!fp) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot open %s", path);
+        return -1;
+    }
+    if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) < 0)
+        goto fail;
+    if (!(data = malloc(size ? size : 1))) {
+        fclose(fp);
+        git_error_set_oom();
+        return -1;
+    }
+    if (fread(data, 1, size, fp) != (size_t)size)
+        goto fail;
+
+    fclose(fp);
+    *out = data;
+    *len = size;
+    return 0;
+
+fail:
+    git_error_set(GIT_ERROR_OS, "pack cache: cannot read %s", path);
+    free(data);
+    fclose(fp);
+    return -1;
+}
+
+/* Copy the file at path into a new large object */
+static int upload_pack(Oid *out, PGconn *conn, const char *path, size_t *bytes)
+{
+    FILE *fp;
+    char *buf;
+    Oid lo;
+    int fd, error = 0;
+    size_t n;
+
+    *bytes = 0;
+    if ((lo = lo_creat(conn, INV_READ | INV_WRITE)) == InvalidOid)
+        return pg_error(conn, "create large object");
+    if ((fd = lo_open(conn, lo, INV_WRITE)) < 0)
+        return pg_error(conn, "open large object");
+
+    if (!(fp = fopen(path, "rb"))) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot open %s", path);
+        return -1;
+    }
+    if (!(buf = malloc(LO_BUF_SIZE))) {
+        fclose(fp);
+        git_error_set_oom();
+        return -1;
+    }
+
+    while ((n = fread(buf, 1, LO_BUF_SIZE, fp)) > 0) {
+        if (lo_write(conn, fd, buf, n) != (int)n) {
+            error = pg_error(conn, "write large object");
+            break;
+        }
+        *bytes += n;
+    }
+    if (error == 0 && ferror(fp)) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot read %s", path);
+        error = -1;
+    }
+
+    free(buf);
+    fclose(fp);
+    if (lo_close(conn, fd) < 0 && error == 0)
+        error = pg_error(conn, "close large object");
+    *out = lo;
+    return error;
+}
+
+int gitgres_pack_cache_build(gitgres_pack_cache_stats *stats, PGconn *conn,
+                             int repo_id, git_repository *pg_repo,
+                             const char *tmpdir)
+{
+    char rid[16], lo_str[16], count_str[32];
+    char dir[4096], pack_path[4200], idx_path[4200];
+    char name[GIT_OID_SHA1_HEXSIZE + 1];
+    git_oid *tips = NULL;
+    char *tips_hex = NULL, *idx = NULL;
+    size_t ntips = 0, idx_len = 0;
+    gitgres_transfer_stats ts;
+    PGresult *res;
+    Oid lo;
+    int error = -1;
+
+    memset(stats, 0, sizeof(*stats));
+    snprintf(rid, sizeof(rid), "%d", repo_id);
+    pack_path[0] = idx_path[0] = '\0';
+
+    /* The tips, as oids for the packbuilder and as newline-separated
+     * hex for the tips column */
+    {
+        const char *params[1] = { rid };
+        res = PQexecParams(conn,
+            "SELECT encode(oid, 'hex') FROM refs "
+            "WHERE repo_id = $1 AND oid IS NOT NULL "
+            "GROUP BY oid ORDER BY oid",
+            1, NULL, params, NULL, NULL, 0);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            pg_error(conn, "list ref tips");
+            PQclear(res);
+            return -1;
+        }
+    }
+
+    ntips = PQntuples(res);
+    if (ntips == 0) {
+        PQclear(res);
+        git_error_set(GIT_ERROR_ODB, "pack cache: repository has no refs to pack");
+        return GIT_ENOTFOUND;
+    }
+    tips = calloc(ntips, sizeof(git_oid));
+    tips_hex = malloc(ntips * (GIT_OID_SHA1_HEXSIZE + 1) + 1);
+    if (!tips || !tips_hex) {
+        PQclear(res);
+        git_error_set_oom();
+        goto done;
+    }
+    tips_hex[0] = '\0';
+    for (size_t i = 0; i < ntips; i++) {
+        const char *hex = PQgetvalue(res, i, 0);
+        if (git_oid_fromstr(&tips[i], hex) < 0) {
+            PQclear(res);
+            goto done;
+        }
+        memcpy(tips_hex + i * (GIT_OID_SHA1_HEXSIZE + 1), hex, GIT_OID_SHA1_HEXSIZE);
+        tips_hex[i * (GIT_OID_SHA1_HEXSIZE + 1) + GIT_OID_SHA1_HEXSIZE] = '\n';
+    }
+    tips_hex[ntips * (GIT_OID_SHA1_HEXSIZE + 1)] = '\0';
+    PQclear(res);
+
+    snprintf(dir, sizeof(dir), "%s/gitgres-pack-XXXXXX", tmpdir);
+    if (!mkdtemp(dir)) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot create %s", dir);
+        goto done;
+    }
+
+    if ((error = gitgres_transfer_write_pack(&ts, name, pg_repo, dir,
+            tips, ntips)) < 0)
+        goto cleanup;
+    error = -1;
+    stats->objects = ts.objects;
+
+    snprintf(pack_path, sizeof(pack_path), "%s/pack-%s.pack", dir, name);
+    snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", dir, name);
+    if (read_file(idx_path, &idx, &idx_len) < 0)
+        goto cleanup;
+
+    res = PQexec(conn, "BEGIN");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        pg_error(conn, "begin");
+        PQclear(res);
+        goto cleanup;
+    }
+    PQclear(res);
+
+    if (upload_pack(&lo, conn, pack_path, &stats->bytes) < 0) {
+        end_transaction(conn, "ROLLBACK");
+        goto cleanup;
+    }
+
+    snprintf(lo_str, sizeof(lo_str), "%u", (unsigned int)lo);
+    snprintf(count_str, sizeof(count_str), "%zu", stats->objects);
+    {
+        const char *params[6] = { rid, name, tips_hex, lo_str, idx, count_str };
+        int lengths[6] = { 0, 0, 0, 0, (int)idx_len, 0 };
+        int formats[6] = { 0, 0, 0, 0, 1, 0 };
+
+        /* Older packs are dropped in the same transaction, so clones
+         * always see exactly one */
+        res = PQexecParams(conn,
+            "WITH new AS ("
+            "  INSERT INTO pack_cache (repo_id, name, tips, pack, idx, object_count) "
+            "  SELECT $1, $2, ARRAY(SELECT decode(h, 'hex') "
+            "    FROM regexp_split_to_table($3, E'\\n') AS h WHERE h <> ''), "
+            "    $4, $5, $6 "
+            "  RETURNING id"
+            ") "
+            "DELETE FROM pack_cache p USING new "
+            "WHERE p.repo_id = $1 AND p.id < new.id",
+            6, NULL, params, lengths, formats, 0);
+    }
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        pg_error(conn, "store pack");
+        PQclear(res);
+        end_transaction(conn, "ROLLBACK");
+        goto cleanup;
+    }
+    PQclear(res);
+
+    res = PQexec(conn, "COMMIT");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        pg_error(conn, "commit");
+        PQclear(res);
+        goto cleanup;
+    }
+    PQclear(res);
+    error = 0;
+
+cleanup:
+    if (pack_path[0])
+        unlink(pack_path);
+    if (idx_path[0])
+        unlink(idx_path);
+    rmdir(dir);
+done:
+    free(tips);
+    free(tips_hex);
+    free(idx);
+    return error;
+}
+
+static int write_file(const char *path, const char *data, size_t len)
+{
+    FILE *fp = fopen(path, "wb");
+
+    if (!fp || fwrite(data, 1, len, fp) != len) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot write %s", path);
+        if (fp)
+            fclose(fp);
+        return -1;
+    }
+    if (fclose(fp) != 0) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot write %s", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copy a large object into the file at path */
+static int download_pack(PGconn *conn, Oid lo, const char *path, size_t *bytes)
+{
+    FILE *fp;
+    char *buf;
+    int fd, n, error = 0;
+
+    *bytes = 0;
+    if ((fd = lo_open(conn, lo, INV_READ)) < 0)
+        return pg_error(conn, "open large object");
+    if (!(fp = fopen(path, "wb"))) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot write %s", path);
+        return -1;
+    }
+    if (!(buf = malloc(LO_BUF_SIZE))) {
+        fclose(fp);
+        git_error_set_oom();
+        return -1;
+    }
+
+    while ((n = lo_read(conn, fd, buf, LO_BUF_SIZE)) > 0) {
+        if (fwrite(buf, 1, n, fp) != (size_t)n) {
+            git_error_set(GIT_ERROR_OS, "pack cache: cannot write %s", path);
+            error = -1;
+            break;
+        }
+        *bytes += n;
+    }
+    if (n < 0 && error == 0)
+        error = pg_error(conn, "read large object");
+
+    free(buf);
+    if (fclose(fp) != 0 && error == 0) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot write %s", path);
+        error = -1;
+    }
+    lo_close(conn, fd);
+    return error;
+}
+
+static uint32_t uint32_at(PGresult *res, int row, int col)
+{
+    uint32_t v;
+    memcpy(&v, PQgetvalue(res, row, col), sizeof(v));
+    return ntohl(v);
+}
+
+int gitgres_pack_cache_fetch(gitgres_pack_cache_stats *stats,
+                             git_oid **tips, size_t *ntips,
+                             PGconn *conn, int repo_id,
+                             const char *objects_dir)
+{
+    char rid[16], id_str[16];
+    char name[GIT_OID_SHA1_HEXSIZE + 1];
+    char pack_path[4200], idx_path[4200], tmp_path[4200];
+    PGresult *res;
+    Oid lo;
+    int error = -1;
+
+    memset(stats, 0, sizeof(*stats));
+    *tips = NULL;
+    *ntips = 0;
+    snprintf(rid, sizeof(rid), "%d", repo_id);
+
+    res = PQexec(conn, "BEGIN");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        PQclear(res);
+        return pg_error(conn, "begin");
+    }
+    PQclear(res);
+
+    /* FOR SHARE holds off a rebuild unlinking the pack mid-read */
+    {
+        const char *params[1] = { rid };
+        res = PQexecParams(conn,
+            "SELECT id, name, pack, idx, object_count FROM pack_cache "
+            "WHERE repo_id = $1 ORDER BY id DESC LIMIT 1 FOR SHARE",
+            1, NULL, params, NULL, NULL, 1 /* binary result */);
+    }
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        pg_error(conn, "find cached pack");
+        goto fail;
+    }
+    if (PQntuples(res) == 0) {
+        git_error_set(GIT_ERROR_ODB, "pack cache: no cached pack");
+        error = GIT_ENOTFOUND;
+        goto fail;
+    }
+
+    /* The name becomes part of a path, so insist it is a pack checksum */
+    if (PQgetlength(res, 0, 1) != GIT_OID_SHA1_HEXSIZE ||
+        strspn(PQgetvalue(res, 0, 1), "0123456789abcdef") != GIT_OID_SHA1_HEXSIZE) {
+        git_error_set(GIT_ERROR_ODB, "pack cache: bad pack name");
+        goto fail;
+    }
+    memcpy(name, PQgetvalue(res, 0, 1), sizeof(name));
+    snprintf(id_str, sizeof(id_str), "%u", uint32_at(res, 0, 0));
+    lo = (Oid)uint32_at(res, 0, 2);
+    stats->objects = uint32_at(res, 0, 4);
+
+    snprintf(pack_path, sizeof(pack_path), "%s/pack/pack-%s.pack", objects_dir, name);
+    snprintf(idx_path, sizeof(idx_path), "%s/pack/pack-%s.idx", objects_dir, name);
+
+    /* The pack goes in first and the index last, under temporary names,
+     * since git only looks at packs that have an index */
+    snprintf(tmp_path, sizeof(tmp_path), "%s/pack/tmp_pack_cache_%s", objects_dir, name);
+    if (download_pack(conn, lo, tmp_path, &stats->bytes) < 0) {
+        unlink(tmp_path);
+        goto fail;
+    }
+    if (rename(tmp_path, pack_path) < 0) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot write %s", pack_path);
+        unlink(tmp_path);
+        goto fail;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s/pack/tmp_idx_cache_%s", objects_dir, name);
+    if (write_file(tmp_path, PQgetvalue(res, 0, 3), PQgetlength(res, 0, 3)) < 0 ||
+        rename(tmp_path, idx_path) < 0) {
+        git_error_set(GIT_ERROR_OS, "pack cache: cannot write %s", idx_path);
+        unlink(tmp_path);
+        unlink(pack_path);
+        goto fail;
+    }
+    PQclear(res);
+
+    {
+        const char *params[1] = { id_str };
+        res = PQexecParams(conn,
+            "SELECT t FROM pack_cache p, unnest(p.tips) AS t WHERE p.id = $1",
+            1, NULL, params, NULL, NULL, 1 /* binary result */);
+    }
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        pg_error(conn, "read cached tips");
+        goto fail;
+    }
+    if (PQntuples(res) > 0 && !(*tips = calloc(PQntuples(res), sizeof(git_oid)))) {
+        git_error_set_oom();
+        goto fail;
+    }
+    for (int i = 0; i < PQntuples(res); i++) {
+        if (PQgetlength(res, i, 0) != GIT_OID_SHA1_SIZE)
+            continue;
+        git_oid_fromraw(&(*tips)[(*ntips)++], (const unsigned char *)PQgetvalue(res, i, 0));
+    }
+    PQclear(res);
+
+    end_transaction(conn, "COMMIT");
+    return 0;
+
+fail:
+    PQclear(res);
+    end_transaction(conn, "ROLLBACK");
+    free(*tips);
+    *tips = NULL;
+    *ntips = 0;
+    return error;
+}
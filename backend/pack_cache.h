@@ -0,0 +1,42 @@
+#ifndef PACK_CACHE_H
+#define PACK_CACHE_H
+
+#include <git2.h>
+#include <libpq-fe.h>
+
+/*
+ * Pre-built packs for serving clones (the pack_cache table).
+ *
+ * A cached pack holds everything reachable from a repo's ref tips when
+ * it was built.  Clones write it out with its index as-is, which costs
+ * one sequential large-object read instead of a read per object, and
+ * then fetch what is newer than the cached tips the usual way.
+ */
+
+typedef struct {
+    size_t objects;     /* objects in the pack */
+    size_t bytes;       /* pack size in bytes */
+} gitgres_pack_cache_stats;
+
+/*
+ * Pack everything reachable from the direct refs of repo_id, read
+ * through pg_repo, and store it as the repo's cached pack, replacing
+ * any older one.  tmpdir holds the pack while it is built.
+ */
+int gitgres_pack_cache_build(gitgres_pack_cache_stats *stats, PGconn *conn,
+                             int repo_id, git_repository *pg_repo,
+                             const char *tmpdir);
+
+/*
+ * Write the cached pack of repo_id and its index into objects_dir/pack.
+ * *tips is set to a malloc'd array of the ref tips the pack was built
+ * from, to use as haves when fetching the rest.  Returns GIT_ENOTFOUND
+ * if the repo has no cached pack.  Callers should git_odb_refresh any
+ * odb open on objects_dir afterwards.
+ */
+int gitgres_pack_cache_fetch(gitgres_pack_cache_stats *stats,
+                             git_oid **tips, size_t *ntips,
+                             PGconn *conn, int repo_id,
+                             const char *objects_dir);
+
+#endif
@@ -0,0 +1,691 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <git2/sys/errors.h>
+#include <libpq-fe.h>
+#include "odb_postgres.h"
+#include "ingest_postgres.h"
+#include "transfer.h"
+#include "parallel.h"
+#include "stats.h"
+
+#define MAX_JOBS 256
+
+typedef struct {
+    git_oid *oids;
+    git_object_t *types;
+    size_t n;
+    size_t cap;
+} oid_vec;
+
+static int oid_vec_add(oid_vec *v, const git_oid *oid, git_object_t type)
+{
+    if (v->n == v->cap) {
+        size_t cap = v->cap ? v->cap * 2 : 1024;
+        git_oid *oids = realloc(v->oids, cap * sizeof(git_oid));
+        if (!oids) {
+            git_error_set_oom();
+            return -1;
+        }
+        v->oids = oids;
+        git_object_t *types = realloc(v->types, cap * sizeof(git_object_t));
+        if (!types) {
+            git_error_set_oom();
+            return -1;
+        }
+        v->types = types;
+        v->cap = cap;
+    }
+    git_oid_cpy(&v->oids[v->n], oid);
+    v->types[v->n] = type;
+    v->n++;
+    return 0;
+}
+
+static void oid_vec_free(oid_vec *v)
+{
+    free(v->oids);
+    free(v->types);
+}
+
+/* Range k holds the oids whose first byte b has b * jobs / 256 == k */
+static int oid_range(const git_oid *oid, int jobs)
+{
+    return oid->id[0] * jobs / 256;
+}
+
+static unsigned char range_start(int range, int jobs)
+{
+    return (unsigned char)((range * 256 + jobs - 1) / jobs);
+}
+
+/* ------------------------------------------------------------------ */
+/* oid set for the push walk                                          */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    git_oid *slots;
+    unsigned char *used;
+    size_t cap;         /* power of two */
+    size_t n;
+} oid_set;
+
+static size_t oid_set_slot(const oid_set *s, const git_oid *oid)
+{
+    size_t h;
+
+    /* SHA-1 bytes are uniform already */
+    memcpy(&h, oid->id, sizeof(h));
+    for (size_t i = h & (s->cap - 1);; i = (i + 1) & (s->cap - 1)) {
+        if (!s->used[i] || git_oid_equal(&s->slots[i], oid))
+            return i;
+    }
+}
+
+static int oid_set_grow(oid_set *s)
+{
+    oid_set bigger;
+
+    bigger.cap = s->cap ? s->cap * 2 : 4096;
+    bigger.n = s->n;
+    bigger.slots = malloc(bigger.cap * sizeof(git_oid));
+    bigger.used = calloc(bigger.cap, 1);
+    if (!bigger.slots || !bigger.used) {
+        free(bigger.slots);
+        free(bigger.used);
+        git_error_set_oom();
+        return -1;
+    }
+
+    for (size_t i = 0; i < s->cap; i++) {
+        if (!s->used[i])
+            continue;
+        size_t slot = oid_set_slot(&bigger, &s->slots[i]);
+        bigger.used[slot] = 1;
+        git_oid_cpy(&bigger.slots[slot], &s->slots[i]);
+    }
+
+    free(s->slots);
+    free(s->used);
+    *s = bigger;
+    return 0;
+}
+
+/* 1 if oid was added, 0 if it was already there, -1 on error */
+static int oid_set_add(oid_set *s, const git_oid *oid)
+{
+    if ((s->n + 1) * 2 > s->cap && oid_set_grow(s) < 0)
+        return -1;
+
+    size_t slot = oid_set_slot(s, oid);
+    if (s->used[slot])
+        return 0;
+    s->used[slot] = 1;
+    git_oid_cpy(&s->slots[slot], oid);
+    s->n++;
+    return 1;
+}
+
+static void oid_set_free(oid_set *s)
+{
+    free(s->slots);
+    free(s->used);
+}
+
+/* ------------------------------------------------------------------ */
+/* workers                                                            */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Push workers stage their range, then wait here so that no range
+ * commits unless all of them were staged.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int waiting;
+    int failed;
+} commit_gate;
+
+/* Returns 1 if every worker staged its objects */
+static int gate_wait(commit_gate *g, int ok)
+{
+    pthread_mutex_lock(&g->lock);
+    if (!ok)
+        g->failed = 1;
+    if (--g->waiting == 0)
+        pthread_cond_broadcast(&g->cond);
+    while (g->waiting > 0)
+        pthread_cond_wait(&g->cond, &g->lock);
+    ok = !g->failed;
+    pthread_mutex_unlock(&g->lock);
+    return ok;
+}
+
+typedef struct {
+    pthread_t thread;
+    const char *conninfo;
+    int repo_id;
+    const char *path;   /* objects dir for clone, local repo for push */
+    int range;
+    int jobs;
+    oid_vec oids;
+    size_t count;
+    commit_gate *gate;
+    char message[256];
+    int error;
+} worker;
+
+static void worker_fail(worker *w, const char *message)
+{
+    const git_error *e = git_error_last();
+
+    if (w->error)
+        return;
+    w->error = -1;
+    if (!message)
+        message = e && e->message ? e->message : "unknown error";
+    snprintf(w->message, sizeof(w->message), "%s", message);
+}
+
+static PGconn *worker_connect(worker *w)
+{
+    PGconn *conn = gitgres_connect(w->conninfo);
+
+    if (PQstatus(conn) != CONNECTION_OK) {
+        worker_fail(w, PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+/*
+ * Start a thread per worker and wait for them all.  Workers that could
+ * not be started count as failed, and are let through the gate.
+ */
+static int run_workers(worker *workers, int jobs, void *(*fn)(void *))
+{
+    int started = 0;
+
+    for (; started < jobs; started++) {
+        if (pthread_create(&workers[started].thread, NULL, fn, &workers[started]) != 0)
+            break;
+    }
+
+    for (int i = started; i < jobs; i++) {
+        worker_fail(&workers[i], "could not start worker thread");
+        if (workers[i].gate) {
+            commit_gate *g = workers[i].gate;
+            pthread_mutex_lock(&g->lock);
+            g->failed = 1;
+            if (--g->waiting == 0)
+                pthread_cond_broadcast(&g->cond);
+            pthread_mutex_unlock(&g->lock);
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for (int i = 0; i < jobs; i++) {
+        if (workers[i].error) {
+            git_error_set(GIT_ERROR_ODB, "job %d: %s", i, workers[i].message);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int clamp_jobs(int jobs)
+{
+    if (jobs < 1)
+        return 1;
+    return jobs > MAX_JOBS ? MAX_JOBS : jobs;
+}
+
+/* ------------------------------------------------------------------ */
+/* clone: one local pack per range                                    */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    worker *w;
+    gitgres_pack_out *po;
+} clone_ctx;
+
+static int clone_write_cb(const git_oid *oid, const void *data, size_t len,
+                          git_object_t type, void *payload)
+{
+    clone_ctx *ctx = (clone_ctx *)payload;
+
+    (void)oid;
+    if (gitgres_pack_add(ctx->po, type, data, len) < 0)
+        return -1;
+    ctx->w->count++;
+    return 0;
+}
+
+static void *clone_worker(void *arg)
+{
+    worker *w = (worker *)arg;
+    PGconn *conn = NULL;
+    PGresult *res = NULL;
+    git_odb_backend *backend = NULL;
+    git_odb *odb = NULL;
+    gitgres_pack_out po;
+    git_odb_backend_postgres_options opts;
+    uint32_t repo_id_n = htonl((uint32_t)w->repo_id);
+    unsigned char lo = range_start(w->range, w->jobs);
+    unsigned char hi = w->range + 1 < w->jobs ? range_start(w->range + 1, w->jobs) : 0;
+    const char *params[3] = {
+        (const char *)&repo_id_n, (const char *)&lo,
+        w->range + 1 < w->jobs ? (const char *)&hi : NULL
+    };
+    int lengths[3] = { sizeof(repo_id_n), 1, 1 };
+    int formats[3] = { 1, 1, 1 };
+
+    memset(&po, 0, sizeof(po));
+
+    if (!(conn = worker_connect(w)))
+        goto done;
+
+    res = PQexecParams(conn,
+        "SELECT DISTINCT o.oid FROM unnest(git_object_repos($1)) AS r(id) "
+        "CROSS JOIN LATERAL (SELECT oid FROM objects WHERE repo_id = r.id "
+        "AND oid >= $2::bytea AND ($3::bytea IS NULL OR oid < $3)) o",
+        3, NULL, params, lengths, formats, 1);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        worker_fail(w, PQresultErrorMessage(res));
+        goto done;
+    }
+    for (int i = 0; i < PQntuples(res); i++) {
+        git_oid oid;
+        git_oid_fromraw(&oid, (const unsigned char *)PQgetvalue(res, i, 0));
+        if (oid_vec_add(&w->oids, &oid, GIT_OBJECT_ANY) < 0) {
+            worker_fail(w, NULL);
+            goto done;
+        }
+    }
+    PQclear(res);
+    res = NULL;
+
+    if (w->oids.n == 0)
+        goto done;
+
+    git_odb_backend_postgres_options_from_env(&opts);
+    if (git_odb_backend_postgres_ext(&backend, conn, w->repo_id, &opts) < 0 ||
+        git_odb_open(&odb, w->path) < 0 ||
+        gitgres_pack_begin(&po, odb, (uint32_t)w->oids.n) < 0) {
+        worker_fail(w, NULL);
+        goto done;
+    }
+
+    clone_ctx ctx = { w, &po };
+    if (git_odb_backend_postgres_read_many(backend, w->oids.oids, w->oids.n,
+            clone_write_cb, &ctx) < 0 ||
+        gitgres_pack_finish(&po) < 0)
+        worker_fail(w, NULL);
+
+done:
+    gitgres_pack_free(&po);
+    git_odb_free(odb);
+    if (backend)
+        backend->free(backend);
+    PQclear(res);
+    PQfinish(conn);
+    return NULL;
+}
+
+int gitgres_parallel_clone(size_t *count, const char *conninfo, int repo_id,
+                           const char *objects_dir, int jobs)
+{
+    worker *workers;
+    int error;
+
+    jobs = clamp_jobs(jobs);
+    *count = 0;
+
+    if (!(workers = calloc(jobs, sizeof(worker)))) {
+        git_error_set_oom();
+        return -1;
+    }
+
+    for (int i = 0; i < jobs; i++) {
+        workers[i].conninfo = conninfo;
+        workers[i].repo_id = repo_id;
+        workers[i].path = objects_dir;
+        workers[i].range = i;
+        workers[i].jobs = jobs;
+    }
+
+    error = run_workers(workers, jobs, clone_worker);
+
+    for (int i = 0; i < jobs; i++) {
+        *count += workers[i].count;
+        oid_vec_free(&workers[i].oids);
+    }
+    free(workers);
+    return error;
+}
+
+/* ------------------------------------------------------------------ */
+/* push: ingest each range in its own transaction                     */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Without a gate (import), the ingest is committed and restarted every
+ * batch so that stored objects survive an interrupted run.
+ */
+static void *push_worker(void *arg)
+{
+    worker *w = (worker *)arg;
+    PGconn *conn = NULL;
+    git_repository *repo = NULL;
+    git_odb *odb = NULL;
+    pg_ingest *ing = NULL;
+    git_odb_backend_postgres_options opts;
+    size_t committed = 0;
+    int ok = 0;
+
+    git_odb_backend_postgres_options_from_env(&opts);
+
+    if (!(conn = worker_connect(w)))
+        goto staged;
+
+    if (git_repository_open(&repo, w->path) < 0 ||
+        git_repository_odb(&odb, repo) < 0) {
+        worker_fail(w, NULL);
+        goto staged;
+    }
+
+    for (size_t i = 0; i < w->oids.n; i++) {
+        git_odb_object *obj = NULL;
+        int error = 0;
+
+        if (!ing)
+            error = pg_ingest_new(&ing, conn, w->repo_id, opts.ingest_batch_objects,
+                opts.ingest_flush_bytes, opts.chunk_bytes);
+        if (error == 0)
+            error = git_odb_read(&obj, odb, &w->oids.oids[i]);
+        if (error == 0)
+            error = pg_ingest_add(ing, &w->oids.oids[i], git_odb_object_type(obj),
+                git_odb_object_data(obj), git_odb_object_size(obj));
+        git_odb_object_free(obj);
+
+        if (error == 0 && !w->gate && pg_ingest_count(ing) == opts.ingest_batch_objects) {
+            if ((error = pg_ingest_commit(ing)) == 0) {
+                committed += pg_ingest_count(ing);
+                pg_ingest_free(ing);
+                ing = NULL;
+            }
+        }
+        if (error < 0) {
+            worker_fail(w, NULL);
+            goto staged;
+        }
+    }
+
+    if (ing && pg_ingest_flush(ing) < 0)
+        worker_fail(w, NULL);
+    else
+        ok = 1;
+
+staged:
+    if (!w->gate || gate_wait(w->gate, ok)) {
+        if (ok && ing && pg_ingest_commit(ing) < 0)
+            worker_fail(w, NULL);
+        else if (ok && ing)
+            committed += pg_ingest_count(ing);
+    }
+    w->count = committed;
+
+    pg_ingest_free(ing);
+    git_odb_free(odb);
+    git_repository_free(repo);
+    PQfinish(conn);
+    return NULL;
+}
+
+typedef struct {
+    git_repository *repo;
+    oid_set seen;
+    oid_vec objects;
+} push_walk;
+
+/* 1 if the object is new to the walk */
+static int walk_add(push_walk *pw, const git_oid *oid, git_object_t type)
+{
+    int added = oid_set_add(&pw->seen, oid);
+
+    if (added <= 0)
+        return added;
+    if (oid_vec_add(&pw->objects, oid, type) < 0)
+        return -1;
+    return 1;
+}
+
+/* Add a tree and everything under it that the walk has not seen */
+static int walk_tree(push_walk *pw, const git_oid *tree_oid)
+{
+    git_tree *tree = NULL;
+    int error = walk_add(pw, tree_oid, GIT_OBJECT_TREE);
+
+    if (error <= 0)
+        return error;
+    if ((error = git_tree_lookup(&tree, pw->repo, tree_oid)) < 0)
+        return error;
+
+    for (size_t i = 0; i < git_tree_entrycount(tree) && error >= 0; i++) {
+        const git_tree_entry *e = git_tree_entry_byindex(tree, i);
+
+        switch (git_tree_entry_type(e)) {
+        case GIT_OBJECT_TREE:
+            error = walk_tree(pw, git_tree_entry_id(e));
+            break;
+        case GIT_OBJECT_BLOB:
+            error = walk_add(pw, git_tree_entry_id(e), GIT_OBJECT_BLOB);
+            break;
+        default:
+            /* submodule commits are not in this repository */
+            break;
+        }
+    }
+
+    git_tree_free(tree);
+    return error < 0 ? error : 0;
+}
+
+/* As insert_want in transfer.c: tags are peeled, commits seed the revwalk */
+static int walk_want(push_walk *pw, git_revwalk *walk, const git_oid *want)
+{
+    git_oid oid;
+    int error;
+
+    git_oid_cpy(&oid, want);
+
+    for (;;) {
+        git_object *obj = NULL;
+
+        if ((error = git_object_lookup(&obj, pw->repo, &oid, GIT_OBJECT_ANY)) < 0)
+            return error;
+
+        switch (git_object_type(obj)) {
+        case GIT_OBJECT_TAG:
+            error = walk_add(pw, &oid, GIT_OBJECT_TAG);
+            git_oid_cpy(&oid, git_tag_target_id((git_tag *)obj));
+            git_object_free(obj);
+            if (error < 0)
+                return error;
+            continue;
+
+        case GIT_OBJECT_COMMIT:
+            error = git_revwalk_push(walk, &oid);
+            break;
+
+        case GIT_OBJECT_TREE:
+            error = walk_tree(pw, &oid);
+            break;
+
+        default:
+            error = walk_add(pw, &oid, git_object_type(obj));
+            break;
+        }
+
+        git_object_free(obj);
+        return error < 0 ? error : 0;
+    }
+}
+
+/*
+ * Everything reachable from wants and not from haves.  Trees of hidden
+ * commits are not subtracted here; objects the database already has
+ * are dropped afterwards with one lookup per thousand oids.
+ */
+static int walk_objects(push_walk *pw, const git_oid *wants, size_t nwants,
+                        const git_oid *haves, size_t nhaves)
+{
+    git_revwalk *walk = NULL;
+    git_oid oid;
+    int error;
+
+    if ((error = git_revwalk_new(&walk, pw->repo)) < 0)
+        return error;
+
+    for (size_t i = 0; i < nwants && error == 0; i++)
+        error = walk_want(pw, walk, &wants[i]);
+    for (size_t i = 0; i < nhaves && error == 0; i++)
+        gitgres_revwalk_hide_have(walk, pw->repo, &haves[i]);
+
+    while (error == 0 && (error = git_revwalk_next(&oid, walk)) == 0) {
+        git_commit *commit = NULL;
+
+        if ((error = walk_add(pw, &oid, GIT_OBJECT_COMMIT)) < 0 ||
+            (error = git_commit_lookup(&commit, pw->repo, &oid)) < 0)
+            break;
+        error = walk_tree(pw, git_commit_tree_id(commit));
+        git_commit_free(commit);
+    }
+    if (error == GIT_ITEROVER)
+        error = 0;
+
+    git_revwalk_free(walk);
+    return error;
+}
+
+static int transfer_ranges(gitgres_parallel_stats *stats, const char *conninfo,
+                           int repo_id, const char *local_path,
+                           const git_oid *wants, size_t nwants,
+                           const git_oid *haves, size_t nhaves,
+                           int jobs, int checkpoint)
+{
+    push_walk pw;
+    PGconn *conn = NULL;
+    git_odb_backend *backend = NULL;
+    unsigned char *missing = NULL;
+    worker *workers = NULL;
+    commit_gate gate;
+    int error;
+
+    jobs = clamp_jobs(jobs);
+    memset(stats, 0, sizeof(*stats));
+    memset(&pw, 0, sizeof(pw));
+
+    if ((error = git_repository_open(&pw.repo, local_path)) < 0 ||
+        (error = walk_objects(&pw, wants, nwants, haves, nhaves)) < 0)
+        goto done;
+
+    if (pw.objects.n == 0)
+        goto done;
+
+    conn = gitgres_connect(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQerrorMessage(conn));
+        error = -1;
+        goto done;
+    }
+    if (!(missing = calloc(pw.objects.n, 1))) {
+        git_error_set_oom();
+        error = -1;
+        goto done;
+    }
+    if ((error = git_odb_backend_postgres(&backend, conn, repo_id)) < 0 ||
+        (error = git_odb_backend_postgres_missing(backend, pw.objects.oids,
+            pw.objects.n, missing)) < 0)
+        goto done;
+    error = 0;
+
+    if (!(workers = calloc(jobs, sizeof(worker)))) {
+        git_error_set_oom();
+        error = -1;
+        goto done;
+    }
+
+    pthread_mutex_init(&gate.lock, NULL);
+    pthread_cond_init(&gate.cond, NULL);
+    gate.waiting = jobs;
+    gate.failed = 0;
+
+    for (int i = 0; i < jobs; i++) {
+        workers[i].conninfo = conninfo;
+        workers[i].repo_id = repo_id;
+        workers[i].path = local_path;
+        workers[i].range = i;
+        workers[i].jobs = jobs;
+        workers[i].gate = checkpoint ? NULL : &gate;
+    }
+
+    for (size_t i = 0; i < pw.objects.n && error == 0; i++) {
+        git_object_t type = pw.objects.types[i];
+        int range;
+
+        if (!missing[i]) {
+            stats->skipped++;
+            continue;
+        }
+        range = type == GIT_OBJECT_COMMIT || type == GIT_OBJECT_TAG
+            ? 0 : oid_range(&pw.objects.oids[i], jobs);
+        error = oid_vec_add(&workers[range].oids, &pw.objects.oids[i], type);
+    }
+
+    if (error == 0)
+        error = run_workers(workers, jobs, push_worker);
+
+    for (int i = 0; i < jobs; i++) {
+        stats->objects += workers[i].count;
+        oid_vec_free(&workers[i].oids);
+    }
+    pthread_cond_destroy(&gate.cond);
+    pthread_mutex_destroy(&gate.lock);
+
+done:
+    free(workers);
+    free(missing);
+    if (backend)
+        backend->free(backend);
+    if (conn)
+        PQfinish(conn);
+    oid_set_free(&pw.seen);
+    oid_vec_free(&pw.objects);
+    git_repository_free(pw.repo);
+    return error;
+}
+
+int gitgres_parallel_push(gitgres_parallel_stats *stats, const char *conninfo,
+                          int repo_id, const char *local_path,
+                          const git_oid *wants, size_t nwants,
+                          const git_oid *haves, size_t nhaves, int jobs)
+{
+    return transfer_ranges(stats, conninfo, repo_id, local_path,
+                           wants, nwants, haves, nhaves, jobs, 0);
+}
+
+int gitgres_parallel_import(gitgres_parallel_stats *stats, const char *conninfo,
+                            int repo_id, const char *local_path,
+                            const git_oid *wants, size_t nwants, int jobs)
+{
+    return transfer_ranges(stats, conninfo, repo_id, local_path,
+                           wants, nwants, NULL, 0, jobs, 1);
+}
@@ -0,0 +1,49 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <git2.h>
+
+/*
+ * Multi-connection object transfer for gitgres-backend --jobs N.
+ *
+ * The oid space is split into jobs ranges by leading byte, and each
+ * range is moved by its own thread over its own database connection.
+ * Up to 256 jobs are used.
+ */
+
+/*
+ * Copy every object of repo_id into the odb at objects_dir (a clone's
+ * .git/objects).  Each thread streams its range with pipelined reads
+ * and writes it locally as one pack.
+ */
+int gitgres_parallel_clone(size_t *count, const char *conninfo, int repo_id,
+                           const char *objects_dir, int jobs);
+
+typedef struct {
+    size_t objects;     /* objects stored by this run */
+    size_t skipped;     /* objects the database already had */
+} gitgres_parallel_stats;
+
+/*
+ * Store the objects of the repository at local_path that are reachable
+ * from wants but not from haves and not already in repo_id.  Objects are
+ * stored whole.  Each range is ingested in its own transaction, and the
+ * transactions only commit once every range has been staged.  Commits
+ * and tags all go through the first range so only one transaction
+ * updates the commit graph.
+ */
+int gitgres_parallel_push(gitgres_parallel_stats *stats, const char *conninfo,
+                          int repo_id, const char *local_path,
+                          const git_oid *wants, size_t nwants,
+                          const git_oid *haves, size_t nhaves, int jobs);
+
+/*
+ * As gitgres_parallel_push with no haves, but each range commits after
+ * every ingest batch instead of all at once.  Stored objects are skipped
+ * on the next run, so an interrupted import picks up where it stopped.
+ */
+int gitgres_parallel_import(gitgres_parallel_stats *stats, const char *conninfo,
+                            int repo_id, const char *local_path,
+                            const git_oid *wants, size_t nwants, int jobs);
+
+#endif
@@ -2,24 +2,38 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <arpa/inet.h>
+#include <fnmatch.h>
 
 #include <git2/sys/refs.h>
 #include <git2/sys/errors.h>
 
 #include "refdb_postgres.h"
+#include "stats.h"
 
 typedef struct {
 	git_refdb_backend parent;
 	PGconn *conn;
 	int repo_id;
+	int lock_depth;		/* refs locked in the open transaction */
+	int lock_failed;	/* a write in that transaction failed */
+	gitgres_stats *stats;	/* NULL unless GITGRES_STATS is set */
 } postgres_refdb_backend;
 
+/* Refs are read in name order a page at a time, each page starting
+ * after the last name of the one before, so iterating a repo with many
+ * refs never holds them all in memory. */
+#define REFDB_ITER_PAGE 1000
+
 typedef struct {
 	git_reference_iterator parent;
 	postgres_refdb_backend *backend;
-	PGresult *result;
+	PGresult *result;	/* current page */
 	int current;
 	int total;
+	int done;		/* current page is the last */
+	char *glob;		/* NULL to list every ref */
+	char *lower;	/* literal prefix of glob, "" for none */
+	char *upper;	/* bound past every name with that prefix, or NULL */
 } postgres_refdb_iterator;
 
 /* Payload for the lock/unlock mechanism. Stores the advisory lock key
@@ -56,6 +70,31 @@ static int64_t hash_refname(int repo_id, const char *refname)
 	return (int64_t)h;
 }
 
+/* Take the advisory lock for a ref in the current transaction.  Every
+ * writer holds it while it reads and replaces the ref, including the
+ * SQL git_ref_update, which computes the same key with
+ * git_ref_lock_key; a row lock alone can't cover a ref that doesn't
+ * exist yet. */
+static int lock_refname(PGconn *conn, int repo_id, const char *refname)
+{
+	char key_str[32];
+	const char *params[1] = { key_str };
+	PGresult *res;
+
+	snprintf(key_str, sizeof(key_str), "%lld",
+		(long long)hash_refname(repo_id, refname));
+
+	res = PQexecParams(conn, "SELECT pg_advisory_xact_lock($1::bigint)",
+		1, NULL, params, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		git_error_set_str(GIT_ERROR_REFERENCE, PQerrorMessage(conn));
+		PQclear(res);
+		return -1;
+	}
+	PQclear(res);
+	return 0;
+}
+
 /* Build a git_reference from a PGresult row that has columns:
  *   0: name (text)   -- only used when name_override is NULL
  *   1: oid  (bytea, 20 bytes, may be NULL)
@@ -121,6 +160,7 @@ static int pg_refdb_exists(int *exists, git_refdb_backend *_backend,
 	char rid[16];
 	const char *params[2];
 	PGresult *res;
+	uint64_t t = gitgres_stats_start(backend->stats);
 
 	repo_id_str(rid, sizeof(rid), backend->repo_id);
 	params[0] = rid;
@@ -138,6 +178,7 @@ static int pg_refdb_exists(int *exists, git_refdb_backend *_backend,
 
 	*exists = (PQntuples(res) > 0) ? 1 : 0;
 	PQclear(res);
+	gitgres_stats_end(backend->stats, GITGRES_STAT_REFDB_EXISTS, t, *exists, 0);
 	return 0;
 }
 
@@ -153,6 +194,7 @@ static int pg_refdb_lookup(git_reference **out, git_refdb_backend *_backend,
 	const char *params[2];
 	PGresult *res;
 	int error;
+	uint64_t t = gitgres_stats_start(backend->stats);
 
 	repo_id_str(rid, sizeof(rid), backend->repo_id);
 	params[0] = rid;
@@ -168,6 +210,8 @@ static int pg_refdb_lookup(git_reference **out, git_refdb_backend *_backend,
 		return -1;
 	}
 
+	gitgres_stats_end(backend->stats, GITGRES_STAT_REFDB_LOOKUP, t,
+		PQntuples(res), PQntuples(res) ? PQgetlength(res, 0, 1) + PQgetlength(res, 0, 2) : 0);
 	if (PQntuples(res) == 0) {
 		PQclear(res);
 		return GIT_ENOTFOUND;
@@ -189,13 +233,84 @@ static int pg_refdb_lookup(git_reference **out, git_refdb_backend *_backend,
  * iterator
  * ---------------------------------------------------------------- */
 
+/* Replace the current page with the next one.  The last name of the
+ * old page is the keyset bound, so the old result is only cleared once
+ * the new one is in. */
+static int iter_fetch_page(postgres_refdb_iterator *iter)
+{
+	char rid[16];
+	char limit[16];
+	const char *params[5];
+	PGresult *res;
+	uint64_t t = gitgres_stats_start(iter->backend->stats);
+
+	repo_id_str(rid, sizeof(rid), iter->backend->repo_id);
+	snprintf(limit, sizeof(limit), "%d", REFDB_ITER_PAGE);
+	params[0] = rid;
+	params[1] = iter->lower;
+	params[2] = iter->upper;
+	params[3] = iter->total > 0
+		? PQgetvalue(iter->result, iter->total - 1, 0) : NULL;
+	params[4] = limit;
+
+	res = PQexecParams(iter->backend->conn,
+		"SELECT name, oid, symbolic FROM refs "
+		"WHERE repo_id = $1 AND name >= $2 "
+		"AND ($3::text IS NULL OR name < $3) "
+		"AND ($4::text IS NULL OR name > $4) "
+		"ORDER BY name LIMIT $5",
+		5, NULL, params, NULL, NULL, 1 /* binary result */);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		git_error_set_str(GIT_ERROR_REFERENCE,
+			PQerrorMessage(iter->backend->conn));
+		PQclear(res);
+		return -1;
+	}
+	gitgres_stats_end(iter->backend->stats, GITGRES_STAT_REFDB_ITERATE, t,
+		PQntuples(res), 0);
+
+	if (iter->result)
+		PQclear(iter->result);
+	iter->result = res;
+	iter->current = 0;
+	iter->total = PQntuples(res);
+	iter->done = iter->total < REFDB_ITER_PAGE;
+	return 0;
+}
+
+/* Move iter->current to the next row whose name matches the glob,
+ * fetching pages as needed.  The prefix range only narrows the scan;
+ * the rest of the pattern is matched here, as refdb_fs does, so * also
+ * matches across slashes. */
+static int iter_seek(postgres_refdb_iterator *iter)
+{
+	for (;;) {
+		while (iter->current < iter->total) {
+			const char *name = PQgetvalue(iter->result, iter->current, 0);
+
+			if (!iter->glob || fnmatch(iter->glob, name, 0) == 0)
+				return 0;
+			iter->current++;
+		}
+
+		if (iter->done)
+			return GIT_ITEROVER;
+		if (iter_fetch_page(iter) < 0)
+			return -1;
+	}
+}
+
 static int pg_refdb_iter_next(git_reference **ref, git_reference_iterator *_iter)
 {
 	postgres_refdb_iterator *iter = (postgres_refdb_iterator *)_iter;
+	int error;
 
-	if (iter->current >= iter->total)
-		return GIT_ITEROVER;
+	if ((error = iter_seek(iter)) != 0)
+		return error;
 
+	/* Binary-format values still come NUL-terminated from libpq, so
+	 * the name and symbolic target columns can be used as strings. */
 	if (ref_from_result(ref, iter->result, iter->current, NULL) < 0)
 		return -1;
 
@@ -207,13 +322,13 @@ static int pg_refdb_iter_next_name(const char **ref_name,
                                    git_reference_iterator *_iter)
 {
 	postgres_refdb_iterator *iter = (postgres_refdb_iterator *)_iter;
+	int error;
 
-	if (iter->current >= iter->total)
-		return GIT_ITEROVER;
+	if ((error = iter_seek(iter)) != 0)
+		return error;
 
-	/* Column 0 is the ref name.  For text-format results PQgetvalue
-	 * returns a NUL-terminated string.  The pointer remains valid
-	 * until we PQclear the result, which happens in iter_free. */
+	/* The pointer stays valid until the page is replaced, which only
+	 * happens on a later call. */
 	*ref_name = PQgetvalue(iter->result, iter->current, 0);
 	iter->current++;
 	return 0;
@@ -224,6 +339,9 @@ static void pg_refdb_iter_free(git_reference_iterator *_iter)
 	postgres_refdb_iterator *iter = (postgres_refdb_iterator *)_iter;
 	if (iter->result)
 		PQclear(iter->result);
+	free(iter->glob);
+	free(iter->lower);
+	free(iter->upper);
 	free(iter);
 }
 
@@ -232,56 +350,11 @@ static int pg_refdb_iterator(git_reference_iterator **out,
 {
 	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
 	postgres_refdb_iterator *iter;
-	char rid[16];
-	PGresult *res;
-
-	repo_id_str(rid, sizeof(rid), backend->repo_id);
-
-	if (glob && *glob) {
-		/* Convert glob pattern: replace * with % for SQL LIKE */
-		size_t len = strlen(glob);
-		char *like = malloc(len + 1);
-		size_t i;
-		const char *params[2];
-
-		if (!like) {
-			git_error_set_oom();
-			return -1;
-		}
-		for (i = 0; i < len; i++)
-			like[i] = (glob[i] == '*') ? '%' : glob[i];
-		like[len] = '\0';
-
-		params[0] = rid;
-		params[1] = like;
-
-		res = PQexecParams(backend->conn,
-			"SELECT name, oid, symbolic FROM refs "
-			"WHERE repo_id = $1 AND name LIKE $2 "
-			"ORDER BY name",
-			2, NULL, params, NULL, NULL, 0);
-
-		free(like);
-	} else {
-		const char *params[1];
-		params[0] = rid;
-
-		res = PQexecParams(backend->conn,
-			"SELECT name, oid, symbolic FROM refs "
-			"WHERE repo_id = $1 ORDER BY name",
-			1, NULL, params, NULL, NULL, 0);
-	}
-
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		git_error_set_str(GIT_ERROR_REFERENCE, PQerrorMessage(backend->conn));
-		PQclear(res);
-		return -1;
-	}
+	size_t len;
 
 	iter = calloc(1, sizeof(postgres_refdb_iterator));
 	if (!iter) {
 		git_error_set_oom();
-		PQclear(res);
 		return -1;
 	}
 
@@ -289,18 +362,60 @@ static int pg_refdb_iterator(git_reference_iterator **out,
 	iter->parent.next_name = pg_refdb_iter_next_name;
 	iter->parent.free = pg_refdb_iter_free;
 	iter->backend = backend;
-	iter->result = res;
-	iter->current = 0;
-	iter->total = PQntuples(res);
+
+	if (glob && *glob) {
+		/* Every match starts with the glob's literal prefix, and refs.name
+		 * sorts bytewise, so the matches lie in [prefix, upper) where upper
+		 * is the prefix with its last byte incremented.  Trailing non-ASCII
+		 * bytes are dropped first so upper stays valid UTF-8; that only
+		 * widens the range. */
+		len = strcspn(glob, "*?[\\");
+		iter->glob = strdup(glob);
+		iter->lower = strndup(glob, len);
+		if (!iter->glob || !iter->lower)
+			goto oom;
+
+		while (len > 0 && (unsigned char)glob[len - 1] >= 0x7f)
+			len--;
+		if (len > 0) {
+			iter->upper = strndup(glob, len);
+			if (!iter->upper)
+				goto oom;
+			iter->upper[len - 1]++;
+		}
+	} else {
+		iter->lower = strdup("");
+		if (!iter->lower)
+			goto oom;
+	}
 
 	*out = (git_reference_iterator *)iter;
 	return 0;
+
+oom:
+	git_error_set_oom();
+	pg_refdb_iter_free((git_reference_iterator *)iter);
+	return -1;
 }
 
 /* ----------------------------------------------------------------
  * write reflog entry (helper)
  * ---------------------------------------------------------------- */
 
+/* The committer, timestamp_s and tz_offset columns of a reflog row.
+ * tz must hold 8 bytes. */
+static void format_signature(const git_signature *who,
+                             char *committer, size_t committer_sz,
+                             char *ts, size_t ts_sz, char *tz)
+{
+	snprintf(committer, committer_sz, "%s <%s>", who->name, who->email);
+	snprintf(ts, ts_sz, "%lld", (long long)who->when.time);
+	snprintf(tz, 8, "%c%02d%02d",
+		who->when.offset >= 0 ? '+' : '-',
+		abs(who->when.offset) / 60,
+		abs(who->when.offset) % 60);
+}
+
 static int write_reflog_entry(postgres_refdb_backend *backend,
                               const char *ref_name,
                               const git_oid *old_oid,
@@ -321,12 +436,7 @@ static int write_reflog_entry(postgres_refdb_backend *backend,
 		return 0;
 
 	repo_id_str(rid, sizeof(rid), backend->repo_id);
-	snprintf(committer, sizeof(committer), "%s <%s>", who->name, who->email);
-	snprintf(ts, sizeof(ts), "%lld", (long long)who->when.time);
-	snprintf(tz, sizeof(tz), "%c%02d%02d",
-		who->when.offset >= 0 ? '+' : '-',
-		abs(who->when.offset) / 60,
-		abs(who->when.offset) % 60);
+	format_signature(who, committer, sizeof(committer), ts, sizeof(ts), tz);
 
 	/* params: repo_id, ref_name, old_oid, new_oid, committer, timestamp_s, tz_offset, message */
 	params[0] = rid;              param_lengths[0] = 0; param_formats[0] = 0;
@@ -401,10 +511,10 @@ static int write_reflog_entry(postgres_refdb_backend *backend,
  * write
  * ---------------------------------------------------------------- */
 
-static int pg_refdb_write(git_refdb_backend *_backend,
-                          const git_reference *ref, int force,
-                          const git_signature *who, const char *message,
-                          const git_oid *old, const char *old_target)
+static int ref_write(git_refdb_backend *_backend,
+                     const git_reference *ref, int force,
+                     const git_signature *who, const char *message,
+                     const git_oid *old, const char *old_target)
 {
 	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
 	const char *ref_name = git_reference_name(ref);
@@ -424,6 +534,11 @@ static int pg_refdb_write(git_refdb_backend *_backend,
 	}
 	PQclear(res);
 
+	if (lock_refname(backend->conn, backend->repo_id, ref_name) < 0) {
+		PQexec(backend->conn, "ROLLBACK");
+		return -1;
+	}
+
 	/* If not forcing, perform compare-and-swap check */
 	if (!force) {
 		const char *sel_params[2] = { rid, ref_name };
@@ -584,10 +699,10 @@ static int pg_refdb_write(git_refdb_backend *_backend,
  * rename
  * ---------------------------------------------------------------- */
 
-static int pg_refdb_rename(git_reference **out, git_refdb_backend *_backend,
-                           const char *old_name, const char *new_name,
-                           int force, const git_signature *who,
-                           const char *message)
+static int ref_rename(git_reference **out, git_refdb_backend *_backend,
+                      const char *old_name, const char *new_name,
+                      int force, const git_signature *who,
+                      const char *message)
 {
 	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
 	char rid[16];
@@ -606,6 +721,20 @@ static int pg_refdb_rename(git_reference **out, git_refdb_backend *_backend,
 	}
 	PQclear(res);
 
+	/* Both names, in key order like update_refs */
+	{
+		int64_t a = hash_refname(backend->repo_id, old_name);
+		int64_t b = hash_refname(backend->repo_id, new_name);
+		const char *first = a <= b ? old_name : new_name;
+		const char *second = a <= b ? new_name : old_name;
+
+		if (lock_refname(backend->conn, backend->repo_id, first) < 0 ||
+		    lock_refname(backend->conn, backend->repo_id, second) < 0) {
+			PQexec(backend->conn, "ROLLBACK");
+			return -1;
+		}
+	}
+
 	/* If not forcing, check the target name doesn't already exist */
 	if (!force) {
 		const char *chk_params[2] = { rid, new_name };
@@ -719,8 +848,8 @@ static int pg_refdb_rename(git_reference **out, git_refdb_backend *_backend,
  * del
  * ---------------------------------------------------------------- */
 
-static int pg_refdb_del(git_refdb_backend *_backend, const char *ref_name,
-                        const git_oid *old_id, const char *old_target)
+static int ref_del(git_refdb_backend *_backend, const char *ref_name,
+                   const git_oid *old_id, const char *old_target)
 {
 	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
 	char rid[16];
@@ -736,6 +865,11 @@ static int pg_refdb_del(git_refdb_backend *_backend, const char *ref_name,
 	}
 	PQclear(res);
 
+	if (lock_refname(backend->conn, backend->repo_id, ref_name) < 0) {
+		PQexec(backend->conn, "ROLLBACK");
+		return -1;
+	}
+
 	/* CAS check if old_id or old_target provided */
 	if (old_id || old_target) {
 		const char *sel_params[2] = { rid, ref_name };
@@ -840,6 +974,7 @@ static int pg_refdb_has_log(git_refdb_backend *_backend, const char *refname)
 	const char *params[2];
 	PGresult *res;
 	int found;
+	uint64_t t = gitgres_stats_start(backend->stats);
 
 	repo_id_str(rid, sizeof(rid), backend->repo_id);
 	params[0] = rid;
@@ -856,6 +991,7 @@ static int pg_refdb_has_log(git_refdb_backend *_backend, const char *refname)
 
 	found = PQntuples(res) > 0 ? 1 : 0;
 	PQclear(res);
+	gitgres_stats_end(backend->stats, GITGRES_STAT_REFDB_HAS_LOG, t, found, 0);
 	return found;
 }
 
@@ -949,8 +1085,8 @@ static int pg_refdb_reflog_delete(git_refdb_backend *_backend, const char *name)
  * releases automatically on COMMIT or ROLLBACK.
  * ---------------------------------------------------------------- */
 
-static int pg_refdb_lock(void **payload_out, git_refdb_backend *_backend,
-                         const char *refname)
+static int ref_lock(void **payload_out, git_refdb_backend *_backend,
+                    const char *refname)
 {
 	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
 	pg_ref_lock *lock;
@@ -972,16 +1108,21 @@ static int pg_refdb_lock(void **payload_out, git_refdb_backend *_backend,
 		return -1;
 	}
 
-	/* Start a transaction to scope the advisory lock */
-	res = PQexec(backend->conn, "BEGIN");
-	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-		git_error_set_str(GIT_ERROR_REFERENCE, PQerrorMessage(backend->conn));
+	/* Start a transaction to scope the advisory lock, unless another
+	 * ref's lock already did.  A git_transaction locks all its refs
+	 * first and then unlocks each, so its updates share one commit. */
+	if (backend->lock_depth == 0) {
+		res = PQexec(backend->conn, "BEGIN");
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			git_error_set_str(GIT_ERROR_REFERENCE, PQerrorMessage(backend->conn));
+			PQclear(res);
+			free(lock->refname);
+			free(lock);
+			return -1;
+		}
 		PQclear(res);
-		free(lock->refname);
-		free(lock);
-		return -1;
+		backend->lock_failed = 0;
 	}
-	PQclear(res);
 
 	snprintf(key_str, sizeof(key_str), "%lld", (long long)lock->lock_key);
 	params[0] = key_str;
@@ -993,27 +1134,36 @@ static int pg_refdb_lock(void **payload_out, git_refdb_backend *_backend,
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		git_error_set_str(GIT_ERROR_REFERENCE, PQerrorMessage(backend->conn));
 		PQclear(res);
-		PQexec(backend->conn, "ROLLBACK");
+		if (backend->lock_depth == 0)
+			PQclear(PQexec(backend->conn, "ROLLBACK"));
+		else
+			backend->lock_failed = 1;
 		free(lock->refname);
 		free(lock);
 		return -1;
 	}
 	PQclear(res);
 
+	backend->lock_depth++;
 	*payload_out = lock;
 	return 0;
 }
 
-static int pg_refdb_unlock(git_refdb_backend *_backend, void *payload,
-                           int success, int update_reflog,
-                           const git_reference *ref,
-                           const git_signature *sig, const char *message)
+static int ref_unlock(git_refdb_backend *_backend, void *payload,
+                      int success, int update_reflog,
+                      const git_reference *ref,
+                      const git_signature *sig, const char *message)
 {
 	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
 	pg_ref_lock *lock = (pg_ref_lock *)payload;
 	int error = 0;
 
-	if (success == 1) {
+	if (backend->lock_failed && success != 0) {
+		git_error_set(GIT_ERROR_REFERENCE,
+			"postgres refdb: not updating %s, an earlier update in the "
+			"transaction failed", lock->refname);
+		error = -1;
+	} else if (success == 1) {
 		/* Write/update the ref within the existing transaction */
 		const char *ref_name = git_reference_name(ref);
 		git_reference_t type = git_reference_type(ref);
@@ -1094,15 +1244,25 @@ static int pg_refdb_unlock(git_refdb_backend *_backend, void *payload,
 			PQclear(res);
 		}
 	}
-	/* success == 0: discard, just rollback */
+	/* success == 0: discard, nothing to write */
 
-	/* End the transaction (commits on success, rolls back on error) */
-	{
+	if (error < 0)
+		backend->lock_failed = 1;
+
+	/* End the transaction once the last locked ref is done (commits if
+	 * every update succeeded, rolls back otherwise) */
+	if (--backend->lock_depth == 0) {
 		PGresult *res;
-		if (error == 0)
+		if (!backend->lock_failed) {
 			res = PQexec(backend->conn, "COMMIT");
-		else
+			if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+				git_error_set_str(GIT_ERROR_REFERENCE,
+					PQerrorMessage(backend->conn));
+				error = -1;
+			}
+		} else {
 			res = PQexec(backend->conn, "ROLLBACK");
+		}
 		PQclear(res);
 	}
 
@@ -1111,6 +1271,465 @@ static int pg_refdb_unlock(git_refdb_backend *_backend, void *payload,
 	return error;
 }
 
+/* ----------------------------------------------------------------
+ * batch update
+ *
+ * Ref names, oids and keys are passed as newline-separated text and
+ * split server side, so a push of thousands of refs is a handful of
+ * statements instead of a transaction per ref.  Ref names cannot
+ * contain newlines or tabs.
+ * ---------------------------------------------------------------- */
+
+typedef struct {
+	char *ptr;
+	size_t len;
+	size_t cap;
+} text_buf;
+
+static int text_buf_put(text_buf *buf, const char *data, size_t len)
+{
+	if (buf->len + len + 1 > buf->cap) {
+		size_t cap = buf->cap ? buf->cap : 4096;
+		char *ptr;
+
+		while (buf->len + len + 1 > cap)
+			cap *= 2;
+		ptr = realloc(buf->ptr, cap);
+		if (!ptr) {
+			git_error_set_oom();
+			return -1;
+		}
+		buf->ptr = ptr;
+		buf->cap = cap;
+	}
+	memcpy(buf->ptr + buf->len, data, len);
+	buf->len += len;
+	buf->ptr[buf->len] = '\0';
+	return 0;
+}
+
+static int text_buf_puts(text_buf *buf, const char *str)
+{
+	return text_buf_put(buf, str, strlen(str));
+}
+
+static int text_buf_put_oid(text_buf *buf, const git_oid *oid)
+{
+	char hex[GIT_OID_SHA1_HEXSIZE + 1];
+
+	if (!oid || git_oid_is_zero(oid))
+		return 0;
+	git_oid_tostr(hex, sizeof(hex), oid);
+	return text_buf_put(buf, hex, GIT_OID_SHA1_HEXSIZE);
+}
+
+static int compare_lock_keys(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* A batch may name each ref once: the upsert can't touch a row twice,
+ * and which of two changes should win is anyone's guess */
+static int check_unique_names(const git_refdb_postgres_update *updates,
+                              size_t n)
+{
+	const char **sorted = malloc(n * sizeof(const char *));
+	int error = 0;
+	size_t i;
+
+	if (!sorted) {
+		git_error_set_oom();
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		sorted[i] = updates[i].name;
+	qsort(sorted, n, sizeof(const char *), compare_names);
+
+	for (i = 1; i < n; i++) {
+		if (strcmp(sorted[i - 1], sorted[i]) == 0) {
+			git_error_set(GIT_ERROR_REFERENCE,
+				"postgres refdb: %s appears twice in one batch", sorted[i]);
+			error = GIT_EINVALID;
+			break;
+		}
+	}
+	free(sorted);
+	return error;
+}
+
+/* Run a statement inside the batch transaction.  On failure the error
+ * is set and the transaction rolled back. */
+static PGresult *batch_exec(PGconn *conn, const char *sql, int nparams,
+                            const char *const *params, ExecStatusType expect,
+                            int binary)
+{
+	PGresult *res = PQexecParams(conn, sql, nparams, NULL, params,
+		NULL, NULL, binary);
+
+	if (PQresultStatus(res) != expect) {
+		git_error_set_str(GIT_ERROR_REFERENCE, PQerrorMessage(conn));
+		PQclear(res);
+		PQclear(PQexec(conn, "ROLLBACK"));
+		return NULL;
+	}
+	return res;
+}
+
+static int update_refs(PGconn *conn, int repo_id,
+                       git_refdb_postgres_update *updates, size_t n,
+                       int atomic, const git_signature *who,
+                       const char *message)
+{
+	text_buf keys = {0}, names = {0}, writes = {0}, deletes = {0}, logs = {0};
+	int64_t *sorted = NULL;
+	char rid[16];
+	char committer[512];
+	char ts[32];
+	char tz[8];
+	PGresult *res;
+	size_t i;
+	int rejected = 0;
+	int error = -1;
+
+	for (i = 0; i < n; i++)
+		updates[i].status = -1;
+	if (n == 0)
+		return 0;
+
+	error = check_unique_names(updates, n);
+	if (error < 0)
+		return error;
+	error = -1;
+
+	repo_id_str(rid, sizeof(rid), repo_id);
+
+	/* Lock keys in ascending order, so two batches touching the same
+	 * refs always queue on them in the same order and can't deadlock */
+	sorted = malloc(n * sizeof(int64_t));
+	if (!sorted) {
+		git_error_set_oom();
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		sorted[i] = hash_refname(repo_id, updates[i].name);
+	qsort(sorted, n, sizeof(int64_t), compare_lock_keys);
+
+	if (text_buf_puts(&keys, "{") < 0)
+		goto done;
+	for (i = 0; i < n; i++) {
+		char key[32];
+		snprintf(key, sizeof(key), "%s%lld", i ? "," : "", (long long)sorted[i]);
+		if (text_buf_puts(&keys, key) < 0)
+			goto done;
+	}
+	if (text_buf_puts(&keys, "}") < 0)
+		goto done;
+
+	for (i = 0; i < n; i++) {
+		if (text_buf_puts(&names, updates[i].name) < 0 ||
+		    text_buf_puts(&names, "\n") < 0)
+			goto done;
+	}
+
+	res = PQexec(conn, "BEGIN");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		git_error_set_str(GIT_ERROR_REFERENCE, PQerrorMessage(conn));
+		PQclear(res);
+		goto done;
+	}
+	PQclear(res);
+
+	{
+		const char *params[1] = { keys.ptr };
+		res = batch_exec(conn,
+			"SELECT pg_advisory_xact_lock(k) FROM unnest($1::bigint[]) AS k",
+			1, params, PGRES_TUPLES_OK, 0);
+		if (!res)
+			goto done;
+		PQclear(res);
+	}
+
+	/* Row-lock the refs that exist too, for writers that lock rows
+	 * rather than keys.  FOR UPDATE can't reach the nullable side of
+	 * the join below, hence the separate statement. */
+	{
+		const char *params[2] = { rid, names.ptr };
+		res = batch_exec(conn,
+			"SELECT 1 FROM refs "
+			"WHERE repo_id = $1 AND name = ANY(string_to_array($2, E'\\n')) "
+			"ORDER BY name FOR UPDATE",
+			2, params, PGRES_TUPLES_OK, 0);
+		if (!res)
+			goto done;
+		PQclear(res);
+	}
+
+	/* Current value of every ref, in the order of updates */
+	{
+		const char *params[2] = { rid, names.ptr };
+		res = batch_exec(conn,
+			"SELECT r.oid, r.symbolic "
+			"FROM regexp_split_to_table($2, E'\\n') WITH ORDINALITY AS u(name, i) "
+			"LEFT JOIN refs r ON r.repo_id = $1 AND r.name = u.name "
+			"WHERE u.name <> '' ORDER BY u.i",
+			2, params, PGRES_TUPLES_OK, 1 /* binary result */);
+		if (!res)
+			goto done;
+	}
+
+	if ((size_t)PQntuples(res) != n) {
+		git_error_set(GIT_ERROR_REFERENCE,
+			"postgres refdb: read %d refs, expected %zu", PQntuples(res), n);
+		PQclear(res);
+		PQclear(PQexec(conn, "ROLLBACK"));
+		goto done;
+	}
+
+	for (i = 0; i < n; i++) {
+		git_refdb_postgres_update *u = &updates[i];
+		int exists = !PQgetisnull(res, i, 0) || !PQgetisnull(res, i, 1);
+		git_oid current;
+		int direct = 0;
+
+		if (!PQgetisnull(res, i, 0) &&
+		    PQgetlength(res, i, 0) == GIT_OID_SHA1_SIZE) {
+			git_oid_fromraw(&current,
+				(const unsigned char *)PQgetvalue(res, i, 0));
+			direct = 1;
+		}
+
+		if (u->old_oid) {
+			int ok = git_oid_is_zero(u->old_oid)
+				? !exists
+				: direct && git_oid_equal(&current, u->old_oid);
+			if (!ok) {
+				u->status = GIT_EEXISTS;
+				rejected++;
+				continue;
+			}
+		}
+		u->status = 0;
+
+		if (u->new_oid || u->symbolic) {
+			const git_oid *target = u->symbolic ? NULL : u->new_oid;
+
+			if (text_buf_puts(&writes, u->name) < 0 ||
+			    text_buf_puts(&writes, "\t") < 0 ||
+			    text_buf_put_oid(&writes, target) < 0 ||
+			    text_buf_puts(&writes, "\t") < 0 ||
+			    (u->symbolic && text_buf_puts(&writes, u->symbolic) < 0) ||
+			    text_buf_puts(&writes, "\n") < 0)
+				goto fail;
+			if (who &&
+			    (text_buf_puts(&logs, u->name) < 0 ||
+			     text_buf_puts(&logs, "\t") < 0 ||
+			     text_buf_put_oid(&logs, direct ? &current : NULL) < 0 ||
+			     text_buf_puts(&logs, "\t") < 0 ||
+			     text_buf_put_oid(&logs, target) < 0 ||
+			     text_buf_puts(&logs, "\n") < 0))
+				goto fail;
+		} else {
+			if (text_buf_puts(&deletes, u->name) < 0 ||
+			    text_buf_puts(&deletes, "\n") < 0)
+				goto fail;
+		}
+	}
+	PQclear(res);
+	res = NULL;
+
+	if (rejected && atomic) {
+		for (i = 0; i < n; i++)
+			if (updates[i].status == 0)
+				updates[i].status = -1;
+		PQclear(PQexec(conn, "ROLLBACK"));
+		error = 0;
+		goto done;
+	}
+
+	if (writes.len > 0) {
+		const char *params[2] = { rid, writes.ptr };
+		res = batch_exec(conn,
+			"INSERT INTO refs (repo_id, name, oid, symbolic) "
+			"SELECT $1, split_part(l, E'\\t', 1), "
+			"decode(nullif(split_part(l, E'\\t', 2), ''), 'hex'), "
+			"nullif(split_part(l, E'\\t', 3), '') "
+			"FROM regexp_split_to_table($2, E'\\n') AS l "
+			"WHERE l <> '' "
+			"ON CONFLICT (repo_id, name) "
+			"DO UPDATE SET oid = EXCLUDED.oid, symbolic = EXCLUDED.symbolic",
+			2, params, PGRES_COMMAND_OK, 0);
+		if (!res)
+			goto fail;
+		PQclear(res);
+		res = NULL;
+	}
+
+	if (deletes.len > 0) {
+		const char *params[2] = { rid, deletes.ptr };
+		res = batch_exec(conn,
+			"DELETE FROM refs WHERE repo_id = $1 "
+			"AND name = ANY(string_to_array($2, E'\\n'))",
+			2, params, PGRES_COMMAND_OK, 0);
+		if (!res)
+			goto fail;
+		PQclear(res);
+
+		res = batch_exec(conn,
+			"DELETE FROM reflog WHERE repo_id = $1 "
+			"AND ref_name = ANY(string_to_array($2, E'\\n'))",
+			2, params, PGRES_COMMAND_OK, 0);
+		if (!res)
+			goto fail;
+		PQclear(res);
+		res = NULL;
+	}
+
+	if (logs.len > 0) {
+		const char *params[6];
+
+		format_signature(who, committer, sizeof(committer), ts, sizeof(ts), tz);
+		params[0] = rid;
+		params[1] = logs.ptr;
+		params[2] = committer;
+		params[3] = ts;
+		params[4] = tz;
+		params[5] = message;
+
+		res = batch_exec(conn,
+			"INSERT INTO reflog (repo_id, ref_name, old_oid, new_oid, "
+			"committer, timestamp_s, tz_offset, message) "
+			"SELECT $1, split_part(l, E'\\t', 1), "
+			"decode(nullif(split_part(l, E'\\t', 2), ''), 'hex'), "
+			"decode(nullif(split_part(l, E'\\t', 3), ''), 'hex'), $3, $4, $5, $6 "
+			"FROM regexp_split_to_table($2, E'\\n') AS l "
+			"WHERE l <> ''",
+			6, params, PGRES_COMMAND_OK, 0);
+		if (!res)
+			goto fail;
+		PQclear(res);
+		res = NULL;
+	}
+
+	res = PQexec(conn, "COMMIT");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		git_error_set_str(GIT_ERROR_REFERENCE, PQerrorMessage(conn));
+		goto fail;
+	}
+	PQclear(res);
+	error = 0;
+	goto done;
+
+fail:
+	/* batch_exec has rolled back already; this covers the rest */
+	if (PQtransactionStatus(conn) != PQTRANS_IDLE)
+		PQclear(PQexec(conn, "ROLLBACK"));
+	if (res)
+		PQclear(res);
+	for (i = 0; i < n; i++)
+		updates[i].status = -1;
+
+done:
+	free(sorted);
+	free(keys.ptr);
+	free(names.ptr);
+	free(writes.ptr);
+	free(deletes.ptr);
+	free(logs.ptr);
+	return error;
+}
+
+/* Not tied to a backend, so counted in the process-wide block */
+int git_refdb_postgres_update_refs(PGconn *conn, int repo_id,
+                                   git_refdb_postgres_update *updates, size_t n,
+                                   int atomic, const git_signature *who,
+                                   const char *message)
+{
+	gitgres_stats *stats = gitgres_stats_shared();
+	uint64_t t = gitgres_stats_start(stats);
+	size_t applied = 0;
+	int error = update_refs(conn, repo_id, updates, n, atomic, who, message);
+
+	for (size_t i = 0; error == 0 && i < n; i++)
+		applied += updates[i].status == 0;
+	gitgres_stats_end(stats, GITGRES_STAT_REFDB_UPDATE_REFS, t, applied, 0);
+	return error;
+}
+
+/* ----------------------------------------------------------------
+ * timed callbacks
+ *
+ * The callbacks with many exits are timed here rather than inline.
+ * rows counts the refs changed.
+ * ---------------------------------------------------------------- */
+
+static int pg_refdb_write(git_refdb_backend *_backend,
+                          const git_reference *ref, int force,
+                          const git_signature *who, const char *message,
+                          const git_oid *old, const char *old_target)
+{
+	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
+	uint64_t t = gitgres_stats_start(backend->stats);
+	int error = ref_write(_backend, ref, force, who, message, old, old_target);
+
+	gitgres_stats_end(backend->stats, GITGRES_STAT_REFDB_WRITE, t, error == 0, 0);
+	return error;
+}
+
+static int pg_refdb_rename(git_reference **out, git_refdb_backend *_backend,
+                           const char *old_name, const char *new_name,
+                           int force, const git_signature *who,
+                           const char *message)
+{
+	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
+	uint64_t t = gitgres_stats_start(backend->stats);
+	int error = ref_rename(out, _backend, old_name, new_name, force, who, message);
+
+	gitgres_stats_end(backend->stats, GITGRES_STAT_REFDB_RENAME, t, error == 0, 0);
+	return error;
+}
+
+static int pg_refdb_del(git_refdb_backend *_backend, const char *ref_name,
+                        const git_oid *old_id, const char *old_target)
+{
+	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
+	uint64_t t = gitgres_stats_start(backend->stats);
+	int error = ref_del(_backend, ref_name, old_id, old_target);
+
+	gitgres_stats_end(backend->stats, GITGRES_STAT_REFDB_DEL, t, error == 0, 0);
+	return error;
+}
+
+static int pg_refdb_lock(void **payload_out, git_refdb_backend *_backend,
+                         const char *refname)
+{
+	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
+	uint64_t t = gitgres_stats_start(backend->stats);
+	int error = ref_lock(payload_out, _backend, refname);
+
+	gitgres_stats_end(backend->stats, GITGRES_STAT_REFDB_LOCK, t, 0, 0);
+	return error;
+}
+
+static int pg_refdb_unlock(git_refdb_backend *_backend, void *payload,
+                           int success, int update_reflog,
+                           const git_reference *ref,
+                           const git_signature *sig, const char *message)
+{
+	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
+	uint64_t t = gitgres_stats_start(backend->stats);
+	int error = ref_unlock(_backend, payload, success, update_reflog, ref, sig, message);
+
+	gitgres_stats_end(backend->stats, GITGRES_STAT_REFDB_UNLOCK, t,
+		error == 0 && success != 0, 0);
+	return error;
+}
+
 /* ----------------------------------------------------------------
  * free
  * ---------------------------------------------------------------- */
@@ -1118,6 +1737,7 @@ static int pg_refdb_unlock(git_refdb_backend *_backend, void *payload,
 static void pg_refdb_free(git_refdb_backend *_backend)
 {
 	postgres_refdb_backend *backend = (postgres_refdb_backend *)_backend;
+	gitgres_stats_free(backend->stats);
 	free(backend);
 }
 
@@ -1156,6 +1776,7 @@ int git_refdb_backend_postgres(git_refdb_backend **out, PGconn *conn,
 
 	backend->conn = conn;
 	backend->repo_id = repo_id;
+	backend->stats = gitgres_stats_new();
 
 	*out = (git_refdb_backend *)backend;
 	return 0;
@@ -7,4 +7,39 @@
 
 int git_refdb_backend_postgres(git_refdb_backend **out, PGconn *conn, int repo_id);
 
+/*
+ * One ref change for git_refdb_postgres_update_refs.  symbolic, when
+ * set, points the ref at that ref name and new_oid is ignored; otherwise
+ * new_oid NULL deletes the ref.  old_oid NULL applies the change whatever the ref
+ * holds, a zero old_oid requires the ref not to exist, and any other
+ * old_oid requires the ref to point at it.
+ *
+ * status is set to 0 if the change was made, GIT_EEXISTS if the ref
+ * did not hold old_oid, or -1 if it was not made because another
+ * change in an atomic batch was rejected or the database failed.
+ */
+typedef struct {
+	const char *name;
+	const git_oid *old_oid;
+	const git_oid *new_oid;
+	const char *symbolic;
+	int status;
+} git_refdb_postgres_update;
+
+/*
+ * Apply n ref changes in one transaction.  The refs' advisory locks
+ * (the ones git_transaction takes through the refdb backend) are taken
+ * in key order, the compare-and-swap checks are made against one read
+ * of the refs, and the writes and reflog rows (when who is set) go in
+ * a statement each.  With atomic set, nothing is written unless every
+ * change passes its check.  Returns 0 once the batch has been decided,
+ * with the outcome of each change in its status, GIT_EINVALID if a
+ * ref is named twice, or -1 on a database error; nothing is written
+ * in either of the last two cases.
+ */
+int git_refdb_postgres_update_refs(PGconn *conn, int repo_id,
+                                   git_refdb_postgres_update *updates, size_t n,
+                                   int atomic, const git_signature *who,
+                                   const char *message);
+
 #endif
@@ -22,16 +22,42 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <git2.h>
+#include <git2/sys/errors.h>
 #include <git2/sys/repository.h>
 #include <git2/sys/odb_backend.h>
 #include <git2/sys/refdb_backend.h>
 #include <libpq-fe.h>
 #include "odb_postgres.h"
 #include "refdb_postgres.h"
+#include "transfer.h"
+#include "pack_cache.h"
+#include "stats.h"
 
 static FILE *debug_fp;
 
+/* Set by "option atomic true": push updates all refs or none */
+static int push_atomic;
+
+/*
+ * Set by "option filter", "option depth", "option from-promisor" and
+ * "option no-dependents" for the fetches that follow.  A depth of
+ * INFINITE_DEPTH is --unshallow.
+ */
+#define INFINITE_DEPTH 0x7fffffff
+static gitgres_filter fetch_filter = GITGRES_FILTER_INIT;
+static int fetch_filtered;
+static int fetch_depth;
+static int fetch_from_promisor;
+static int fetch_no_dependents;
+
+/* The refs the last "list" reported, kept for push's compare-and-swap */
+static PGresult *listed_refs;
+
 static void debug(const char *fmt, ...) {
 	if (!debug_fp) return;
 	va_list ap;
@@ -76,7 +102,7 @@ static void parse_url(const char *url, char **conninfo, char **reponame) {
 }
 
 static PGconn *pg_connect(const char *conninfo) {
-	PGconn *conn = PQconnectdb(conninfo);
+	PGconn *conn = gitgres_connect(conninfo);
 	if (PQstatus(conn) != CONNECTION_OK)
 		die("connection failed: %s", PQerrorMessage(conn));
 	return conn;
@@ -105,7 +131,9 @@ static git_repository *open_pg_repo(PGconn *conn, int repo_id) {
 
 	check_lg2(git_repository_new(&repo), "create repo");
 	check_lg2(git_odb_new(&odb), "create odb");
-	check_lg2(git_odb_backend_postgres(&odb_backend, conn, repo_id),
+	git_odb_backend_postgres_options opts;
+	git_odb_backend_postgres_options_from_env(&opts);
+	check_lg2(git_odb_backend_postgres_ext(&odb_backend, conn, repo_id, &opts),
 		"create odb backend");
 	check_lg2(git_odb_add_backend(odb, odb_backend, 1),
 		"add odb backend");
@@ -137,10 +165,56 @@ static char *chomp(char *line) {
 static void cmd_capabilities(void) {
 	printf("fetch\n");
 	printf("push\n");
+	printf("option\n");
 	printf("\n");
 	fflush(stdout);
 }
 
+/* ------------------------------------------------------------------ */
+/* option                                                             */
+/* ------------------------------------------------------------------ */
+
+/* "<name> true" or "<name> false", and the 1 and 0 some git versions send */
+static int bool_option(const char *opt, const char *name, int *out) {
+	size_t len = strlen(name);
+	if (strncmp(opt, name, len) != 0 || opt[len] != ' ')
+		return 0;
+	if (strcmp(opt + len + 1, "true") == 0 || strcmp(opt + len + 1, "1") == 0)
+		*out = 1;
+	else if (strcmp(opt + len + 1, "false") == 0 || strcmp(opt + len + 1, "0") == 0)
+		*out = 0;
+	else
+		return 0;
+	return 1;
+}
+
+static void cmd_option(const char *opt) {
+	if (bool_option(opt, "atomic", &push_atomic) ||
+		bool_option(opt, "from-promisor", &fetch_from_promisor) ||
+		bool_option(opt, "no-dependents", &fetch_no_dependents)) {
+		printf("ok\n");
+	} else if (strncmp(opt, "filter ", 7) == 0) {
+		if (gitgres_filter_parse(&fetch_filter, opt + 7) == 0) {
+			fetch_filtered = 1;
+			printf("ok\n");
+		} else {
+			printf("error %s\n", git_error_last()->message);
+		}
+	} else if (strncmp(opt, "depth ", 6) == 0) {
+		char *end;
+		long depth = strtol(opt + 6, &end, 10);
+		if (end == opt + 6 || *end || depth < 1) {
+			printf("error invalid depth '%s'\n", opt + 6);
+		} else {
+			fetch_depth = depth > INFINITE_DEPTH ? INFINITE_DEPTH : (int)depth;
+			printf("ok\n");
+		}
+	} else {
+		printf("unsupported\n");
+	}
+	fflush(stdout);
+}
+
 /* ------------------------------------------------------------------ */
 /* list                                                               */
 /* ------------------------------------------------------------------ */
@@ -201,51 +275,313 @@ static void cmd_list(PGconn *conn, int repo_id) {
 
 	printf("\n");
 	fflush(stdout);
-	PQclear(res);
+	if (listed_refs)
+		PQclear(listed_refs);
+	listed_refs = res;
+}
+
+static int compare_listed_name(const void *key, const void *row) {
+	return strcmp((const char *)key,
+		PQgetvalue(listed_refs, *(const int *)row, 0));
+}
+
+/*
+ * The oid "list" reported for a ref, as the value a push expects to
+ * replace.  refs.name sorts bytewise, the same order as strcmp, so the
+ * listed rows can be binary searched.  Returns 0 if the ref wasn't
+ * listed or isn't direct.
+ */
+static int listed_oid(const char *name, git_oid *out) {
+	int n = PQntuples(listed_refs);
+	int lo = 0, hi = n;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		int cmp = compare_listed_name(name, &mid);
+		if (cmp == 0) {
+			if (PQgetisnull(listed_refs, mid, 1))
+				return 0;
+			return git_oid_fromstr(out, PQgetvalue(listed_refs, mid, 1)) == 0;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return 0;
 }
 
 /* ------------------------------------------------------------------ */
 /* fetch                                                              */
 /* ------------------------------------------------------------------ */
 
-struct fetch_ctx {
-	git_odb *pg_odb;
-	git_odb *local_odb;
-	int count;
-};
+static void add_oid(git_oid **list, size_t *n, size_t *cap, const git_oid *oid) {
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 32;
+		*list = realloc(*list, *cap * sizeof(git_oid));
+		if (!*list)
+			die("out of memory");
+	}
+	git_oid_cpy(&(*list)[(*n)++], oid);
+}
 
-static int fetch_copy_cb(const git_oid *oid, void *payload) {
-	struct fetch_ctx *ctx = (struct fetch_ctx *)payload;
+/*
+ * Collect the tips of every direct ref in repo whose target also exists
+ * in postgres.  These are the commits both sides share, which bound the
+ * walk on the sending side.  All tips are checked in one query.
+ */
+static void collect_shared_tips(git_repository *repo, git_odb *pg_odb,
+	git_oid **haves, size_t *nhaves, size_t *cap)
+{
+	git_reference_iterator *iter = NULL;
+	git_reference *ref = NULL;
+	git_oid *tips = NULL;
+	size_t ntips = 0, tips_cap = 0;
+
+	check_lg2(git_reference_iterator_new(&iter, repo),
+		"create ref iterator");
+	while (git_reference_next(&ref, iter) == 0) {
+		if (git_reference_type(ref) == GIT_REFERENCE_DIRECT)
+			add_oid(&tips, &ntips, &tips_cap, git_reference_target(ref));
+		git_reference_free(ref);
+	}
+	git_reference_iterator_free(iter);
+
+	if (ntips > 0) {
+		git_odb_backend *pg_backend = NULL;
+		unsigned char *missing = malloc(ntips);
+		if (!missing)
+			die("out of memory");
+
+		check_lg2(git_odb_get_backend(&pg_backend, pg_odb, 0),
+			"get pg backend");
+		check_lg2(git_odb_backend_postgres_missing(pg_backend, tips, ntips,
+			missing), "check local tips");
+
+		for (size_t i = 0; i < ntips; i++)
+			if (!missing[i])
+				add_oid(haves, nhaves, cap, &tips[i]);
+		free(missing);
+	}
+	free(tips);
+}
 
-	if (git_odb_exists(ctx->local_odb, oid))
-		return 0;
+/* Every OID a ref in postgres points at, direct refs only */
+static void collect_pg_tips(PGconn *conn, int repo_id,
+	git_oid **tips, size_t *ntips, size_t *cap)
+{
+	uint32_t repo_id_n = htonl((uint32_t)repo_id);
+	const char *params[1] = { (const char *)&repo_id_n };
+	int lengths[1] = { sizeof(repo_id_n) };
+	int formats[1] = { 1 };
 
-	git_odb_object *obj = NULL;
-	if (git_odb_read(&obj, ctx->pg_odb, oid) < 0)
-		return 0;
+	PGresult *res = PQexecParams(conn,
+		"SELECT DISTINCT oid FROM refs "
+		"WHERE repo_id = $1 AND oid IS NOT NULL",
+		1, NULL, params, lengths, formats, 1);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		die("list remote tips: %s", PQerrorMessage(conn));
 
-	git_oid written;
-	git_odb_write(&written, ctx->local_odb,
-		git_odb_object_data(obj),
-		git_odb_object_size(obj),
-		git_odb_object_type(obj));
-	git_odb_object_free(obj);
-	ctx->count++;
-	return 0;
+	for (int i = 0; i < PQntuples(res); i++) {
+		git_oid oid;
+		if (PQgetlength(res, i, 0) != GIT_OID_SHA1_SIZE)
+			continue;
+		git_oid_fromraw(&oid, (const unsigned char *)PQgetvalue(res, i, 0));
+		add_oid(tips, ntips, cap, &oid);
+	}
+	PQclear(res);
 }
 
 /*
- * The first "fetch" line was already read by the main loop.
- * Read remaining fetch lines until blank, then copy objects.
+ * Move the wants a partial clone asks for one by one to singles: all of
+ * them with no-dependents, otherwise the blobs, which is what a lazy
+ * fetch of missing blobs names.  Their types come from one query per
+ * thousand rather than a lookup each.
  */
-static void cmd_fetch(git_repository *pg_repo, const char *git_dir) {
-	char line[1024];
-	while (fgets(line, sizeof(line), stdin)) {
-		chomp(line);
-		if (line[0] == '\0') break;
-		debug("fetch: %s", line);
+static void split_singles(git_odb_backend *pg_backend, git_oid *wants,
+	size_t *nwants, git_oid **singles, size_t *nsingles, size_t *cap)
+{
+	size_t n = *nwants, kept = 0;
+
+	if (fetch_no_dependents) {
+		for (size_t i = 0; i < n; i++)
+			add_oid(singles, nsingles, cap, &wants[i]);
+		*nwants = 0;
+		return;
+	}
+
+	size_t *sizes = malloc(n * sizeof(*sizes));
+	git_object_t *types = malloc(n * sizeof(*types));
+	if (!sizes || !types)
+		die("out of memory");
+	check_lg2(git_odb_backend_postgres_read_headers(pg_backend, wants, n,
+		sizes, types), "look up wanted objects");
+
+	for (size_t i = 0; i < n; i++) {
+		if (types[i] == GIT_OBJECT_BLOB)
+			add_oid(singles, nsingles, cap, &wants[i]);
+		else
+			git_oid_cpy(&wants[kept++], &wants[i]);
+	}
+	*nwants = kept;
+	free(sizes);
+	free(types);
+}
+
+/* Blob sizes for blob:limit, from the postgres backend in payload */
+static int blob_sizes(size_t *sizes, const git_oid *oids, size_t n, void *payload) {
+	git_object_t *types = malloc(n * sizeof(*types));
+	if (!types)
+		die("out of memory");
+	int error = git_odb_backend_postgres_read_headers(payload, oids, n,
+		sizes, types);
+	free(types);
+	return error < 0 ? error : 0;
+}
+
+/*
+ * With "option from-promisor", a .promisor file next to each fetched
+ * pack tells git that objects the pack refers to but doesn't hold can
+ * be fetched from this remote when needed.
+ */
+static void mark_promisor(git_repository *local_repo, const char *name) {
+	if (!fetch_from_promisor || name[0] == '\0')
+		return;
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%sobjects/pack/pack-%s.promisor",
+		git_repository_path(local_repo), name);
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+		die("write %s: %s", path, strerror(errno));
+	fclose(fp);
+}
+
+/*
+ * The commits within fetch_depth of the wants, from the commit graph.
+ * Those at the cut whose parents stay behind go in boundary, the rest
+ * in interior.
+ */
+static void shallow_commits(PGconn *conn, int repo_id, git_repository *pg_repo,
+	const git_oid *wants, size_t nwants, git_oid **commits, size_t *ncommits,
+	git_oid **boundary, size_t *nboundary)
+{
+	size_t commits_cap = 0, boundary_cap = 0;
+	char *array = malloc(nwants * (GIT_OID_SHA1_HEXSIZE + 1) + 3);
+	size_t len = 0;
+
+	if (!array)
+		die("out of memory");
+	array[len++] = '{';
+	for (size_t i = 0; i < nwants; i++) {
+		git_object *obj = NULL, *commit = NULL;
+		if (git_object_lookup(&obj, pg_repo, &wants[i], GIT_OBJECT_ANY) == 0 &&
+			git_object_peel(&commit, obj, GIT_OBJECT_COMMIT) == 0) {
+			if (len > 1)
+				array[len++] = ',';
+			git_oid_fmt(array + len, git_object_id(commit));
+			len += GIT_OID_SHA1_HEXSIZE;
+		} else {
+			git_error_clear();
+		}
+		git_object_free(commit);
+		git_object_free(obj);
+	}
+	array[len++] = '}';
+	array[len] = '\0';
+
+	char repo_id_str[32], depth_str[32];
+	snprintf(repo_id_str, sizeof(repo_id_str), "%d", repo_id);
+	snprintf(depth_str, sizeof(depth_str), "%d", fetch_depth);
+	const char *params[3] = { repo_id_str, array, depth_str };
+
+	PGresult *res = PQexecParams(conn,
+		"SELECT commit_oid, boundary FROM git_commit_graph_shallow($1, "
+		"ARRAY(SELECT decode(h, 'hex') FROM unnest($2::text[]) AS h), $3)",
+		3, NULL, params, NULL, NULL, 1);
+	free(array);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		die("walk commit graph: %s", PQerrorMessage(conn));
+
+	for (int i = 0; i < PQntuples(res); i++) {
+		git_oid oid;
+		if (PQgetlength(res, i, 0) != GIT_OID_SHA1_SIZE)
+			continue;
+		git_oid_fromraw(&oid, (const unsigned char *)PQgetvalue(res, i, 0));
+		add_oid(commits, ncommits, &commits_cap, &oid);
+		if (!PQgetisnull(res, i, 1) && *PQgetvalue(res, i, 1))
+			add_oid(boundary, nboundary, &boundary_cap, &oid);
 	}
+	PQclear(res);
+}
 
+static int compare_oids(const void *a, const void *b) {
+	return git_oid_cmp((const git_oid *)a, (const git_oid *)b);
+}
+
+/*
+ * Rewrite $GIT_DIR/shallow: what it listed, less the commits this fetch
+ * sent (their parents came too, or they are on the new cut anyway), plus
+ * the new boundary.  The file goes when nothing is left, which is always
+ * the case after --unshallow.
+ */
+static void update_shallow(git_repository *local_repo,
+	git_oid *sent, size_t nsent, const git_oid *boundary, size_t nboundary)
+{
+	char path[4096], lock[4200], line[128];
+	git_oid *keep = NULL;
+	size_t nkeep = 0, keep_cap = 0;
+
+	snprintf(path, sizeof(path), "%sshallow", git_repository_path(local_repo));
+	snprintf(lock, sizeof(lock), "%s.lock", path);
+	qsort(sent, nsent, sizeof(git_oid), compare_oids);
+
+	FILE *fp = fetch_depth < INFINITE_DEPTH ? fopen(path, "r") : NULL;
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			git_oid oid;
+			if (git_oid_fromstrn(&oid, chomp(line), GIT_OID_SHA1_HEXSIZE) == 0 &&
+				!bsearch(&oid, sent, nsent, sizeof(git_oid), compare_oids))
+				add_oid(&keep, &nkeep, &keep_cap, &oid);
+		}
+		fclose(fp);
+	}
+	for (size_t i = 0; i < nboundary; i++)
+		add_oid(&keep, &nkeep, &keep_cap, &boundary[i]);
+
+	if (nkeep == 0) {
+		if (unlink(path) < 0 && errno != ENOENT)
+			die("remove %s: %s", path, strerror(errno));
+		return;
+	}
+
+	qsort(keep, nkeep, sizeof(git_oid), compare_oids);
+	if (!(fp = fopen(lock, "w")))
+		die("write %s: %s", lock, strerror(errno));
+	for (size_t i = 0; i < nkeep; i++) {
+		if (i > 0 && git_oid_equal(&keep[i - 1], &keep[i]))
+			continue;
+		fprintf(fp, "%s\n", git_oid_tostr_s(&keep[i]));
+	}
+	if (fclose(fp) != 0 || rename(lock, path) < 0)
+		die("write %s: %s", path, strerror(errno));
+	free(keep);
+}
+
+/*
+ * The first "fetch" line was already read by the main loop and is passed
+ * in as first_line.  Read remaining fetch lines until blank, then send
+ * the objects reachable from the wanted OIDs that the local repo's ref
+ * tips don't already cover.
+ *
+ * For a partial clone, blobs (or, with no-dependents, every object)
+ * named on their own are sent in one pack read in batches, and the rest
+ * through the filtered walk.  For --depth the commits come from the
+ * commit graph and the cut goes into $GIT_DIR/shallow.
+ */
+static void cmd_fetch(PGconn *conn, int repo_id, git_repository *pg_repo,
+	const char *git_dir, const char *first_line)
+{
 	git_repository *local_repo = NULL;
 	check_lg2(git_repository_open(&local_repo, git_dir),
 		"open local repo for fetch");
@@ -255,11 +591,114 @@ static void cmd_fetch(git_repository *pg_repo, const char *git_dir) {
 	check_lg2(git_repository_odb(&pg_odb, pg_repo), "get pg odb");
 	check_lg2(git_repository_odb(&local_odb, local_repo), "get local odb");
 
-	struct fetch_ctx ctx = { .pg_odb = pg_odb, .local_odb = local_odb,
-		.count = 0 };
-	git_odb_foreach(pg_odb, fetch_copy_cb, &ctx);
-	debug("fetched %d new objects", ctx.count);
+	git_oid *wants = NULL, *haves = NULL;
+	size_t nwants = 0, wants_cap = 0, nhaves = 0, haves_cap = 0;
+
+	char line[1024];
+	const char *cur = first_line;
+	do {
+		git_oid oid;
+
+		debug("fetch: %s", cur);
+		/* Deepening wants tips the client already has */
+		if (strncmp(cur, "fetch ", 6) == 0 &&
+			git_oid_fromstrn(&oid, cur + 6, GIT_OID_SHA1_HEXSIZE) == 0 &&
+			(fetch_depth > 0 || !git_odb_exists(local_odb, &oid)))
+			add_oid(&wants, &nwants, &wants_cap, &oid);
+
+		if (!fgets(line, sizeof(line), stdin))
+			break;
+		cur = chomp(line);
+	} while (cur[0] != '\0');
+
+	git_odb_backend *pg_backend = NULL;
+	check_lg2(git_odb_get_backend(&pg_backend, pg_odb, 0), "get pg backend");
+
+	if (nwants > 0 && (fetch_filtered || fetch_no_dependents)) {
+		git_oid *singles = NULL;
+		size_t nsingles = 0, singles_cap = 0;
+		gitgres_transfer_stats stats;
+
+		split_singles(pg_backend, wants, &nwants, &singles, &nsingles, &singles_cap);
+		check_lg2(gitgres_transfer_objects(&stats, pg_backend, local_odb,
+			singles, nsingles), "transfer objects");
+		mark_promisor(local_repo, stats.name);
+		if (nsingles > 0)
+			debug("fetched %zu objects by oid (%zu bytes)", stats.objects, stats.bytes);
+		free(singles);
+	}
+
+	if (nwants > 0 && (fetch_filtered || fetch_depth > 0)) {
+		gitgres_transfer_opts opts = { 0 };
+		gitgres_transfer_stats stats;
+		git_oid *commits = NULL, *boundary = NULL;
+		size_t ncommits = 0, nboundary = 0;
+
+		opts.filter = fetch_filtered ? &fetch_filter : NULL;
+		opts.blob_sizes = blob_sizes;
+		opts.payload = pg_backend;
+
+		/*
+		 * --unshallow walks all of history with no haves, since the
+		 * haves' ancestry stops at the old cut; what the client has is
+		 * still left out object by object.
+		 */
+		if (fetch_depth > 0 && fetch_depth < INFINITE_DEPTH) {
+			shallow_commits(conn, repo_id, pg_repo, wants, nwants,
+				&commits, &ncommits, &boundary, &nboundary);
+			opts.commits = commits;
+			opts.ncommits = ncommits;
+		} else if (fetch_depth == 0) {
+			collect_shared_tips(local_repo, pg_odb, &haves, &nhaves, &haves_cap);
+		}
+		debug("fetch: %zu wants, %zu haves, %zu commits", nwants, nhaves, ncommits);
+
+		check_lg2(gitgres_transfer_pack_ext(&stats, pg_repo, local_odb,
+			wants, nwants, haves, nhaves, &opts), "transfer objects");
+		mark_promisor(local_repo, stats.name);
+		debug("fetched %zu objects (%zu bytes)", stats.objects, stats.bytes);
+
+		if (fetch_depth > 0)
+			update_shallow(local_repo, commits, ncommits, boundary, nboundary);
+		free(commits);
+		free(boundary);
+	} else if (nwants > 0) {
+		collect_shared_tips(local_repo, pg_odb, &haves, &nhaves, &haves_cap);
+
+		/*
+		 * Nothing in common means a clone: start from the cached pack if
+		 * there is one, and send only what is newer than its tips.
+		 */
+		if (nhaves == 0) {
+			char objects_dir[4096];
+			gitgres_pack_cache_stats cache;
+			snprintf(objects_dir, sizeof(objects_dir), "%sobjects",
+				git_repository_path(local_repo));
+
+			int err = gitgres_pack_cache_fetch(&cache, &haves, &nhaves,
+				conn, repo_id, objects_dir);
+			if (err == 0) {
+				debug("fetch: cached pack of %zu objects (%zu bytes)",
+					cache.objects, cache.bytes);
+				check_lg2(git_odb_refresh(local_odb), "refresh local odb");
+			} else if (err != GIT_ENOTFOUND) {
+				const git_error *e = git_error_last();
+				debug("fetch: not using cached pack: %s",
+					e ? e->message : "unknown");
+			}
+		}
+		debug("fetch: %zu wants, %zu haves", nwants, nhaves);
+
+		gitgres_transfer_stats stats;
+		check_lg2(gitgres_transfer_pack(&stats, pg_repo, local_odb,
+			wants, nwants, haves, nhaves), "transfer objects");
+		debug("fetched %zu objects (%zu bytes)", stats.objects, stats.bytes);
+	} else {
+		debug("fetch: all wanted objects already present");
+	}
 
+	free(wants);
+	free(haves);
 	git_odb_free(pg_odb);
 	git_odb_free(local_odb);
 	git_repository_free(local_repo);
@@ -278,32 +717,6 @@ typedef struct {
 	int force;
 } push_spec;
 
-struct push_copy_ctx {
-	git_odb *src;
-	git_odb *dst;
-	int count;
-};
-
-static int push_copy_cb(const git_oid *oid, void *payload) {
-	struct push_copy_ctx *ctx = (struct push_copy_ctx *)payload;
-
-	if (git_odb_exists(ctx->dst, oid))
-		return 0;
-
-	git_odb_object *obj = NULL;
-	if (git_odb_read(&obj, ctx->src, oid) < 0)
-		return 0;
-
-	git_oid written;
-	git_odb_write(&written, ctx->dst,
-		git_odb_object_data(obj),
-		git_odb_object_size(obj),
-		git_odb_object_type(obj));
-	git_odb_object_free(obj);
-	ctx->count++;
-	return 0;
-}
-
 static void parse_push_spec(const char *raw, push_spec *out) {
 	const char *p = raw;
 	out->force = 0;
@@ -326,6 +739,28 @@ static void parse_push_spec(const char *raw, push_spec *out) {
 	out->dst[sizeof(out->dst) - 1] = '\0';
 }
 
+static void add_push_spec(push_spec **specs, size_t *n, size_t *cap,
+	const char *raw)
+{
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		*specs = realloc(*specs, *cap * sizeof(push_spec));
+		if (!*specs)
+			die("out of memory");
+	}
+	parse_push_spec(raw, &(*specs)[*n]);
+	debug("push: %s -> %s%s", (*specs)[*n].src, (*specs)[*n].dst,
+		(*specs)[*n].force ? " (force)" : "");
+	(*n)++;
+}
+
+/* A status line can't span lines, so cut a libgit2/libpq message at its
+ * first newline */
+static void print_push_error(const char *dst, const char *msg) {
+	int len = (int)strcspn(msg, "\n");
+	printf("error %s %.*s\n", dst, len, msg);
+}
+
 /*
  * The first "push" line was already read by the main loop.
  * first_line contains its content. Read remaining push lines
@@ -335,29 +770,20 @@ static void cmd_push(PGconn *conn, int repo_id,
 	git_repository *pg_repo, const char *git_dir,
 	const char *first_line)
 {
-	push_spec specs[128];
-	int nspecs = 0;
+	push_spec *specs = NULL;
+	size_t nspecs = 0, specs_cap = 0;
 
 	/* Parse the first line */
-	if (strncmp(first_line, "push ", 5) == 0) {
-		parse_push_spec(first_line + 5, &specs[nspecs]);
-		debug("push: %s -> %s%s", specs[nspecs].src, specs[nspecs].dst,
-			specs[nspecs].force ? " (force)" : "");
-		nspecs++;
-	}
+	if (strncmp(first_line, "push ", 5) == 0)
+		add_push_spec(&specs, &nspecs, &specs_cap, first_line + 5);
 
 	/* Read remaining push lines */
 	char line[1024];
 	while (fgets(line, sizeof(line), stdin)) {
 		chomp(line);
 		if (line[0] == '\0') break;
-		if (strncmp(line, "push ", 5) == 0 && nspecs < 128) {
-			parse_push_spec(line + 5, &specs[nspecs]);
-			debug("push: %s -> %s%s", specs[nspecs].src,
-				specs[nspecs].dst,
-				specs[nspecs].force ? " (force)" : "");
-			nspecs++;
-		}
+		if (strncmp(line, "push ", 5) == 0)
+			add_push_spec(&specs, &nspecs, &specs_cap, line + 5);
 	}
 
 	/* Open local repo */
@@ -365,80 +791,134 @@ static void cmd_push(PGconn *conn, int repo_id,
 	check_lg2(git_repository_open(&local_repo, git_dir),
 		"open local repo for push");
 
-	/* Copy all local objects that postgres doesn't have */
-	git_odb *local_odb = NULL;
-	git_odb *pg_odb = NULL;
-	check_lg2(git_repository_odb(&local_odb, local_repo), "get local odb");
-	check_lg2(git_repository_odb(&pg_odb, pg_repo), "get pg odb");
-
-	struct push_copy_ctx pctx = { .src = local_odb, .dst = pg_odb,
-		.count = 0 };
-	git_odb_foreach(local_odb, push_copy_cb, &pctx);
-	debug("copied %d new objects", pctx.count);
-
-	git_odb_free(local_odb);
-	git_odb_free(pg_odb);
+	/* Resolve every source up front so the objects go in one pack */
+	size_t slots = nspecs ? nspecs : 1;
+	git_oid *oids = calloc(slots, sizeof(git_oid));
+	int *resolved = calloc(slots, sizeof(int));
+	git_oid *wants = NULL, *haves = NULL;
+	size_t nwants = 0, wants_cap = 0, nhaves = 0, haves_cap = 0;
+	size_t unresolved = 0;
 
-	/* Update refs */
-	char repo_id_str[32];
-	snprintf(repo_id_str, sizeof(repo_id_str), "%d", repo_id);
+	if (!oids || !resolved)
+		die("out of memory");
 
-	for (int i = 0; i < nspecs; i++) {
-		if (strlen(specs[i].src) == 0) {
-			/* Delete */
-			const char *params[2] = { repo_id_str, specs[i].dst };
-			PGresult *res = PQexecParams(conn,
-				"DELETE FROM refs WHERE repo_id=$1 AND name=$2",
-				2, NULL, params, NULL, NULL, 0);
-			printf("ok %s\n", specs[i].dst);
-			PQclear(res);
+	for (size_t i = 0; i < nspecs; i++) {
+		if (strlen(specs[i].src) == 0)
 			continue;
-		}
 
-		/* Resolve source ref to OID */
 		git_reference *ref = NULL;
-		git_oid oid;
-		int resolved = 0;
-
 		if (git_reference_lookup(&ref, local_repo, specs[i].src) == 0) {
 			git_reference *peeled = NULL;
 			if (git_reference_resolve(&peeled, ref) == 0) {
-				git_oid_cpy(&oid, git_reference_target(peeled));
-				resolved = 1;
+				git_oid_cpy(&oids[i], git_reference_target(peeled));
+				resolved[i] = 1;
 				git_reference_free(peeled);
 			}
 			git_reference_free(ref);
 		}
-		if (!resolved && git_oid_fromstr(&oid, specs[i].src) == 0)
-			resolved = 1;
+		if (!resolved[i] && git_oid_fromstr(&oids[i], specs[i].src) == 0)
+			resolved[i] = 1;
+
+		if (resolved[i])
+			add_oid(&wants, &nwants, &wants_cap, &oids[i]);
+		else
+			unresolved++;
+	}
+
+	/* With --atomic a source that doesn't resolve fails the whole push,
+	 * so there is nothing to send */
+	if (push_atomic && unresolved > 0)
+		nwants = 0;
+
+	/*
+	 * Send what the pushed refs reach minus what the remote ref tips
+	 * already cover, as a single pack through the postgres writepack.
+	 */
+	if (nwants > 0) {
+		git_odb *pg_odb = NULL;
+		check_lg2(git_repository_odb(&pg_odb, pg_repo), "get pg odb");
+
+		collect_pg_tips(conn, repo_id, &haves, &nhaves, &haves_cap);
 
-		if (!resolved) {
+		gitgres_transfer_stats stats;
+		check_lg2(gitgres_transfer_pack(&stats, local_repo, pg_odb,
+			wants, nwants, haves, nhaves), "transfer objects");
+		debug("pushed %zu objects (%zu bytes)", stats.objects, stats.bytes);
+
+		git_odb_free(pg_odb);
+	}
+	free(wants);
+	free(haves);
+
+	/*
+	 * Update refs in one batch.  Unless forced, each ref must still hold
+	 * the value "list for-push" reported, since that's what git checked
+	 * the push against; a ref that wasn't listed must still not exist.
+	 */
+	git_refdb_postgres_update *updates = calloc(slots,
+		sizeof(git_refdb_postgres_update));
+	git_oid *olds = calloc(slots, sizeof(git_oid));
+	size_t *spec_of = calloc(slots, sizeof(size_t));
+	size_t nupdates = 0;
+
+	if (!updates || !olds || !spec_of)
+		die("out of memory");
+
+	for (size_t i = 0; i < nspecs; i++) {
+		int is_delete = strlen(specs[i].src) == 0;
+
+		if (!is_delete && !resolved[i]) {
 			printf("error %s cannot resolve '%s'\n",
 				specs[i].dst, specs[i].src);
 			continue;
 		}
 
-		char oid_hex[GIT_OID_SHA1_HEXSIZE + 1];
-		git_oid_tostr(oid_hex, sizeof(oid_hex), &oid);
+		git_refdb_postgres_update *u = &updates[nupdates];
+		u->name = specs[i].dst;
+		u->new_oid = is_delete ? NULL : &oids[i];
+		if (!specs[i].force && listed_refs) {
+			/* olds[] starts zeroed, which means "must not exist" */
+			listed_oid(specs[i].dst, &olds[nupdates]);
+			u->old_oid = &olds[nupdates];
+		}
+		spec_of[nupdates++] = i;
+	}
 
-		const char *params[3] = { repo_id_str, specs[i].dst, oid_hex };
-		PGresult *res = PQexecParams(conn,
-			"INSERT INTO refs (repo_id, name, oid) "
-			"VALUES ($1, $2, decode($3, 'hex')) "
-			"ON CONFLICT (repo_id, name) "
-			"DO UPDATE SET oid = decode($3, 'hex'), symbolic = NULL",
-			3, NULL, params, NULL, NULL, 0);
-
-		if (PQresultStatus(res) == PGRES_COMMAND_OK) {
-			printf("ok %s\n", specs[i].dst);
-			debug("ref %s -> %s", specs[i].dst, oid_hex);
+	if (push_atomic && unresolved > 0) {
+		for (size_t j = 0; j < nupdates; j++)
+			printf("error %s atomic push failed\n", updates[j].name);
+	} else if (nupdates > 0) {
+		git_signature *who = NULL;
+		if (git_signature_default(&who, local_repo) < 0)
+			who = NULL;
+
+		if (git_refdb_postgres_update_refs(conn, repo_id, updates, nupdates,
+				push_atomic, who, "push") < 0) {
+			const git_error *e = git_error_last();
+			for (size_t j = 0; j < nupdates; j++)
+				print_push_error(updates[j].name,
+					e ? e->message : "ref update failed");
 		} else {
-			printf("error %s %s\n", specs[i].dst,
-				PQerrorMessage(conn));
+			for (size_t j = 0; j < nupdates; j++) {
+				const push_spec *spec = &specs[spec_of[j]];
+
+				if (updates[j].status == 0) {
+					printf("ok %s\n", spec->dst);
+					debug("ref %s -> %s", spec->dst,
+						updates[j].new_oid ? spec->src : "(deleted)");
+				} else if (updates[j].status == GIT_EEXISTS) {
+					printf("error %s fetch first\n", spec->dst);
+				} else {
+					printf("error %s atomic push failed\n", spec->dst);
+				}
+			}
 		}
-		PQclear(res);
+		git_signature_free(who);
 	}
 
+	char repo_id_str[32];
+	snprintf(repo_id_str, sizeof(repo_id_str), "%d", repo_id);
+
 	/* Ensure HEAD exists */
 	{
 		const char *params[1] = { repo_id_str };
@@ -461,6 +941,12 @@ static void cmd_push(PGconn *conn, int repo_id,
 		PQclear(res);
 	}
 
+	free(updates);
+	free(olds);
+	free(spec_of);
+	free(oids);
+	free(resolved);
+	free(specs);
 	git_repository_free(local_repo);
 
 	printf("\n");
@@ -495,6 +981,7 @@ int main(int argc, char **argv) {
 	debug("url='%s' conninfo='%s' repo='%s'", url, conninfo, reponame);
 
 	git_libgit2_init();
+	gitgres_set_application_name("git-remote-gitgres");
 
 	PGconn *conn = pg_connect(conninfo);
 	int repo_id = get_or_create_repo(conn, reponame);
@@ -512,11 +999,13 @@ int main(int argc, char **argv) {
 
 		if (strcmp(line, "capabilities") == 0) {
 			cmd_capabilities();
+		} else if (strncmp(line, "option ", 7) == 0) {
+			cmd_option(line + 7);
 		} else if (strcmp(line, "list") == 0 ||
 			   strcmp(line, "list for-push") == 0) {
 			cmd_list(conn, repo_id);
 		} else if (strncmp(line, "fetch ", 6) == 0) {
-			cmd_fetch(pg_repo, git_dir);
+			cmd_fetch(conn, repo_id, pg_repo, git_dir, line);
 		} else if (strncmp(line, "push ", 5) == 0) {
 			cmd_push(conn, repo_id, pg_repo, git_dir, line);
 		} else if (line[0] == '\0') {
@@ -526,6 +1015,8 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (listed_refs)
+		PQclear(listed_refs);
 	git_repository_free(pg_repo);
 	PQfinish(conn);
 	free(conninfo);
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "stats.h"
+
+/* Four buckets per power of two of nanoseconds */
+#define SUB_BUCKETS 4
+#define NBUCKETS (64 * SUB_BUCKETS)
+
+typedef struct {
+    uint64_t calls;
+    uint64_t rows;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[NBUCKETS];
+} op_stats;
+
+struct gitgres_stats {
+    op_stats ops[GITGRES_STAT_COUNT];
+    struct gitgres_stats *next;   /* live blocks, for the exit dump */
+    struct gitgres_stats *prev;
+};
+
+static const char *op_names[GITGRES_STAT_COUNT] = {
+    [GITGRES_STAT_ODB_READ] = "odb.read",
+    [GITGRES_STAT_ODB_READ_HEADER] = "odb.read_header",
+    [GITGRES_STAT_ODB_EXISTS] = "odb.exists",
+    [GITGRES_STAT_ODB_EXISTS_PREFIX] = "odb.exists_prefix",
+    [GITGRES_STAT_ODB_WRITE] = "odb.write",
+    [GITGRES_STAT_ODB_FOREACH] = "odb.foreach",
+    [GITGRES_STAT_ODB_MISSING] = "odb.missing",
+    [GITGRES_STAT_ODB_READ_MANY] = "odb.read_many",
+    [GITGRES_STAT_ODB_READ_HEADERS] = "odb.read_headers",
+    [GITGRES_STAT_ODB_CACHE_HIT] = "odb.cache_hit",
+    [GITGRES_STAT_ODB_CACHE_MISS] = "odb.cache_miss",
+    [GITGRES_STAT_ODB_CACHE_EVICT] = "odb.cache_evict",
+    [GITGRES_STAT_REFDB_EXISTS] = "refdb.exists",
+    [GITGRES_STAT_REFDB_LOOKUP] = "refdb.lookup",
+    [GITGRES_STAT_REFDB_ITERATE] = "refdb.iterate",
+    [GITGRES_STAT_REFDB_WRITE] = "refdb.write",
+    [GITGRES_STAT_REFDB_RENAME] = "refdb.rename",
+    [GITGRES_STAT_REFDB_DEL] = "refdb.del",
+    [GITGRES_STAT_REFDB_HAS_LOG] = "refdb.has_log",
+    [GITGRES_STAT_REFDB_LOCK] = "refdb.lock",
+    [GITGRES_STAT_REFDB_UNLOCK] = "refdb.unlock",
+    [GITGRES_STAT_REFDB_UPDATE_REFS] = "refdb.update_refs",
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static const char *stats_target;      /* GITGRES_STATS, NULL when off */
+static gitgres_stats *live;
+static gitgres_stats retired;        /* totals of freed blocks */
+static gitgres_stats *shared;
+static const char *application_name = "gitgres";
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t ns)
+{
+    if (ns < SUB_BUCKETS)
+        return (size_t)ns;
+    int e = 63 - __builtin_clzll(ns);
+    return (size_t)e * SUB_BUCKETS + ((ns >> (e - 2)) & (SUB_BUCKETS - 1));
+}
+
+/* Upper bound of a bucket, in nanoseconds */
+static uint64_t bucket_limit(size_t b)
+{
+    if (b < SUB_BUCKETS)
+        return b + 1;
+    int e = (int)(b / SUB_BUCKETS);
+    uint64_t sub = b % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub + 1) << (e - 2);
+}
+
+static uint64_t percentile(const op_stats *s, double p)
+{
+    uint64_t rank = (uint64_t)(p * s->calls + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+    for (size_t b = 0; b < NBUCKETS; b++) {
+        seen += s->buckets[b];
+        if (seen >= rank)
+            return bucket_limit(b) < s->max_ns ? bucket_limit(b) : s->max_ns;
+    }
+    return s->max_ns;
+}
+
+static void add_block(gitgres_stats *into, const gitgres_stats *from)
+{
+    for (int op = 0; op < GITGRES_STAT_COUNT; op++) {
+        op_stats *d = &into->ops[op];
+        const op_stats *s = &from->ops[op];
+        d->calls += s->calls;
+        d->rows += s->rows;
+        d->bytes += s->bytes;
+        d->total_ns += s->total_ns;
+        if (s->max_ns > d->max_ns)
+            d->max_ns = s->max_ns;
+        for (size_t b = 0; b < NBUCKETS; b++)
+            d->buckets[b] += s->buckets[b];
+    }
+}
+
+static void dump(void)
+{
+    gitgres_stats *total = calloc(1, sizeof(*total));
+    FILE *out = stderr;
+
+    if (!total)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    add_block(total, &retired);
+    for (gitgres_stats *s = live; s; s = s->next)
+        add_block(total, s);
+    pthread_mutex_unlock(&stats_lock);
+
+    if (strcmp(stats_target, "1") != 0 && !(out = fopen(stats_target, "a"))) {
+        fprintf(stderr, "warning: cannot write stats to %s\n", stats_target);
+        free(total);
+        return;
+    }
+
+    for (int op = 0; op < GITGRES_STAT_COUNT; op++) {
+        const op_stats *s = &total->ops[op];
+        if (s->calls == 0)
+            continue;
+        fprintf(out,
+            "{\"program\":\"%s\",\"pid\":%d,\"op\":\"%s\",\"calls\":%llu,"
+            "\"rows\":%llu,\"bytes\":%llu,\"total_ms\":%.3f,"
+            "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+            application_name, (int)getpid(), op_names[op],
+            (unsigned long long)s->calls, (unsigned long long)s->rows,
+            (unsigned long long)s->bytes, s->total_ns / 1e6,
+            percentile(s, 0.50) / 1e3, percentile(s, 0.99) / 1e3, s->max_ns / 1e3);
+    }
+
+    if (out != stderr)
+        fclose(out);
+    free(total);
+}
+
+static void stats_init(void)
+{
+    const char *val = getenv("GITGRES_STATS");
+
+    if (!val || !*val || strcmp(val, "0") == 0)
+        return;
+    stats_target = val;
+    atexit(dump);
+
+    /* Never freed: it is on the live list when the dump runs */
+    if ((shared = calloc(1, sizeof(*shared))))
+        live = shared;
+}
+
+gitgres_stats *gitgres_stats_new(void)
+{
+    pthread_once(&stats_once, stats_init);
+    if (!stats_target)
+        return NULL;
+
+    gitgres_stats *s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+
+    pthread_mutex_lock(&stats_lock);
+    s->next = live;
+    if (live)
+        live->prev = s;
+    live = s;
+    pthread_mutex_unlock(&stats_lock);
+    return s;
+}
+
+void gitgres_stats_free(gitgres_stats *stats)
+{
+    if (!stats)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    add_block(&retired, stats);
+    if (stats->prev)
+        stats->prev->next = stats->next;
+    else
+        live = stats->next;
+    if (stats->next)
+        stats->next->prev = stats->prev;
+    pthread_mutex_unlock(&stats_lock);
+    free(stats);
+}
+
+gitgres_stats *gitgres_stats_shared(void)
+{
+    pthread_once(&stats_once, stats_init);
+    if (!stats_target)
+        return NULL;
+
+    return shared;
+}
+
+uint64_t gitgres_stats_start(const gitgres_stats *stats)
+{
+    return stats ? now_ns() : 0;
+}
+
+void gitgres_stats_end(gitgres_stats *stats, gitgres_stat_op op, uint64_t start,
+                       size_t rows, size_t bytes)
+{
+    if (!stats)
+        return;
+
+    uint64_t ns = now_ns() - start;
+    op_stats *s = &stats->ops[op];
+    s->calls++;
+    s->rows += rows;
+    s->bytes += bytes;
+    s->total_ns += ns;
+    if (ns > s->max_ns)
+        s->max_ns = ns;
+    s->buckets[bucket_of(ns)]++;
+}
+
+void gitgres_stats_count(gitgres_stats *stats, gitgres_stat_op op, size_t calls,
+                         size_t rows, size_t bytes)
+{
+    if (!stats)
+        return;
+
+    op_stats *s = &stats->ops[op];
+    s->calls += calls;
+    s->rows += rows;
+    s->bytes += bytes;
+}
+
+void gitgres_set_application_name(const char *name)
+{
+    application_name = name;
+}
+
+PGconn *gitgres_connect(const char *conninfo)
+{
+    const char *keys[] = { "dbname", "fallback_application_name", NULL };
+    const char *values[] = { conninfo, application_name, NULL };
+
+    /* expand_dbname: conninfo is parsed as a connection string or URI */
+    return PQconnectdbParams(keys, values, 1);
+}
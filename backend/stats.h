@@ -0,0 +1,91 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libpq-fe.h>
+
+/*
+ * Per-operation counters and latency histograms for the ODB and refdb
+ * backends.  Collection is off unless GITGRES_STATS is set.  Then each
+ * backend keeps its own block, with no locking on the hot path, and at
+ * exit every block is summed into one JSON object per operation:
+ *
+ *   {"program":"git-remote-gitgres","pid":123,"op":"odb.read","calls":..,
+ *    "rows":..,"bytes":..,"total_ms":..,"p50_us":..,"p99_us":..,"max_us":..}
+ *
+ * written to stderr for GITGRES_STATS=1, or appended to the file it
+ * names otherwise.  Percentiles come from log-linear buckets, four per
+ * power of two, so they are accurate to within a quarter.
+ */
+typedef enum {
+    GITGRES_STAT_ODB_READ,
+    GITGRES_STAT_ODB_READ_HEADER,
+    GITGRES_STAT_ODB_EXISTS,
+    GITGRES_STAT_ODB_EXISTS_PREFIX,
+    GITGRES_STAT_ODB_WRITE,
+    GITGRES_STAT_ODB_FOREACH,
+    GITGRES_STAT_ODB_MISSING,
+    GITGRES_STAT_ODB_READ_MANY,
+    GITGRES_STAT_ODB_READ_HEADERS,
+    GITGRES_STAT_ODB_CACHE_HIT,
+    GITGRES_STAT_ODB_CACHE_MISS,
+    GITGRES_STAT_ODB_CACHE_EVICT,
+    GITGRES_STAT_REFDB_EXISTS,
+    GITGRES_STAT_REFDB_LOOKUP,
+    GITGRES_STAT_REFDB_ITERATE,
+    GITGRES_STAT_REFDB_WRITE,
+    GITGRES_STAT_REFDB_RENAME,
+    GITGRES_STAT_REFDB_DEL,
+    GITGRES_STAT_REFDB_HAS_LOG,
+    GITGRES_STAT_REFDB_LOCK,
+    GITGRES_STAT_REFDB_UNLOCK,
+    GITGRES_STAT_REFDB_UPDATE_REFS,
+    GITGRES_STAT_COUNT
+} gitgres_stat_op;
+
+typedef struct gitgres_stats gitgres_stats;
+
+/*
+ * A new, zeroed block registered for the exit dump, or NULL when
+ * GITGRES_STATS is unset.  A block must only be used by one thread at a
+ * time, as a backend and its connection are.
+ */
+gitgres_stats *gitgres_stats_new(void);
+
+/* Fold a block into the process totals and free it; NULL is ignored */
+void gitgres_stats_free(gitgres_stats *stats);
+
+/*
+ * The process-wide block, for code that works on a bare connection
+ * rather than through a backend.  NULL when stats are off.
+ */
+gitgres_stats *gitgres_stats_shared(void);
+
+/* Start timing a call; returns 0 and costs nothing when stats is NULL */
+uint64_t gitgres_stats_start(const gitgres_stats *stats);
+
+/* Count a call to op timed from start that returned rows rows of bytes bytes */
+void gitgres_stats_end(gitgres_stats *stats, gitgres_stat_op op, uint64_t start,
+                       size_t rows, size_t bytes);
+
+/*
+ * Count calls made without timing each one, such as object cache
+ * lookups, which cost less than reading the clock.  They add to calls,
+ * rows and bytes but not to the latencies.
+ */
+void gitgres_stats_count(gitgres_stats *stats, gitgres_stat_op op, size_t calls,
+                         size_t rows, size_t bytes);
+
+/*
+ * Name this program's connections (and its exit dump).  The name is
+ * sent as fallback_application_name, so queries can be attributed in
+ * pg_stat_activity and by log_line_prefix's %a, and an application_name
+ * in the conninfo still wins.
+ */
+void gitgres_set_application_name(const char *name);
+
+/* PQconnectdb with the application name above */
+PGconn *gitgres_connect(const char *conninfo);
+
+#endif
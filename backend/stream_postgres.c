@@ -0,0 +1,544 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <git2/sys/errors.h>
+#include "odb_postgres.h"
+
+/*
+ * Blobs larger than opts.chunk_bytes are stored as an `objects` row with
+ * chunked set and empty content, plus one object_chunks row per
+ * chunk_bytes slice.  readstream and writestream move one chunk at a time,
+ * so neither side of the connection holds the whole object.
+ */
+
+typedef struct {
+    git_odb_stream parent;
+    postgres_odb_backend *pg;
+    git_object_t type;
+    git_object_size_t size;
+
+    /* whole objects are served from a normal read */
+    void *data;
+    size_t data_len;
+    size_t data_pos;
+
+    /* chunked objects are fetched one chunk per query */
+    git_oid oid;
+    int chunked;
+    int repo_id;      /* holding the chunks: the backend's or an alternate */
+    int chunk_no;
+    PGresult *chunk;
+    size_t chunk_pos;
+    int eof;
+} postgres_readstream;
+
+typedef struct {
+    git_odb_stream parent;
+    postgres_odb_backend *pg;
+    git_object_t type;
+
+    unsigned char *buf;
+    size_t buf_len;
+    size_t buf_cap;   /* chunk_bytes, or the declared size if smaller */
+    int nchunks;      /* chunks staged in gitgres_stream */
+    int own_tx;
+    int failed;
+} postgres_writestream;
+
+static int stream_exec(PGconn *conn, const char *sql)
+{
+    PGresult *res = PQexec(conn, sql);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        return -1;
+    }
+    PQclear(res);
+    return 0;
+}
+
+/* Open a transaction unless the caller is already inside one */
+static int begin_if_idle(PGconn *conn, int *own_tx)
+{
+    *own_tx = 0;
+    if (PQtransactionStatus(conn) != PQTRANS_IDLE)
+        return 0;
+    if (stream_exec(conn, "BEGIN") < 0)
+        return -1;
+    *own_tx = 1;
+    return 0;
+}
+
+static void rollback_if_owned(PGconn *conn, int own_tx)
+{
+    if (own_tx) {
+        PGresult *res = PQexec(conn, "ROLLBACK");
+        PQclear(res);
+    }
+}
+
+/*
+ * Insert the header row of a chunked object.  *inserted is 0 when the
+ * object was already stored, in which case there is nothing more to write.
+ */
+static int insert_chunked_header(postgres_odb_backend *pg, const git_oid *oid,
+                                 git_object_t type, size_t len, int *inserted)
+{
+    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
+    int16_t type_n = htons((int16_t)type);
+    uint32_t size_n = htonl((uint32_t)len);
+
+    const char *paramValues[4] = {
+        (const char *)&repo_id_n,
+        (const char *)oid->id,
+        (const char *)&type_n,
+        (const char *)&size_n
+    };
+    int paramLengths[4] = { sizeof(repo_id_n), GIT_OID_SHA1_SIZE, sizeof(type_n), sizeof(size_n) };
+    int paramFormats[4] = { 1, 1, 1, 1 };
+
+    PGresult *res = PQexecParams(pg->conn,
+        "INSERT INTO objects (repo_id, oid, type, size, content, chunked) "
+        "VALUES ($1, $2, $3, $4, '', true) "
+        "ON CONFLICT (repo_id, oid) DO NOTHING",
+        4, NULL, paramValues, paramLengths, paramFormats, 0);
+
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        return -1;
+    }
+
+    *inserted = strcmp(PQcmdTuples(res), "0") != 0;
+    PQclear(res);
+    return 0;
+}
+
+static int insert_chunk(postgres_odb_backend *pg, const char *table, const git_oid *oid,
+                        int chunk_no, const void *data, size_t len)
+{
+    uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
+    uint32_t chunk_no_n = htonl((uint32_t)chunk_no);
+    PGresult *res;
+
+    if (oid) {
+        const char *paramValues[4] = {
+            (const char *)&repo_id_n,
+            (const char *)oid->id,
+            (const char *)&chunk_no_n,
+            (const char *)data
+        };
+        int paramLengths[4] = { sizeof(repo_id_n), GIT_OID_SHA1_SIZE, sizeof(chunk_no_n), (int)len };
+        int paramFormats[4] = { 1, 1, 1, 1 };
+        char sql[128];
+
+        snprintf(sql, sizeof(sql),
+            "INSERT INTO %s (repo_id, oid, chunk_no, data) VALUES ($1, $2, $3, $4)", table);
+        res = PQexecParams(pg->conn, sql, 4, NULL, paramValues, paramLengths, paramFormats, 0);
+    } else {
+        const char *paramValues[2] = { (const char *)&chunk_no_n, (const char *)data };
+        int paramLengths[2] = { sizeof(chunk_no_n), (int)len };
+        int paramFormats[2] = { 1, 1 };
+        char sql[128];
+
+        snprintf(sql, sizeof(sql), "INSERT INTO %s (chunk_no, data) VALUES ($1, $2)", table);
+        res = PQexecParams(pg->conn, sql, 2, NULL, paramValues, paramLengths, paramFormats, 0);
+    }
+
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        return -1;
+    }
+    PQclear(res);
+    return 0;
+}
+
+/* Write an object already in memory as chunks, one statement per chunk */
+int pg_odb_write_chunked(postgres_odb_backend *pg, const git_oid *oid,
+                         const void *data, size_t len, git_object_t type)
+{
+    size_t chunk = pg->opts.chunk_bytes;
+    int own_tx, inserted;
+
+    if (begin_if_idle(pg->conn, &own_tx) < 0)
+        return -1;
+
+    if (insert_chunked_header(pg, oid, type, len, &inserted) < 0)
+        goto fail;
+
+    for (size_t off = 0; inserted && off < len; off += chunk) {
+        size_t n = len - off < chunk ? len - off : chunk;
+        if (insert_chunk(pg, "object_chunks", oid, (int)(off / chunk),
+                (const unsigned char *)data + off, n) < 0)
+            goto fail;
+    }
+
+    if (own_tx && stream_exec(pg->conn, "COMMIT") < 0)
+        return -1;
+    return 0;
+
+fail:
+    rollback_if_owned(pg->conn, own_tx);
+    return -1;
+}
+
+/*
+ * Fill buf (of the object's full size) from its chunks.  Single-row mode
+ * keeps libpq from buffering the whole result on top of buf.
+ */
+int pg_odb_read_chunks(postgres_odb_backend *pg, int repo_id, const git_oid *oid,
+                       unsigned char *buf, size_t size)
+{
+    uint32_t repo_id_n = htonl((uint32_t)repo_id);
+    const char *paramValues[2] = { (const char *)&repo_id_n, (const char *)oid->id };
+    int paramLengths[2] = { sizeof(repo_id_n), GIT_OID_SHA1_SIZE };
+    int paramFormats[2] = { 1, 1 };
+    PGresult *res;
+    size_t pos = 0;
+    int error = 0;
+
+    if (!PQsendQueryParams(pg->conn,
+            "SELECT data FROM object_chunks WHERE repo_id=$1 AND oid=$2 ORDER BY chunk_no",
+            2, NULL, paramValues, paramLengths, paramFormats, 1) ||
+        !PQsetSingleRowMode(pg->conn)) {
+        git_error_set_str(GIT_ERROR_ODB, PQerrorMessage(pg->conn));
+        while ((res = PQgetResult(pg->conn)) != NULL)
+            PQclear(res);
+        return -1;
+    }
+
+    while ((res = PQgetResult(pg->conn)) != NULL) {
+        ExecStatusType status = PQresultStatus(res);
+
+        if (status == PGRES_SINGLE_TUPLE && error == 0) {
+            size_t n = (size_t)PQgetlength(res, 0, 0);
+            if (n > size - pos) {
+                git_error_set(GIT_ERROR_ODB, "chunks of %s exceed object size",
+                    git_oid_tostr_s(oid));
+                error = -1;
+            } else {
+                memcpy(buf + pos, PQgetvalue(res, 0, 0), n);
+                pos += n;
+            }
+        } else if (status != PGRES_SINGLE_TUPLE && status != PGRES_TUPLES_OK && error == 0) {
+            git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+            error = -1;
+        }
+        PQclear(res);
+    }
+
+    if (error == 0 && pos != size) {
+        git_error_set(GIT_ERROR_ODB, "chunks of %s are incomplete", git_oid_tostr_s(oid));
+        error = -1;
+    }
+    return error;
+}
+
+/* Fetch the next chunk; sets eof when there are no more */
+static int readstream_next_chunk(postgres_readstream *rs)
+{
+    postgres_odb_backend *pg = rs->pg;
+    uint32_t repo_id_n = htonl((uint32_t)rs->repo_id);
+    uint32_t chunk_no_n = htonl((uint32_t)rs->chunk_no);
+    const char *paramValues[3] = {
+        (const char *)&repo_id_n,
+        (const char *)rs->oid.id,
+        (const char *)&chunk_no_n
+    };
+    int paramLengths[3] = { sizeof(repo_id_n), GIT_OID_SHA1_SIZE, sizeof(chunk_no_n) };
+    int paramFormats[3] = { 1, 1, 1 };
+
+    PQclear(rs->chunk);
+    rs->chunk = PQexecParams(pg->conn,
+        "SELECT data FROM object_chunks WHERE repo_id=$1 AND oid=$2 AND chunk_no=$3",
+        3, NULL, paramValues, paramLengths, paramFormats, 1);
+    rs->chunk_pos = 0;
+
+    if (PQresultStatus(rs->chunk) != PGRES_TUPLES_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(rs->chunk));
+        PQclear(rs->chunk);
+        rs->chunk = NULL;
+        return -1;
+    }
+
+    if (PQntuples(rs->chunk) == 0) {
+        PQclear(rs->chunk);
+        rs->chunk = NULL;
+        rs->eof = 1;
+    } else {
+        rs->chunk_no++;
+    }
+    return 0;
+}
+
+static int readstream_read(git_odb_stream *stream, char *buffer, size_t len)
+{
+    postgres_readstream *rs = (postgres_readstream *)stream;
+    size_t copied = 0;
+
+    if (!rs->chunked) {
+        size_t n = rs->data_len - rs->data_pos;
+        if (n > len)
+            n = len;
+        memcpy(buffer, (const char *)rs->data + rs->data_pos, n);
+        rs->data_pos += n;
+        return (int)n;
+    }
+
+    while (copied < len && !rs->eof) {
+        size_t avail = rs->chunk ? (size_t)PQgetlength(rs->chunk, 0, 0) - rs->chunk_pos : 0;
+
+        if (avail == 0) {
+            if (readstream_next_chunk(rs) < 0)
+                return -1;
+            continue;
+        }
+
+        size_t n = avail < len - copied ? avail : len - copied;
+        memcpy(buffer + copied, PQgetvalue(rs->chunk, 0, 0) + rs->chunk_pos, n);
+        rs->chunk_pos += n;
+        copied += n;
+    }
+    return (int)copied;
+}
+
+static void readstream_free(git_odb_stream *stream)
+{
+    postgres_readstream *rs = (postgres_readstream *)stream;
+
+    if (rs->data)
+        git_odb_backend_data_free(&rs->pg->parent, rs->data);
+    PQclear(rs->chunk);
+    free(rs);
+}
+
+int pg_odb_readstream(
+    git_odb_stream **out,
+    size_t *len_p,
+    git_object_t *type_p,
+    git_odb_backend *backend,
+    const git_oid *oid)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    const char *paramValues[2] = { pg->repo_ids, (const char *)oid->id };
+    int paramLengths[2] = { 0, GIT_OID_SHA1_SIZE };
+    int paramFormats[2] = { 0, 1 };
+
+    PGresult *res = PQexecParams(pg->conn,
+        "SELECT type, size, chunked, repo_id FROM git_object_find($1::int[], $2)",
+        2, NULL, paramValues, paramLengths, paramFormats, 1);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        return -1;
+    }
+
+    if (PQntuples(res) == 0) {
+        PQclear(res);
+        return GIT_ENOTFOUND;
+    }
+
+    int16_t type_val;
+    memcpy(&type_val, PQgetvalue(res, 0, 0), sizeof(type_val));
+    type_val = ntohs(type_val);
+
+    int32_t size_val;
+    memcpy(&size_val, PQgetvalue(res, 0, 1), sizeof(size_val));
+    size_val = ntohl(size_val);
+
+    int chunked = *PQgetvalue(res, 0, 2) != 0;
+
+    int32_t repo_val;
+    memcpy(&repo_val, PQgetvalue(res, 0, 3), sizeof(repo_val));
+    PQclear(res);
+
+    postgres_readstream *rs = calloc(1, sizeof(postgres_readstream));
+    if (!rs) {
+        git_error_set_oom();
+        return -1;
+    }
+
+    rs->parent.backend = backend;
+    rs->parent.mode = GIT_STREAM_RDONLY;
+    rs->parent.read = readstream_read;
+    rs->parent.free = readstream_free;
+    rs->pg = pg;
+    rs->type = (git_object_t)type_val;
+    rs->size = (git_object_size_t)size_val;
+    rs->chunked = chunked;
+    rs->repo_id = (int)ntohl(repo_val);
+    git_oid_cpy(&rs->oid, oid);
+
+    /* Small and delta-stored objects go through the normal read path */
+    if (!chunked) {
+        git_object_t type;
+        int error = backend->read(&rs->data, &rs->data_len, &type, backend, oid);
+        if (error < 0) {
+            free(rs);
+            return error;
+        }
+    }
+
+    *out = &rs->parent;
+    *len_p = (size_t)size_val;
+    *type_p = (git_object_t)type_val;
+    return 0;
+}
+
+/* Stage a full buffer as the next chunk, starting the staging table on first use */
+static int writestream_flush_chunk(postgres_writestream *ws)
+{
+    PGconn *conn = ws->pg->conn;
+
+    if (ws->nchunks == 0) {
+        if (begin_if_idle(conn, &ws->own_tx) < 0 ||
+            stream_exec(conn,
+                "CREATE TEMP TABLE IF NOT EXISTS gitgres_stream ("
+                "chunk_no integer, data bytea) ON COMMIT DROP") < 0 ||
+            stream_exec(conn, "TRUNCATE gitgres_stream") < 0)
+            return -1;
+    }
+
+    if (insert_chunk(ws->pg, "gitgres_stream", NULL, ws->nchunks, ws->buf, ws->buf_len) < 0)
+        return -1;
+
+    ws->nchunks++;
+    ws->buf_len = 0;
+    return 0;
+}
+
+static int writestream_write(git_odb_stream *stream, const char *buffer, size_t len)
+{
+    postgres_writestream *ws = (postgres_writestream *)stream;
+
+    if (ws->failed)
+        return -1;
+
+    while (len > 0) {
+        size_t n = ws->buf_cap - ws->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(ws->buf + ws->buf_len, buffer, n);
+        ws->buf_len += n;
+        buffer += n;
+        len -= n;
+
+        /* Hold back a full final chunk so small objects never hit the staging table */
+        if (ws->buf_len == ws->buf_cap && len > 0 && writestream_flush_chunk(ws) < 0) {
+            ws->failed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int writestream_finalize(git_odb_stream *stream, const git_oid *oid)
+{
+    postgres_writestream *ws = (postgres_writestream *)stream;
+    postgres_odb_backend *pg = ws->pg;
+    int inserted;
+
+    if (ws->failed)
+        return -1;
+
+    /* Everything fit in one chunk: store it like any other write */
+    if (ws->nchunks == 0)
+        return pg->parent.write(&pg->parent, oid, ws->buf, ws->buf_len, ws->type);
+
+    if (ws->buf_len > 0 && writestream_flush_chunk(ws) < 0)
+        goto fail;
+
+    if (insert_chunked_header(pg, oid, ws->type, (size_t)stream->received_bytes, &inserted) < 0)
+        goto fail;
+
+    if (inserted) {
+        uint32_t repo_id_n = htonl((uint32_t)pg->repo_id);
+        const char *paramValues[2] = { (const char *)&repo_id_n, (const char *)oid->id };
+        int paramLengths[2] = { sizeof(repo_id_n), GIT_OID_SHA1_SIZE };
+        int paramFormats[2] = { 1, 1 };
+
+        PGresult *res = PQexecParams(pg->conn,
+            "INSERT INTO object_chunks (repo_id, oid, chunk_no, data) "
+            "SELECT $1, $2, chunk_no, data FROM gitgres_stream",
+            2, NULL, paramValues, paramLengths, paramFormats, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+            PQclear(res);
+            goto fail;
+        }
+        PQclear(res);
+    }
+
+    if (stream_exec(pg->conn, "TRUNCATE gitgres_stream") < 0)
+        goto fail;
+
+    if (ws->own_tx) {
+        ws->own_tx = 0;
+        if (stream_exec(pg->conn, "COMMIT") < 0)
+            goto fail;
+    }
+    ws->nchunks = 0;
+    return 0;
+
+fail:
+    ws->failed = 1;
+    return -1;
+}
+
+static void writestream_free(git_odb_stream *stream)
+{
+    postgres_writestream *ws = (postgres_writestream *)stream;
+
+    rollback_if_owned(ws->pg->conn, ws->own_tx);
+    free(ws->buf);
+    free(ws);
+}
+
+int pg_odb_writestream(
+    git_odb_stream **out,
+    git_odb_backend *backend,
+    git_object_size_t size,
+    git_object_t type)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    size_t chunk = pg->opts.chunk_bytes;
+
+    if (size > INT32_MAX) {
+        git_error_set(GIT_ERROR_ODB, "object too large for postgres storage");
+        return -1;
+    }
+
+    postgres_writestream *ws = calloc(1, sizeof(postgres_writestream));
+    if (!ws) {
+        git_error_set_oom();
+        return -1;
+    }
+
+    /* Only blobs are chunked; other types are parsed in place by the SQL views */
+    if (type != GIT_OBJECT_BLOB || size < chunk)
+        ws->buf_cap = (size_t)size;
+    else
+        ws->buf_cap = chunk;
+    ws->buf = malloc(ws->buf_cap ? ws->buf_cap : 1);
+    if (!ws->buf) {
+        free(ws);
+        git_error_set_oom();
+        return -1;
+    }
+
+    ws->parent.backend = backend;
+    ws->parent.mode = GIT_STREAM_WRONLY;
+    ws->parent.write = writestream_write;
+    ws->parent.finalize_write = writestream_finalize;
+    ws->parent.free = writestream_free;
+    ws->pg = pg;
+    ws->type = type;
+
+    *out = &ws->parent;
+    return 0;
+}
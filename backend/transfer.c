@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <git2.h>
+#include <git2/sys/errors.h>
+#include "transfer.h"
+#include "odb_postgres.h"
+
+#define PACK_BUF_SIZE (256 * 1024)
+
+typedef struct {
+    git_odb_writepack *wp;
+    git_indexer_progress progress;
+    size_t bytes;
+} pack_sink;
+
+static int sink_cb(void *buf, size_t size, void *payload)
+{
+    pack_sink *sink = (pack_sink *)payload;
+    sink->bytes += size;
+    return sink->wp->append(sink->wp, buf, size, &sink->progress);
+}
+
+/* State for a filtered walk, see gitgres_transfer_pack_ext */
+typedef struct {
+    git_packbuilder *pb;
+    git_repository *src;
+    git_odb *dst;
+    const gitgres_transfer_opts *opts;
+    const gitgres_filter *filter;
+    git_oid *blobs;     /* blobs blob:limit has yet to weigh */
+    size_t nblobs, blobs_cap;
+} filter_walk;
+
+static int filter_tree(filter_walk *fw, const git_oid *oid, int depth);
+static int filter_insert(filter_walk *fw, const git_oid *oid);
+
+/*
+ * Annotated tags go in as-is and are peeled until something that is
+ * not a tag turns up.  Commits seed the revwalk so history is walked
+ * against the haves; trees and blobs are inserted with their contents.
+ * With fw, trees are walked through the filter instead, and commits are
+ * left out of the walk when the caller lists them itself.
+ */
+static int insert_want(git_packbuilder *pb, git_revwalk *walk,
+                       git_repository *repo, const git_oid *want,
+                       filter_walk *fw)
+{
+    git_oid oid;
+    int error;
+
+    git_oid_cpy(&oid, want);
+
+    for (;;) {
+        git_object *obj = NULL;
+
+        if ((error = git_object_lookup(&obj, repo, &oid, GIT_OBJECT_ANY)) < 0)
+            return error;
+
+        switch (git_object_type(obj)) {
+        case GIT_OBJECT_TAG:
+            error = git_packbuilder_insert(pb, &oid, NULL);
+            if (error == 0)
+                git_oid_cpy(&oid, git_tag_target_id((git_tag *)obj));
+            git_object_free(obj);
+            if (error < 0)
+                return error;
+            continue;
+
+        case GIT_OBJECT_COMMIT:
+            if (!fw || !fw->opts->commits)
+                error = git_revwalk_push(walk, &oid);
+            break;
+
+        case GIT_OBJECT_TREE:
+            if (!fw)
+                error = git_packbuilder_insert_recur(pb, &oid, NULL);
+            else if (fw->filter->tree_depth == 0)
+                error = git_packbuilder_insert(pb, &oid, NULL);
+            else
+                error = filter_tree(fw, &oid, 0);
+            break;
+
+        default:
+            error = git_packbuilder_insert_recur(pb, &oid, NULL);
+            break;
+        }
+
+        git_object_free(obj);
+        return error < 0 ? error : 0;
+    }
+}
+
+void gitgres_revwalk_hide_have(git_revwalk *walk, git_repository *repo, const git_oid *have)
+{
+    git_object *obj = NULL, *commit = NULL;
+
+    if (git_object_lookup(&obj, repo, have, GIT_OBJECT_ANY) == 0 &&
+        git_object_peel(&commit, obj, GIT_OBJECT_COMMIT) == 0)
+        git_revwalk_hide(walk, git_object_id(commit));
+    else
+        git_error_clear();
+
+    git_object_free(commit);
+    git_object_free(obj);
+}
+
+/* A packbuilder loaded with what src reaches from wants but not haves */
+static int build_pack(git_packbuilder **out, git_repository *src,
+                      const git_oid *wants, size_t nwants,
+                      const git_oid *haves, size_t nhaves)
+{
+    git_packbuilder *pb = NULL;
+    git_revwalk *walk = NULL;
+    int error;
+
+    if ((error = git_packbuilder_new(&pb, src)) < 0 ||
+        (error = git_revwalk_new(&walk, src)) < 0)
+        goto done;
+
+    for (size_t i = 0; i < nwants; i++) {
+        if ((error = insert_want(pb, walk, src, &wants[i], NULL)) < 0)
+            goto done;
+    }
+
+    for (size_t i = 0; i < nhaves; i++)
+        gitgres_revwalk_hide_have(walk, src, &haves[i]);
+
+    error = git_packbuilder_insert_walk(pb, walk);
+
+done:
+    git_revwalk_free(walk);
+    if (error < 0) {
+        git_packbuilder_free(pb);
+        pb = NULL;
+    }
+    *out = pb;
+    return error;
+}
+
+/*
+ * Insert oid unless dst has it.  Returns 1 if it went into the pack just
+ * now, 0 if dst or the pack already had it.
+ */
+static int filter_insert(filter_walk *fw, const git_oid *oid)
+{
+    size_t before = git_packbuilder_object_count(fw->pb);
+    int error;
+
+    if (git_odb_exists(fw->dst, oid))
+        return 0;
+    if ((error = git_packbuilder_insert(fw->pb, oid, NULL)) < 0)
+        return error;
+    return git_packbuilder_object_count(fw->pb) > before;
+}
+
+static int filter_blob(filter_walk *fw, const git_oid *oid)
+{
+    size_t limit = fw->filter->blob_limit;
+
+    if (limit == 0)
+        return 0;
+    if (limit == SIZE_MAX)
+        return filter_insert(fw, oid) < 0 ? -1 : 0;
+    if (git_odb_exists(fw->dst, oid))
+        return 0;
+
+    if (fw->nblobs == fw->blobs_cap) {
+        size_t cap = fw->blobs_cap ? fw->blobs_cap * 2 : 1024;
+        git_oid *blobs = realloc(fw->blobs, cap * sizeof(git_oid));
+        if (!blobs) {
+            git_error_set_oom();
+            return -1;
+        }
+        fw->blobs = blobs;
+        fw->blobs_cap = cap;
+    }
+    git_oid_cpy(&fw->blobs[fw->nblobs++], oid);
+    return 0;
+}
+
+/*
+ * Insert a tree and what it holds, down to the filter's depth.  A tree
+ * already in the pack is not walked again, so one met first below where
+ * it also appears keeps the deeper cut; the client fetches the rest
+ * lazily if it ever needs it.
+ */
+static int filter_tree(filter_walk *fw, const git_oid *oid, int depth)
+{
+    int max = fw->filter->tree_depth;
+    git_tree *tree = NULL;
+    int error;
+
+    if (max >= 0 && depth >= max)
+        return 0;
+    if ((error = filter_insert(fw, oid)) <= 0)
+        return error;
+    if ((error = git_tree_lookup(&tree, fw->src, oid)) < 0)
+        return error;
+
+    for (size_t i = 0; i < git_tree_entrycount(tree) && error == 0; i++) {
+        const git_tree_entry *entry = git_tree_entry_byindex(tree, i);
+
+        switch (git_tree_entry_type(entry)) {
+        case GIT_OBJECT_TREE:
+            error = filter_tree(fw, git_tree_entry_id(entry), depth + 1);
+            break;
+        case GIT_OBJECT_BLOB:
+            if (max < 0 || depth + 1 < max)
+                error = filter_blob(fw, git_tree_entry_id(entry));
+            break;
+        default:
+            /* Submodule commits belong to another repository */
+            break;
+        }
+    }
+
+    git_tree_free(tree);
+    return error;
+}
+
+static int filter_commit(filter_walk *fw, const git_oid *oid)
+{
+    git_commit *commit = NULL;
+    int error;
+
+    if ((error = filter_insert(fw, oid)) <= 0)
+        return error;
+    if ((error = git_commit_lookup(&commit, fw->src, oid)) < 0)
+        return error;
+
+    error = filter_tree(fw, git_commit_tree_id(commit), 0);
+    git_commit_free(commit);
+    return error;
+}
+
+static int compare_oids(const void *a, const void *b)
+{
+    return git_oid_cmp((const git_oid *)a, (const git_oid *)b);
+}
+
+/* Weigh the blobs blob:limit held back and insert the small ones */
+static int filter_sized_blobs(filter_walk *fw)
+{
+    size_t n = 0, *sizes;
+    int error = 0;
+
+    qsort(fw->blobs, fw->nblobs, sizeof(git_oid), compare_oids);
+    for (size_t i = 0; i < fw->nblobs; i++) {
+        if (n == 0 || !git_oid_equal(&fw->blobs[n - 1], &fw->blobs[i]))
+            git_oid_cpy(&fw->blobs[n++], &fw->blobs[i]);
+    }
+
+    if (!(sizes = malloc(n * sizeof(size_t)))) {
+        git_error_set_oom();
+        return -1;
+    }
+
+    if (fw->opts->blob_sizes) {
+        error = fw->opts->blob_sizes(sizes, fw->blobs, n, fw->opts->payload);
+    } else {
+        git_odb *odb = NULL;
+        git_object_t type;
+
+        if ((error = git_repository_odb(&odb, fw->src)) == 0) {
+            for (size_t i = 0; i < n && error == 0; i++)
+                error = git_odb_read_header(&sizes[i], &type, odb, &fw->blobs[i]);
+            git_odb_free(odb);
+        }
+    }
+
+    for (size_t i = 0; i < n && error == 0; i++) {
+        if (sizes[i] < fw->filter->blob_limit)
+            error = git_packbuilder_insert(fw->pb, &fw->blobs[i], NULL);
+    }
+
+    free(sizes);
+    return error;
+}
+
+static int build_filtered(git_packbuilder **out, git_repository *src, git_odb *dst,
+                          const git_oid *wants, size_t nwants,
+                          const git_oid *haves, size_t nhaves,
+                          const gitgres_transfer_opts *opts)
+{
+    static const gitgres_filter keep_all = GITGRES_FILTER_INIT;
+    git_revwalk *walk = NULL;
+    filter_walk fw;
+    git_oid oid;
+    int error;
+
+    memset(&fw, 0, sizeof(fw));
+    fw.src = src;
+    fw.dst = dst;
+    fw.opts = opts;
+    fw.filter = opts->filter ? opts->filter : &keep_all;
+
+    if ((error = git_packbuilder_new(&fw.pb, src)) < 0 ||
+        (error = git_revwalk_new(&walk, src)) < 0)
+        goto done;
+
+    for (size_t i = 0; i < nwants; i++) {
+        if ((error = insert_want(fw.pb, walk, src, &wants[i], &fw)) < 0)
+            goto done;
+    }
+
+    if (opts->commits) {
+        for (size_t i = 0; i < opts->ncommits; i++) {
+            if ((error = filter_commit(&fw, &opts->commits[i])) < 0)
+                goto done;
+        }
+    } else {
+        for (size_t i = 0; i < nhaves; i++)
+            gitgres_revwalk_hide_have(walk, src, &haves[i]);
+
+        while ((error = git_revwalk_next(&oid, walk)) == 0) {
+            if ((error = filter_commit(&fw, &oid)) < 0)
+                goto done;
+        }
+        if (error != GIT_ITEROVER)
+            goto done;
+    }
+
+    error = fw.nblobs > 0 ? filter_sized_blobs(&fw) : 0;
+
+done:
+    git_revwalk_free(walk);
+    free(fw.blobs);
+    if (error < 0) {
+        git_packbuilder_free(fw.pb);
+        fw.pb = NULL;
+    }
+    *out = fw.pb;
+    return error < 0 ? error : 0;
+}
+
+int gitgres_transfer_pack(gitgres_transfer_stats *stats,
+                          git_repository *src, git_odb *dst_odb,
+                          const git_oid *wants, size_t nwants,
+                          const git_oid *haves, size_t nhaves)
+{
+    return gitgres_transfer_pack_ext(stats, src, dst_odb, wants, nwants,
+                                     haves, nhaves, NULL);
+}
+
+int gitgres_transfer_pack_ext(gitgres_transfer_stats *stats,
+                              git_repository *src, git_odb *dst_odb,
+                              const git_oid *wants, size_t nwants,
+                              const git_oid *haves, size_t nhaves,
+                              const gitgres_transfer_opts *opts)
+{
+    git_packbuilder *pb = NULL;
+    pack_sink sink;
+    int error;
+
+    memset(&sink, 0, sizeof(sink));
+    memset(stats, 0, sizeof(*stats));
+
+    if (opts)
+        error = build_filtered(&pb, src, dst_odb, wants, nwants, haves, nhaves, opts);
+    else
+        error = build_pack(&pb, src, wants, nwants, haves, nhaves);
+    if (error < 0)
+        goto done;
+
+    stats->objects = git_packbuilder_object_count(pb);
+    if (stats->objects == 0)
+        goto done;
+
+    if ((error = git_odb_write_pack(&sink.wp, dst_odb, NULL, NULL)) < 0)
+        goto done;
+
+    error = git_packbuilder_foreach(pb, sink_cb, &sink);
+    if (error == 0)
+        error = sink.wp->commit(sink.wp, &sink.progress);
+    if (error == 0)
+        snprintf(stats->name, sizeof(stats->name), "%s", git_packbuilder_name(pb));
+
+    sink.wp->free(sink.wp);
+    stats->bytes = sink.bytes;
+
+done:
+    git_packbuilder_free(pb);
+    return error;
+}
+
+int gitgres_transfer_write_pack(gitgres_transfer_stats *stats, char *name,
+                                git_repository *src, const char *dir,
+                                const git_oid *wants, size_t nwants)
+{
+    git_packbuilder *pb = NULL;
+    int error;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if ((error = build_pack(&pb, src, wants, nwants, NULL, 0)) < 0)
+        goto done;
+
+    stats->objects = git_packbuilder_object_count(pb);
+    if ((error = git_packbuilder_write(pb, dir, 0, NULL, NULL)) < 0)
+        goto done;
+
+    snprintf(name, GIT_OID_SHA1_HEXSIZE + 1, "%s", git_packbuilder_name(pb));
+
+done:
+    git_packbuilder_free(pb);
+    return error;
+}
+
+static int add_to_pack(const git_oid *oid, const void *data, size_t len,
+                       git_object_t type, void *payload)
+{
+    (void)oid;
+    return gitgres_pack_add((gitgres_pack_out *)payload, type, data, len);
+}
+
+int gitgres_transfer_objects(gitgres_transfer_stats *stats, git_odb_backend *backend,
+                             git_odb *dst_odb, const git_oid *oids, size_t n)
+{
+    gitgres_pack_out po;
+    int error;
+
+    memset(&po, 0, sizeof(po));
+    memset(stats, 0, sizeof(*stats));
+    if (n == 0)
+        return 0;
+
+    if ((error = gitgres_pack_begin(&po, dst_odb, (uint32_t)n)) == 0 &&
+        (error = git_odb_backend_postgres_read_many(backend, oids, n, add_to_pack, &po)) == 0 &&
+        (error = gitgres_pack_finish(&po)) == 0) {
+        stats->objects = n;
+        stats->bytes = po.bytes;
+        memcpy(stats->name, po.name, sizeof(stats->name));
+    }
+
+    gitgres_pack_free(&po);
+    return error;
+}
+
+int gitgres_filter_parse(gitgres_filter *out, const char *spec)
+{
+    gitgres_filter filter = GITGRES_FILTER_INIT;
+    char *end;
+
+    if (strcmp(spec, "blob:none") == 0) {
+        filter.blob_limit = 0;
+    } else if (strncmp(spec, "blob:limit=", 11) == 0 && isdigit((unsigned char)spec[11])) {
+        unsigned long long n = strtoull(spec + 11, &end, 10), unit = 1;
+
+        switch (*end) {
+        case 'k': case 'K': unit = 1024; end++; break;
+        case 'm': case 'M': unit = 1024 * 1024; end++; break;
+        case 'g': case 'G': unit = 1024 * 1024 * 1024; end++; break;
+        }
+        if (*end || n > SIZE_MAX / unit)
+            goto invalid;
+        filter.blob_limit = (size_t)(n * unit);
+    } else if (strncmp(spec, "tree:", 5) == 0 && isdigit((unsigned char)spec[5])) {
+        long n = strtol(spec + 5, &end, 10);
+
+        if (*end || n > INT_MAX)
+            goto invalid;
+        filter.tree_depth = (int)n;
+    } else {
+        goto invalid;
+    }
+
+    *out = filter;
+    return 0;
+
+invalid:
+    git_error_set(GIT_ERROR_INVALID, "unsupported filter '%s'", spec);
+    return GIT_EINVALIDSPEC;
+}
+
+static int pack_flush(gitgres_pack_out *po)
+{
+    int error;
+
+    if (po->len == 0)
+        return 0;
+    EVP_DigestUpdate(po->sha, po->buf, po->len);
+    po->bytes += po->len;
+    error = po->wp->append(po->wp, po->buf, po->len, &po->progress);
+    po->len = 0;
+    return error;
+}
+
+static int pack_put(gitgres_pack_out *po, const void *data, size_t len)
+{
+    if (po->len + len > PACK_BUF_SIZE && pack_flush(po) < 0)
+        return -1;
+    memcpy(po->buf + po->len, data, len);
+    po->len += len;
+    return 0;
+}
+
+int gitgres_pack_begin(gitgres_pack_out *po, git_odb *odb, uint32_t count)
+{
+    unsigned char hdr[12] = { 'P', 'A', 'C', 'K' };
+    uint32_t version = htonl(2), n = htonl(count);
+    int error;
+
+    po->buf = malloc(PACK_BUF_SIZE);
+    po->sha = EVP_MD_CTX_new();
+    if (!po->buf || !po->sha || EVP_DigestInit_ex(po->sha, EVP_sha1(), NULL) != 1) {
+        git_error_set_oom();
+        return -1;
+    }
+    if (deflateInit(&po->zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        git_error_set(GIT_ERROR_ZLIB, "failed to initialize deflate");
+        return -1;
+    }
+    po->zs_ready = 1;
+
+    if ((error = git_odb_write_pack(&po->wp, odb, NULL, NULL)) < 0)
+        return error;
+
+    memcpy(hdr + 4, &version, 4);
+    memcpy(hdr + 8, &n, 4);
+    return pack_put(po, hdr, sizeof(hdr));
+}
+
+/* Entry header (type and size varint) followed by the deflated object */
+int gitgres_pack_add(gitgres_pack_out *po, git_object_t type, const void *data, size_t len)
+{
+    unsigned char hdr[16];
+    size_t n = 1, size = len >> 4;
+    int zret;
+
+    hdr[0] = (unsigned char)((type << 4) | (len & 0x0f));
+    while (size) {
+        hdr[n - 1] |= 0x80;
+        hdr[n++] = size & 0x7f;
+        size >>= 7;
+    }
+    if (pack_put(po, hdr, n) < 0)
+        return -1;
+
+    deflateReset(&po->zs);
+    po->zs.next_in = (Bytef *)data;
+    po->zs.avail_in = (uInt)len;
+    do {
+        if (po->len == PACK_BUF_SIZE && pack_flush(po) < 0)
+            return -1;
+        po->zs.next_out = po->buf + po->len;
+        po->zs.avail_out = (uInt)(PACK_BUF_SIZE - po->len);
+        zret = deflate(&po->zs, Z_FINISH);
+        if (zret == Z_STREAM_ERROR) {
+            git_error_set(GIT_ERROR_ZLIB, "failed to deflate object");
+            return -1;
+        }
+        po->len = PACK_BUF_SIZE - po->zs.avail_out;
+    } while (zret != Z_STREAM_END);
+
+    return 0;
+}
+
+int gitgres_pack_finish(gitgres_pack_out *po)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+    git_oid name;
+    int error;
+
+    if ((error = pack_flush(po)) < 0)
+        return error;
+    EVP_DigestFinal_ex(po->sha, digest, &digest_len);
+    if ((error = po->wp->append(po->wp, digest, GIT_OID_SHA1_SIZE, &po->progress)) < 0)
+        return error;
+    po->bytes += GIT_OID_SHA1_SIZE;
+
+    /* Packs are named after their trailing checksum */
+    git_oid_fromraw(&name, digest);
+    git_oid_tostr(po->name, sizeof(po->name), &name);
+    return po->wp->commit(po->wp, &po->progress);
+}
+
+void gitgres_pack_free(gitgres_pack_out *po)
+{
+    if (po->wp)
+        po->wp->free(po->wp);
+    if (po->zs_ready)
+        deflateEnd(&po->zs);
+    EVP_MD_CTX_free(po->sha);
+    free(po->buf);
+}
+
@@ -0,0 +1,113 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <git2.h>
+
+/*
+ * Reachability-based object transfer between two repositories.
+ *
+ * Packs everything in src reachable from wants but not from haves and
+ * writes the pack to dst_odb with git_odb_write_pack.  Haves that src
+ * does not know are ignored, so callers can pass ref tips from the other
+ * side without filtering them first.
+ */
+typedef struct {
+    size_t objects;     /* objects in the pack that was sent */
+    size_t bytes;       /* pack size in bytes */
+    char name[GIT_OID_SHA1_HEXSIZE + 1]; /* pack-<name>.pack, empty if nothing was sent */
+} gitgres_transfer_stats;
+
+int gitgres_transfer_pack(gitgres_transfer_stats *stats,
+                          git_repository *src, git_odb *dst_odb,
+                          const git_oid *wants, size_t nwants,
+                          const git_oid *haves, size_t nhaves);
+
+/*
+ * An object filter for partial clones, from the rev-list --filter specs
+ * git passes down: blob:none, blob:limit=<n>[kmg] and tree:<depth>.
+ * Trees and blobs named as wants are sent whatever the filter says.
+ */
+typedef struct {
+    size_t blob_limit;  /* leave out blobs of this many bytes or more; SIZE_MAX keeps all */
+    int tree_depth;     /* leave out trees and blobs this far below a root tree; -1 keeps all */
+} gitgres_filter;
+
+#define GITGRES_FILTER_INIT { SIZE_MAX, -1 }
+
+/* Parse spec into out.  Anything else fails with GIT_EINVALIDSPEC. */
+int gitgres_filter_parse(gitgres_filter *out, const char *spec);
+
+/* Fill sizes[i] with the size of each of n blobs, for blob:limit */
+typedef int (*gitgres_blob_sizes_cb)(size_t *sizes, const git_oid *oids,
+                                     size_t n, void *payload);
+
+typedef struct {
+    const gitgres_filter *filter;   /* NULL keeps everything */
+    gitgres_blob_sizes_cb blob_sizes; /* NULL reads each header from src */
+    void *payload;
+    const git_oid *commits;         /* send exactly these commits rather than */
+    size_t ncommits;                /* walking from wants, for shallow fetches */
+} gitgres_transfer_opts;
+
+/*
+ * gitgres_transfer_pack with a filter or an explicit commit list.
+ * History is walked here rather than by the packbuilder, and each commit,
+ * tree and blob dst_odb already has is left out along with what it
+ * reaches, so haves only bound the commit walk.  Blobs that blob:limit
+ * has to weigh are looked up together once the walk is done.
+ */
+int gitgres_transfer_pack_ext(gitgres_transfer_stats *stats,
+                              git_repository *src, git_odb *dst_odb,
+                              const git_oid *wants, size_t nwants,
+                              const git_oid *haves, size_t nhaves,
+                              const gitgres_transfer_opts *opts);
+
+/*
+ * Send exactly the n distinct objects in oids, nothing they reference,
+ * as one undeltified pack.  backend is a postgres odb backend, read with
+ * git_odb_backend_postgres_read_many.  This is what a partial clone's
+ * lazy fetch of missing blobs asks for.
+ */
+int gitgres_transfer_objects(gitgres_transfer_stats *stats, git_odb_backend *backend,
+                             git_odb *dst_odb, const git_oid *oids, size_t n);
+
+/*
+ * Pack everything src reaches from wants into dir with
+ * git_packbuilder_write, which writes the pack and its index as
+ * pack-<name>.pack and pack-<name>.idx.  name must hold
+ * GIT_OID_SHA1_HEXSIZE + 1 bytes.  stats->bytes is not set.
+ */
+int gitgres_transfer_write_pack(gitgres_transfer_stats *stats, char *name,
+                                git_repository *src, const char *dir,
+                                const git_oid *wants, size_t nwants);
+
+/*
+ * An undeltified pack fed straight into a writepack, so the odb indexes
+ * it as it arrives.  pack_begin takes the object count up front; name is
+ * filled in by pack_finish.
+ */
+typedef struct {
+    git_odb_writepack *wp;
+    git_indexer_progress progress;
+    EVP_MD_CTX *sha;
+    z_stream zs;
+    int zs_ready;
+    unsigned char *buf;
+    size_t len;
+    size_t bytes;
+    char name[GIT_OID_SHA1_HEXSIZE + 1];
+} gitgres_pack_out;
+
+int gitgres_pack_begin(gitgres_pack_out *po, git_odb *odb, uint32_t count);
+int gitgres_pack_add(gitgres_pack_out *po, git_object_t type, const void *data, size_t len);
+int gitgres_pack_finish(gitgres_pack_out *po);
+void gitgres_pack_free(gitgres_pack_out *po);
+
+/* Hide the commit a have peels to, if repo knows it */
+void gitgres_revwalk_hide_have(git_revwalk *walk, git_repository *repo,
+                               const git_oid *have);
+
+#endif
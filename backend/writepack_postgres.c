@@ -1,31 +1,746 @@
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/evp.h>
 #include <git2/sys/errors.h>
 #include "odb_postgres.h"
-
+#include "ingest_postgres.h"
+#include "delta.h"
+
+/*
+ * Two ways of receiving a pack:
+ *
+ * Streaming (the default) parses the pack as append() receives it,
+ * inflates each entry, resolves deltas against a bounded cache of recent
+ * objects (falling back to reading bases back out of postgres) and hands
+ * the results to the COPY ingest.  Nothing touches the filesystem.
+ *
+ * Spool (GITGRES_WRITEPACK_SPOOL=1) lets git_indexer write the pack and
+ * index to a temp directory, then copies every object out at commit.
+ */
+
+enum {
+    STATE_HEADER,
+    STATE_ENTRY_HEADER,
+    STATE_ENTRY_DATA,
+    STATE_TRAILER,
+    STATE_DONE
+};
+
+#define PACK_HEADER_SIZE 12
+#define MAX_ENTRY_HEADER 64
+#define NO_ENTRY SIZE_MAX
+
+/* One object in the incoming pack, in pack order */
+typedef struct {
+    uint64_t offset;
+    git_oid oid;
+    git_object_t type;
+    int resolved;
+    int depth;            /* delta chain length as stored, 0 when whole */
+    int depth_checked;    /* depth looked up in the database */
+    unsigned char *data;  /* cached content, NULL once evicted */
+    size_t len;
+    size_t cache_next;    /* next entry in the FIFO cache list */
+} pack_entry;
+
+/* A delta whose base was not available when it arrived */
 typedef struct {
-    git_odb_backend parent;
-    PGconn *conn;
-    int repo_id;
-} postgres_odb_backend;
+    size_t entry;
+    int ref_base;         /* base named by oid rather than pack offset */
+    git_oid base_oid;
+    size_t base_entry;
+    unsigned char *delta;
+    size_t delta_len;
+} deferred_delta;
 
 typedef struct {
     git_odb_writepack parent;
     postgres_odb_backend *odb_backend;
     git_odb *odb;
-    git_indexer *indexer;
     git_indexer_progress_cb progress_cb;
     void *progress_payload;
+    git_indexer_progress stats;
+
+    /* spool mode */
+    git_indexer *indexer;
     char *tmpdir;
+
+    /* streaming mode */
+    pg_ingest *ingest;
+    int state;
+    uint64_t offset;          /* bytes of pack consumed so far */
+    uint32_t nobjects;
+    uint32_t seen;
+    unsigned char hdr[MAX_ENTRY_HEADER];
+    size_t hdr_len;
+
+    uint64_t entry_offset;
+    git_object_t entry_type;
+    size_t entry_size;
+    uint64_t base_offset;
+    git_oid base_oid;
+    z_stream zs;
+    int zs_init;
+    unsigned char *entry_buf;
+
+    EVP_MD_CTX *sha;
+
+    pack_entry *entries;
+    size_t nentries;
+    size_t entries_cap;
+
+    size_t cache_head;
+    size_t cache_tail;
+    size_t cache_bytes;
+
+    deferred_delta *deferred;
+    size_t ndeferred;
+    size_t deferred_cap;
 } postgres_writepack;
 
+static int corrupt(const char *msg)
+{
+    git_error_set_str(GIT_ERROR_INDEXER, msg);
+    return -1;
+}
+
+static int report_progress(postgres_writepack *wp)
+{
+    if (!wp->progress_cb)
+        return 0;
+    return wp->progress_cb(&wp->stats, wp->progress_payload);
+}
+
+static void consume(postgres_writepack *wp, const unsigned char *p, size_t n)
+{
+    EVP_DigestUpdate(wp->sha, p, n);
+    wp->offset += n;
+}
+
+/* Entries are appended in pack order, so offsets are sorted */
+static size_t find_entry(postgres_writepack *wp, uint64_t offset)
+{
+    size_t lo = 0, hi = wp->nentries;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (wp->entries[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < wp->nentries && wp->entries[lo].offset == offset)
+        return lo;
+    return NO_ENTRY;
+}
+
+static void cache_evict(postgres_writepack *wp, size_t budget)
+{
+    while (wp->cache_head != NO_ENTRY && wp->cache_bytes > budget) {
+        pack_entry *e = &wp->entries[wp->cache_head];
+        wp->cache_bytes -= e->len;
+        free(e->data);
+        e->data = NULL;
+        wp->cache_head = e->cache_next;
+        e->cache_next = NO_ENTRY;
+    }
+    if (wp->cache_head == NO_ENTRY)
+        wp->cache_tail = NO_ENTRY;
+}
+
+/* Takes ownership of data */
+static void cache_insert(postgres_writepack *wp, size_t idx, unsigned char *data, size_t len)
+{
+    size_t budget = wp->odb_backend->opts.writepack_cache_bytes;
+    pack_entry *e = &wp->entries[idx];
+
+    if (len > budget / 4) {
+        free(data);
+        return;
+    }
+
+    cache_evict(wp, budget - len);
+
+    e->data = data;
+    e->len = len;
+    e->cache_next = NO_ENTRY;
+    if (wp->cache_tail != NO_ENTRY)
+        wp->entries[wp->cache_tail].cache_next = idx;
+    else
+        wp->cache_head = idx;
+    wp->cache_tail = idx;
+    wp->cache_bytes += len;
+}
+
+static int ensure_ingest(postgres_writepack *wp)
+{
+    postgres_odb_backend *pg = wp->odb_backend;
+
+    if (wp->ingest)
+        return 0;
+    return pg_ingest_new(&wp->ingest, pg->conn, pg->repo_id,
+        pg->opts.ingest_batch_objects, pg->opts.ingest_flush_bytes, pg->opts.chunk_bytes);
+}
+
+/*
+ * Fetch the content of a delta base.  Evicted pack entries have already
+ * been handed to the ingest, so merge what is staged and read them back
+ * through the odb, which also covers thin-pack bases already stored.
+ * *holder is set when the data belongs to an odb object the caller frees.
+ */
+static int load_base(postgres_writepack *wp, const git_oid *oid,
+                     const unsigned char **data, size_t *len,
+                     git_object_t *type, git_odb_object **holder)
+{
+    int error;
+
+    *holder = NULL;
+    if (wp->ingest && (error = pg_ingest_flush(wp->ingest)) < 0)
+        return error;
+
+    error = git_odb_read(holder, wp->odb, oid);
+    if (error < 0)
+        return error;
+
+    *data = git_odb_object_data(*holder);
+    *len = git_odb_object_size(*holder);
+    *type = git_odb_object_type(*holder);
+    return 0;
+}
+
+/*
+ * Set base->depth to the chain length of the row the database holds for
+ * it.  The ingest keeps a row the repository or an alternate already
+ * has, which may be a delta of its own, over the one this pack staged,
+ * so the depth the pack gave it only counts when no row is found.  The
+ * staged rows are not merged first: the ones only staged are the new
+ * objects, whose pack depth is right.
+ */
+static int check_base_depth(postgres_writepack *wp, pack_entry *base)
+{
+    postgres_odb_backend *pg = wp->odb_backend;
+    const char *paramValues[2] = { pg->repo_ids, (const char *)base->oid.id };
+    int paramLengths[2] = { 0, GIT_OID_SHA1_SIZE };
+    int paramFormats[2] = { 0, 1 };
+    PGresult *res;
+    int error;
+
+    if (base->depth_checked)
+        return 0;
+    if ((error = pg_ingest_pause(wp->ingest)) < 0)
+        return error;
+
+    res = PQexecPrepared(pg->conn, "gitgres_odb_read_depth",
+        2, paramValues, paramLengths, paramFormats, 1);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        git_error_set_str(GIT_ERROR_ODB, PQresultErrorMessage(res));
+        PQclear(res);
+        return -1;
+    }
+    if (PQntuples(res) > 0) {
+        int16_t depth;
+        memcpy(&depth, PQgetvalue(res, 0, 0), sizeof(depth));
+        base->depth = (int16_t)ntohs(depth);
+    }
+    PQclear(res);
+
+    base->depth_checked = 1;
+    return 0;
+}
+
+/*
+ * With delta storage enabled, a blob whose base is a blob from this pack
+ * keeps its pack delta when that saves at least half the space and the
+ * chain, counted from how the base is stored, stays within the
+ * configured depth.  A base from outside the pack, which a thin pack
+ * leaves to the database, is taken to be at the limit already, so the
+ * blob is stored whole.  Returns 1 to keep the delta, 0 not to, or an
+ * error.
+ */
+static int keep_delta(postgres_writepack *wp, git_object_t type, pack_entry *base,
+                      size_t len, size_t delta_len)
+{
+    int max_depth = wp->odb_backend->opts.delta_depth;
+    int error;
+
+    if (max_depth <= 0 || !base ||
+        type != GIT_OBJECT_BLOB || base->type != GIT_OBJECT_BLOB ||
+        base->depth >= max_depth || delta_len >= len / 2)
+        return 0;
+
+    if ((error = check_base_depth(wp, base)) < 0)
+        return error;
+    return base->depth < max_depth;
+}
+
+/* Takes ownership of data.  base and delta are NULL for whole objects. */
+static int store_entry(postgres_writepack *wp, size_t idx, git_object_t type,
+                       unsigned char *data, size_t len, pack_entry *base,
+                       const unsigned char *delta, size_t delta_len)
+{
+    pack_entry *e = &wp->entries[idx];
+    int error;
+
+    if ((error = git_odb_hash(&e->oid, data, len, type)) < 0) {
+        free(data);
+        return error;
+    }
+
+    if ((error = keep_delta(wp, type, base, len, delta_len)) < 0) {
+        free(data);
+        return error;
+    }
+    if (error) {
+        e->depth = base->depth + 1;
+        error = pg_ingest_add_delta(wp->ingest, &e->oid, type, len,
+            delta, delta_len, &base->oid, e->depth);
+    } else {
+        error = pg_ingest_add(wp->ingest, &e->oid, type, data, len);
+    }
+    if (error < 0) {
+        free(data);
+        return error;
+    }
+
+    e->type = type;
+    e->resolved = 1;
+    wp->stats.indexed_objects++;
+    cache_insert(wp, idx, data, len);
+    return 0;
+}
+
+/* base_entry is the pack entry the base came from, NULL if outside the pack */
+static int apply_to_base(postgres_writepack *wp, size_t idx,
+                         const unsigned char *base, size_t base_len,
+                         git_object_t base_type, pack_entry *base_entry,
+                         const unsigned char *delta, size_t delta_len)
+{
+    unsigned char *result;
+    size_t result_len;
+
+    if (git_delta_apply_buf(&result, &result_len, base, base_len, delta, delta_len) < 0)
+        return -1;
+
+    if (store_entry(wp, idx, base_type, result, result_len, base_entry, delta, delta_len) < 0)
+        return -1;
+
+    wp->stats.indexed_deltas++;
+    return 0;
+}
+
+/*
+ * Resolve a delta against a base entry from this pack.  Returns 0 when
+ * applied, GIT_ENOTFOUND when the base is itself still unresolved.
+ */
+static int resolve_ofs(postgres_writepack *wp, size_t idx, size_t base_idx,
+                       const unsigned char *delta, size_t delta_len)
+{
+    pack_entry *base = &wp->entries[base_idx];
+    git_odb_object *holder = NULL;
+    const unsigned char *data;
+    size_t len;
+    git_object_t type;
+    int error;
+
+    if (!base->resolved)
+        return GIT_ENOTFOUND;
+
+    if (base->data) {
+        data = base->data;
+        len = base->len;
+        type = base->type;
+    } else if ((error = load_base(wp, &base->oid, &data, &len, &type, &holder)) < 0) {
+        return error;
+    }
+
+    error = apply_to_base(wp, idx, data, len, type, base, delta, delta_len);
+    git_odb_object_free(holder);
+    return error;
+}
+
+/* As resolve_ofs, for a base named by oid; GIT_ENOTFOUND if not stored yet */
+static int resolve_ref(postgres_writepack *wp, size_t idx, const git_oid *base_oid,
+                       const unsigned char *delta, size_t delta_len)
+{
+    git_odb_object *holder = NULL;
+    const unsigned char *data;
+    size_t len;
+    git_object_t type;
+    int error;
+
+    /* The base is most often an object we just received */
+    for (size_t i = wp->cache_head; i != NO_ENTRY; i = wp->entries[i].cache_next) {
+        pack_entry *e = &wp->entries[i];
+        if (git_oid_equal(&e->oid, base_oid))
+            return apply_to_base(wp, idx, e->data, e->len, e->type, e, delta, delta_len);
+    }
+
+    error = load_base(wp, base_oid, &data, &len, &type, &holder);
+    if (error == GIT_ENOTFOUND)
+        git_error_clear();
+    if (error < 0)
+        return error;
+
+    error = apply_to_base(wp, idx, data, len, type, NULL, delta, delta_len);
+    git_odb_object_free(holder);
+    return error;
+}
+
+static int defer_delta(postgres_writepack *wp, size_t idx, unsigned char *delta, size_t delta_len)
+{
+    if (wp->ndeferred == wp->deferred_cap) {
+        size_t cap = wp->deferred_cap ? wp->deferred_cap * 2 : 64;
+        deferred_delta *nd = realloc(wp->deferred, cap * sizeof(deferred_delta));
+        if (!nd) {
+            git_error_set_oom();
+            return -1;
+        }
+        wp->deferred = nd;
+        wp->deferred_cap = cap;
+    }
+
+    deferred_delta *d = &wp->deferred[wp->ndeferred++];
+    memset(d, 0, sizeof(*d));
+    d->entry = idx;
+    d->delta = delta;
+    d->delta_len = delta_len;
+    if (wp->entry_type == GIT_OBJECT_REF_DELTA) {
+        d->ref_base = 1;
+        git_oid_cpy(&d->base_oid, &wp->base_oid);
+    } else {
+        d->base_entry = find_entry(wp, wp->base_offset);
+    }
+    return 0;
+}
+
+/* Called once the current entry is fully inflated into entry_buf */
+static int finish_entry(postgres_writepack *wp)
+{
+    unsigned char *buf = wp->entry_buf;
+    size_t len = wp->entry_size;
+    int error;
+
+    wp->entry_buf = NULL;
+
+    if (wp->nentries == wp->entries_cap) {
+        size_t cap = wp->entries_cap ? wp->entries_cap * 2 : 1024;
+        pack_entry *ne = realloc(wp->entries, cap * sizeof(pack_entry));
+        if (!ne) {
+            free(buf);
+            git_error_set_oom();
+            return -1;
+        }
+        wp->entries = ne;
+        wp->entries_cap = cap;
+    }
+
+    size_t idx = wp->nentries++;
+    pack_entry *e = &wp->entries[idx];
+    memset(e, 0, sizeof(*e));
+    e->offset = wp->entry_offset;
+    e->cache_next = NO_ENTRY;
+
+    wp->stats.received_objects++;
+
+    if ((error = ensure_ingest(wp)) < 0) {
+        free(buf);
+        return error;
+    }
+
+    switch (wp->entry_type) {
+    case GIT_OBJECT_COMMIT:
+    case GIT_OBJECT_TREE:
+    case GIT_OBJECT_BLOB:
+    case GIT_OBJECT_TAG:
+        error = store_entry(wp, idx, wp->entry_type, buf, len, NULL, NULL, 0);
+        break;
+
+    case GIT_OBJECT_OFS_DELTA: {
+        size_t base_idx = find_entry(wp, wp->base_offset);
+        wp->stats.total_deltas++;
+        if (base_idx == NO_ENTRY) {
+            free(buf);
+            return corrupt("delta base offset does not name a pack entry");
+        }
+        error = resolve_ofs(wp, idx, base_idx, buf, len);
+        if (error == GIT_ENOTFOUND)
+            return defer_delta(wp, idx, buf, len);
+        free(buf);
+        break;
+    }
+
+    case GIT_OBJECT_REF_DELTA:
+        wp->stats.total_deltas++;
+        error = resolve_ref(wp, idx, &wp->base_oid, buf, len);
+        if (error == GIT_ENOTFOUND)
+            return defer_delta(wp, idx, buf, len);
+        free(buf);
+        break;
+
+    default:
+        free(buf);
+        return corrupt("invalid pack entry type");
+    }
+
+    if (error < 0)
+        return error;
+    return report_progress(wp);
+}
+
+/*
+ * Resolve deltas whose bases arrived later in the pack (or were
+ * themselves deferred).  Each round merges what has been staged so far,
+ * so ref bases resolved in one round are readable in the next.
+ */
+static int resolve_deferred(postgres_writepack *wp)
+{
+    size_t remaining = wp->ndeferred;
+    int progress = 1;
+
+    while (remaining && progress) {
+        progress = 0;
+
+        if (pg_ingest_flush(wp->ingest) < 0)
+            return -1;
+
+        for (size_t i = 0; i < wp->ndeferred; i++) {
+            deferred_delta *d = &wp->deferred[i];
+            int error;
+
+            if (!d->delta)
+                continue;
+
+            if (d->ref_base)
+                error = resolve_ref(wp, d->entry, &d->base_oid, d->delta, d->delta_len);
+            else
+                error = resolve_ofs(wp, d->entry, d->base_entry, d->delta, d->delta_len);
+
+            if (error == GIT_ENOTFOUND)
+                continue;
+            if (error < 0)
+                return error;
+
+            free(d->delta);
+            d->delta = NULL;
+            remaining--;
+            progress = 1;
+
+            if ((error = report_progress(wp)) != 0)
+                return error;
+        }
+    }
+
+    if (remaining) {
+        git_error_set(GIT_ERROR_INDEXER, "pack has %zu deltas with missing bases", remaining);
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns 1 once hdr holds a complete entry header, 0 if it needs more bytes */
+static int parse_entry_header(postgres_writepack *wp)
+{
+    const unsigned char *p = wp->hdr, *end = wp->hdr + wp->hdr_len;
+    unsigned char c = *p++;
+    int type = (c >> 4) & 7;
+    uint64_t size = c & 0x0f;
+    int shift = 4;
+
+    while (c & 0x80) {
+        if (p >= end)
+            return 0;
+        if (shift > 57)
+            return corrupt("pack entry size overflow");
+        c = *p++;
+        size |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+
+    if (type == GIT_OBJECT_OFS_DELTA) {
+        uint64_t off;
+
+        if (p >= end)
+            return 0;
+        c = *p++;
+        off = c & 0x7f;
+        while (c & 0x80) {
+            if (p >= end)
+                return 0;
+            if (off > (UINT64_MAX >> 8))
+                return corrupt("delta base offset overflow");
+            c = *p++;
+            off = ((off + 1) << 7) | (c & 0x7f);
+        }
+        if (off == 0 || off > wp->entry_offset)
+            return corrupt("delta base offset out of range");
+        wp->base_offset = wp->entry_offset - off;
+    } else if (type == GIT_OBJECT_REF_DELTA) {
+        if (end - p < GIT_OID_SHA1_SIZE)
+            return 0;
+        git_oid_fromraw(&wp->base_oid, p);
+    } else if (type < GIT_OBJECT_COMMIT || type > GIT_OBJECT_TAG) {
+        return corrupt("invalid pack entry type");
+    }
+
+    if (size >= SIZE_MAX)
+        return corrupt("pack entry too large");
+
+    wp->entry_type = (git_object_t)type;
+    wp->entry_size = (size_t)size;
+    return 1;
+}
+
+static int begin_entry_data(postgres_writepack *wp)
+{
+    /* One spare byte so a zero-length entry still has room to finish */
+    wp->entry_buf = malloc(wp->entry_size + 1);
+    if (!wp->entry_buf) {
+        git_error_set_oom();
+        return -1;
+    }
+
+    if (inflateReset(&wp->zs) != Z_OK)
+        return corrupt("failed to reset inflate stream");
+
+    wp->zs.next_out = wp->entry_buf;
+    wp->zs.avail_out = (uInt)(wp->entry_size + 1);
+    wp->state = STATE_ENTRY_DATA;
+    return 0;
+}
+
+static int stream_append(postgres_writepack *wp, const unsigned char *p, size_t left)
+{
+    int error;
+
+    wp->stats.received_bytes += left;
+
+    while (left > 0) {
+        switch (wp->state) {
+        case STATE_HEADER: {
+            size_t n = PACK_HEADER_SIZE - wp->hdr_len;
+            if (n > left)
+                n = left;
+            memcpy(wp->hdr + wp->hdr_len, p, n);
+            wp->hdr_len += n;
+            consume(wp, p, n);
+            p += n;
+            left -= n;
+
+            if (wp->hdr_len < PACK_HEADER_SIZE)
+                break;
+
+            uint32_t version, count;
+            memcpy(&version, wp->hdr + 4, 4);
+            memcpy(&count, wp->hdr + 8, 4);
+            version = ntohl(version);
+
+            if (memcmp(wp->hdr, "PACK", 4) != 0)
+                return corrupt("invalid pack signature");
+            if (version != 2 && version != 3)
+                return corrupt("unsupported pack version");
+
+            wp->nobjects = ntohl(count);
+            wp->stats.total_objects = wp->nobjects;
+            wp->hdr_len = 0;
+            wp->state = wp->nobjects ? STATE_ENTRY_HEADER : STATE_TRAILER;
+            break;
+        }
+
+        case STATE_ENTRY_HEADER:
+            if (wp->hdr_len == 0)
+                wp->entry_offset = wp->offset;
+            if (wp->hdr_len == MAX_ENTRY_HEADER)
+                return corrupt("pack entry header too long");
+
+            wp->hdr[wp->hdr_len++] = *p;
+            consume(wp, p, 1);
+            p++;
+            left--;
+
+            if ((error = parse_entry_header(wp)) < 0)
+                return error;
+            if (error == 1 && (error = begin_entry_data(wp)) < 0)
+                return error;
+            break;
+
+        case STATE_ENTRY_DATA: {
+            size_t chunk = left > UINT32_MAX ? UINT32_MAX : left;
+
+            wp->zs.next_in = (Bytef *)p;
+            wp->zs.avail_in = (uInt)chunk;
+            int zret = inflate(&wp->zs, Z_NO_FLUSH);
+            size_t used = chunk - wp->zs.avail_in;
+
+            consume(wp, p, used);
+            p += used;
+            left -= used;
+
+            if (zret == Z_STREAM_END) {
+                if (wp->zs.total_out != wp->entry_size)
+                    return corrupt("pack entry size does not match its header");
+                if ((error = finish_entry(wp)) != 0)
+                    return error;
+                wp->hdr_len = 0;
+                wp->state = ++wp->seen == wp->nobjects ? STATE_TRAILER : STATE_ENTRY_HEADER;
+            } else if (zret != Z_OK && zret != Z_BUF_ERROR) {
+                return corrupt("failed to inflate pack entry");
+            } else if (wp->zs.avail_out == 0) {
+                return corrupt("pack entry size does not match its header");
+            }
+            break;
+        }
+
+        case STATE_TRAILER: {
+            size_t n = GIT_OID_SHA1_SIZE - wp->hdr_len;
+            if (n > left)
+                n = left;
+            memcpy(wp->hdr + wp->hdr_len, p, n);
+            wp->hdr_len += n;
+            p += n;
+            left -= n;
+
+            if (wp->hdr_len < GIT_OID_SHA1_SIZE)
+                break;
+
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int digest_len;
+            EVP_DigestFinal_ex(wp->sha, digest, &digest_len);
+            if (memcmp(digest, wp->hdr, GIT_OID_SHA1_SIZE) != 0)
+                return corrupt("pack checksum mismatch");
+            wp->state = STATE_DONE;
+            break;
+        }
+
+        default:
+            return corrupt("unexpected data after pack trailer");
+        }
+    }
+    return 0;
+}
+
+static int stream_commit(postgres_writepack *wp)
+{
+    int error;
+
+    if (wp->state != STATE_DONE)
+        return corrupt("incomplete pack");
+
+    if ((error = ensure_ingest(wp)) < 0 ||
+        (error = resolve_deferred(wp)) < 0)
+        return error;
+
+    return pg_ingest_commit(wp->ingest);
+}
+
 /* Context for the foreach callback that copies objects from pack to postgres */
 typedef struct {
     git_odb *pack_odb;
-    git_odb_backend *pg_backend;
+    pg_ingest *ingest;
 } copy_context;
 
 static int copy_object_cb(const git_oid *oid, void *payload)
@@ -37,32 +752,19 @@ static int copy_object_cb(const git_oid *oid, void *payload)
     if (error < 0)
         return error;
 
-    error = ctx->pg_backend->write(
-        ctx->pg_backend,
+    error = pg_ingest_add(
+        ctx->ingest,
         oid,
+        git_odb_object_type(obj),
         git_odb_object_data(obj),
-        git_odb_object_size(obj),
-        git_odb_object_type(obj));
+        git_odb_object_size(obj));
 
     git_odb_object_free(obj);
     return error;
 }
 
-static int pg_writepack_append(
-    git_odb_writepack *writepack,
-    const void *data,
-    size_t size,
-    git_indexer_progress *stats)
+static int spool_commit(postgres_writepack *wp, git_indexer_progress *stats)
 {
-    postgres_writepack *wp = (postgres_writepack *)writepack;
-    return git_indexer_append(wp->indexer, data, size, stats);
-}
-
-static int pg_writepack_commit(
-    git_odb_writepack *writepack,
-    git_indexer_progress *stats)
-{
-    postgres_writepack *wp = (postgres_writepack *)writepack;
     int error;
 
     error = git_indexer_commit(wp->indexer, stats);
@@ -72,8 +774,8 @@ static int pg_writepack_commit(
     /*
      * The indexer has written a .pack and .idx file in our temp directory.
      * Build the path to the .idx file, create a temporary ODB with a
-     * one_pack backend, iterate all objects in the pack, and write each
-     * one to postgres.
+     * one_pack backend, iterate all objects in the pack, and bulk load
+     * them into postgres with COPY in a single transaction.
      */
     const char *name = git_indexer_name(wp->indexer);
     if (!name) {
@@ -104,17 +806,59 @@ static int pg_writepack_commit(
         return error;
     }
 
+    error = ensure_ingest(wp);
+    if (error < 0) {
+        git_odb_free(pack_odb);
+        return error;
+    }
+
     copy_context ctx = {
         .pack_odb = pack_odb,
-        .pg_backend = &wp->odb_backend->parent
+        .ingest = wp->ingest
     };
 
     error = git_odb_foreach(pack_odb, copy_object_cb, &ctx);
+    if (error == 0)
+        error = pg_ingest_commit(wp->ingest);
 
     git_odb_free(pack_odb);
     return error;
 }
 
+static int pg_writepack_append(
+    git_odb_writepack *writepack,
+    const void *data,
+    size_t size,
+    git_indexer_progress *stats)
+{
+    postgres_writepack *wp = (postgres_writepack *)writepack;
+    int error;
+
+    if (wp->indexer)
+        return git_indexer_append(wp->indexer, data, size, stats);
+
+    error = stream_append(wp, data, size);
+    if (stats)
+        *stats = wp->stats;
+    return error;
+}
+
+static int pg_writepack_commit(
+    git_odb_writepack *writepack,
+    git_indexer_progress *stats)
+{
+    postgres_writepack *wp = (postgres_writepack *)writepack;
+    int error;
+
+    if (wp->indexer)
+        return spool_commit(wp, stats);
+
+    error = stream_commit(wp);
+    if (stats)
+        *stats = wp->stats;
+    return error;
+}
+
 /* Recursively remove a directory and its contents */
 static void rmdir_recursive(const char *path)
 {
@@ -138,18 +882,29 @@ static void pg_writepack_free(git_odb_writepack *writepack)
         wp->tmpdir = NULL;
     }
 
+    /* Rolls back anything staged if commit never ran or failed */
+    pg_ingest_free(wp->ingest);
+
+    for (size_t i = 0; i < wp->nentries; i++)
+        free(wp->entries[i].data);
+    free(wp->entries);
+
+    for (size_t i = 0; i < wp->ndeferred; i++)
+        free(wp->deferred[i].delta);
+    free(wp->deferred);
+
+    free(wp->entry_buf);
+    if (wp->zs_init)
+        inflateEnd(&wp->zs);
+    if (wp->sha)
+        EVP_MD_CTX_free(wp->sha);
+
     free(wp);
 }
 
-int pg_odb_writepack(
-    git_odb_writepack **out,
-    git_odb_backend *backend,
-    git_odb *odb,
-    git_indexer_progress_cb progress_cb,
-    void *progress_payload)
+static int spool_init(postgres_writepack *wp, git_odb *odb,
+                      git_indexer_progress_cb progress_cb, void *progress_payload)
 {
-    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
-
     /* Create a temp directory for the indexer to write pack/idx files */
     char tmpdir[] = "/tmp/gitgres-writepack-XXXXXX";
     if (!mkdtemp(tmpdir)) {
@@ -157,6 +912,13 @@ int pg_odb_writepack(
         return -1;
     }
 
+    wp->tmpdir = strdup(tmpdir);
+    if (!wp->tmpdir) {
+        rmdir_recursive(tmpdir);
+        git_error_set_oom();
+        return -1;
+    }
+
     /*
      * The indexer expects a "pack" subdirectory structure. It writes
      * pack-<hash>.pack and pack-<hash>.idx into the given path inside
@@ -166,7 +928,6 @@ int pg_odb_writepack(
     snprintf(packdir, sizeof(packdir), "%s/pack", tmpdir);
     if (mkdir(packdir, 0700) < 0) {
         git_error_set_str(GIT_ERROR_ODB, "failed to create pack subdirectory");
-        rmdir_recursive(tmpdir);
         return -1;
     }
 
@@ -175,17 +936,40 @@ int pg_odb_writepack(
     opts.progress_cb = progress_cb;
     opts.progress_cb_payload = progress_payload;
 
-    git_indexer *indexer = NULL;
-    int error = git_indexer_new(&indexer, packdir, 0, odb, &opts);
-    if (error < 0) {
-        rmdir_recursive(tmpdir);
-        return error;
+    return git_indexer_new(&wp->indexer, packdir, 0, odb, &opts);
+}
+
+static int stream_init(postgres_writepack *wp)
+{
+    if (inflateInit(&wp->zs) != Z_OK)
+        return corrupt("failed to initialize inflate stream");
+    wp->zs_init = 1;
+
+    wp->sha = EVP_MD_CTX_new();
+    if (!wp->sha || EVP_DigestInit_ex(wp->sha, EVP_sha1(), NULL) != 1) {
+        git_error_set_str(GIT_ERROR_INDEXER, "failed to initialize pack checksum");
+        return -1;
     }
 
+    wp->state = STATE_HEADER;
+    wp->cache_head = NO_ENTRY;
+    wp->cache_tail = NO_ENTRY;
+    return 0;
+}
+
+int pg_odb_writepack(
+    git_odb_writepack **out,
+    git_odb_backend *backend,
+    git_odb *odb,
+    git_indexer_progress_cb progress_cb,
+    void *progress_payload)
+{
+    postgres_odb_backend *pg = (postgres_odb_backend *)backend;
+    int error;
+
     postgres_writepack *wp = calloc(1, sizeof(postgres_writepack));
     if (!wp) {
-        git_indexer_free(indexer);
-        rmdir_recursive(tmpdir);
+        git_error_set_oom();
         return -1;
     }
 
@@ -196,10 +980,18 @@ int pg_odb_writepack(
 
     wp->odb_backend = pg;
     wp->odb = odb;
-    wp->indexer = indexer;
     wp->progress_cb = progress_cb;
     wp->progress_payload = progress_payload;
-    wp->tmpdir = strdup(tmpdir);
+
+    if (pg->opts.writepack_spool)
+        error = spool_init(wp, odb, progress_cb, progress_payload);
+    else
+        error = stream_init(wp);
+
+    if (error < 0) {
+        pg_writepack_free(&wp->parent);
+        return error;
+    }
 
     *out = &wp->parent;
     return 0;
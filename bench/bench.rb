@@ -0,0 +1,290 @@
+# Benchmark harness: builds synthetic repositories of a few shapes,
+# moves them through gitgres-backend and git-remote-gitgres, and times
+# the object store and SQL functions against what was pushed.  Results
+# are JSON lines on stdout (or BENCH_OUT), one per measurement, after a
+# "meta" line describing the run, so runs can be diffed between
+# releases.  Progress goes to stderr.
+#
+#   make bench
+#   BENCH_SHAPES=huge_blobs BENCH_SCALE=4 BENCH_OUT=before.jsonl make bench
+#
+# Environment:
+#   BENCH_CONNINFO  libpq conninfo (default dbname=gitgres_test)
+#   BENCH_SHAPES    comma-separated subset of the shapes below
+#   BENCH_SCALE     multiplies every shape's size (default 1)
+#   BENCH_READS     objects odb-bench samples (default 2000)
+#   BENCH_SEED      seed for generated content and sampling (default 42)
+#   BENCH_OUT       file to write results to instead of stdout
+
+require "pg"
+require "json"
+require "tmpdir"
+require "fileutils"
+require "open3"
+require "time"
+
+ROOT = File.expand_path("..", __dir__)
+BACKEND_DIR = File.join(ROOT, "backend")
+BACKEND = File.join(BACKEND_DIR, "gitgres-backend")
+ODB_BENCH = File.join(ROOT, "bench", "odb-bench")
+
+CONNINFO = ENV.fetch("BENCH_CONNINFO", "dbname=gitgres_test")
+SCALE = Float(ENV.fetch("BENCH_SCALE", "1"))
+READS = Integer(ENV.fetch("BENCH_READS", "2000"))
+SEED = Integer(ENV.fetch("BENCH_SEED", "42"))
+
+# Commits added on top of each shape for the incremental push and fetch
+INCREMENTAL_COMMITS = 10
+
+def scaled(n)
+  [(n * SCALE).round, 1].max
+end
+
+# Each shape writes a git fast-import stream for a repository of that
+# shape.  Content comes from rng, so a seed always gives the same oids.
+class Stream
+  def initialize(io)
+    @io = io
+    @mark = 0
+    @time = 1_700_000_000
+  end
+
+  def data(bytes)
+    @io.write("data #{bytes.bytesize}\n")
+    @io.write(bytes)
+    @io.write("\n")
+  end
+
+  # files is { path => content }; returns the commit's mark
+  def commit(ref, message, files, from: nil)
+    @mark += 1
+    @time += 60
+    @io.write("commit #{ref}\nmark :#{@mark}\n")
+    @io.write("committer Bench <bench@example.com> #{@time} +0000\n")
+    data(message)
+    @io.write("from #{from}\n") if from
+    files.each do |path, content|
+      @io.write("M 100644 inline #{path}\n")
+      data(content)
+    end
+    @io.write("\n")
+    ":#{@mark}"
+  end
+
+  def ref(name, from)
+    @io.write("reset #{name}\nfrom #{from}\n\n")
+  end
+end
+
+def text(rng, lines)
+  Array.new(lines) { |i| "line #{i} #{rng.rand(1 << 32).to_s(16)}\n" }.join
+end
+
+SHAPES = {
+  # One wide, nested tree of small files
+  "small_files" => lambda do |s, rng|
+    files = {}
+    scaled(5000).times do |i|
+      files[format("d%02d/d%02d/f%05d.txt", i / 1000, (i / 100) % 10, i)] = text(rng, 5)
+    end
+    s.commit("refs/heads/main", "many small files\n", files)
+  end,
+
+  # A long linear history touching a handful of files
+  "deep_history" => lambda do |s, rng|
+    scaled(2000).times do |i|
+      s.commit("refs/heads/main", "commit #{i}\n", { format("src/file%02d.c", i % 20) => text(rng, 40) })
+    end
+  end,
+
+  # A few incompressible blobs, each chunked when stored
+  "huge_blobs" => lambda do |s, rng|
+    files = {}
+    scaled(4).times do |i|
+      files[format("blob%02d.bin", i)] = rng.bytes(16 * 1024 * 1024)
+    end
+    s.commit("refs/heads/main", "huge blobs\n", files)
+  end,
+
+  # Lots of branches and tags over a short history
+  "many_refs" => lambda do |s, rng|
+    marks = Array.new(100) do |i|
+      s.commit("refs/heads/main", "commit #{i}\n", { "file.txt" => text(rng, 10) })
+    end
+    scaled(5000).times do |i|
+      s.ref(i.even? ? format("refs/tags/v%05d", i) : format("refs/heads/topic-%05d", i), marks[i % marks.size])
+    end
+  end,
+}
+
+def git(dir, *args)
+  out, status = Open3.capture2e("git", "-C", dir, *args)
+  raise "git #{args.join(' ')} failed:\n#{out}" unless status.success?
+  out
+end
+
+def run!(*cmd)
+  out, status = Open3.capture2e({ "PATH" => "#{BACKEND_DIR}:#{ENV['PATH']}" }, *cmd)
+  raise "#{cmd.join(' ')} failed:\n#{out}" unless status.success?
+  out
+end
+
+def fast_import(dir)
+  IO.popen(["git", "-C", dir, "fast-import", "--quiet"], "wb") { |io| yield Stream.new(io) }
+  raise "fast-import failed in #{dir}" unless $?.success?
+end
+
+def timed
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  yield
+  Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+end
+
+class Bench
+  def initialize(out)
+    @out = out
+    @conn = PG.connect(CONNINFO)
+    @tmp = Dir.mktmpdir("gitgres_bench")
+    @repos = []
+  end
+
+  def emit(result)
+    @out.puts(JSON.generate(result))
+    @out.flush
+  end
+
+  def meta(shapes)
+    emit(
+      bench: "meta",
+      revision: `git -C #{ROOT} describe --always --dirty 2>/dev/null`.strip,
+      started_at: Time.now.utc.iso8601,
+      server_version: @conn.exec("SHOW server_version")[0]["server_version"],
+      git_version: `git --version`.strip,
+      shapes: shapes, scale: SCALE, reads: READS, seed: SEED
+    )
+  end
+
+  def record(shape, bench, seconds, extra = {})
+    emit({ shape: shape, bench: bench, seconds: seconds.round(6) }.merge(extra))
+  end
+
+  def repo_id(name)
+    @conn.exec_params("SELECT id FROM repositories WHERE name = $1", [name])[0]["id"].to_i
+  end
+
+  def stored_objects(id)
+    @conn.exec_params("SELECT count(*) FROM objects WHERE repo_id = $1", [id])[0]["count"].to_i
+  end
+
+  def function?(name)
+    @conn.exec_params("SELECT 1 FROM pg_proc WHERE proname = $1", [name]).ntuples > 0
+  end
+
+  def run_shape(shape)
+    warn "#{shape}: generating"
+    name = "bench_#{shape}_#{$$}"
+    @repos << name
+    source = File.join(@tmp, shape)
+    git(@tmp, "init", "-q", source)
+    git(source, "symbolic-ref", "HEAD", "refs/heads/main")
+    fast_import(source) { |s| SHAPES[shape].call(s, Random.new(SEED)) }
+    objects = git(source, "rev-list", "--objects", "--all").lines.size
+    refs = git(source, "for-each-ref").lines.size
+
+    warn "#{shape}: push and clone"
+    record(shape, "push", timed { run!(BACKEND, "push", CONNINFO, name, source) }, objects: objects, refs: refs)
+    id = repo_id(name)
+    record(shape, "stored", 0, objects: stored_objects(id))
+
+    dest = File.join(@tmp, "#{shape}_clone")
+    record(shape, "clone", timed { run!(BACKEND, "clone", CONNINFO, name, dest) }, objects: objects)
+
+    url = "gitgres::#{CONNINFO}/#{name}"
+    helper = File.join(@tmp, "#{shape}_helper")
+    record(shape, "helper_clone", timed { run!("git", "clone", "-q", "--bare", url, helper) }, objects: objects)
+
+    fetched = File.join(@tmp, "#{shape}_fetch")
+    git(@tmp, "init", "-q", "--bare", fetched)
+    record(shape, "helper_fetch",
+      timed { run!("git", "-C", fetched, "fetch", "-q", url, "+refs/*:refs/*") }, objects: objects)
+
+    fast_import(source) do |s|
+      rng = Random.new(SEED + 1)
+      from = "refs/heads/main^0"
+      INCREMENTAL_COMMITS.times do |i|
+        from = s.commit("refs/heads/main", "incremental #{i}\n", { "incremental.txt" => text(rng, 20) }, from: from)
+      end
+    end
+    record(shape, "push_incremental", timed { run!(BACKEND, "push", CONNINFO, name, source) },
+      commits: INCREMENTAL_COMMITS)
+    record(shape, "helper_fetch_incremental",
+      timed { run!("git", "-C", fetched, "fetch", "-q", url, "+refs/*:refs/*") }, commits: INCREMENTAL_COMMITS)
+
+    warn "#{shape}: object store"
+    if File.executable?(ODB_BENCH)
+      run!(ODB_BENCH, "--reads", READS.to_s, "--seed", SEED.to_s, CONNINFO, name).each_line do |line|
+        result = JSON.parse(line)
+        result.delete("repo")
+        emit({ "shape" => shape }.merge(result))
+      end
+    else
+      warn "#{shape}: #{ODB_BENCH} not built, skipping object store benchmarks"
+    end
+
+    warn "#{shape}: SQL functions"
+    sql_benches(shape, id)
+
+    [dest, helper, fetched, source].each { |d| FileUtils.rm_rf(d) }
+  end
+
+  def sql_bench(shape, bench, sql, params)
+    rows = nil
+    seconds = timed { rows = @conn.exec_params(sql, params)[0]["count"].to_i }
+    record(shape, bench, seconds, rows: rows, rows_per_sec: seconds > 0 ? (rows / seconds).round(1) : 0)
+  end
+
+  def sql_benches(shape, id)
+    commits = "SELECT count(*) FROM objects o CROSS JOIN LATERAL %s(o.content) p WHERE o.repo_id = $1 AND o.type = 1"
+    trees = "SELECT count(*) FROM objects o CROSS JOIN LATERAL %s(o.content) p WHERE o.repo_id = $1 AND o.type = 2"
+
+    %w[git_commit_parse git_commit_parse_c].each do |fn|
+      sql_bench(shape, fn, format(commits, fn), [id]) if function?(fn)
+    end
+    %w[git_tree_entries git_tree_entries_c].each do |fn|
+      sql_bench(shape, fn, format(trees, fn), [id]) if function?(fn)
+    end
+    sql_bench(shape, "git_ls_tree_r",
+      "SELECT count(*) FROM refs r, git_object_read(r.repo_id, r.oid) o, git_commit_parse(o.content) c, " \
+      "git_ls_tree_r(r.repo_id, c.tree_oid) t WHERE r.repo_id = $1 AND r.name = 'refs/heads/main'", [id])
+  end
+
+  def cleanup
+    @repos.each do |name|
+      result = @conn.exec_params("SELECT id FROM repositories WHERE name = $1", [name])
+      next if result.ntuples == 0
+      rid = result[0]["id"].to_i
+      %w[reflog refs commits tree_entries blob_text pack_cache objects].each do |table|
+        @conn.exec_params("DELETE FROM #{table} WHERE repo_id = $1", [rid])
+      end
+      @conn.exec_params("DELETE FROM repositories WHERE id = $1", [rid])
+    end
+    @conn.close
+    FileUtils.rm_rf(@tmp)
+  end
+end
+
+abort "#{BACKEND} not built; run make backend" unless File.executable?(BACKEND)
+
+shapes = ENV.fetch("BENCH_SHAPES", SHAPES.keys.join(",")).split(",").map(&:strip)
+unknown = shapes - SHAPES.keys
+abort "unknown shapes: #{unknown.join(', ')} (have #{SHAPES.keys.join(', ')})" unless unknown.empty?
+
+out = ENV["BENCH_OUT"] ? File.open(ENV["BENCH_OUT"], "w") : $stdout
+bench = Bench.new(out)
+begin
+  bench.meta(shapes)
+  shapes.each { |shape| bench.run_shape(shape) }
+ensure
+  bench.cleanup
+  out.close if ENV["BENCH_OUT"]
+end
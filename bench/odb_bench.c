@@ -0,0 +1,266 @@
+/*
+ * odb-bench: time the postgres ODB and refdb backends directly, without
+ * git or a transport in the way.  Prints one JSON object per line.
+ *
+ * Usage:
+ *   odb-bench [--reads N] [--seed N] <conninfo> <reponame>
+ *
+ * Objects are sampled with a fixed seed, so two runs against the same
+ * repository read the same objects in the same order.  Options for the
+ * backend come from the environment as they do for gitgres-backend
+ * (GITGRES_CACHE_BYTES and friends).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <git2.h>
+#include <git2/sys/repository.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <libpq-fe.h>
+#include "odb_postgres.h"
+#include "refdb_postgres.h"
+#include "stats.h"
+
+/* Hex digits the prefix lookups use, as git's default abbreviation */
+#define PREFIX_HEX 7
+
+static void die(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "fatal: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static void check_lg2(int error, const char *msg) {
+	if (error < 0) {
+		const git_error *e = git_error_last();
+		die("%s: %s", msg, e ? e->message : "unknown error");
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, so the sample doesn't depend on the libc's rand() */
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void report(const char *bench, const char *repo, size_t ops,
+	double seconds, unsigned long long bytes)
+{
+	printf("{\"bench\":\"%s\",\"repo\":\"%s\",\"ops\":%zu,\"seconds\":%.6f,"
+		"\"ops_per_sec\":%.1f,\"bytes\":%llu}\n",
+		bench, repo, ops, seconds, seconds > 0 ? ops / seconds : 0.0, bytes);
+	fflush(stdout);
+}
+
+typedef struct {
+	git_oid *oids;
+	size_t n, cap;
+} oid_list;
+
+static int collect_oid(const git_oid *oid, void *payload) {
+	oid_list *l = payload;
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 1024;
+		l->oids = realloc(l->oids, l->cap * sizeof(git_oid));
+		if (!l->oids)
+			die("out of memory");
+	}
+	git_oid_cpy(&l->oids[l->n++], oid);
+	return 0;
+}
+
+static int get_repo(PGconn *conn, const char *name) {
+	const char *params[1] = { name };
+	PGresult *res = PQexecParams(conn,
+		"SELECT id FROM repositories WHERE name = $1",
+		1, NULL, params, NULL, NULL, 0);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		die("get_repo: %s", PQerrorMessage(conn));
+	if (PQntuples(res) == 0)
+		die("repository '%s' not found", name);
+
+	int repo_id = atoi(PQgetvalue(res, 0, 0));
+	PQclear(res);
+	return repo_id;
+}
+
+/* Random reads through the backend, bypassing git_odb's own cache */
+static void bench_reads(git_odb_backend *backend, const char *reponame,
+	const oid_list *sample, const char *name)
+{
+	unsigned long long bytes = 0;
+	double start = now();
+	for (size_t i = 0; i < sample->n; i++) {
+		void *data;
+		size_t len;
+		git_object_t type;
+		check_lg2(backend->read(&data, &len, &type, backend, &sample->oids[i]), "read");
+		bytes += len;
+		git_odb_backend_data_free(backend, data);
+	}
+	report(name, reponame, sample->n, now() - start, bytes);
+}
+
+static void bench_headers(git_odb_backend *backend, const char *reponame,
+	const oid_list *sample)
+{
+	unsigned long long bytes = 0;
+	double start = now();
+	for (size_t i = 0; i < sample->n; i++) {
+		size_t len;
+		git_object_t type;
+		check_lg2(backend->read_header(&len, &type, backend, &sample->oids[i]), "read_header");
+		bytes += len;
+	}
+	report("odb_read_header", reponame, sample->n, now() - start, bytes);
+}
+
+static void bench_prefix(git_odb_backend *backend, const char *reponame,
+	const oid_list *sample)
+{
+	size_t found = 0;
+	double start = now();
+	for (size_t i = 0; i < sample->n; i++) {
+		char hex[GIT_OID_SHA1_HEXSIZE + 1];
+		git_oid short_oid, full;
+		git_oid_tostr(hex, sizeof(hex), &sample->oids[i]);
+		check_lg2(git_oid_fromstrn(&short_oid, hex, PREFIX_HEX), "parse prefix");
+		/* A short sample-wide prefix can legitimately be ambiguous */
+		int error = backend->exists_prefix(&full, backend, &short_oid, PREFIX_HEX);
+		if (error == 0)
+			found++;
+		else if (error != GIT_EAMBIGUOUS)
+			check_lg2(error, "exists_prefix");
+	}
+	report("odb_exists_prefix", reponame, sample->n, now() - start, found);
+}
+
+static void bench_refs(git_repository *repo, const char *reponame,
+	const char *glob, const char *name)
+{
+	git_reference_iterator *it;
+	git_reference *ref;
+	size_t n = 0;
+	int error;
+
+	double start = now();
+	if (glob)
+		check_lg2(git_reference_iterator_glob_new(&it, repo, glob), "ref iterator");
+	else
+		check_lg2(git_reference_iterator_new(&it, repo), "ref iterator");
+	while ((error = git_reference_next(&ref, it)) == 0) {
+		n++;
+		git_reference_free(ref);
+	}
+	if (error != GIT_ITEROVER)
+		check_lg2(error, "ref iteration");
+	git_reference_iterator_free(it);
+	report(name, reponame, n, now() - start, 0);
+}
+
+int main(int argc, char **argv) {
+	size_t reads = 2000;
+	uint64_t seed = 42;
+	int argi = 1;
+
+	for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+		if (strcmp(argv[argi], "--reads") == 0 && argi + 1 < argc)
+			reads = strtoul(argv[++argi], NULL, 10);
+		else if (strcmp(argv[argi], "--seed") == 0 && argi + 1 < argc)
+			seed = strtoull(argv[++argi], NULL, 10);
+		else
+			die("unknown option %s", argv[argi]);
+	}
+	if (argc - argi != 2) {
+		fprintf(stderr, "usage: odb-bench [--reads N] [--seed N] <conninfo> <reponame>\n");
+		return 1;
+	}
+	const char *conninfo = argv[argi];
+	const char *reponame = argv[argi + 1];
+
+	git_libgit2_init();
+	gitgres_set_application_name("odb-bench");
+
+	PGconn *conn = gitgres_connect(conninfo);
+	if (PQstatus(conn) != CONNECTION_OK)
+		die("connection to database failed: %s", PQerrorMessage(conn));
+	int repo_id = get_repo(conn, reponame);
+
+	git_repository *repo;
+	git_odb *odb;
+	git_odb_backend *backend;
+	git_refdb *refdb;
+	git_refdb_backend *refdb_backend;
+	git_odb_backend_postgres_options opts;
+
+	check_lg2(git_repository_new(&repo), "create repo");
+	check_lg2(git_odb_new(&odb), "create odb");
+	git_odb_backend_postgres_options_from_env(&opts);
+	check_lg2(git_odb_backend_postgres_ext(&backend, conn, repo_id, &opts),
+		"create odb backend");
+	check_lg2(git_odb_add_backend(odb, backend, 1), "add odb backend");
+	git_repository_set_odb(repo, odb);
+	check_lg2(git_refdb_new(&refdb, repo), "create refdb");
+	check_lg2(git_refdb_backend_postgres(&refdb_backend, conn, repo_id),
+		"create refdb backend");
+	check_lg2(git_refdb_set_backend(refdb, refdb_backend), "set refdb backend");
+	git_repository_set_refdb(repo, refdb);
+
+	oid_list all = { 0 };
+	double start = now();
+	check_lg2(backend->foreach(backend, collect_oid, &all), "foreach");
+	report("odb_foreach", reponame, all.n, now() - start, 0);
+
+	/* Partial Fisher-Yates: the first `reads` oids are a distinct sample */
+	oid_list sample = { 0 };
+	if (all.n > 0) {
+		rng_state = seed ? seed : 1;
+		if (reads > all.n)
+			reads = all.n;
+		for (size_t i = 0; i < reads; i++) {
+			size_t j = i + rng_next() % (all.n - i);
+			git_oid tmp = all.oids[i];
+			all.oids[i] = all.oids[j];
+			all.oids[j] = tmp;
+		}
+		sample.oids = all.oids;
+		sample.n = reads;
+
+		/* Each oid once, so the first pass misses the object cache */
+		bench_reads(backend, reponame, &sample, "odb_read_cold");
+		bench_reads(backend, reponame, &sample, "odb_read_warm");
+		bench_headers(backend, reponame, &sample);
+		bench_prefix(backend, reponame, &sample);
+	}
+
+	bench_refs(repo, reponame, NULL, "ref_iterate");
+	bench_refs(repo, reponame, "refs/tags/*", "ref_iterate_glob");
+
+	free(all.oids);
+	git_refdb_free(refdb);
+	git_odb_free(odb);
+	git_repository_free(repo);
+	PQfinish(conn);
+	git_libgit2_shutdown();
+	return 0;
+}
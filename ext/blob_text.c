@@ -0,0 +1,48 @@
+#include "postgres.h"
+#include "varatt.h"
+#include "fmgr.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+
+#include <string.h>
+
+PG_FUNCTION_INFO_V1(git_blob_text_c);
+
+/* Blobs larger than this are not indexed for git_grep */
+#define BLOB_TEXT_MAX_BYTES (1024 * 1024)
+
+/*
+ * git_blob_text_c(content bytea) RETURNS text
+ *
+ * The blob as text for the git_grep index, or NULL when it is too large,
+ * contains a NUL byte (git's binary heuristic) or is not valid UTF-8.
+ * Validating here instead of catching convert_from's error keeps a
+ * subtransaction out of every blob a push inserts.
+ */
+Datum
+git_blob_text_c(PG_FUNCTION_ARGS)
+{
+    bytea      *content = PG_GETARG_BYTEA_PP(0);
+    const char *data = VARDATA_ANY(content);
+    int         len = VARSIZE_ANY_EXHDR(content);
+    char       *converted;
+    text       *result;
+
+    if (len > BLOB_TEXT_MAX_BYTES || memchr(data, '\0', len) != NULL)
+        PG_RETURN_NULL();
+
+    if (!pg_verify_mbstr(PG_UTF8, data, len, true))
+        PG_RETURN_NULL();
+
+    /* Returns its input unconverted, and unterminated, in a UTF-8 database */
+    converted = pg_any_to_server(data, len, PG_UTF8);
+    if (converted == data)
+        result = cstring_to_text_with_len(data, len);
+    else
+    {
+        result = cstring_to_text(converted);
+        pfree(converted);
+    }
+
+    PG_RETURN_TEXT_P(result);
+}
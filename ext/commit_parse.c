@@ -0,0 +1,341 @@
+#include "postgres.h"
+#include "varatt.h"
+#include "funcapi.h"
+#include "fmgr.h"
+#include "catalog/pg_type.h"
+#include "mb/pg_wchar.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+
+#include <ctype.h>
+#include <string.h>
+
+PG_FUNCTION_INFO_V1(git_commit_parse_c);
+
+#define MAX_PARENTS_INLINE 8
+
+typedef struct {
+    const char *ptr;
+    int         len;
+} Span;
+
+/* Parsed "Name <email> timestamp tz" identity line */
+typedef struct {
+    Span        name;
+    Span        email;
+    bool        has_email;
+    int64       timestamp;
+    Span        tz;
+    bool        has_date;
+} Ident;
+
+static int
+hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Decode a hex object id the way decode(..., 'hex') would */
+static bytea *
+parse_hex_oid(const char *p, int len)
+{
+    bytea      *result;
+    unsigned char *out;
+    int         i;
+
+    if (len % 2 != 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid hexadecimal data: odd number of digits")));
+
+    result = (bytea *) palloc(VARHDRSZ + len / 2);
+    SET_VARSIZE(result, VARHDRSZ + len / 2);
+    out = (unsigned char *) VARDATA(result);
+
+    for (i = 0; i < len; i += 2)
+    {
+        int         hi = hexval(p[i]);
+        int         lo = hexval(p[i + 1]);
+
+        if (hi < 0 || lo < 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("invalid hexadecimal digit in commit header")));
+        out[i / 2] = (unsigned char) (hi << 4 | lo);
+    }
+
+    return result;
+}
+
+/*
+ * Split an identity into its parts.  The email is the first <...> pair;
+ * the name is everything before '<' with surrounding spaces trimmed.  The
+ * date is only taken when the line ends in "> <digits> <+|-><4 digits>".
+ */
+static void
+parse_ident(const char *p, int len, Ident *id)
+{
+    const char *end = p + len;
+    const char *lt = memchr(p, '<', len);
+    const char *q;
+    int64       ts = 0;
+
+    memset(id, 0, sizeof(*id));
+
+    q = lt ? lt : end;
+    while (p < q && *p == ' ')
+        p++;
+    while (q > p && q[-1] == ' ')
+        q--;
+    id->name.ptr = p;
+    id->name.len = q - p;
+
+    if (lt)
+    {
+        const char *gt = memchr(lt + 1, '>', end - lt - 1);
+
+        if (gt && gt > lt + 1)
+        {
+            id->email.ptr = lt + 1;
+            id->email.len = gt - lt - 1;
+            id->has_email = true;
+        }
+    }
+
+    /* Walk back over " <tz>", " <digits>" and the closing '>' */
+    if (len < 9)
+        return;
+    q = end - 5;
+    if ((q[0] != '+' && q[0] != '-') ||
+        !isdigit((unsigned char) q[1]) || !isdigit((unsigned char) q[2]) ||
+        !isdigit((unsigned char) q[3]) || !isdigit((unsigned char) q[4]) ||
+        q[-1] != ' ')
+        return;
+    id->tz.ptr = q;
+    id->tz.len = 5;
+
+    q -= 2;
+    {
+        const char *digits_end = q + 1;
+
+        while (q >= p && isdigit((unsigned char) *q))
+            q--;
+        if (q + 1 == digits_end || q < p + 1 || *q != ' ' || q[-1] != '>')
+            return;
+
+        for (q = q + 1; q < digits_end; q++)
+        {
+            if (ts > (PG_INT64_MAX - 9) / 10)
+                ereport(ERROR,
+                        (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                         errmsg("commit timestamp out of range")));
+            ts = ts * 10 + (*q - '0');
+        }
+    }
+    id->timestamp = ts;
+    id->has_date = true;
+}
+
+/*
+ * Produce a text datum in the server encoding from commit bytes.  The
+ * bytes are in the commit's declared encoding, or UTF-8 when it has no
+ * encoding header.  Latin-1 is assumed for text that claims to be UTF-8
+ * but isn't.
+ */
+static Datum
+commit_text(const char *p, int len, int encoding)
+{
+    char       *conv;
+    text       *result;
+
+    if (encoding == PG_UTF8 && !pg_verify_mbstr(PG_UTF8, p, len, true))
+        encoding = PG_LATIN1;
+
+    conv = (char *) pg_do_encoding_conversion((unsigned char *) p, len,
+                                              encoding, GetDatabaseEncoding());
+    if (conv == p)
+        return PointerGetDatum(cstring_to_text_with_len(p, len));
+
+    result = cstring_to_text(conv);
+    pfree(conv);
+    return PointerGetDatum(result);
+}
+
+/*
+ * git_commit_parse_c(content bytea)
+ *   RETURNS TABLE(tree_oid bytea, parent_oids bytea[],
+ *                 author_name text, author_email text,
+ *                 author_timestamp bigint, author_tz text,
+ *                 committer_name text, committer_email text,
+ *                 committer_timestamp bigint, committer_tz text,
+ *                 message text)
+ *
+ * One pass over the header lines up to the first blank line.  Lines
+ * starting with a space continue the previous header (gpgsig, mergetag)
+ * and are skipped.  An "encoding" header names the charset of the
+ * identities and message.
+ */
+Datum
+git_commit_parse_c(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc   tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("return type must be a row type")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        funcctx->max_calls = 1;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        bytea      *content = PG_GETARG_BYTEA_PP(0);
+        const char *data = VARDATA_ANY(content);
+        int         len = VARSIZE_ANY_EXHDR(content);
+        const char *end = data + len;
+        const char *line = data;
+        const char *msg = end;
+        bytea      *tree = NULL;
+        Datum       parents_inline[MAX_PARENTS_INLINE];
+        Datum      *parents = parents_inline;
+        int         nparents = 0;
+        int         parents_cap = MAX_PARENTS_INLINE;
+        Ident       author;
+        Ident       committer;
+        bool        has_author = false;
+        bool        has_committer = false;
+        int         encoding = PG_UTF8;
+        Datum       values[11];
+        bool        nulls[11];
+        HeapTuple   tuple;
+
+        while (line < end)
+        {
+            const char *nl = memchr(line, '\n', end - line);
+            const char *eol = nl ? nl : end;
+            int         llen = eol - line;
+
+            if (llen == 0)
+            {
+                msg = line + 1;
+                break;
+            }
+
+            if (llen > 5 && memcmp(line, "tree ", 5) == 0)
+                tree = parse_hex_oid(line + 5, llen - 5);
+            else if (llen > 7 && memcmp(line, "parent ", 7) == 0)
+            {
+                if (nparents == parents_cap)
+                {
+                    Datum      *grown = palloc(sizeof(Datum) * parents_cap * 2);
+
+                    memcpy(grown, parents, sizeof(Datum) * nparents);
+                    parents = grown;
+                    parents_cap *= 2;
+                }
+                parents[nparents++] = PointerGetDatum(parse_hex_oid(line + 7, llen - 7));
+            }
+            else if (llen >= 7 && memcmp(line, "author ", 7) == 0)
+            {
+                parse_ident(line + 7, llen - 7, &author);
+                has_author = true;
+            }
+            else if (llen >= 10 && memcmp(line, "committer ", 10) == 0)
+            {
+                parse_ident(line + 10, llen - 10, &committer);
+                has_committer = true;
+            }
+            else if (llen > 9 && memcmp(line, "encoding ", 9) == 0)
+            {
+                char       *name = pnstrdup(line + 9, llen - 9);
+                int         enc = pg_char_to_encoding(name);
+
+                if (enc >= 0)
+                    encoding = enc;
+                pfree(name);
+            }
+            /* anything else, including continuation lines, is ignored */
+
+            if (!nl)
+                break;
+            line = nl + 1;
+        }
+
+        memset(nulls, true, sizeof(nulls));
+
+        if (tree)
+        {
+            values[0] = PointerGetDatum(tree);
+            nulls[0] = false;
+        }
+
+        if (nparents > 0)
+            values[1] = PointerGetDatum(construct_array(parents, nparents,
+                                                        BYTEAOID, -1, false, TYPALIGN_INT));
+        else
+            values[1] = PointerGetDatum(construct_empty_array(BYTEAOID));
+        nulls[1] = false;
+
+        if (has_author)
+        {
+            values[2] = commit_text(author.name.ptr, author.name.len, encoding);
+            nulls[2] = false;
+            if (author.has_email)
+            {
+                values[3] = commit_text(author.email.ptr, author.email.len, encoding);
+                nulls[3] = false;
+            }
+            if (author.has_date)
+            {
+                values[4] = Int64GetDatum(author.timestamp);
+                values[5] = PointerGetDatum(cstring_to_text_with_len(author.tz.ptr, author.tz.len));
+                nulls[4] = nulls[5] = false;
+            }
+        }
+
+        if (has_committer)
+        {
+            values[6] = commit_text(committer.name.ptr, committer.name.len, encoding);
+            nulls[6] = false;
+            if (committer.has_email)
+            {
+                values[7] = commit_text(committer.email.ptr, committer.email.len, encoding);
+                nulls[7] = false;
+            }
+            if (committer.has_date)
+            {
+                values[8] = Int64GetDatum(committer.timestamp);
+                values[9] = PointerGetDatum(cstring_to_text_with_len(committer.tz.ptr, committer.tz.len));
+                nulls[8] = nulls[9] = false;
+            }
+        }
+
+        values[10] = commit_text(msg, end - msg, encoding);
+        nulls[10] = false;
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,131 @@
+#include "postgres.h"
+#include "varatt.h"
+#include "fmgr.h"
+#include "utils/builtins.h"
+
+#include <string.h>
+
+PG_FUNCTION_INFO_V1(git_delta_apply_c);
+
+/* Little-endian base-128 size from the delta header */
+static uint64
+delta_varint(const unsigned char **p, const unsigned char *end)
+{
+    uint64 v = 0;
+    int    shift = 0;
+    unsigned char c;
+
+    do
+    {
+        if (*p >= end || shift > 56)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("corrupt delta: truncated header")));
+        c = *(*p)++;
+        v |= (uint64) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return v;
+}
+
+/*
+ * git_delta_apply_c(base bytea, delta bytea) RETURNS bytea
+ *
+ * Applies a git delta, as stored in OFS_DELTA/REF_DELTA pack entries,
+ * to its base.  After the base and target size varints, each opcode
+ * either copies a range of the base (high bit set) or inserts the next
+ * 1-127 literal bytes.
+ */
+Datum
+git_delta_apply_c(PG_FUNCTION_ARGS)
+{
+    bytea               *base = PG_GETARG_BYTEA_PP(0);
+    bytea               *delta = PG_GETARG_BYTEA_PP(1);
+    const unsigned char *base_data = (const unsigned char *) VARDATA_ANY(base);
+    Size                 base_len = VARSIZE_ANY_EXHDR(base);
+    const unsigned char *p = (const unsigned char *) VARDATA_ANY(delta);
+    const unsigned char *end = p + VARSIZE_ANY_EXHDR(delta);
+    uint64               base_size;
+    uint64               target_size;
+    bytea               *result;
+    unsigned char       *out;
+    Size                 pos = 0;
+
+    base_size = delta_varint(&p, end);
+    target_size = delta_varint(&p, end);
+
+    if (base_size != base_len)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("delta base size mismatch: expected " UINT64_FORMAT ", got %zu",
+                        base_size, base_len)));
+
+    if (target_size > MaxAllocSize - VARHDRSZ)
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("delta target too large: " UINT64_FORMAT " bytes", target_size)));
+
+    result = (bytea *) palloc(VARHDRSZ + target_size);
+    SET_VARSIZE(result, VARHDRSZ + target_size);
+    out = (unsigned char *) VARDATA(result);
+
+    while (p < end)
+    {
+        unsigned char cmd = *p++;
+
+        if (cmd & 0x80)
+        {
+            Size off = 0;
+            Size len = 0;
+            int  i;
+
+            for (i = 0; i < 4; i++)
+            {
+                if (cmd & (1 << i))
+                {
+                    if (p >= end)
+                        goto corrupt;
+                    off |= (Size) *p++ << (8 * i);
+                }
+            }
+            for (i = 0; i < 3; i++)
+            {
+                if (cmd & (0x10 << i))
+                {
+                    if (p >= end)
+                        goto corrupt;
+                    len |= (Size) *p++ << (8 * i);
+                }
+            }
+            if (len == 0)
+                len = 0x10000;
+
+            if (off > base_len || len > base_len - off || len > target_size - pos)
+                goto corrupt;
+            memcpy(out + pos, base_data + off, len);
+            pos += len;
+        }
+        else if (cmd)
+        {
+            if ((Size) (end - p) < cmd || cmd > target_size - pos)
+                goto corrupt;
+            memcpy(out + pos, p, cmd);
+            p += cmd;
+            pos += cmd;
+        }
+        else
+            goto corrupt;
+    }
+
+    if (pos != target_size)
+        goto corrupt;
+
+    PG_RETURN_BYTEA_P(result);
+
+corrupt:
+    ereport(ERROR,
+            (errcode(ERRCODE_DATA_CORRUPTED),
+             errmsg("corrupt delta")));
+    PG_RETURN_NULL();           /* keep compiler quiet */
+}
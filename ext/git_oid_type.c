@@ -1,8 +1,22 @@
 #include "postgres.h"
+#include "varatt.h"
 #include "fmgr.h"
 #include "utils/builtins.h"
 #include "access/hash.h"
+#include "access/stratnum.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_type.h"
+#include "libpq/pqformat.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/supportnodes.h"
+#include "optimizer/optimizer.h"
+#include "port/pg_bswap.h"
+#include "utils/lsyscache.h"
+#include "utils/selfuncs.h"
+#include "utils/sortsupport.h"
 
+#include <math.h>
 #include <string.h>
 
 PG_FUNCTION_INFO_V1(git_oid_in);
@@ -15,6 +29,29 @@ PG_FUNCTION_INFO_V1(git_oid_gt);
 PG_FUNCTION_INFO_V1(git_oid_ge);
 PG_FUNCTION_INFO_V1(git_oid_cmp);
 PG_FUNCTION_INFO_V1(git_oid_hash);
+PG_FUNCTION_INFO_V1(git_oid_recv);
+PG_FUNCTION_INFO_V1(git_oid_send);
+PG_FUNCTION_INFO_V1(git_oid_sortsupport);
+PG_FUNCTION_INFO_V1(git_oid_to_bytea);
+PG_FUNCTION_INFO_V1(git_oid_from_bytea);
+PG_FUNCTION_INFO_V1(git_oid_hash_bytea);
+PG_FUNCTION_INFO_V1(git_oid_bytea_eq);
+PG_FUNCTION_INFO_V1(git_oid_bytea_ne);
+PG_FUNCTION_INFO_V1(git_oid_bytea_lt);
+PG_FUNCTION_INFO_V1(git_oid_bytea_le);
+PG_FUNCTION_INFO_V1(git_oid_bytea_gt);
+PG_FUNCTION_INFO_V1(git_oid_bytea_ge);
+PG_FUNCTION_INFO_V1(git_oid_bytea_cmp);
+PG_FUNCTION_INFO_V1(bytea_git_oid_eq);
+PG_FUNCTION_INFO_V1(bytea_git_oid_ne);
+PG_FUNCTION_INFO_V1(bytea_git_oid_lt);
+PG_FUNCTION_INFO_V1(bytea_git_oid_le);
+PG_FUNCTION_INFO_V1(bytea_git_oid_gt);
+PG_FUNCTION_INFO_V1(bytea_git_oid_ge);
+PG_FUNCTION_INFO_V1(bytea_git_oid_cmp);
+PG_FUNCTION_INFO_V1(git_oid_starts_with);
+PG_FUNCTION_INFO_V1(git_oid_prefix_support);
+PG_FUNCTION_INFO_V1(git_oid_prefix_sel);
 
 /* git_oid is stored as a fixed 20-byte pass-by-reference type */
 typedef struct {
@@ -45,6 +82,13 @@ git_oid_in(PG_FUNCTION_ARGS)
     int     len = strlen(str);
     int     i;
 
+    /* Also take bytea's hex output, so COPY data from bytea columns loads */
+    if (len == 42 && str[0] == '\\' && str[1] == 'x')
+    {
+        str += 2;
+        len -= 2;
+    }
+
     if (len != 40)
         ereport(ERROR,
                 (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
@@ -155,3 +199,430 @@ git_oid_hash(PG_FUNCTION_ARGS)
 
     PG_RETURN_INT32(hash_any((unsigned char *) oid->data, 20));
 }
+
+/* Binary format is the raw 20 bytes, the same as a 20-byte bytea */
+Datum
+git_oid_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo  buf = (StringInfo) PG_GETARG_POINTER(0);
+    GitOid     *result;
+
+    if (buf->len - buf->cursor != 20)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("invalid git OID: must be exactly 20 bytes")));
+
+    result = (GitOid *) palloc(sizeof(GitOid));
+    pq_copymsgbytes(buf, result->data, 20);
+
+    PG_RETURN_POINTER(result);
+}
+
+Datum
+git_oid_send(PG_FUNCTION_ARGS)
+{
+    GitOid         *oid = (GitOid *) PG_GETARG_POINTER(0);
+    StringInfoData  buf;
+
+    pq_begintypsend(&buf);
+    pq_sendbytes(&buf, oid->data, 20);
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * Sort support.  Comparisons skip the fmgr call, and sorts on a git_oid
+ * key compare the first 8 bytes as an integer held in the Datum itself,
+ * only going to the full 20 bytes on a tie.
+ */
+static int
+git_oid_fastcmp(Datum a, Datum b, SortSupport ssup)
+{
+    GitOid *x = (GitOid *) DatumGetPointer(a);
+    GitOid *y = (GitOid *) DatumGetPointer(b);
+
+    return memcmp(x->data, y->data, 20);
+}
+
+static Datum
+git_oid_abbrev_convert(Datum original, SortSupport ssup)
+{
+    GitOid *oid = (GitOid *) DatumGetPointer(original);
+    Datum   res;
+
+    /* Read big-endian, so unsigned integer order is memcmp order */
+    memcpy(&res, oid->data, sizeof(Datum));
+    return DatumBigEndianToNative(res);
+}
+
+static int
+git_oid_abbrev_cmp(Datum a, Datum b, SortSupport ssup)
+{
+    if (a > b)
+        return 1;
+    if (a < b)
+        return -1;
+    return 0;
+}
+
+/*
+ * SHA1 output is uniformly distributed, so the leading bytes are as
+ * distinct as any abbreviation gets: never worth giving up on.
+ */
+static bool
+git_oid_abbrev_abort(int memtupcount, SortSupport ssup)
+{
+    return false;
+}
+
+Datum
+git_oid_sortsupport(PG_FUNCTION_ARGS)
+{
+    SortSupport ssup = (SortSupport) PG_GETARG_POINTER(0);
+
+    ssup->comparator = git_oid_fastcmp;
+    if (ssup->abbreviate)
+    {
+        ssup->comparator = git_oid_abbrev_cmp;
+        ssup->abbrev_converter = git_oid_abbrev_convert;
+        ssup->abbrev_abort = git_oid_abbrev_abort;
+        ssup->abbrev_full_comparator = git_oid_fastcmp;
+    }
+
+    PG_RETURN_VOID();
+}
+
+/* Casts to and from bytea, which the SQL functions take and return */
+Datum
+git_oid_to_bytea(PG_FUNCTION_ARGS)
+{
+    GitOid *oid = (GitOid *) PG_GETARG_POINTER(0);
+    bytea  *result = (bytea *) palloc(VARHDRSZ + 20);
+
+    SET_VARSIZE(result, VARHDRSZ + 20);
+    memcpy(VARDATA(result), oid->data, 20);
+
+    PG_RETURN_BYTEA_P(result);
+}
+
+Datum
+git_oid_from_bytea(PG_FUNCTION_ARGS)
+{
+    bytea  *b = PG_GETARG_BYTEA_PP(0);
+    GitOid *result;
+
+    if (VARSIZE_ANY_EXHDR(b) != 20)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid git OID: must be exactly 20 bytes, got %d",
+                        (int) VARSIZE_ANY_EXHDR(b))));
+
+    result = (GitOid *) palloc(sizeof(GitOid));
+    memcpy(result->data, VARDATA_ANY(b), 20);
+
+    PG_RETURN_POINTER(result);
+}
+
+/* Equal to git_oid_hash for a 20-byte bytea, for cross-type hash joins */
+Datum
+git_oid_hash_bytea(PG_FUNCTION_ARGS)
+{
+    bytea  *b = PG_GETARG_BYTEA_PP(0);
+
+    PG_RETURN_INT32(hash_any((unsigned char *) VARDATA_ANY(b), VARSIZE_ANY_EXHDR(b)));
+}
+
+/*
+ * git_oid against bytea, ordered the way byteacmp orders two byteas, so
+ * the types share one btree family and a bytea argument can still be
+ * looked up in a git_oid index.
+ */
+static int
+oid_bytea_cmp(const GitOid *a, const bytea *b)
+{
+    int len = VARSIZE_ANY_EXHDR(b);
+    int cmp = memcmp(a->data, VARDATA_ANY(b), Min(len, 20));
+
+    if (cmp == 0 && len != 20)
+        cmp = len < 20 ? 1 : -1;
+    return cmp;
+}
+
+#define OID_BYTEA_CMP() \
+    oid_bytea_cmp((GitOid *) PG_GETARG_POINTER(0), PG_GETARG_BYTEA_PP(1))
+#define BYTEA_OID_CMP() \
+    (-oid_bytea_cmp((GitOid *) PG_GETARG_POINTER(1), PG_GETARG_BYTEA_PP(0)))
+
+Datum
+git_oid_bytea_eq(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(OID_BYTEA_CMP() == 0);
+}
+
+Datum
+git_oid_bytea_ne(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(OID_BYTEA_CMP() != 0);
+}
+
+Datum
+git_oid_bytea_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(OID_BYTEA_CMP() < 0);
+}
+
+Datum
+git_oid_bytea_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(OID_BYTEA_CMP() <= 0);
+}
+
+Datum
+git_oid_bytea_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(OID_BYTEA_CMP() > 0);
+}
+
+Datum
+git_oid_bytea_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(OID_BYTEA_CMP() >= 0);
+}
+
+Datum
+git_oid_bytea_cmp(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(OID_BYTEA_CMP());
+}
+
+Datum
+bytea_git_oid_eq(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(BYTEA_OID_CMP() == 0);
+}
+
+Datum
+bytea_git_oid_ne(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(BYTEA_OID_CMP() != 0);
+}
+
+Datum
+bytea_git_oid_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(BYTEA_OID_CMP() < 0);
+}
+
+Datum
+bytea_git_oid_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(BYTEA_OID_CMP() <= 0);
+}
+
+Datum
+bytea_git_oid_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(BYTEA_OID_CMP() > 0);
+}
+
+Datum
+bytea_git_oid_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(BYTEA_OID_CMP() >= 0);
+}
+
+Datum
+bytea_git_oid_cmp(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(BYTEA_OID_CMP());
+}
+
+/*
+ * The [lo, hi) range of oids that start with a hex prefix.  Returns 1
+ * when hi bounds the range, 0 when the prefix is all f's and nothing
+ * does, and -1 if the prefix isn't hex or is longer than an oid.
+ */
+static int
+prefix_range(const char *hex, int len, GitOid *lo, GitOid *hi)
+{
+    int i;
+
+    if (len > 40)
+        return -1;
+
+    memset(lo->data, 0, 20);
+    for (i = 0; i < len; i++)
+    {
+        int n = hex_to_nibble(hex[i]);
+
+        if (n < 0)
+            return -1;
+        lo->data[i / 2] |= (i % 2) ? n : n << 4;
+    }
+
+    /* hi is lo with its last digit incremented, carrying leftwards */
+    *hi = *lo;
+    for (i = len - 1; i >= 0; i--)
+    {
+        int n = hex_to_nibble(hex[i]);
+        unsigned char *b = (unsigned char *) &hi->data[i / 2];
+
+        if (n < 15)
+        {
+            *b += (i % 2) ? 1 : 0x10;
+            return 1;
+        }
+        *b &= (i % 2) ? 0xf0 : 0x0f;
+    }
+    return 0;
+}
+
+/*
+ * git_oid_starts_with(oid git_oid, prefix text) RETURNS boolean
+ *
+ * Backs the ^@ operator: oid ^@ 'a1b2c' matches every oid whose hex form
+ * starts with those digits.
+ */
+Datum
+git_oid_starts_with(PG_FUNCTION_ARGS)
+{
+    GitOid *oid = (GitOid *) PG_GETARG_POINTER(0);
+    text   *prefix = PG_GETARG_TEXT_PP(1);
+    GitOid  lo, hi;
+    int     bounded;
+
+    bounded = prefix_range(VARDATA_ANY(prefix), VARSIZE_ANY_EXHDR(prefix), &lo, &hi);
+    if (bounded < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid git OID prefix: must be at most 40 hex characters")));
+
+    PG_RETURN_BOOL(memcmp(oid->data, lo.data, 20) >= 0 &&
+                   (!bounded || memcmp(oid->data, hi.data, 20) < 0));
+}
+
+/* A prefix of n hex digits matches 16^-n of uniformly distributed oids */
+static Selectivity
+prefix_selectivity(PlannerInfo *root, List *args)
+{
+    Node   *right;
+    text   *prefix;
+    GitOid  lo, hi;
+    int     len;
+
+    if (list_length(args) != 2)
+        return DEFAULT_MATCH_SEL;
+
+    right = estimate_expression_value(root, lsecond(args));
+    if (!IsA(right, Const) || ((Const *) right)->constisnull)
+        return DEFAULT_MATCH_SEL;
+
+    prefix = DatumGetTextPP(((Const *) right)->constvalue);
+    len = VARSIZE_ANY_EXHDR(prefix);
+    if (prefix_range(VARDATA_ANY(prefix), len, &lo, &hi) < 0)
+        return DEFAULT_MATCH_SEL;
+
+    return pow(16.0, -len);
+}
+
+static Const *
+oid_const(Oid typid, const GitOid *value)
+{
+    GitOid *copy = (GitOid *) palloc(sizeof(GitOid));
+
+    *copy = *value;
+    return makeConst(typid, -1, InvalidOid, 20, PointerGetDatum(copy), false, false);
+}
+
+/*
+ * oid ^@ 'a1b2c' as the btree conditions oid >= 'a1b2c000...' AND
+ * oid < 'a1b2d000...'.  The range is exact, so the original clause
+ * needn't be rechecked.
+ */
+static List *
+prefix_index_conditions(SupportRequestIndexCondition *req)
+{
+    List       *args;
+    Node       *leftop;
+    Node       *rightop;
+    Oid         typid;
+    Oid         ge_op;
+    Oid         lt_op;
+    text       *prefix;
+    GitOid      lo, hi;
+    int         bounded;
+    List       *result;
+
+    if (is_opclause(req->node))
+        args = ((OpExpr *) req->node)->args;
+    else if (is_funcclause(req->node))
+        args = ((FuncExpr *) req->node)->args;
+    else
+        return NIL;
+
+    if (list_length(args) != 2 || req->indexarg != 0 ||
+        req->index->relam != BTREE_AM_OID)
+        return NIL;
+
+    leftop = (Node *) linitial(args);
+    rightop = (Node *) lsecond(args);
+    if (!IsA(rightop, Const) || ((Const *) rightop)->constisnull)
+        return NIL;
+
+    typid = exprType(leftop);
+    ge_op = get_opfamily_member(req->opfamily, typid, typid, BTGreaterEqualStrategyNumber);
+    lt_op = get_opfamily_member(req->opfamily, typid, typid, BTLessStrategyNumber);
+    if (!OidIsValid(ge_op) || !OidIsValid(lt_op))
+        return NIL;
+
+    /* A bad prefix is left for git_oid_starts_with to report */
+    prefix = DatumGetTextPP(((Const *) rightop)->constvalue);
+    bounded = prefix_range(VARDATA_ANY(prefix), VARSIZE_ANY_EXHDR(prefix), &lo, &hi);
+    if (bounded < 0)
+        return NIL;
+
+    result = list_make1(make_opclause(ge_op, BOOLOID, false, (Expr *) leftop,
+                                      (Expr *) oid_const(typid, &lo),
+                                      InvalidOid, InvalidOid));
+    if (bounded)
+        result = lappend(result, make_opclause(lt_op, BOOLOID, false, (Expr *) leftop,
+                                               (Expr *) oid_const(typid, &hi),
+                                               InvalidOid, InvalidOid));
+    req->lossy = false;
+    return result;
+}
+
+/* Planner support for git_oid_starts_with: index ranges and selectivity */
+Datum
+git_oid_prefix_support(PG_FUNCTION_ARGS)
+{
+    Node   *rawreq = (Node *) PG_GETARG_POINTER(0);
+    Node   *ret = NULL;
+
+    if (IsA(rawreq, SupportRequestSelectivity))
+    {
+        SupportRequestSelectivity *req = (SupportRequestSelectivity *) rawreq;
+
+        if (!req->is_join)
+        {
+            req->selectivity = prefix_selectivity(req->root, req->args);
+            ret = (Node *) req;
+        }
+    }
+    else if (IsA(rawreq, SupportRequestIndexCondition))
+    {
+        ret = (Node *) prefix_index_conditions((SupportRequestIndexCondition *) rawreq);
+    }
+
+    PG_RETURN_POINTER(ret);
+}
+
+/* Restriction estimator for the ^@ operator */
+Datum
+git_oid_prefix_sel(PG_FUNCTION_ARGS)
+{
+    PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+    List        *args = (List *) PG_GETARG_POINTER(2);
+
+    PG_RETURN_FLOAT8(prefix_selectivity(root, args));
+}
@@ -7,7 +7,88 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef GITGRES_SHA1DC
+#include <sha1dc/sha1.h>
+#endif
+
 PG_FUNCTION_INFO_V1(git_object_hash_c);
+PG_FUNCTION_INFO_V1(git_object_check_c);
+
+#define GIT_OID_RAWSZ 20
+
+/*
+ * One digest context per backend process, reset for each object rather
+ * than allocated and freed, and the SHA1 implementation fetched once.
+ * OpenSSL picks the SHA-NI or ARMv8 crypto extension code path itself
+ * when the CPU has it.  Built with GITGRES_SHA1DC (make WITH_SHA1DC=1),
+ * hashing goes through the sha1collisiondetection library instead, as
+ * git does, and reports objects crafted to collide.
+ */
+#ifndef GITGRES_SHA1DC
+static EVP_MD_CTX *sha1_ctx;
+static EVP_MD *sha1_md;
+#endif
+
+static const char *
+git_type_name(int16 type)
+{
+    switch (type)
+    {
+        case 1: return "commit";
+        case 2: return "tree";
+        case 3: return "blob";
+        case 4: return "tag";
+        default: return NULL;
+    }
+}
+
+/*
+ * SHA1("<type> <size>\0<content>") into hash.  Returns true if the
+ * content carries a SHA-1 collision attack, which only SHA1DC detects.
+ */
+static bool
+git_hash(const char *type_name, const char *data, int len, unsigned char *hash)
+{
+    char        header[64];
+    int         header_len;
+
+    header_len = snprintf(header, sizeof(header), "%s %d", type_name, len);
+    header_len++; /* include the null terminator byte */
+
+#ifdef GITGRES_SHA1DC
+    {
+        SHA1_CTX    ctx;
+
+        SHA1DCInit(&ctx);
+        SHA1DCUpdate(&ctx, header, header_len);
+        SHA1DCUpdate(&ctx, data, len);
+        return SHA1DCFinal(hash, &ctx) != 0;
+    }
+#else
+    {
+        unsigned int hash_len;
+
+        if (!sha1_ctx)
+        {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            sha1_md = EVP_MD_fetch(NULL, "SHA1", NULL);
+#else
+            sha1_md = (EVP_MD *) EVP_sha1();
+#endif
+            sha1_ctx = EVP_MD_CTX_new();
+            if (!sha1_md || !sha1_ctx)
+                ereport(ERROR, (errmsg("could not set up SHA1")));
+        }
+
+        if (!EVP_DigestInit_ex(sha1_ctx, sha1_md, NULL) ||
+            !EVP_DigestUpdate(sha1_ctx, header, header_len) ||
+            !EVP_DigestUpdate(sha1_ctx, data, len) ||
+            !EVP_DigestFinal_ex(sha1_ctx, hash, &hash_len))
+            ereport(ERROR, (errmsg("SHA1 computation failed")));
+        return false;
+    }
+#endif
+}
 
 /*
  * git_object_hash_c(type smallint, content bytea) RETURNS bytea
@@ -20,49 +101,58 @@ git_object_hash_c(PG_FUNCTION_ARGS)
 {
     int16          type = PG_GETARG_INT16(0);
     bytea         *content = PG_GETARG_BYTEA_PP(1);
-    const char    *type_name;
-    int            content_len;
-    char           header[64];
-    int            header_len;
-    EVP_MD_CTX    *ctx;
-    unsigned char  hash[EVP_MAX_MD_SIZE];
-    unsigned int   hash_len;
+    const char    *type_name = git_type_name(type);
     bytea         *result;
 
-    switch (type)
-    {
-        case 1: type_name = "commit"; break;
-        case 2: type_name = "tree";   break;
-        case 3: type_name = "blob";   break;
-        case 4: type_name = "tag";    break;
-        default:
-            ereport(ERROR,
-                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("invalid git object type: %d", type)));
-    }
+    if (!type_name)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid git object type: %d", type)));
 
-    content_len = VARSIZE_ANY_EXHDR(content);
-    header_len = snprintf(header, sizeof(header), "%s %d", type_name, content_len);
-    header_len++; /* include the null terminator byte */
+    result = (bytea *) palloc(VARHDRSZ + GIT_OID_RAWSZ);
+    SET_VARSIZE(result, VARHDRSZ + GIT_OID_RAWSZ);
+    git_hash(type_name, VARDATA_ANY(content), VARSIZE_ANY_EXHDR(content),
+             (unsigned char *) VARDATA(result));
 
-    ctx = EVP_MD_CTX_new();
-    if (!ctx)
-        ereport(ERROR, (errmsg("could not allocate EVP_MD_CTX")));
+    PG_RETURN_BYTEA_P(result);
+}
 
-    if (!EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) ||
-        !EVP_DigestUpdate(ctx, header, header_len) ||
-        !EVP_DigestUpdate(ctx, VARDATA_ANY(content), content_len) ||
-        !EVP_DigestFinal_ex(ctx, hash, &hash_len))
-    {
-        EVP_MD_CTX_free(ctx);
-        ereport(ERROR, (errmsg("SHA1 computation failed")));
-    }
+/*
+ * git_object_check_c(oid bytea, type smallint, size integer, content bytea)
+ *     RETURNS text
+ *
+ * What is wrong with an object stored under oid, or NULL if nothing is.
+ * content is the full object, NULL when it couldn't be reassembled.
+ * Not strict, so that a NULL content is reported rather than skipped.
+ */
+Datum
+git_object_check_c(PG_FUNCTION_ARGS)
+{
+    bytea          *oid;
+    bytea          *content;
+    const char     *type_name;
+    unsigned char   hash[GIT_OID_RAWSZ];
+    int             len;
 
-    EVP_MD_CTX_free(ctx);
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+        PG_RETURN_TEXT_P(cstring_to_text("missing header"));
+    if (PG_ARGISNULL(3))
+        PG_RETURN_TEXT_P(cstring_to_text("missing content"));
 
-    result = (bytea *) palloc(VARHDRSZ + 20);
-    SET_VARSIZE(result, VARHDRSZ + 20);
-    memcpy(VARDATA(result), hash, 20);
+    oid = PG_GETARG_BYTEA_PP(0);
+    content = PG_GETARG_BYTEA_PP(3);
+    len = VARSIZE_ANY_EXHDR(content);
 
-    PG_RETURN_BYTEA_P(result);
+    if (!(type_name = git_type_name(PG_GETARG_INT16(1))))
+        PG_RETURN_TEXT_P(cstring_to_text("bad type"));
+    if (len != PG_GETARG_INT32(2))
+        PG_RETURN_TEXT_P(cstring_to_text("size mismatch"));
+
+    if (git_hash(type_name, VARDATA_ANY(content), len, hash))
+        PG_RETURN_TEXT_P(cstring_to_text("sha1 collision"));
+    if (VARSIZE_ANY_EXHDR(oid) != GIT_OID_RAWSZ ||
+        memcmp(VARDATA_ANY(oid), hash, GIT_OID_RAWSZ) != 0)
+        PG_RETURN_TEXT_P(cstring_to_text("hash mismatch"));
+
+    PG_RETURN_NULL();
 }
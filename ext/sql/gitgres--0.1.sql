@@ -7,9 +7,18 @@ CREATE FUNCTION git_oid_in(cstring) RETURNS git_oid
 CREATE FUNCTION git_oid_out(git_oid) RETURNS cstring
     AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
 
+-- Binary format is the raw 20 bytes, as for a 20-byte bytea
+CREATE FUNCTION git_oid_recv(internal) RETURNS git_oid
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION git_oid_send(git_oid) RETURNS bytea
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+
 CREATE TYPE git_oid (
     INPUT = git_oid_in,
     OUTPUT = git_oid_out,
+    RECEIVE = git_oid_recv,
+    SEND = git_oid_send,
     INTERNALLENGTH = 20,
     PASSEDBYVALUE = false,
     ALIGNMENT = char,
@@ -33,6 +42,51 @@ CREATE FUNCTION git_oid_cmp(git_oid, git_oid) RETURNS integer
     AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
 CREATE FUNCTION git_oid_hash(git_oid) RETURNS integer
     AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION git_oid_sortsupport(internal) RETURNS void
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+
+-- Casts: the SQL functions take and return bytea, and a 20-byte bytea
+-- stores into a git_oid column
+CREATE FUNCTION git_oid_to_bytea(git_oid) RETURNS bytea
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION git_oid_from_bytea(bytea) RETURNS git_oid
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (git_oid AS bytea) WITH FUNCTION git_oid_to_bytea(git_oid) AS IMPLICIT;
+CREATE CAST (bytea AS git_oid) WITH FUNCTION git_oid_from_bytea(bytea) AS ASSIGNMENT;
+
+-- Cross-type comparisons with bytea, so bytea arguments and columns
+-- compare against git_oid columns without a cast and use their indexes
+CREATE FUNCTION git_oid_bytea_eq(git_oid, bytea) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION git_oid_bytea_ne(git_oid, bytea) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION git_oid_bytea_lt(git_oid, bytea) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION git_oid_bytea_le(git_oid, bytea) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION git_oid_bytea_gt(git_oid, bytea) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION git_oid_bytea_ge(git_oid, bytea) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION git_oid_bytea_cmp(git_oid, bytea) RETURNS integer
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION bytea_git_oid_eq(bytea, git_oid) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION bytea_git_oid_ne(bytea, git_oid) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION bytea_git_oid_lt(bytea, git_oid) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION bytea_git_oid_le(bytea, git_oid) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION bytea_git_oid_gt(bytea, git_oid) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION bytea_git_oid_ge(bytea, git_oid) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION bytea_git_oid_cmp(bytea, git_oid) RETURNS integer
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION git_oid_hash_bytea(bytea) RETURNS integer
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 -- Operators
 CREATE OPERATOR = (
@@ -78,7 +132,94 @@ CREATE OPERATOR >= (
     RESTRICT = scalargesel, JOIN = scalargejoinsel
 );
 
--- B-tree operator class for indexing and ORDER BY
+CREATE OPERATOR = (
+    LEFTARG = git_oid, RIGHTARG = bytea,
+    FUNCTION = git_oid_bytea_eq,
+    COMMUTATOR = =, NEGATOR = <>,
+    RESTRICT = eqsel, JOIN = eqjoinsel,
+    HASHES, MERGES
+);
+
+CREATE OPERATOR <> (
+    LEFTARG = git_oid, RIGHTARG = bytea,
+    FUNCTION = git_oid_bytea_ne,
+    COMMUTATOR = <>, NEGATOR = =,
+    RESTRICT = neqsel, JOIN = neqjoinsel
+);
+
+CREATE OPERATOR < (
+    LEFTARG = git_oid, RIGHTARG = bytea,
+    FUNCTION = git_oid_bytea_lt,
+    COMMUTATOR = >, NEGATOR = >=,
+    RESTRICT = scalarltsel, JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+    LEFTARG = git_oid, RIGHTARG = bytea,
+    FUNCTION = git_oid_bytea_le,
+    COMMUTATOR = >=, NEGATOR = >,
+    RESTRICT = scalarlesel, JOIN = scalarlejoinsel
+);
+
+CREATE OPERATOR > (
+    LEFTARG = git_oid, RIGHTARG = bytea,
+    FUNCTION = git_oid_bytea_gt,
+    COMMUTATOR = <, NEGATOR = <=,
+    RESTRICT = scalargtsel, JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR >= (
+    LEFTARG = git_oid, RIGHTARG = bytea,
+    FUNCTION = git_oid_bytea_ge,
+    COMMUTATOR = <=, NEGATOR = <,
+    RESTRICT = scalargesel, JOIN = scalargejoinsel
+);
+
+CREATE OPERATOR = (
+    LEFTARG = bytea, RIGHTARG = git_oid,
+    FUNCTION = bytea_git_oid_eq,
+    COMMUTATOR = =, NEGATOR = <>,
+    RESTRICT = eqsel, JOIN = eqjoinsel,
+    HASHES, MERGES
+);
+
+CREATE OPERATOR <> (
+    LEFTARG = bytea, RIGHTARG = git_oid,
+    FUNCTION = bytea_git_oid_ne,
+    COMMUTATOR = <>, NEGATOR = =,
+    RESTRICT = neqsel, JOIN = neqjoinsel
+);
+
+CREATE OPERATOR < (
+    LEFTARG = bytea, RIGHTARG = git_oid,
+    FUNCTION = bytea_git_oid_lt,
+    COMMUTATOR = >, NEGATOR = >=,
+    RESTRICT = scalarltsel, JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+    LEFTARG = bytea, RIGHTARG = git_oid,
+    FUNCTION = bytea_git_oid_le,
+    COMMUTATOR = >=, NEGATOR = >,
+    RESTRICT = scalarlesel, JOIN = scalarlejoinsel
+);
+
+CREATE OPERATOR > (
+    LEFTARG = bytea, RIGHTARG = git_oid,
+    FUNCTION = bytea_git_oid_gt,
+    COMMUTATOR = <, NEGATOR = <=,
+    RESTRICT = scalargtsel, JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR >= (
+    LEFTARG = bytea, RIGHTARG = git_oid,
+    FUNCTION = bytea_git_oid_ge,
+    COMMUTATOR = <=, NEGATOR = <,
+    RESTRICT = scalargesel, JOIN = scalargejoinsel
+);
+
+-- B-tree operator class for indexing and ORDER BY.  Sort support
+-- compares the first 8 bytes as an integer before the full oid.
 CREATE OPERATOR CLASS git_oid_ops
     DEFAULT FOR TYPE git_oid USING btree AS
         OPERATOR 1 <,
@@ -86,7 +227,30 @@ CREATE OPERATOR CLASS git_oid_ops
         OPERATOR 3 =,
         OPERATOR 4 >=,
         OPERATOR 5 >,
-        FUNCTION 1 git_oid_cmp(git_oid, git_oid);
+        FUNCTION 1 git_oid_cmp(git_oid, git_oid),
+        FUNCTION 2 git_oid_sortsupport(internal);
+
+-- bytea sorts the same way, so it joins the family: lookups and merge
+-- joins between git_oid and bytea can use git_oid indexes
+ALTER OPERATOR FAMILY git_oid_ops USING btree ADD
+    OPERATOR 1 < (git_oid, bytea),
+    OPERATOR 2 <= (git_oid, bytea),
+    OPERATOR 3 = (git_oid, bytea),
+    OPERATOR 4 >= (git_oid, bytea),
+    OPERATOR 5 > (git_oid, bytea),
+    FUNCTION 1 (git_oid, bytea) git_oid_bytea_cmp(git_oid, bytea),
+    OPERATOR 1 < (bytea, git_oid),
+    OPERATOR 2 <= (bytea, git_oid),
+    OPERATOR 3 = (bytea, git_oid),
+    OPERATOR 4 >= (bytea, git_oid),
+    OPERATOR 5 > (bytea, git_oid),
+    FUNCTION 1 (bytea, git_oid) bytea_git_oid_cmp(bytea, git_oid),
+    OPERATOR 1 < (bytea, bytea),
+    OPERATOR 2 <= (bytea, bytea),
+    OPERATOR 3 = (bytea, bytea),
+    OPERATOR 4 >= (bytea, bytea),
+    OPERATOR 5 > (bytea, bytea),
+    FUNCTION 1 (bytea, bytea) byteacmp(bytea, bytea);
 
 -- Hash operator class for hash indexes and hash joins
 CREATE OPERATOR CLASS git_oid_hash_ops
@@ -94,11 +258,39 @@ CREATE OPERATOR CLASS git_oid_hash_ops
         OPERATOR 1 =,
         FUNCTION 1 git_oid_hash(git_oid);
 
+ALTER OPERATOR FAMILY git_oid_hash_ops USING hash ADD
+    OPERATOR 1 = (git_oid, bytea),
+    OPERATOR 1 = (bytea, git_oid),
+    FUNCTION 1 (bytea) git_oid_hash_bytea(bytea);
+
+-- Hex prefix match: oid ^@ 'a1b2c' is true for every oid starting with
+-- those digits.  Against a btree index the planner scans the range
+-- ['a1b2c000...', 'a1b2d000...') rather than filtering every row.
+CREATE FUNCTION git_oid_prefix_support(internal) RETURNS internal
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION git_oid_prefix_sel(internal, oid, internal, integer) RETURNS float8
+    AS 'MODULE_PATHNAME' LANGUAGE C STABLE STRICT;
+CREATE FUNCTION git_oid_starts_with(git_oid, text) RETURNS boolean
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT git_oid_prefix_support;
+
+CREATE OPERATOR ^@ (
+    LEFTARG = git_oid, RIGHTARG = text,
+    FUNCTION = git_oid_starts_with,
+    RESTRICT = git_oid_prefix_sel
+);
+
 -- Fast C SHA1 hash function
 -- git_object_hash_c(type smallint, content bytea) RETURNS bytea
 -- Type codes: 1=commit, 2=tree, 3=blob, 4=tag
 CREATE FUNCTION git_object_hash_c(smallint, bytea) RETURNS bytea
-    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Object integrity check for git_verify_objects
+-- git_object_check_c(oid bytea, type smallint, size integer, content bytea) RETURNS text
+-- NULL when content hashes to oid, otherwise what is wrong
+CREATE FUNCTION git_object_check_c(bytea, smallint, integer, bytea) RETURNS text
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE;
 
 -- Fast C tree entry parser
 -- Parses binary tree content into (mode, name, entry_oid) rows
@@ -106,6 +298,49 @@ CREATE FUNCTION git_tree_entries_c(bytea)
     RETURNS TABLE(mode text, name text, entry_oid bytea)
     AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
 
+-- As git_tree_entries_c, returning entry_oid as git_oid
+CREATE FUNCTION git_tree_entries_oid_c(bytea)
+    RETURNS TABLE(mode text, name text, entry_oid git_oid)
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+
+-- Iterative C tree walker behind git_tree_walk
+CREATE FUNCTION git_tree_walk_c(integer, bytea, text, integer)
+    RETURNS TABLE(mode text, path text, oid bytea, obj_type text)
+    AS 'MODULE_PATHNAME' LANGUAGE C STABLE;
+
+-- C tree diff behind git_diff_trees
+CREATE FUNCTION git_diff_trees_c(integer, bytea, bytea, integer)
+    RETURNS TABLE(status text, path text, old_mode text, new_mode text,
+                  old_oid bytea, new_oid bytea, old_path text, similarity integer)
+    AS 'MODULE_PATHNAME' LANGUAGE C STABLE;
+
+-- Fast C commit parser, same row shape as git_commit_parse
+CREATE FUNCTION git_commit_parse_c(bytea)
+    RETURNS TABLE(
+        tree_oid bytea,
+        parent_oids bytea[],
+        author_name text,
+        author_email text,
+        author_timestamp bigint,
+        author_tz text,
+        committer_name text,
+        committer_email text,
+        committer_timestamp bigint,
+        committer_tz text,
+        message text
+    )
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+
+-- Fast C delta application
+-- git_delta_apply_c(base bytea, delta bytea) RETURNS bytea
+CREATE FUNCTION git_delta_apply_c(bytea, bytea) RETURNS bytea
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+
+-- Blob content as text for the git_grep index, NULL for binary,
+-- oversized or non-UTF-8 blobs
+CREATE FUNCTION git_blob_text_c(bytea) RETURNS text
+    AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+
 -- ============================================================
 -- Schema: tables
 -- ============================================================
@@ -116,20 +351,116 @@ CREATE TABLE repositories (
     created_at  timestamptz NOT NULL DEFAULT now()
 );
 
+CREATE TABLE repository_alternates (
+    repo_id      integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    alternate_id integer NOT NULL REFERENCES repositories(id),
+    PRIMARY KEY (repo_id, alternate_id),
+    CHECK (repo_id <> alternate_id)
+);
+
 CREATE TABLE objects (
     repo_id     integer NOT NULL REFERENCES repositories(id),
-    oid         bytea NOT NULL,
+    oid         git_oid NOT NULL,
     type        smallint NOT NULL,
     size        integer NOT NULL,
     content     bytea NOT NULL,
+    base_oid    git_oid,
+    depth       smallint NOT NULL DEFAULT 0,
+    chunked     boolean NOT NULL DEFAULT false,
+    PRIMARY KEY (repo_id, oid)
+) PARTITION BY HASH (repo_id);
+
+CREATE TABLE object_chunks (
+    repo_id     integer NOT NULL,
+    oid         git_oid NOT NULL,
+    chunk_no    integer NOT NULL,
+    data        bytea NOT NULL,
+    PRIMARY KEY (repo_id, oid, chunk_no),
+    FOREIGN KEY (repo_id, oid) REFERENCES objects (repo_id, oid) ON DELETE CASCADE
+) PARTITION BY HASH (repo_id);
+
+DO $$
+BEGIN
+    FOR i IN 0..15 LOOP
+        EXECUTE format('CREATE TABLE objects_p%s PARTITION OF objects '
+                       'FOR VALUES WITH (MODULUS 16, REMAINDER %s)', i, i);
+        EXECUTE format('CREATE TABLE object_chunks_p%s PARTITION OF object_chunks '
+                       'FOR VALUES WITH (MODULUS 16, REMAINDER %s)', i, i);
+    END LOOP;
+END;
+$$;
+
+CREATE TABLE commits (
+    repo_id         integer NOT NULL,
+    commit_oid      bytea NOT NULL,
+    sha             text NOT NULL,
+    tree_oid        bytea,
+    parent_oids     bytea[],
+    author_name     text,
+    author_email    text,
+    authored_at     timestamptz,
+    committer_name  text,
+    committer_email text,
+    committed_at    timestamptz,
+    message         text,
+    PRIMARY KEY (repo_id, commit_oid)
+);
+
+CREATE TABLE tree_entries (
+    repo_id     integer NOT NULL,
+    tree_oid    bytea NOT NULL,
+    mode        text NOT NULL,
+    name        text NOT NULL,
+    entry_oid   bytea NOT NULL
+);
+CREATE INDEX idx_tree_entries_oid ON tree_entries (repo_id, tree_oid);
+
+CREATE TABLE commit_graph (
+    id           bigint GENERATED ALWAYS AS IDENTITY PRIMARY KEY,
+    repo_id      integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    commit_oid   bytea NOT NULL,
+    parent_ids   bigint[],
+    generation   integer,
+    committed_at timestamptz,
+    UNIQUE (repo_id, commit_oid)
+);
+CREATE INDEX idx_commit_graph_unsettled ON commit_graph (repo_id) WHERE generation IS NULL;
+CREATE INDEX idx_commit_graph_unsettled_parents ON commit_graph USING gin (parent_ids)
+    WHERE generation IS NULL;
+
+CREATE TABLE blob_text (
+    repo_id     integer NOT NULL,
+    oid         bytea NOT NULL,
+    content     text NOT NULL,
     PRIMARY KEY (repo_id, oid)
 );
-CREATE INDEX idx_objects_oid ON objects (oid);
+CREATE INDEX idx_blob_text_trgm ON blob_text USING gin (content gin_trgm_ops);
+
+CREATE TABLE last_commit_cache (
+    repo_id         integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    commit_oid      bytea NOT NULL,
+    path            text NOT NULL,
+    name            text NOT NULL,
+    last_commit_oid bytea NOT NULL,
+    PRIMARY KEY (repo_id, commit_oid, path, name)
+);
+
+CREATE TABLE pack_cache (
+    id           serial PRIMARY KEY,
+    repo_id      integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    name         text NOT NULL,
+    tips         bytea[] NOT NULL,
+    pack         oid NOT NULL,
+    idx          bytea NOT NULL,
+    object_count integer NOT NULL,
+    created_at   timestamptz NOT NULL DEFAULT now()
+);
+CREATE INDEX idx_pack_cache_repo ON pack_cache (repo_id, id);
 
 CREATE TABLE refs (
     repo_id     integer NOT NULL REFERENCES repositories(id),
-    name        text NOT NULL,
-    oid         bytea,
+    name        text COLLATE "C" NOT NULL,
+    oid         git_oid,
     symbolic    text,
     PRIMARY KEY (repo_id, name),
     CHECK ((oid IS NOT NULL) != (symbolic IS NOT NULL))
@@ -139,8 +470,8 @@ CREATE TABLE reflog (
     id          bigserial PRIMARY KEY,
     repo_id     integer NOT NULL REFERENCES repositories(id),
     ref_name    text NOT NULL,
-    old_oid     bytea,
-    new_oid     bytea,
+    old_oid     git_oid,
+    new_oid     git_oid,
     committer   text NOT NULL,
     timestamp_s bigint NOT NULL,
     tz_offset   text NOT NULL,
@@ -149,13 +480,24 @@ CREATE TABLE reflog (
 );
 CREATE INDEX idx_reflog_ref ON reflog (repo_id, ref_name, id);
 
+CREATE TABLE ref_events (
+    id          bigserial PRIMARY KEY,
+    repo_id     integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    ref_name    text COLLATE "C" NOT NULL,
+    old_oid     git_oid,
+    new_oid     git_oid,
+    xact        bigint NOT NULL DEFAULT txid_current(),
+    created_at  timestamptz NOT NULL DEFAULT now()
+);
+CREATE INDEX idx_ref_events_repo ON ref_events (repo_id, xact, id);
+
 -- ============================================================
 -- Functions: object hashing
 -- ============================================================
 
 CREATE FUNCTION git_type_name(obj_type smallint)
 RETURNS text
-LANGUAGE sql IMMUTABLE STRICT AS $$
+LANGUAGE sql IMMUTABLE STRICT PARALLEL SAFE AS $$
     SELECT CASE obj_type
         WHEN 1 THEN 'commit'
         WHEN 2 THEN 'tree'
@@ -166,7 +508,7 @@ $$;
 
 CREATE FUNCTION git_object_hash(obj_type smallint, content bytea)
 RETURNS bytea
-LANGUAGE sql IMMUTABLE STRICT AS $$
+LANGUAGE sql IMMUTABLE STRICT PARALLEL SAFE AS $$
     SELECT digest(
         convert_to(git_type_name(obj_type) || ' ' || octet_length(content)::text, 'UTF8')
         || '\x00'::bytea
@@ -191,23 +533,180 @@ DECLARE
 BEGIN
     v_oid := git_object_hash(p_type, p_content);
 
-    INSERT INTO objects (repo_id, oid, type, size, content)
-    VALUES (p_repo_id, v_oid, p_type, octet_length(p_content), p_content)
-    ON CONFLICT (repo_id, oid) DO NOTHING;
+    -- An object one of the repository's alternates stores is shared, not copied
+    IF NOT EXISTS (SELECT 1 FROM git_share_objects(p_repo_id, ARRAY[v_oid])) THEN
+        INSERT INTO objects (repo_id, oid, type, size, content)
+        VALUES (p_repo_id, v_oid, p_type, octet_length(p_content), p_content)
+        ON CONFLICT (repo_id, oid) DO NOTHING;
+    END IF;
 
     RETURN v_oid;
 END;
 $$;
 
+-- Apply a git delta (the format used by OFS_DELTA/REF_DELTA pack entries)
+-- to its base.  The delta starts with the base and target sizes as
+-- little-endian base-128 varints, followed by copy and insert opcodes.
+CREATE FUNCTION git_delta_apply(p_base bytea, p_delta bytea)
+RETURNS bytea
+LANGUAGE plpgsql IMMUTABLE STRICT AS $$
+DECLARE
+    v_len integer := octet_length(p_delta);
+    v_base_len integer := octet_length(p_base);
+    v_pos integer := 0;
+    v_base_size bigint := 0;
+    v_target_size bigint := 0;
+    v_shift integer;
+    v_c integer;
+    v_off bigint;
+    v_size bigint;
+    v_result bytea := '';
+BEGIN
+    v_shift := 0;
+    LOOP
+        v_c := get_byte(p_delta, v_pos);
+        v_pos := v_pos + 1;
+        v_base_size := v_base_size | ((v_c & 127)::bigint << v_shift);
+        v_shift := v_shift + 7;
+        EXIT WHEN v_c < 128;
+    END LOOP;
+
+    v_shift := 0;
+    LOOP
+        v_c := get_byte(p_delta, v_pos);
+        v_pos := v_pos + 1;
+        v_target_size := v_target_size | ((v_c & 127)::bigint << v_shift);
+        v_shift := v_shift + 7;
+        EXIT WHEN v_c < 128;
+    END LOOP;
+
+    IF v_base_size != v_base_len THEN
+        RAISE EXCEPTION 'delta base size mismatch: expected %, got %', v_base_size, v_base_len;
+    END IF;
+
+    WHILE v_pos < v_len LOOP
+        v_c := get_byte(p_delta, v_pos);
+        v_pos := v_pos + 1;
+
+        IF v_c >= 128 THEN
+            -- Copy from base: bits 0-3 select offset bytes, bits 4-6 size bytes
+            v_off := 0;
+            v_size := 0;
+            FOR i IN 0..3 LOOP
+                IF (v_c & (1 << i)) != 0 THEN
+                    v_off := v_off | (get_byte(p_delta, v_pos)::bigint << (8 * i));
+                    v_pos := v_pos + 1;
+                END IF;
+            END LOOP;
+            FOR i IN 0..2 LOOP
+                IF (v_c & (16 << i)) != 0 THEN
+                    v_size := v_size | (get_byte(p_delta, v_pos)::bigint << (8 * i));
+                    v_pos := v_pos + 1;
+                END IF;
+            END LOOP;
+            IF v_size = 0 THEN
+                v_size := 65536;
+            END IF;
+            IF v_off + v_size > v_base_len THEN
+                RAISE EXCEPTION 'corrupt delta: copy past end of base';
+            END IF;
+            v_result := v_result || substring(p_base FROM v_off::integer + 1 FOR v_size::integer);
+        ELSIF v_c > 0 THEN
+            -- Insert the next v_c literal bytes
+            IF v_pos + v_c > v_len THEN
+                RAISE EXCEPTION 'corrupt delta: insert past end of delta';
+            END IF;
+            v_result := v_result || substring(p_delta FROM v_pos + 1 FOR v_c);
+            v_pos := v_pos + v_c;
+        ELSE
+            RAISE EXCEPTION 'corrupt delta: reserved opcode 0';
+        END IF;
+    END LOOP;
+
+    IF octet_length(v_result) != v_target_size THEN
+        RAISE EXCEPTION 'corrupt delta: expected % bytes, produced %', v_target_size, octet_length(v_result);
+    END IF;
+
+    RETURN v_result;
+END;
+$$;
+
+CREATE FUNCTION git_object_repos(p_repo_id integer)
+RETURNS integer[]
+LANGUAGE sql STABLE STRICT AS $$
+    WITH RECURSIVE chain(id, depth) AS (
+        SELECT p_repo_id, 0
+        UNION
+        SELECT a.alternate_id, c.depth + 1
+        FROM chain c
+        JOIN repository_alternates a ON a.repo_id = c.id
+        WHERE c.depth < 16
+    )
+    SELECT array_agg(id ORDER BY depth)
+    FROM (SELECT id, min(depth) AS depth FROM chain GROUP BY id) s;
+$$;
+
+CREATE FUNCTION git_object_find(p_repos integer[], p_oid bytea)
+RETURNS TABLE(repo_id integer, oid bytea, type smallint, size integer, content bytea,
+              base_oid bytea, depth smallint, chunked boolean)
+LANGUAGE sql STABLE AS $$
+    SELECT o.repo_id, o.oid::bytea, o.type, o.size, o.content, o.base_oid::bytea, o.depth, o.chunked
+    FROM unnest(p_repos) WITH ORDINALITY AS r(id, n)
+    CROSS JOIN LATERAL (SELECT * FROM objects WHERE objects.repo_id = r.id AND objects.oid = p_oid) o
+    ORDER BY r.n
+    LIMIT 1;
+$$;
+
 CREATE FUNCTION git_object_read(
     p_repo_id integer,
     p_oid bytea
 )
 RETURNS TABLE(type smallint, size integer, content bytea)
-LANGUAGE sql STABLE STRICT AS $$
-    SELECT o.type, o.size, o.content
-    FROM objects o
-    WHERE o.repo_id = p_repo_id AND o.oid = p_oid;
+LANGUAGE plpgsql STABLE STRICT AS $$
+DECLARE
+    v_repos integer[] := git_object_repos(p_repo_id);
+    v_link record;
+    v_content bytea;
+BEGIN
+    -- Objects stored as deltas name their base.  Walk the chain down to
+    -- a full object, then apply the deltas back up to the one asked for.
+    -- A base can live in a different repository than its delta, and an
+    -- object stored in several is read from the nearest.
+    FOR v_link IN
+        WITH RECURSIVE chain AS (
+            SELECT o.repo_id, o.oid, o.type, o.size, o.content, o.base_oid, o.chunked, 0 AS n
+            FROM git_object_find(v_repos, p_oid) o
+            UNION ALL
+            SELECT b.repo_id, b.oid, b.type, b.size, b.content, b.base_oid, b.chunked, c.n + 1
+            FROM chain c, LATERAL git_object_find(v_repos, c.base_oid) b
+        )
+        SELECT * FROM chain ORDER BY chain.n DESC
+    LOOP
+        IF v_content IS NULL THEN
+            IF v_link.base_oid IS NOT NULL THEN
+                RAISE EXCEPTION 'missing delta base % for object %',
+                    encode(v_link.base_oid, 'hex'), encode(p_oid, 'hex');
+            END IF;
+            IF v_link.chunked THEN
+                SELECT coalesce(string_agg(k.data, ''::bytea ORDER BY k.chunk_no), ''::bytea)
+                INTO v_content
+                FROM object_chunks k
+                WHERE k.repo_id = v_link.repo_id AND k.oid = v_link.oid;
+            ELSE
+                v_content := v_link.content;
+            END IF;
+        ELSE
+            v_content := git_delta_apply_c(v_content, v_link.content);
+        END IF;
+        type := v_link.type;
+        size := v_link.size;
+    END LOOP;
+
+    IF v_content IS NOT NULL THEN
+        content := v_content;
+        RETURN NEXT;
+    END IF;
+END;
 $$;
 
 CREATE FUNCTION git_object_read_prefix(
@@ -218,15 +717,62 @@ CREATE FUNCTION git_object_read_prefix(
 RETURNS TABLE(oid bytea, type smallint, size integer, content bytea)
 LANGUAGE plpgsql STABLE AS $$
 DECLARE
-    v_prefix_bytes integer;
+    v_repos integer[] := git_object_repos(p_repo_id);
+    v_lo bytea;
+    v_hi bytea;
+    v_full integer := p_prefix_len / 2;
+    v_step integer := 1;
+    v_byte integer;
+    i integer;
 BEGIN
-    v_prefix_bytes := p_prefix_len / 2;
+    -- Turn the prefix into a [lo, hi) range on the primary key so the
+    -- (repo_id, oid) btree serves it.  An odd trailing hex digit only
+    -- fixes the high nibble of the next byte.
+    v_lo := substring(p_prefix FROM 1 FOR v_full);
+    IF p_prefix_len % 2 = 1 THEN
+        v_lo := v_lo || set_byte('\x00'::bytea, 0, get_byte(p_prefix, v_full) & 240);
+        v_step := 16;
+    END IF;
 
-    RETURN QUERY
-    SELECT o.oid, o.type, o.size, o.content
-    FROM objects o
-    WHERE o.repo_id = p_repo_id
-      AND substring(o.oid FROM 1 FOR v_prefix_bytes) = substring(p_prefix FROM 1 FOR v_prefix_bytes);
+    -- hi is lo with its last digit incremented; trailing bytes that would
+    -- overflow are dropped.  A prefix of all f's has no upper bound.
+    i := length(v_lo) - 1;
+    WHILE i >= 0 LOOP
+        v_byte := get_byte(v_lo, i) + v_step;
+        IF v_byte < 256 THEN
+            v_hi := set_byte(substring(v_lo FROM 1 FOR i + 1), i, v_byte);
+            EXIT;
+        END IF;
+        v_step := 1;
+        i := i - 1;
+    END LOOP;
+
+    -- Two rows are enough to tell a unique match from an ambiguous one
+    IF v_hi IS NULL THEN
+        RETURN QUERY
+        SELECT m.oid::bytea, r.type, r.size, r.content
+        FROM (SELECT DISTINCT o.oid
+              FROM unnest(v_repos) AS r(id)
+              CROSS JOIN LATERAL (SELECT o.oid FROM objects o
+                                  WHERE o.repo_id = r.id AND o.oid >= v_lo
+                                  ORDER BY o.oid
+                                  LIMIT 2) o
+              ORDER BY o.oid
+              LIMIT 2) m,
+             LATERAL git_object_read(p_repo_id, m.oid) r;
+    ELSE
+        RETURN QUERY
+        SELECT m.oid::bytea, r.type, r.size, r.content
+        FROM (SELECT DISTINCT o.oid
+              FROM unnest(v_repos) AS r(id)
+              CROSS JOIN LATERAL (SELECT o.oid FROM objects o
+                                  WHERE o.repo_id = r.id AND o.oid >= v_lo AND o.oid < v_hi
+                                  ORDER BY o.oid
+                                  LIMIT 2) o
+              ORDER BY o.oid
+              LIMIT 2) m,
+             LATERAL git_object_read(p_repo_id, m.oid) r;
+    END IF;
 END;
 $$;
 
@@ -279,14 +825,14 @@ DECLARE
     v_entry record;
 BEGIN
     SELECT o.content INTO v_content
-    FROM objects o
-    WHERE o.repo_id = p_repo_id AND o.oid = p_tree_oid AND o.type = 2;
+    FROM git_object_find(git_object_repos(p_repo_id), p_tree_oid) o
+    WHERE o.type = 2;
 
     IF v_content IS NULL THEN
         RETURN;
     END IF;
 
-    FOR v_entry IN SELECT e.mode, e.name, e.entry_oid FROM git_tree_entries(v_content) e LOOP
+    FOR v_entry IN SELECT e.mode, e.name, e.entry_oid FROM git_tree_entries_c(v_content) e LOOP
         IF v_entry.mode = '40000' THEN
             path := p_prefix || v_entry.name || '/';
             mode := v_entry.mode;
@@ -306,6 +852,110 @@ BEGIN
 END;
 $$;
 
+CREATE FUNCTION git_tree_walk(
+    p_repo_id integer,
+    p_tree_oid bytea,
+    p_pathspec text DEFAULT '',
+    p_max_depth integer DEFAULT NULL
+)
+RETURNS TABLE(mode text, path text, oid bytea, obj_type text)
+LANGUAGE sql STABLE AS $$
+    SELECT * FROM git_tree_walk_c(p_repo_id, p_tree_oid, p_pathspec, p_max_depth);
+$$;
+
+-- ============================================================
+-- Functions: tree diff
+-- ============================================================
+
+CREATE FUNCTION git_tree_entry_pairs(
+    p_repo_id integer,
+    p_old_tree bytea,
+    p_new_tree bytea
+)
+RETURNS TABLE(name text, old_mode text, new_mode text, old_oid bytea, new_oid bytea)
+LANGUAGE sql STABLE AS $$
+    WITH repos(ids) AS (
+        SELECT git_object_repos(p_repo_id)
+    ),
+    o AS (
+        SELECT e.name || CASE WHEN e.mode = '40000' THEN '/' ELSE '' END AS name,
+               e.mode, e.entry_oid
+        FROM repos r,
+             LATERAL git_object_find(r.ids, p_old_tree) t,
+             LATERAL git_tree_entries_c(t.content) e
+        WHERE t.type = 2
+    ),
+    n AS (
+        SELECT e.name || CASE WHEN e.mode = '40000' THEN '/' ELSE '' END AS name,
+               e.mode, e.entry_oid
+        FROM repos r,
+             LATERAL git_object_find(r.ids, p_new_tree) t,
+             LATERAL git_tree_entries_c(t.content) e
+        WHERE t.type = 2
+    )
+    SELECT coalesce(o.name, n.name), o.mode, n.mode, o.entry_oid, n.entry_oid
+    FROM o FULL JOIN n ON n.name = o.name
+    WHERE o.entry_oid IS DISTINCT FROM n.entry_oid
+       OR o.mode IS DISTINCT FROM n.mode;
+$$;
+
+CREATE FUNCTION git_blob_similarity(p_old bytea, p_new bytea)
+RETURNS integer
+LANGUAGE plpgsql IMMUTABLE STRICT AS $$
+DECLARE
+    v_old bytea[] := '{}';
+    v_new bytea[] := '{}';
+    v_lines bytea[];
+    v_blob bytea;
+    v_side integer;
+    v_len integer;
+    v_start integer;
+    v_pos integer;
+    v_copied bigint;
+BEGIN
+    IF octet_length(p_old) = 0 OR octet_length(p_new) = 0 THEN
+        RETURN 0;
+    END IF;
+
+    FOR v_side IN 1..2 LOOP
+        v_blob := CASE v_side WHEN 1 THEN p_old ELSE p_new END;
+        v_len := octet_length(v_blob);
+        v_lines := '{}';
+        v_start := 1;
+        FOR v_pos IN 1..v_len LOOP
+            IF get_byte(v_blob, v_pos - 1) = 10 OR v_pos = v_len THEN
+                v_lines := array_append(v_lines, substring(v_blob FROM v_start FOR v_pos - v_start + 1));
+                v_start := v_pos + 1;
+            END IF;
+        END LOOP;
+        IF v_side = 1 THEN
+            v_old := v_lines;
+        ELSE
+            v_new := v_lines;
+        END IF;
+    END LOOP;
+
+    SELECT coalesce(sum(least(a.n, b.n) * octet_length(a.line)), 0) INTO v_copied
+    FROM (SELECT l.line, count(*) AS n FROM unnest(v_old) AS l(line) GROUP BY l.line) a
+    JOIN (SELECT l.line, count(*) AS n FROM unnest(v_new) AS l(line) GROUP BY l.line) b
+      ON b.line = a.line;
+
+    RETURN (v_copied * 100 / greatest(octet_length(p_old), octet_length(p_new)))::integer;
+END;
+$$;
+
+CREATE FUNCTION git_diff_trees(
+    p_repo_id integer,
+    p_old_tree bytea,
+    p_new_tree bytea,
+    p_rename_threshold integer DEFAULT NULL
+)
+RETURNS TABLE(status text, path text, old_mode text, new_mode text,
+              old_oid bytea, new_oid bytea, old_path text, similarity integer)
+LANGUAGE sql STABLE AS $$
+    SELECT * FROM git_diff_trees_c(p_repo_id, p_old_tree, p_new_tree, p_rename_threshold);
+$$;
+
 -- ============================================================
 -- Functions: commit parsing
 -- ============================================================
@@ -382,6 +1032,26 @@ $$;
 -- Functions: ref management
 -- ============================================================
 
+CREATE FUNCTION git_ref_lock_key(p_repo_id integer, p_name text)
+RETURNS bigint
+LANGUAGE plpgsql IMMUTABLE STRICT AS $$
+DECLARE
+    v_bytes bytea := int4send(p_repo_id) || convert_to(p_name, 'UTF8');
+    v_hash numeric := 14695981039346656037;
+    v_low integer;
+BEGIN
+    FOR i IN 0 .. length(v_bytes) - 1 LOOP
+        v_low := mod(v_hash, 256)::integer;
+        v_hash := v_hash - v_low + (v_low # get_byte(v_bytes, i));
+        v_hash := mod(v_hash * 1099511628211, 18446744073709551616);
+    END LOOP;
+    IF v_hash >= 9223372036854775808 THEN
+        v_hash := v_hash - 18446744073709551616;
+    END IF;
+    RETURN v_hash::bigint;
+END;
+$$;
+
 CREATE FUNCTION git_ref_update(
     p_repo_id integer,
     p_name text,
@@ -394,6 +1064,8 @@ LANGUAGE plpgsql AS $$
 DECLARE
     v_current_oid bytea;
 BEGIN
+    PERFORM pg_advisory_xact_lock(git_ref_lock_key(p_repo_id, p_name));
+
     SELECT oid INTO v_current_oid
     FROM refs
     WHERE repo_id = p_repo_id AND name = p_name
@@ -434,6 +1106,8 @@ CREATE FUNCTION git_ref_set_symbolic(
 RETURNS void
 LANGUAGE plpgsql AS $$
 BEGIN
+    PERFORM pg_advisory_xact_lock(git_ref_lock_key(p_repo_id, p_name));
+
     INSERT INTO refs (repo_id, name, symbolic)
     VALUES (p_repo_id, p_name, p_target)
     ON CONFLICT (repo_id, name) DO UPDATE
@@ -441,6 +1115,1043 @@ BEGIN
 END;
 $$;
 
+CREATE FUNCTION git_refs_changed()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    IF TG_OP = 'INSERT' THEN
+        INSERT INTO ref_events (repo_id, ref_name, old_oid, new_oid)
+        SELECT n.repo_id, n.name, NULL, n.oid
+        FROM new_refs n
+        WHERE n.oid IS NOT NULL;
+    ELSIF TG_OP = 'DELETE' THEN
+        INSERT INTO ref_events (repo_id, ref_name, old_oid, new_oid)
+        SELECT o.repo_id, o.name, o.oid, NULL
+        FROM old_refs o
+        WHERE o.oid IS NOT NULL;
+    ELSE
+        INSERT INTO ref_events (repo_id, ref_name, old_oid, new_oid)
+        SELECT coalesce(n.repo_id, o.repo_id), coalesce(n.name, o.name), o.oid, n.oid
+        FROM old_refs o
+        FULL JOIN new_refs n ON n.repo_id = o.repo_id AND n.name = o.name
+        WHERE o.oid IS DISTINCT FROM n.oid;
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE TRIGGER refs_inserted
+    AFTER INSERT ON refs
+    REFERENCING NEW TABLE AS new_refs
+    FOR EACH STATEMENT EXECUTE FUNCTION git_refs_changed();
+
+CREATE TRIGGER refs_updated
+    AFTER UPDATE ON refs
+    REFERENCING OLD TABLE AS old_refs NEW TABLE AS new_refs
+    FOR EACH STATEMENT EXECUTE FUNCTION git_refs_changed();
+
+CREATE TRIGGER refs_deleted
+    AFTER DELETE ON refs
+    REFERENCING OLD TABLE AS old_refs
+    FOR EACH STATEMENT EXECUTE FUNCTION git_refs_changed();
+
+CREATE FUNCTION git_ref_events_notify()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_flag text := 'gitgres.ref_events_' || NEW.repo_id;
+    v_last bigint;
+    v_count bigint;
+    v_payload jsonb;
+BEGIN
+    IF current_setting(v_flag, true) = NEW.xact::text THEN
+        RETURN NULL;
+    END IF;
+    PERFORM set_config(v_flag, NEW.xact::text, true);
+
+    SELECT max(e.id), count(*) INTO v_last, v_count
+    FROM ref_events e
+    WHERE e.repo_id = NEW.repo_id AND e.id >= NEW.id AND e.xact = NEW.xact;
+
+    v_payload := jsonb_build_object('repo_id', NEW.repo_id, 'first_id', NEW.id,
+                                    'last_id', v_last, 'count', v_count);
+    IF v_count = 1 THEN
+        v_payload := v_payload || (
+            SELECT jsonb_build_object('ref', NEW.ref_name, 'old', encode(NEW.old_oid::bytea, 'hex'),
+                                      'new', encode(NEW.new_oid::bytea, 'hex'), 'reflog_id', max(r.id))
+            FROM reflog r
+            WHERE r.repo_id = NEW.repo_id AND r.ref_name = NEW.ref_name
+              AND r.created_at = NEW.created_at AND r.new_oid = NEW.new_oid
+        );
+    END IF;
+
+    PERFORM pg_notify('gitgres_refs', v_payload::text);
+    RETURN NULL;
+END;
+$$;
+
+CREATE CONSTRAINT TRIGGER ref_events_notify
+    AFTER INSERT ON ref_events
+    DEFERRABLE INITIALLY DEFERRED
+    FOR EACH ROW EXECUTE FUNCTION git_ref_events_notify();
+
+CREATE FUNCTION git_ref_events(
+    p_repo_id integer,
+    p_after bigint DEFAULT 0,
+    p_limit integer DEFAULT 1000
+)
+RETURNS TABLE(id bigint, repo_id integer, ref_name text, old_oid bytea, new_oid bytea,
+              reflog_id bigint, created_at timestamptz)
+LANGUAGE sql STABLE AS $$
+    SELECT e.id, e.repo_id, e.ref_name, e.old_oid::bytea, e.new_oid::bytea, l.id, e.created_at
+    FROM ref_events e
+    LEFT JOIN LATERAL (
+        SELECT r.id
+        FROM reflog r
+        WHERE r.repo_id = e.repo_id AND r.ref_name = e.ref_name
+          AND r.created_at = e.created_at AND r.new_oid = e.new_oid
+        ORDER BY r.id DESC
+        LIMIT 1
+    ) l ON true
+    WHERE (p_repo_id IS NULL OR e.repo_id = p_repo_id)
+      AND (e.xact, e.id) > (coalesce((SELECT c.xact FROM ref_events c WHERE c.id = p_after), 0), p_after)
+      AND (e.xact < txid_snapshot_xmin(txid_current_snapshot())
+           OR e.xact = txid_current_if_assigned())
+    ORDER BY e.xact, e.id
+    LIMIT p_limit;
+$$;
+
+CREATE FUNCTION git_ref_events_prune(p_keep interval DEFAULT '30 days')
+RETURNS bigint
+LANGUAGE sql AS $$
+    WITH gone AS (
+        DELETE FROM ref_events
+        WHERE created_at < now() - p_keep
+        RETURNING 1
+    )
+    SELECT count(*) FROM gone;
+$$;
+
+-- ============================================================
+-- Functions: commits and tree_entries maintenance
+-- ============================================================
+
+CREATE FUNCTION git_objects_inserted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    INSERT INTO commits (repo_id, commit_oid, sha, tree_oid, parent_oids,
+                         author_name, author_email, authored_at,
+                         committer_name, committer_email, committed_at, message)
+    SELECT n.repo_id, n.oid, encode(n.oid, 'hex'), c.tree_oid, c.parent_oids,
+           c.author_name, c.author_email, to_timestamp(c.author_timestamp),
+           c.committer_name, c.committer_email, to_timestamp(c.committer_timestamp),
+           c.message
+    FROM new_objects n, LATERAL git_commit_parse_c(n.content) c
+    WHERE n.type = 1
+    ON CONFLICT (repo_id, commit_oid) DO NOTHING;
+
+    INSERT INTO tree_entries (repo_id, tree_oid, mode, name, entry_oid)
+    SELECT n.repo_id, n.oid, e.mode, e.name, e.entry_oid
+    FROM new_objects n, LATERAL git_tree_entries_c(n.content) e
+    WHERE n.type = 2;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE FUNCTION git_objects_deleted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    DELETE FROM commits c
+    USING old_objects o
+    WHERE o.type = 1 AND c.repo_id = o.repo_id AND c.commit_oid = o.oid;
+
+    DELETE FROM tree_entries t
+    USING old_objects o
+    WHERE o.type = 2 AND t.repo_id = o.repo_id AND t.tree_oid = o.oid;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE TRIGGER objects_inserted
+    AFTER INSERT ON objects
+    REFERENCING NEW TABLE AS new_objects
+    FOR EACH STATEMENT EXECUTE FUNCTION git_objects_inserted();
+
+CREATE TRIGGER objects_deleted
+    AFTER DELETE ON objects
+    REFERENCING OLD TABLE AS old_objects
+    FOR EACH STATEMENT EXECUTE FUNCTION git_objects_deleted();
+
+CREATE FUNCTION git_backfill_commits_and_trees(p_repo_id integer DEFAULT NULL)
+RETURNS void
+LANGUAGE sql AS $$
+    INSERT INTO commits (repo_id, commit_oid, sha, tree_oid, parent_oids,
+                         author_name, author_email, authored_at,
+                         committer_name, committer_email, committed_at, message)
+    SELECT o.repo_id, o.oid, encode(o.oid, 'hex'), c.tree_oid, c.parent_oids,
+           c.author_name, c.author_email, to_timestamp(c.author_timestamp),
+           c.committer_name, c.committer_email, to_timestamp(c.committer_timestamp),
+           c.message
+    FROM objects o, LATERAL git_commit_parse_c(o.content) c
+    WHERE o.type = 1 AND (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+    ON CONFLICT (repo_id, commit_oid) DO NOTHING;
+
+    INSERT INTO tree_entries (repo_id, tree_oid, mode, name, entry_oid)
+    SELECT o.repo_id, o.oid, e.mode, e.name, e.entry_oid
+    FROM objects o, LATERAL git_tree_entries_c(o.content) e
+    WHERE o.type = 2 AND (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+      AND NOT EXISTS (
+          SELECT 1 FROM tree_entries t
+          WHERE t.repo_id = o.repo_id AND t.tree_oid = o.oid
+      );
+$$;
+
+-- ============================================================
+-- Functions: commit graph
+-- ============================================================
+
+CREATE FUNCTION git_commit_graph_settle_ids(p_ids bigint[])
+RETURNS bigint[]
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_ids bigint[];
+    v_best integer[];       -- highest parent generation seen so far
+    v_pending integer[];    -- parents still waiting for a generation
+    v_blocked boolean[];    -- has a parent that isn't stored
+    v_kid_count integer[];
+    v_kids integer[];       -- children's positions, grouped by parent
+    v_off integer[];
+    v_gen integer[];
+    v_queue integer[] := '{}';
+    v_n integer;
+    v_head integer := 1;
+    v_i integer;
+    v_k integer;
+    v_c integer;
+BEGIN
+    WITH u AS (
+        SELECT g.id, g.parent_ids, (row_number() OVER (ORDER BY g.id))::integer AS i
+        FROM commit_graph g
+        WHERE g.id = ANY(p_ids) AND g.generation IS NULL AND g.parent_ids IS NOT NULL
+    ),
+    e AS (
+        SELECT u.i AS child, pu.i AS parent, p.generation,
+               p.parent_ids IS NULL OR (pu.i IS NULL AND p.generation IS NULL) AS missing
+        FROM u
+        CROSS JOIN LATERAL unnest(u.parent_ids) AS x(pid)
+        JOIN commit_graph p ON p.id = x.pid
+        LEFT JOIN u pu ON pu.id = x.pid
+    ),
+    per AS (
+        SELECT u.i,
+               coalesce(max(e.generation), 0) AS best,
+               count(e.parent)::integer AS pending,
+               coalesce(bool_or(e.missing), false) AS blocked
+        FROM u LEFT JOIN e ON e.child = u.i
+        GROUP BY u.i
+    ),
+    kids AS (
+        SELECT u.i, count(e.child)::integer AS n
+        FROM u LEFT JOIN e ON e.parent = u.i
+        GROUP BY u.i
+    )
+    SELECT (SELECT array_agg(u.id ORDER BY u.i) FROM u),
+           (SELECT array_agg(per.best ORDER BY per.i) FROM per),
+           (SELECT array_agg(per.pending ORDER BY per.i) FROM per),
+           (SELECT array_agg(per.blocked ORDER BY per.i) FROM per),
+           (SELECT array_agg(kids.n ORDER BY kids.i) FROM kids),
+           (SELECT array_agg(e.child ORDER BY e.parent, e.child) FROM e WHERE e.parent IS NOT NULL)
+    INTO v_ids, v_best, v_pending, v_blocked, v_kid_count, v_kids;
+
+    v_n := coalesce(cardinality(v_ids), 0);
+    IF v_n = 0 THEN
+        RETURN '{}';
+    END IF;
+
+    -- v_kids[v_off[i] .. v_off[i + 1] - 1] are the children of commit i
+    v_off := array_fill(1, ARRAY[v_n + 1]);
+    FOR v_i IN 1..v_n LOOP
+        v_off[v_i + 1] := v_off[v_i] + v_kid_count[v_i];
+    END LOOP;
+
+    v_gen := array_fill(NULL::integer, ARRAY[v_n]);
+    FOR v_i IN 1..v_n LOOP
+        IF v_pending[v_i] = 0 AND NOT v_blocked[v_i] THEN
+            v_queue := array_append(v_queue, v_i);
+        END IF;
+    END LOOP;
+
+    WHILE v_head <= cardinality(v_queue) LOOP
+        v_i := v_queue[v_head];
+        v_head := v_head + 1;
+        v_gen[v_i] := v_best[v_i] + 1;
+
+        FOR v_k IN v_off[v_i]..v_off[v_i + 1] - 1 LOOP
+            v_c := v_kids[v_k];
+            v_best[v_c] := greatest(v_best[v_c], v_gen[v_i]);
+            v_pending[v_c] := v_pending[v_c] - 1;
+            IF v_pending[v_c] = 0 AND NOT v_blocked[v_c] THEN
+                v_queue := array_append(v_queue, v_c);
+            END IF;
+        END LOOP;
+    END LOOP;
+
+    UPDATE commit_graph g
+    SET generation = s.gen
+    FROM unnest(v_ids, v_gen) AS s(id, gen)
+    WHERE g.id = s.id AND s.gen IS NOT NULL;
+
+    RETURN ARRAY(SELECT v_ids[q.i] FROM unnest(v_queue) AS q(i));
+END;
+$$;
+
+CREATE FUNCTION git_commit_graph_settle(p_repo_id integer)
+RETURNS integer
+LANGUAGE sql AS $$
+    SELECT cardinality(git_commit_graph_settle_ids(ARRAY(
+        SELECT g.id FROM commit_graph g
+        WHERE g.repo_id = p_repo_id AND g.generation IS NULL
+    )));
+$$;
+
+CREATE FUNCTION git_commits_inserted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_settled bigint[];
+BEGIN
+    INSERT INTO commit_graph (repo_id, commit_oid)
+    SELECT DISTINCT n.repo_id, x.oid
+    FROM new_commits n,
+         LATERAL unnest(array_append(n.parent_oids, n.commit_oid)) AS x(oid)
+    ON CONFLICT (repo_id, commit_oid) DO NOTHING;
+
+    UPDATE commit_graph g
+    SET parent_ids = p.ids, committed_at = n.committed_at
+    FROM new_commits n,
+         LATERAL (
+             SELECT coalesce(array_agg(pg.id ORDER BY x.ord), '{}') AS ids
+             FROM unnest(n.parent_oids) WITH ORDINALITY AS x(oid, ord)
+             JOIN commit_graph pg ON pg.repo_id = n.repo_id AND pg.commit_oid = x.oid
+         ) p
+    WHERE g.repo_id = n.repo_id AND g.commit_oid = n.commit_oid;
+
+    v_settled := git_commit_graph_settle_ids(ARRAY(
+        SELECT g.id
+        FROM new_commits n
+        JOIN commit_graph g ON g.repo_id = n.repo_id AND g.commit_oid = n.commit_oid
+    ));
+
+    IF cardinality(v_settled) > 0 THEN
+        PERFORM git_commit_graph_settle_ids(ARRAY(
+            WITH RECURSIVE d(id) AS (
+                SELECT c.id
+                FROM unnest(v_settled) AS s(id)
+                JOIN commit_graph c ON c.parent_ids @> ARRAY[s.id] AND c.generation IS NULL
+                UNION
+                SELECT c.id
+                FROM d
+                JOIN commit_graph c ON c.parent_ids @> ARRAY[d.id] AND c.generation IS NULL
+            )
+            SELECT d.id FROM d
+        ));
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE FUNCTION git_commits_deleted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    UPDATE commit_graph g
+    SET parent_ids = NULL, generation = NULL, committed_at = NULL
+    FROM old_commits o
+    WHERE g.repo_id = o.repo_id AND g.commit_oid = o.commit_oid;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE TRIGGER commits_inserted
+    AFTER INSERT ON commits
+    REFERENCING NEW TABLE AS new_commits
+    FOR EACH STATEMENT EXECUTE FUNCTION git_commits_inserted();
+
+CREATE TRIGGER commits_deleted
+    AFTER DELETE ON commits
+    REFERENCING OLD TABLE AS old_commits
+    FOR EACH STATEMENT EXECUTE FUNCTION git_commits_deleted();
+
+CREATE FUNCTION git_is_ancestor(
+    p_repo_id integer,
+    p_ancestor bytea,
+    p_descendant bytea
+)
+RETURNS boolean
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    v_a_id bigint;
+    v_a_gen integer;
+    v_d_id bigint;
+    v_d_gen integer;
+BEGIN
+    SELECT g.id, g.generation INTO v_d_id, v_d_gen
+    FROM commit_graph g
+    WHERE g.repo_id = p_repo_id AND g.commit_oid = p_descendant AND g.parent_ids IS NOT NULL;
+    IF v_d_id IS NULL THEN
+        RETURN NULL;
+    END IF;
+
+    SELECT g.id, g.generation INTO v_a_id, v_a_gen
+    FROM commit_graph g
+    WHERE g.repo_id = p_repo_id AND g.commit_oid = p_ancestor;
+    IF v_a_id IS NULL THEN
+        RETURN false;
+    END IF;
+
+    IF v_a_id = v_d_id THEN
+        RETURN true;
+    END IF;
+    IF v_a_gen >= v_d_gen THEN
+        RETURN false;
+    END IF;
+
+    RETURN EXISTS (
+        WITH RECURSIVE walk(id) AS (
+            SELECT v_d_id
+            UNION
+            SELECT p.id
+            FROM walk w
+            JOIN commit_graph g ON g.id = w.id
+            CROSS JOIN LATERAL unnest(g.parent_ids) AS x(pid)
+            JOIN commit_graph p ON p.id = x.pid
+            WHERE v_a_gen IS NULL OR p.generation IS NULL OR p.generation >= v_a_gen
+        )
+        SELECT 1 FROM walk WHERE walk.id = v_a_id
+    );
+END;
+$$;
+
+CREATE FUNCTION git_commit_graph_paint(
+    p_repo_id integer,
+    p_a bytea,
+    p_b bytea,
+    p_stop_at_base boolean
+)
+RETURNS TABLE(ahead integer, behind integer, merge_base bytea)
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    v_a_id bigint;
+    v_a_gen integer;
+    v_b_id bigint;
+    v_b_gen integer;
+    v_ids bigint[];
+    v_flags integer[];
+    v_gens integer[];
+    v_level integer;
+BEGIN
+    SELECT g.id, g.generation INTO v_a_id, v_a_gen
+    FROM commit_graph g
+    WHERE g.repo_id = p_repo_id AND g.commit_oid = p_a AND g.parent_ids IS NOT NULL;
+    SELECT g.id, g.generation INTO v_b_id, v_b_gen
+    FROM commit_graph g
+    WHERE g.repo_id = p_repo_id AND g.commit_oid = p_b AND g.parent_ids IS NOT NULL;
+    IF v_a_id IS NULL OR v_b_id IS NULL THEN
+        RETURN;
+    END IF;
+
+    ahead := 0;
+    behind := 0;
+    IF v_a_id = v_b_id THEN
+        v_ids := ARRAY[v_a_id];
+        v_flags := ARRAY[3];
+        v_gens := ARRAY[v_a_gen];
+    ELSE
+        v_ids := ARRAY[v_a_id, v_b_id];
+        v_flags := ARRAY[1, 2];
+        v_gens := ARRAY[v_a_gen, v_b_gen];
+    END IF;
+
+    LOOP
+        EXIT WHEN coalesce(cardinality(v_ids), 0) = 0;
+        EXIT WHEN NOT p_stop_at_base AND 3 = ALL (v_flags);
+
+        IF array_position(v_gens, NULL) IS NOT NULL THEN
+            RAISE EXCEPTION 'commit graph of repository % has commits without a generation', p_repo_id;
+        END IF;
+
+        SELECT max(x.gen) INTO v_level FROM unnest(v_gens) AS x(gen);
+
+        SELECT ahead + count(*) FILTER (WHERE x.flags = 1),
+               behind + count(*) FILTER (WHERE x.flags = 2)
+        INTO ahead, behind
+        FROM unnest(v_flags, v_gens) AS x(flags, gen)
+        WHERE x.gen = v_level;
+
+        IF p_stop_at_base THEN
+            SELECT g.commit_oid INTO merge_base
+            FROM unnest(v_ids, v_flags, v_gens) AS x(id, flags, gen)
+            JOIN commit_graph g ON g.id = x.id
+            WHERE x.gen = v_level AND x.flags = 3
+            ORDER BY g.committed_at DESC, g.commit_oid
+            LIMIT 1;
+            EXIT WHEN merge_base IS NOT NULL;
+        END IF;
+
+        -- Replace this generation's commits with their parents
+        SELECT array_agg(f.id), array_agg(f.flags), array_agg(f.gen)
+        INTO v_ids, v_flags, v_gens
+        FROM (
+            SELECT s.id, bit_or(s.flags) AS flags, max(s.gen) AS gen
+            FROM (
+                SELECT x.id, x.flags, x.gen
+                FROM unnest(v_ids, v_flags, v_gens) AS x(id, flags, gen)
+                WHERE x.gen < v_level
+                UNION ALL
+                SELECT p.id, x.flags, p.generation
+                FROM unnest(v_ids, v_flags, v_gens) AS x(id, flags, gen)
+                JOIN commit_graph g ON g.id = x.id
+                CROSS JOIN LATERAL unnest(g.parent_ids) AS y(pid)
+                JOIN commit_graph p ON p.id = y.pid
+                WHERE x.gen = v_level AND p.parent_ids IS NOT NULL
+            ) s
+            GROUP BY s.id
+        ) f;
+    END LOOP;
+
+    RETURN NEXT;
+END;
+$$;
+
+CREATE FUNCTION git_merge_base(p_repo_id integer, p_a bytea, p_b bytea)
+RETURNS bytea
+LANGUAGE sql STABLE AS $$
+    SELECT w.merge_base FROM git_commit_graph_paint(p_repo_id, p_a, p_b, true) w;
+$$;
+
+CREATE FUNCTION git_ahead_behind(p_repo_id integer, p_a bytea, p_b bytea)
+RETURNS TABLE(ahead integer, behind integer)
+LANGUAGE sql STABLE AS $$
+    SELECT w.ahead, w.behind FROM git_commit_graph_paint(p_repo_id, p_a, p_b, false) w;
+$$;
+
+CREATE FUNCTION git_commit_graph_shallow(
+    p_repo_id integer,
+    p_wants bytea[],
+    p_depth integer
+)
+RETURNS TABLE(commit_oid bytea, boundary boolean)
+LANGUAGE sql STABLE AS $$
+    WITH RECURSIVE walk(id, depth) AS (
+        SELECT g.id, 1
+        FROM commit_graph g
+        WHERE g.repo_id = p_repo_id AND g.commit_oid = ANY(p_wants)
+        UNION
+        SELECT x.pid, w.depth + 1
+        FROM walk w
+        JOIN commit_graph g ON g.id = w.id
+        CROSS JOIN LATERAL unnest(g.parent_ids) AS x(pid)
+        WHERE w.depth < p_depth
+    )
+    SELECT g.commit_oid, min(w.depth) >= p_depth AND cardinality(g.parent_ids) > 0
+    FROM walk w
+    JOIN commit_graph g ON g.id = w.id
+    WHERE g.parent_ids IS NOT NULL
+    GROUP BY g.id;
+$$;
+
+-- ============================================================
+-- Functions: last commit per path
+-- ============================================================
+
+CREATE FUNCTION git_tree_lookup(p_repo_id integer, p_tree_oid bytea, p_path text)
+RETURNS bytea
+LANGUAGE plpgsql STABLE STRICT AS $$
+DECLARE
+    v_oid bytea := p_tree_oid;
+    v_part text;
+BEGIN
+    FOREACH v_part IN ARRAY string_to_array(trim(both '/' from p_path), '/') LOOP
+        SELECT te.entry_oid INTO v_oid
+        FROM tree_entries te
+        WHERE te.repo_id = p_repo_id AND te.tree_oid = v_oid
+          AND te.name = v_part AND te.mode = '40000';
+        IF v_oid IS NULL THEN
+            RETURN NULL;
+        END IF;
+    END LOOP;
+    RETURN v_oid;
+END;
+$$;
+
+CREATE FUNCTION git_last_commits(
+    p_repo_id integer,
+    p_commit bytea,
+    p_path text DEFAULT ''
+)
+RETURNS TABLE(name text, commit_oid bytea)
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_path text := trim(both '/' from coalesce(p_path, ''));
+    v_dir bytea;
+    -- Entries still being followed, and the commit each has reached
+    v_at bigint[];
+    v_names text[];
+    v_oids bytea[];
+    v_modes text[];
+    -- Entries resolved so far
+    v_res_names text[] := '{}';
+    v_res_commits bytea[] := '{}';
+    v_step_names text[];
+    v_step_commits bytea[];
+BEGIN
+    IF EXISTS (
+        SELECT 1 FROM last_commit_cache lc
+        WHERE lc.repo_id = p_repo_id AND lc.commit_oid = p_commit AND lc.path = v_path
+    ) THEN
+        RETURN QUERY
+            SELECT lc.name, lc.last_commit_oid
+            FROM last_commit_cache lc
+            WHERE lc.repo_id = p_repo_id AND lc.commit_oid = p_commit AND lc.path = v_path
+            ORDER BY lc.name;
+        RETURN;
+    END IF;
+
+    SELECT git_tree_lookup(p_repo_id, cm.tree_oid, v_path) INTO v_dir
+    FROM commits cm
+    WHERE cm.repo_id = p_repo_id AND cm.commit_oid = p_commit;
+    IF v_dir IS NULL THEN
+        RETURN;
+    END IF;
+
+    SELECT array_agg(g.id), array_agg(te.name), array_agg(te.entry_oid), array_agg(te.mode)
+    INTO v_at, v_names, v_oids, v_modes
+    FROM tree_entries te, commit_graph g
+    WHERE te.repo_id = p_repo_id AND te.tree_oid = v_dir
+      AND g.repo_id = p_repo_id AND g.commit_oid = p_commit;
+
+    WHILE coalesce(cardinality(v_at), 0) > 0 LOOP
+        WITH cur AS (
+            SELECT x.at, x.name, x.oid, x.mode, g.commit_oid AS here
+            FROM unnest(v_at, v_names, v_oids, v_modes) AS x(at, name, oid, mode)
+            JOIN commit_graph g ON g.id = x.at
+        ),
+        par AS MATERIALIZED (
+            SELECT c.at, y.ord, y.pid, git_tree_lookup(p_repo_id, cm.tree_oid, v_path) AS dir
+            FROM (SELECT DISTINCT cur.at FROM cur) c
+            JOIN commit_graph g ON g.id = c.at
+            CROSS JOIN LATERAL unnest(g.parent_ids) WITH ORDINALITY AS y(pid, ord)
+            JOIN commit_graph pg ON pg.id = y.pid
+            JOIN commits cm ON cm.repo_id = p_repo_id AND cm.commit_oid = pg.commit_oid
+        ),
+        step AS (
+            SELECT cur.name, cur.oid, cur.mode, cur.here,
+                   (SELECT lc.last_commit_oid
+                    FROM last_commit_cache lc
+                    WHERE lc.repo_id = p_repo_id AND lc.commit_oid = cur.here
+                      AND lc.path = v_path AND lc.name = cur.name) AS cached,
+                   (SELECT par.pid
+                    FROM par
+                    JOIN tree_entries te ON te.repo_id = p_repo_id AND te.tree_oid = par.dir
+                    WHERE par.at = cur.at AND te.name = cur.name
+                      AND te.entry_oid = cur.oid AND te.mode = cur.mode
+                    ORDER BY par.ord
+                    LIMIT 1) AS next
+            FROM cur
+        )
+        SELECT array_agg(s.name) FILTER (WHERE s.cached IS NOT NULL OR s.next IS NULL),
+               array_agg(coalesce(s.cached, s.here)) FILTER (WHERE s.cached IS NOT NULL OR s.next IS NULL),
+               array_agg(s.next) FILTER (WHERE s.cached IS NULL AND s.next IS NOT NULL),
+               array_agg(s.name) FILTER (WHERE s.cached IS NULL AND s.next IS NOT NULL),
+               array_agg(s.oid) FILTER (WHERE s.cached IS NULL AND s.next IS NOT NULL),
+               array_agg(s.mode) FILTER (WHERE s.cached IS NULL AND s.next IS NOT NULL)
+        INTO v_step_names, v_step_commits, v_at, v_names, v_oids, v_modes
+        FROM step s;
+
+        v_res_names := v_res_names || coalesce(v_step_names, '{}');
+        v_res_commits := v_res_commits || coalesce(v_step_commits, '{}');
+    END LOOP;
+
+    INSERT INTO last_commit_cache (repo_id, commit_oid, path, name, last_commit_oid)
+    SELECT p_repo_id, p_commit, v_path, r.name, r.last
+    FROM unnest(v_res_names, v_res_commits) AS r(name, last)
+    ON CONFLICT DO NOTHING;
+
+    RETURN QUERY
+        SELECT r.name, r.last
+        FROM unnest(v_res_names, v_res_commits) AS r(name, last)
+        ORDER BY r.name;
+END;
+$$;
+
+-- ============================================================
+-- Functions: code search
+-- ============================================================
+
+CREATE FUNCTION git_blob_text(p_content bytea)
+RETURNS text
+LANGUAGE sql IMMUTABLE STRICT AS $$
+    SELECT git_blob_text_c(p_content);
+$$;
+
+CREATE FUNCTION git_objects_blob_text_inserted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    INSERT INTO blob_text (repo_id, oid, content)
+    SELECT n.repo_id, n.oid, t.content
+    FROM new_objects n,
+         LATERAL (
+             SELECT git_blob_text(CASE
+                 WHEN n.base_oid IS NULL THEN n.content
+                 ELSE (SELECT r.content FROM git_object_read(n.repo_id, n.oid) r)
+             END) AS content
+         ) t
+    WHERE n.type = 3 AND NOT n.chunked AND n.size <= 1048576
+      AND (n.base_oid IS NULL OR EXISTS (
+          SELECT 1 FROM git_object_find(git_object_repos(n.repo_id), n.base_oid)
+      ))
+      AND t.content IS NOT NULL
+    ON CONFLICT (repo_id, oid) DO NOTHING;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE FUNCTION git_objects_blob_text_deleted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    DELETE FROM blob_text b
+    USING old_objects o
+    WHERE o.type = 3 AND b.repo_id = o.repo_id AND b.oid = o.oid;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE TRIGGER objects_blob_text_inserted
+    AFTER INSERT ON objects
+    REFERENCING NEW TABLE AS new_objects
+    FOR EACH STATEMENT EXECUTE FUNCTION git_objects_blob_text_inserted();
+
+CREATE TRIGGER objects_blob_text_deleted
+    AFTER DELETE ON objects
+    REFERENCING OLD TABLE AS old_objects
+    FOR EACH STATEMENT EXECUTE FUNCTION git_objects_blob_text_deleted();
+
+CREATE FUNCTION git_backfill_blob_text(p_repo_id integer DEFAULT NULL)
+RETURNS void
+LANGUAGE sql AS $$
+    INSERT INTO blob_text (repo_id, oid, content)
+    SELECT o.repo_id, o.oid, t.content
+    FROM objects o,
+         LATERAL (
+             SELECT git_blob_text(r.content) AS content
+             FROM git_object_read(o.repo_id, o.oid) r
+         ) t
+    WHERE o.type = 3 AND o.size <= 1048576
+      AND (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+      AND NOT EXISTS (
+          SELECT 1 FROM blob_text b WHERE b.repo_id = o.repo_id AND b.oid = o.oid
+      )
+      AND t.content IS NOT NULL
+    ON CONFLICT (repo_id, oid) DO NOTHING;
+$$;
+
+CREATE FUNCTION git_resolve_tree(p_repo_id integer, p_rev text)
+RETURNS bytea
+LANGUAGE plpgsql STABLE STRICT AS $$
+DECLARE
+    v_repos integer[] := git_object_repos(p_repo_id);
+    v_name text := p_rev;
+    v_names text[];
+    v_oid bytea;
+    v_symbolic text;
+    v_type smallint;
+    v_content bytea;
+    i integer;
+BEGIN
+    IF p_rev ~ '^[0-9a-f]{40}$' THEN
+        v_oid := decode(p_rev, 'hex');
+    ELSE
+        FOR i IN 1..10 LOOP
+            v_names := ARRAY[v_name, 'refs/' || v_name, 'refs/tags/' || v_name, 'refs/heads/' || v_name];
+            SELECT r.oid, r.symbolic INTO v_oid, v_symbolic
+            FROM refs r
+            WHERE r.repo_id = p_repo_id AND r.name = ANY(v_names)
+            ORDER BY array_position(v_names, r.name)
+            LIMIT 1;
+            EXIT WHEN v_symbolic IS NULL;
+            v_name := v_symbolic;
+        END LOOP;
+    END IF;
+
+    FOR i IN 1..10 LOOP
+        SELECT o.type, o.content INTO v_type, v_content
+        FROM git_object_find(v_repos, v_oid) o;
+
+        IF v_type = 2 THEN
+            RETURN v_oid;
+        ELSIF v_type = 1 THEN
+            SELECT c.tree_oid INTO v_oid FROM git_commit_parse_c(v_content) c;
+        ELSIF v_type = 4 THEN
+            v_oid := decode(substring(convert_from(v_content, 'UTF8') FROM '^object ([0-9a-f]{40})'), 'hex');
+        ELSE
+            RETURN NULL;
+        END IF;
+    END LOOP;
+    RETURN NULL;
+END;
+$$;
+
+CREATE FUNCTION git_grep(
+    p_repo_id integer,
+    p_rev text,
+    p_pattern text,
+    p_ignore_case boolean DEFAULT false
+)
+RETURNS TABLE(path text, line_no integer, line text)
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    v_tree bytea := git_resolve_tree(p_repo_id, p_rev);
+    v_regex text := '(?n' || CASE WHEN p_ignore_case THEN 'i' ELSE '' END || ')' || p_pattern;
+    v_oids bytea[];
+BEGIN
+    IF v_tree IS NULL THEN
+        RAISE EXCEPTION 'unknown revision %', p_rev;
+    END IF;
+
+    v_oids := ARRAY(
+        SELECT b.oid FROM blob_text b
+        WHERE b.repo_id = p_repo_id AND b.content ~ v_regex
+    );
+    IF cardinality(v_oids) = 0 THEN
+        RETURN;
+    END IF;
+
+    RETURN QUERY
+        WITH RECURSIVE walk AS (
+            SELECT te.name AS path, te.mode, te.entry_oid AS oid
+            FROM tree_entries te
+            WHERE te.repo_id = p_repo_id AND te.tree_oid = v_tree
+            UNION ALL
+            SELECT w.path || '/' || te.name, te.mode, te.entry_oid
+            FROM walk w
+            JOIN tree_entries te ON te.repo_id = p_repo_id AND te.tree_oid = w.oid
+            WHERE w.mode = '40000'
+        )
+        SELECT w.path, l.n::integer, l.line
+        FROM walk w
+        JOIN blob_text b ON b.repo_id = p_repo_id AND b.oid = w.oid,
+             LATERAL regexp_split_to_table(
+                 CASE WHEN right(b.content, 1) = E'\n' THEN left(b.content, -1) ELSE b.content END,
+                 E'\n'
+             ) WITH ORDINALITY AS l(line, n)
+        WHERE w.mode NOT IN ('40000', '160000') AND w.oid = ANY(v_oids)
+          AND l.line ~ v_regex
+        ORDER BY w.path COLLATE "C", l.n;
+END;
+$$;
+
+-- ============================================================
+-- Functions: pack cache
+-- ============================================================
+
+CREATE FUNCTION git_pack_cache_deleted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    PERFORM lo_unlink(OLD.pack);
+    RETURN NULL;
+END;
+$$;
+
+CREATE TRIGGER pack_cache_deleted
+    AFTER DELETE ON pack_cache
+    FOR EACH ROW EXECUTE FUNCTION git_pack_cache_deleted();
+
+-- ============================================================
+-- Functions: alternates
+-- ============================================================
+
+CREATE FUNCTION git_share_objects(p_repo_id integer, p_oids bytea[])
+RETURNS SETOF bytea
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_alternates integer[] := (git_object_repos(p_repo_id))[2:];
+    v_shared bytea[];
+BEGIN
+    IF cardinality(v_alternates) = 0 THEN
+        RETURN;
+    END IF;
+
+    v_shared := ARRAY(
+        SELECT DISTINCT u.oid FROM unnest(p_oids) u(oid)
+        WHERE EXISTS (SELECT 1 FROM git_object_find(v_alternates, u.oid))
+          AND NOT EXISTS (SELECT 1 FROM objects o WHERE o.repo_id = p_repo_id AND o.oid = u.oid)
+    );
+    IF cardinality(v_shared) = 0 THEN
+        RETURN;
+    END IF;
+
+    INSERT INTO commits (repo_id, commit_oid, sha, tree_oid, parent_oids,
+                         author_name, author_email, authored_at,
+                         committer_name, committer_email, committed_at, message)
+    SELECT p_repo_id, c.commit_oid, c.sha, c.tree_oid, c.parent_oids,
+           c.author_name, c.author_email, c.authored_at,
+           c.committer_name, c.committer_email, c.committed_at, c.message
+    FROM commits c
+    WHERE c.repo_id = ANY(v_alternates) AND c.commit_oid = ANY(v_shared)
+    ON CONFLICT (repo_id, commit_oid) DO NOTHING;
+
+    -- A tree's entries are the same in every repository that has it
+    INSERT INTO tree_entries (repo_id, tree_oid, mode, name, entry_oid)
+    SELECT DISTINCT p_repo_id, t.tree_oid, t.mode, t.name, t.entry_oid
+    FROM tree_entries t
+    WHERE t.repo_id = ANY(v_alternates) AND t.tree_oid = ANY(v_shared)
+      AND NOT EXISTS (
+          SELECT 1 FROM tree_entries m WHERE m.repo_id = p_repo_id AND m.tree_oid = t.tree_oid
+      );
+
+    INSERT INTO blob_text (repo_id, oid, content)
+    SELECT p_repo_id, b.oid, b.content
+    FROM blob_text b
+    WHERE b.repo_id = ANY(v_alternates) AND b.oid = ANY(v_shared)
+    ON CONFLICT (repo_id, oid) DO NOTHING;
+
+    RETURN QUERY SELECT unnest(v_shared);
+END;
+$$;
+
+CREATE FUNCTION git_fork_repository(p_upstream integer, p_name text)
+RETURNS integer
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_id integer;
+BEGIN
+    INSERT INTO repositories (name) VALUES (p_name) RETURNING id INTO v_id;
+    INSERT INTO repository_alternates (repo_id, alternate_id) VALUES (v_id, p_upstream);
+
+    INSERT INTO refs (repo_id, name, oid, symbolic)
+    SELECT v_id, r.name, r.oid, r.symbolic FROM refs r WHERE r.repo_id = p_upstream;
+
+    -- The upstream's rows already cover what it borrows in turn
+    INSERT INTO commits (repo_id, commit_oid, sha, tree_oid, parent_oids,
+                         author_name, author_email, authored_at,
+                         committer_name, committer_email, committed_at, message)
+    SELECT v_id, c.commit_oid, c.sha, c.tree_oid, c.parent_oids,
+           c.author_name, c.author_email, c.authored_at,
+           c.committer_name, c.committer_email, c.committed_at, c.message
+    FROM commits c WHERE c.repo_id = p_upstream;
+
+    INSERT INTO tree_entries (repo_id, tree_oid, mode, name, entry_oid)
+    SELECT v_id, t.tree_oid, t.mode, t.name, t.entry_oid
+    FROM tree_entries t WHERE t.repo_id = p_upstream;
+
+    INSERT INTO blob_text (repo_id, oid, content)
+    SELECT v_id, b.oid, b.content FROM blob_text b WHERE b.repo_id = p_upstream;
+
+    RETURN v_id;
+END;
+$$;
+
+CREATE FUNCTION git_dissociate_repository(p_repo_id integer)
+RETURNS integer
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_alternates integer[] := (git_object_repos(p_repo_id))[2:];
+    v_count integer;
+BEGIN
+    -- The insert trigger adds tree_entries for the copied trees again
+    DELETE FROM tree_entries t
+    USING objects a
+    WHERE t.repo_id = p_repo_id AND a.repo_id = ANY(v_alternates)
+      AND a.type = 2 AND a.oid = t.tree_oid
+      AND NOT EXISTS (SELECT 1 FROM objects o WHERE o.repo_id = p_repo_id AND o.oid = t.tree_oid);
+
+    -- Chunks come from the repository the object row was taken from,
+    -- as another may have split the blob differently
+    WITH src AS (
+        SELECT DISTINCT ON (a.oid) a.*
+        FROM objects a
+        WHERE a.repo_id = ANY(v_alternates)
+          AND NOT EXISTS (SELECT 1 FROM objects o WHERE o.repo_id = p_repo_id AND o.oid = a.oid)
+        ORDER BY a.oid, array_position(v_alternates, a.repo_id)
+    ),
+    copied AS (
+        INSERT INTO objects (repo_id, oid, type, size, content, base_oid, depth, chunked)
+        SELECT p_repo_id, s.oid, s.type, s.size, s.content, s.base_oid, s.depth, s.chunked
+        FROM src s
+        RETURNING 1
+    ),
+    chunks AS (
+        INSERT INTO object_chunks (repo_id, oid, chunk_no, data)
+        SELECT p_repo_id, k.oid, k.chunk_no, k.data
+        FROM src s
+        JOIN object_chunks k ON k.repo_id = s.repo_id AND k.oid = s.oid
+        WHERE s.chunked
+    )
+    SELECT count(*) INTO v_count FROM copied;
+
+    DELETE FROM repository_alternates WHERE repo_id = p_repo_id;
+    RETURN v_count;
+END;
+$$;
+
+-- ============================================================
+-- Functions: verify
+-- ============================================================
+
+CREATE FUNCTION git_object_check(p_oid bytea, p_type smallint, p_size integer, p_content bytea)
+RETURNS text
+LANGUAGE sql IMMUTABLE PARALLEL SAFE AS $$
+    SELECT git_object_check_c(p_oid, p_type, p_size, p_content);
+$$;
+
+CREATE FUNCTION git_verify_objects(p_repo_id integer DEFAULT NULL)
+RETURNS TABLE(repo_id integer, oid bytea, type smallint, problem text)
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_obj record;
+    v_content bytea;
+BEGIN
+    RETURN QUERY
+    SELECT o.repo_id, o.oid::bytea, o.type, git_object_check(o.oid, o.type, o.size, o.content)
+    FROM objects o
+    WHERE (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+      AND NOT o.chunked AND o.base_oid IS NULL
+      AND git_object_check(o.oid, o.type, o.size, o.content) IS NOT NULL;
+
+    FOR v_obj IN
+        SELECT o.repo_id, o.oid, o.type, o.size
+        FROM objects o
+        WHERE (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+          AND (o.chunked OR o.base_oid IS NOT NULL)
+    LOOP
+        BEGIN
+            v_content := (SELECT r.content FROM git_object_read(v_obj.repo_id, v_obj.oid) r);
+            problem := git_object_check(v_obj.oid, v_obj.type, v_obj.size, v_content);
+        EXCEPTION WHEN others THEN
+            problem := SQLERRM;
+        END;
+        IF problem IS NOT NULL THEN
+            repo_id := v_obj.repo_id;
+            oid := v_obj.oid;
+            type := v_obj.type;
+            RETURN NEXT;
+        END IF;
+    END LOOP;
+END;
+$$;
+
 -- ============================================================
 -- Views
 -- ============================================================
@@ -452,14 +2163,14 @@ SELECT o.repo_id, o.oid AS commit_oid, encode(o.oid, 'hex') AS sha,
        c.committer_name, c.committer_email,
        to_timestamp(c.committer_timestamp) AS committed_at,
        c.message
-FROM objects o, LATERAL git_commit_parse(o.content) c
+FROM objects o, LATERAL git_commit_parse_c(o.content) c
 WHERE o.type = 1;
 
 CREATE UNIQUE INDEX idx_commits_view_oid ON commits_view (repo_id, commit_oid);
 
 CREATE MATERIALIZED VIEW tree_entries_view AS
 SELECT o.repo_id, o.oid AS tree_oid, e.mode, e.name, e.entry_oid
-FROM objects o, LATERAL git_tree_entries(o.content) e
+FROM objects o, LATERAL git_tree_entries_c(o.content) e
 WHERE o.type = 2;
 
 CREATE INDEX idx_tree_entries_view_oid ON tree_entries_view (repo_id, tree_oid);
@@ -0,0 +1,772 @@
+#include "postgres.h"
+#include "funcapi.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "catalog/pg_type.h"
+#include "common/hashfn.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "utils/builtins.h"
+#include "utils/tuplestore.h"
+
+#include <string.h>
+
+PG_FUNCTION_INFO_V1(git_diff_trees_c);
+
+#define GIT_OID_RAWSZ 20
+
+/* Similarity renames are skipped when adds * deletes exceeds this squared */
+#define DIFF_RENAME_LIMIT 1000
+
+/* One entry of a parsed tree, pointing into the tree's content */
+typedef struct {
+    const char *mode;
+    int         mode_len;
+    const char *name;
+    int         name_len;
+    const char *oid;
+    bool        is_tree;
+} DiffEntry;
+
+/* A changed path.  status is 0 once a delete has been paired as a rename. */
+typedef struct {
+    char        status;
+    char       *path;
+    char       *old_path;
+    char       *old_mode;
+    char       *new_mode;
+    char        old_oid[GIT_OID_RAWSZ];
+    char        new_oid[GIT_OID_RAWSZ];
+    int         similarity;
+} DiffChange;
+
+typedef struct {
+    int         repo_id;
+    MemoryContext ctx;          /* where changes and the path buffer live */
+    SPIPlanPtr  tree_plan;
+    DiffChange *changes;
+    int         n;
+    int         cap;
+    StringInfoData path;
+} DiffState;
+
+/* Line hashes of one rename candidate, sorted by (hash, len) */
+typedef struct {
+    uint64      hash;
+    int32       len;
+    int32       count;
+} LineHash;
+
+typedef struct {
+    int         change;
+    int64       size;
+    LineHash   *lines;
+    int         nlines;
+} BlobSig;
+
+typedef struct {
+    int         score;
+    int         add;
+    int         del;
+} RenameCandidate;
+
+static bool
+mode_is(const char *mode, const char *want)
+{
+    return mode != NULL && strcmp(mode, want) == 0;
+}
+
+/*
+ * Regular files and symlinks can pair up as renames, but only with their
+ * own kind.  Gitlinks never do.
+ */
+static bool
+rename_kinds_match(const char *a, const char *b)
+{
+    if (mode_is(a, "160000") || mode_is(b, "160000"))
+        return false;
+    return mode_is(a, "120000") == mode_is(b, "120000");
+}
+
+/* Tree content, or NULL when the tree is not stored (read as empty) */
+static bytea *
+load_tree(DiffState *st, const char *oid)
+{
+    Datum       args[2];
+    bytea      *b;
+    bytea      *content = NULL;
+    bool        isnull;
+
+    b = (bytea *) palloc(VARHDRSZ + GIT_OID_RAWSZ);
+    SET_VARSIZE(b, VARHDRSZ + GIT_OID_RAWSZ);
+    memcpy(VARDATA(b), oid, GIT_OID_RAWSZ);
+    args[0] = Int32GetDatum(st->repo_id);
+    args[1] = PointerGetDatum(b);
+
+    if (SPI_execute_plan(st->tree_plan, args, NULL, true, 1) != SPI_OK_SELECT)
+        elog(ERROR, "git_diff_trees: fetching tree failed");
+
+    if (SPI_processed > 0)
+    {
+        Datum       d = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+        if (!isnull)
+            content = DatumGetByteaPCopy(d);
+    }
+
+    SPI_freetuptable(SPI_tuptable);
+    pfree(b);
+    return content;
+}
+
+static DiffEntry *
+parse_entries(DiffState *st, bytea *content, int *n_out)
+{
+    const char *data;
+    int         len;
+    int         pos = 0;
+    int         n = 0;
+    int         cap = 16;
+    DiffEntry  *entries = palloc(sizeof(DiffEntry) * cap);
+
+    *n_out = 0;
+    if (content == NULL)
+        return entries;
+
+    data = VARDATA_ANY(content);
+    len = VARSIZE_ANY_EXHDR(content);
+
+    while (pos < len)
+    {
+        const char *space = memchr(data + pos, ' ', len - pos);
+        const char *nul;
+        DiffEntry  *e;
+
+        if (space == NULL ||
+            (nul = memchr(space + 1, '\0', data + len - (space + 1))) == NULL ||
+            data + len - (nul + 1) < GIT_OID_RAWSZ)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("malformed tree entry under \"%s\"", st->path.data)));
+
+        if (n == cap)
+        {
+            cap *= 2;
+            entries = repalloc(entries, sizeof(DiffEntry) * cap);
+        }
+
+        e = &entries[n++];
+        e->mode = data + pos;
+        e->mode_len = space - (data + pos);
+        e->name = space + 1;
+        e->name_len = nul - (space + 1);
+        e->oid = nul + 1;
+        e->is_tree = e->mode_len == 5 && memcmp(e->mode, "40000", 5) == 0;
+
+        pos = (nul + 1 + GIT_OID_RAWSZ) - data;
+    }
+
+    *n_out = n;
+    return entries;
+}
+
+/*
+ * git's tree order: names compare bytewise with trees treated as if
+ * they ended in '/'.  A blob and a tree of the same name never compare
+ * equal, so they show up as a delete and an add.
+ */
+static int
+entry_compare(const DiffEntry *a, const DiffEntry *b)
+{
+    int         len = Min(a->name_len, b->name_len);
+    int         cmp = memcmp(a->name, b->name, len);
+    unsigned char c1;
+    unsigned char c2;
+
+    if (cmp != 0)
+        return cmp;
+
+    c1 = a->name_len > len ? (unsigned char) a->name[len] : (a->is_tree ? '/' : '\0');
+    c2 = b->name_len > len ? (unsigned char) b->name[len] : (b->is_tree ? '/' : '\0');
+    return (c1 > c2) - (c1 < c2);
+}
+
+static void
+record_change(DiffState *st, const DiffEntry *old, const DiffEntry *new)
+{
+    MemoryContext oldcxt = MemoryContextSwitchTo(st->ctx);
+    DiffChange *c;
+
+    if (st->n == st->cap)
+    {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->changes = st->changes
+            ? repalloc(st->changes, sizeof(DiffChange) * st->cap)
+            : palloc(sizeof(DiffChange) * st->cap);
+    }
+
+    c = &st->changes[st->n++];
+    memset(c, 0, sizeof(*c));
+    c->path = pnstrdup(st->path.data, st->path.len);
+    if (old)
+    {
+        c->old_mode = pnstrdup(old->mode, old->mode_len);
+        memcpy(c->old_oid, old->oid, GIT_OID_RAWSZ);
+    }
+    if (new)
+    {
+        c->new_mode = pnstrdup(new->mode, new->mode_len);
+        memcpy(c->new_oid, new->oid, GIT_OID_RAWSZ);
+    }
+
+    if (!old)
+        c->status = 'A';
+    else if (!new)
+        c->status = 'D';
+    else if (strcmp(c->old_mode, c->new_mode) != 0 &&
+             (mode_is(c->old_mode, "120000") || mode_is(c->old_mode, "160000") ||
+              mode_is(c->new_mode, "120000") || mode_is(c->new_mode, "160000")))
+        c->status = 'T';
+    else
+        c->status = 'M';
+
+    MemoryContextSwitchTo(oldcxt);
+}
+
+static void diff_trees(DiffState *st, const char *old_oid, const char *new_oid);
+
+/* Record a changed leaf, or descend into a changed, added or deleted tree */
+static void
+diff_entry(DiffState *st, const DiffEntry *old, const DiffEntry *new)
+{
+    const DiffEntry *e = old ? old : new;
+    int         base = st->path.len;
+
+    appendBinaryStringInfo(&st->path, e->name, e->name_len);
+
+    if (e->is_tree)
+    {
+        appendStringInfoChar(&st->path, '/');
+        diff_trees(st, old ? old->oid : NULL, new ? new->oid : NULL);
+    }
+    else
+        record_change(st, old, new);
+
+    st->path.len = base;
+    st->path.data[base] = '\0';
+}
+
+/*
+ * Merge the sorted entry lists of two trees.  Entries with the same name,
+ * mode and oid are skipped, so an unchanged subtree is never read.
+ */
+static void
+diff_trees(DiffState *st, const char *old_oid, const char *new_oid)
+{
+    bytea      *old_tree;
+    bytea      *new_tree;
+    DiffEntry  *old_e;
+    DiffEntry  *new_e;
+    int         n_old;
+    int         n_new;
+    int         i = 0;
+    int         j = 0;
+
+    check_stack_depth();
+    CHECK_FOR_INTERRUPTS();
+
+    old_tree = old_oid ? load_tree(st, old_oid) : NULL;
+    new_tree = new_oid ? load_tree(st, new_oid) : NULL;
+    old_e = parse_entries(st, old_tree, &n_old);
+    new_e = parse_entries(st, new_tree, &n_new);
+
+    while (i < n_old || j < n_new)
+    {
+        int         cmp;
+
+        if (i >= n_old)
+            cmp = 1;
+        else if (j >= n_new)
+            cmp = -1;
+        else
+            cmp = entry_compare(&old_e[i], &new_e[j]);
+
+        if (cmp < 0)
+            diff_entry(st, &old_e[i++], NULL);
+        else if (cmp > 0)
+            diff_entry(st, NULL, &new_e[j++]);
+        else
+        {
+            if (memcmp(old_e[i].oid, new_e[j].oid, GIT_OID_RAWSZ) != 0 ||
+                old_e[i].mode_len != new_e[j].mode_len ||
+                memcmp(old_e[i].mode, new_e[j].mode, old_e[i].mode_len) != 0)
+                diff_entry(st, &old_e[i], &new_e[j]);
+            i++;
+            j++;
+        }
+    }
+
+    pfree(old_e);
+    pfree(new_e);
+    if (old_tree)
+        pfree(old_tree);
+    if (new_tree)
+        pfree(new_tree);
+}
+
+static void
+pair_rename(DiffState *st, int add, int del, int score)
+{
+    DiffChange *a = &st->changes[add];
+    DiffChange *d = &st->changes[del];
+
+    a->status = 'R';
+    a->old_path = d->path;
+    a->old_mode = d->old_mode;
+    memcpy(a->old_oid, d->old_oid, GIT_OID_RAWSZ);
+    a->similarity = score;
+    d->status = 0;
+}
+
+static int
+del_oid_cmp(const void *a, const void *b, void *arg)
+{
+    DiffState  *st = (DiffState *) arg;
+    int         x = *(const int *) a;
+    int         y = *(const int *) b;
+    int         cmp = memcmp(st->changes[x].old_oid, st->changes[y].old_oid, GIT_OID_RAWSZ);
+
+    if (cmp != 0)
+        return cmp;
+    return (x > y) - (x < y);
+}
+
+/* Pair each add with the first unpaired delete of the same blob */
+static void
+find_exact_renames(DiffState *st, int *adds, int n_adds, int *dels, int n_dels)
+{
+    int         i;
+
+    qsort_arg(dels, n_dels, sizeof(int), del_oid_cmp, st);
+
+    for (i = 0; i < n_adds; i++)
+    {
+        DiffChange *a = &st->changes[adds[i]];
+        int         lo = 0;
+        int         hi = n_dels;
+        int         k;
+
+        while (lo < hi)
+        {
+            int         mid = lo + (hi - lo) / 2;
+
+            if (memcmp(st->changes[dels[mid]].old_oid, a->new_oid, GIT_OID_RAWSZ) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for (k = lo; k < n_dels; k++)
+        {
+            DiffChange *d = &st->changes[dels[k]];
+
+            if (memcmp(d->old_oid, a->new_oid, GIT_OID_RAWSZ) != 0)
+                break;
+            if (d->status == 'D' && rename_kinds_match(d->old_mode, a->new_mode))
+            {
+                pair_rename(st, adds[i], dels[k], 100);
+                break;
+            }
+        }
+    }
+}
+
+static int
+line_hash_cmp(const void *a, const void *b)
+{
+    const LineHash *x = (const LineHash *) a;
+    const LineHash *y = (const LineHash *) b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/*
+ * Hash a blob's lines, each including its newline, into a sorted
+ * multiset.  Returns false when the blob is not stored.
+ */
+static bool
+blob_signature(DiffState *st, SPIPlanPtr plan, const char *oid, int change, BlobSig *sig)
+{
+    Datum       args[2];
+    bytea      *b;
+    bool        isnull;
+    Datum       d;
+    bytea      *content;
+    const char *data;
+    const char *p;
+    int         len;
+    int         pos = 0;
+    int         n = 0;
+    int         i;
+
+    b = (bytea *) palloc(VARHDRSZ + GIT_OID_RAWSZ);
+    SET_VARSIZE(b, VARHDRSZ + GIT_OID_RAWSZ);
+    memcpy(VARDATA(b), oid, GIT_OID_RAWSZ);
+    args[0] = Int32GetDatum(st->repo_id);
+    args[1] = PointerGetDatum(b);
+
+    if (SPI_execute_plan(plan, args, NULL, true, 1) != SPI_OK_SELECT)
+        elog(ERROR, "git_diff_trees: reading blob failed");
+
+    if (SPI_processed == 0)
+    {
+        SPI_freetuptable(SPI_tuptable);
+        pfree(b);
+        return false;
+    }
+
+    d = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+    content = DatumGetByteaPP(d);
+    data = VARDATA_ANY(content);
+    len = VARSIZE_ANY_EXHDR(content);
+
+    for (p = data; (p = memchr(p, '\n', data + len - p)) != NULL; p++)
+        n++;
+
+    sig->change = change;
+    sig->size = len;
+    sig->lines = palloc(sizeof(LineHash) * (n + 1));
+
+    n = 0;
+    while (pos < len)
+    {
+        const char *nl = memchr(data + pos, '\n', len - pos);
+        int         end = nl ? (nl + 1) - data : len;
+
+        sig->lines[n].hash = hash_bytes_extended((const unsigned char *) data + pos,
+                                                 end - pos, 0);
+        sig->lines[n].len = end - pos;
+        sig->lines[n].count = 1;
+        n++;
+        pos = end;
+    }
+
+    qsort(sig->lines, n, sizeof(LineHash), line_hash_cmp);
+
+    /* Fold repeated lines into counts */
+    sig->nlines = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (sig->nlines > 0 && line_hash_cmp(&sig->lines[sig->nlines - 1], &sig->lines[i]) == 0)
+            sig->lines[sig->nlines - 1].count++;
+        else
+            sig->lines[sig->nlines++] = sig->lines[i];
+    }
+
+    if ((Pointer) content != DatumGetPointer(d))
+        pfree(content);
+    SPI_freetuptable(SPI_tuptable);
+    pfree(b);
+    return true;
+}
+
+/* Bytes of src's lines also found in dst, as a percentage of the larger */
+static int
+blob_similarity(const BlobSig *src, const BlobSig *dst)
+{
+    int64       copied = 0;
+    int         i = 0;
+    int         j = 0;
+
+    if (src->size == 0 || dst->size == 0)
+        return 0;
+
+    while (i < src->nlines && j < dst->nlines)
+    {
+        int         cmp = line_hash_cmp(&src->lines[i], &dst->lines[j]);
+
+        if (cmp < 0)
+            i++;
+        else if (cmp > 0)
+            j++;
+        else
+        {
+            copied += (int64) Min(src->lines[i].count, dst->lines[j].count) * src->lines[i].len;
+            i++;
+            j++;
+        }
+    }
+
+    return (int) (copied * 100 / Max(src->size, dst->size));
+}
+
+static int
+candidate_cmp(const void *a, const void *b)
+{
+    const RenameCandidate *x = (const RenameCandidate *) a;
+    const RenameCandidate *y = (const RenameCandidate *) b;
+
+    if (x->score != y->score)
+        return x->score > y->score ? -1 : 1;
+    if (x->add != y->add)
+        return x->add < y->add ? -1 : 1;
+    return (x->del > y->del) - (x->del < y->del);
+}
+
+/*
+ * Score every remaining add against every remaining delete of the same
+ * kind and pair them greedily, best score first.
+ */
+static void
+find_similar_renames(DiffState *st, int *adds, int n_adds, int *dels, int n_dels,
+                     int threshold)
+{
+    Oid         argtypes[2] = { INT4OID, BYTEAOID };
+    SPIPlanPtr  plan;
+    BlobSig    *add_sigs;
+    BlobSig    *del_sigs;
+    int         na = 0;
+    int         nd = 0;
+    int         i;
+    int         j;
+    RenameCandidate *cands;
+    int         ncands = 0;
+
+    plan = SPI_prepare("SELECT content FROM git_object_read($1, $2)", 2, argtypes);
+    if (plan == NULL)
+        elog(ERROR, "git_diff_trees: SPI_prepare failed: %s",
+             SPI_result_code_string(SPI_result));
+
+    add_sigs = palloc(sizeof(BlobSig) * n_adds);
+    del_sigs = palloc(sizeof(BlobSig) * n_dels);
+    for (i = 0; i < n_adds; i++)
+        if (blob_signature(st, plan, st->changes[adds[i]].new_oid, adds[i], &add_sigs[na]))
+            na++;
+    for (i = 0; i < n_dels; i++)
+        if (blob_signature(st, plan, st->changes[dels[i]].old_oid, dels[i], &del_sigs[nd]))
+            nd++;
+
+    cands = palloc(sizeof(RenameCandidate) * Max((int64) na * nd, 1));
+
+    for (i = 0; i < na; i++)
+    {
+        DiffChange *a = &st->changes[add_sigs[i].change];
+
+        CHECK_FOR_INTERRUPTS();
+
+        for (j = 0; j < nd; j++)
+        {
+            DiffChange *d = &st->changes[del_sigs[j].change];
+            int64       lo = Min(add_sigs[i].size, del_sigs[j].size);
+            int64       hi = Max(Max(add_sigs[i].size, del_sigs[j].size), 1);
+            int         score;
+
+            if (!rename_kinds_match(d->old_mode, a->new_mode))
+                continue;
+            /* The score can't beat the ratio of the sizes */
+            if (lo * 100 / hi < threshold)
+                continue;
+
+            score = blob_similarity(&del_sigs[j], &add_sigs[i]);
+            if (score < threshold)
+                continue;
+
+            cands[ncands].score = score;
+            cands[ncands].add = add_sigs[i].change;
+            cands[ncands].del = del_sigs[j].change;
+            ncands++;
+        }
+    }
+
+    qsort(cands, ncands, sizeof(RenameCandidate), candidate_cmp);
+
+    for (i = 0; i < ncands; i++)
+    {
+        if (st->changes[cands[i].add].status != 'A' ||
+            st->changes[cands[i].del].status != 'D')
+            continue;
+        pair_rename(st, cands[i].add, cands[i].del, cands[i].score);
+    }
+
+    SPI_freeplan(plan);
+}
+
+static void
+detect_renames(DiffState *st, int threshold)
+{
+    int        *adds = palloc(sizeof(int) * Max(st->n, 1));
+    int        *dels = palloc(sizeof(int) * Max(st->n, 1));
+    int         n_adds = 0;
+    int         n_dels = 0;
+    int         i;
+
+    for (i = 0; i < st->n; i++)
+    {
+        if (st->changes[i].status == 'A' && !mode_is(st->changes[i].new_mode, "160000"))
+            adds[n_adds++] = i;
+        else if (st->changes[i].status == 'D' && !mode_is(st->changes[i].old_mode, "160000"))
+            dels[n_dels++] = i;
+    }
+
+    if (n_adds > 0 && n_dels > 0)
+        find_exact_renames(st, adds, n_adds, dels, n_dels);
+
+    /* What is left after exact matching, back in path order */
+    n_adds = n_dels = 0;
+    for (i = 0; i < st->n; i++)
+    {
+        if (st->changes[i].status == 'A' && !mode_is(st->changes[i].new_mode, "160000"))
+            adds[n_adds++] = i;
+        else if (st->changes[i].status == 'D' && !mode_is(st->changes[i].old_mode, "160000"))
+            dels[n_dels++] = i;
+    }
+
+    if (n_adds > 0 && n_dels > 0 &&
+        (int64) n_adds * n_dels <= (int64) DIFF_RENAME_LIMIT * DIFF_RENAME_LIMIT)
+        find_similar_renames(st, adds, n_adds, dels, n_dels, threshold);
+
+    pfree(adds);
+    pfree(dels);
+}
+
+static const char *
+tree_oid_arg(FunctionCallInfo fcinfo, int argno)
+{
+    bytea      *oid;
+
+    if (PG_ARGISNULL(argno))
+        return NULL;
+
+    oid = PG_GETARG_BYTEA_PP(argno);
+    if (VARSIZE_ANY_EXHDR(oid) != GIT_OID_RAWSZ)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("tree oid must be %d bytes", GIT_OID_RAWSZ)));
+    return VARDATA_ANY(oid);
+}
+
+/*
+ * git_diff_trees_c(repo_id integer, old_tree bytea, new_tree bytea,
+ *                  rename_threshold integer DEFAULT NULL)
+ *   RETURNS TABLE(status text, path text, old_mode text, new_mode text,
+ *                 old_oid bytea, new_oid bytea, old_path text,
+ *                 similarity integer)
+ *
+ * The changed files between two trees, like git diff-tree -r.  status is
+ * A, D, M, T (the kind of file changed) or R.  Subtrees with the same oid
+ * on both sides are skipped without being read, so the cost follows the
+ * size of the change.  A NULL or unstored tree reads as empty.
+ *
+ * With a rename_threshold (0-100), deletes and adds of the same blob are
+ * paired as renames with similarity 100, then the remaining ones are
+ * scored by the share of bytes in lines they have in common and paired
+ * best first when the score reaches the threshold.
+ */
+Datum
+git_diff_trees_c(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo;
+    DiffState   st;
+    const char *old_oid;
+    const char *new_oid;
+    int         threshold = -1;
+    Oid         argtypes[2] = { INT4OID, BYTEAOID };
+    int         i;
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+    rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    if (!PG_ARGISNULL(3))
+    {
+        threshold = PG_GETARG_INT32(3);
+        if (threshold < 0 || threshold > 100)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("rename threshold must be between 0 and 100")));
+    }
+
+    /* Not strict, so that either tree may be NULL */
+    if (PG_ARGISNULL(0))
+        return (Datum) 0;
+
+    old_oid = tree_oid_arg(fcinfo, 1);
+    new_oid = tree_oid_arg(fcinfo, 2);
+    if (old_oid && new_oid && memcmp(old_oid, new_oid, GIT_OID_RAWSZ) == 0)
+        return (Datum) 0;
+
+    st.repo_id = PG_GETARG_INT32(0);
+    st.ctx = CurrentMemoryContext;
+    st.changes = NULL;
+    st.n = 0;
+    st.cap = 0;
+    initStringInfo(&st.path);
+
+    SPI_connect();
+    st.tree_plan = SPI_prepare("SELECT content FROM git_object_find(git_object_repos($1), $2) "
+                               "WHERE type = 2",
+                               2, argtypes);
+    if (st.tree_plan == NULL)
+        elog(ERROR, "git_diff_trees: SPI_prepare failed: %s",
+             SPI_result_code_string(SPI_result));
+
+    diff_trees(&st, old_oid, new_oid);
+    if (threshold >= 0)
+        detect_renames(&st, threshold);
+
+    SPI_finish();
+
+    for (i = 0; i < st.n; i++)
+    {
+        DiffChange *c = &st.changes[i];
+        Datum       values[8];
+        bool        nulls[8];
+        char        status[2] = { c->status, '\0' };
+        bool        has_old = c->status != 'A';
+        bool        has_new = c->status != 'D';
+
+        if (c->status == 0)
+            continue;
+
+        memset(nulls, false, sizeof(nulls));
+        values[0] = CStringGetTextDatum(status);
+        values[1] = CStringGetTextDatum(c->path);
+
+        if (has_old)
+        {
+            bytea      *oid = (bytea *) palloc(VARHDRSZ + GIT_OID_RAWSZ);
+
+            SET_VARSIZE(oid, VARHDRSZ + GIT_OID_RAWSZ);
+            memcpy(VARDATA(oid), c->old_oid, GIT_OID_RAWSZ);
+            values[2] = CStringGetTextDatum(c->old_mode);
+            values[4] = PointerGetDatum(oid);
+        }
+        else
+            nulls[2] = nulls[4] = true;
+
+        if (has_new)
+        {
+            bytea      *oid = (bytea *) palloc(VARHDRSZ + GIT_OID_RAWSZ);
+
+            SET_VARSIZE(oid, VARHDRSZ + GIT_OID_RAWSZ);
+            memcpy(VARDATA(oid), c->new_oid, GIT_OID_RAWSZ);
+            values[3] = CStringGetTextDatum(c->new_mode);
+            values[5] = PointerGetDatum(oid);
+        }
+        else
+            nulls[3] = nulls[5] = true;
+
+        if (c->status == 'R')
+        {
+            values[6] = CStringGetTextDatum(c->old_path);
+            values[7] = Int32GetDatum(c->similarity);
+        }
+        else
+            nulls[6] = nulls[7] = true;
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
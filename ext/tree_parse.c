@@ -2,129 +2,123 @@
 #include "funcapi.h"
 #include "fmgr.h"
 #include "utils/builtins.h"
+#include "utils/tuplestore.h"
 
 #include <string.h>
 
 PG_FUNCTION_INFO_V1(git_tree_entries_c);
+PG_FUNCTION_INFO_V1(git_tree_entries_oid_c);
 
-typedef struct {
-    char *data;
-    int   len;
-    int   pos;
-} TreeParseState;
+#define GIT_OID_RAWSZ 20
 
 /*
- * git_tree_entries_c(content bytea)
- *   RETURNS TABLE(mode text, name text, entry_oid bytea)
- *
- * Parses git tree object binary format. Each entry is:
+ * Parse git tree object binary format straight out of the detoasted
+ * datum into the function's tuplestore.  Each entry is:
  *   <mode_ascii_digits> <name>\0<20_byte_sha1>
+ *
+ * Delimiters are found with memchr.  mode, name and (for bytea output)
+ * the oid are assembled in scratch varlenas that are reused for every
+ * entry, since tuplestore_putvalues copies them into the stored tuple.
+ * A git_oid is fixed-length and pass-by-reference, so it is passed as a
+ * pointer into the content itself.
  */
-Datum
-git_tree_entries_c(PG_FUNCTION_ARGS)
+static void
+tree_entries_materialize(FunctionCallInfo fcinfo, bool oid_as_git_oid)
 {
-    FuncCallContext *funcctx;
-    TreeParseState  *state;
-
-    if (SRF_IS_FIRSTCALL())
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    bytea      *content = PG_GETARG_BYTEA_PP(0);
+    const char *data = VARDATA_ANY(content);
+    int         len = VARSIZE_ANY_EXHDR(content);
+    int         pos = 0;
+    text       *mode;
+    text       *name;
+    bytea      *oid = NULL;
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    /* No field can be longer than the whole tree */
+    mode = (text *) palloc(VARHDRSZ + len);
+    name = (text *) palloc(VARHDRSZ + len);
+    if (!oid_as_git_oid)
     {
-        MemoryContext  oldcontext;
-        bytea         *content;
-        TupleDesc      tupdesc;
-
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-
-        content = PG_GETARG_BYTEA_PP(0);
-
-        state = (TreeParseState *) palloc(sizeof(TreeParseState));
-        state->len = VARSIZE_ANY_EXHDR(content);
-        state->data = (char *) palloc(state->len);
-        memcpy(state->data, VARDATA_ANY(content), state->len);
-        state->pos = 0;
-
-        funcctx->user_fctx = state;
-
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-            ereport(ERROR,
-                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                     errmsg("return type must be a row type")));
-
-        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
-
-        MemoryContextSwitchTo(oldcontext);
+        oid = (bytea *) palloc(VARHDRSZ + GIT_OID_RAWSZ);
+        SET_VARSIZE(oid, VARHDRSZ + GIT_OID_RAWSZ);
     }
 
-    funcctx = SRF_PERCALL_SETUP();
-    state = (TreeParseState *) funcctx->user_fctx;
-
-    if (state->pos < state->len)
+    while (pos < len)
     {
-        int        space_pos;
-        int        null_pos;
-        int        mode_len;
-        int        name_len;
-        char      *mode;
-        char      *name;
-        bytea     *oid;
-        Datum      values[3];
-        bool       nulls[3] = { false, false, false };
-        HeapTuple  tuple;
+        const char *space;
+        const char *nul;
+        int         mode_len;
+        int         name_len;
+        Datum       values[3];
+        bool        nulls[3] = { false, false, false };
 
         /* Find the space between mode and name */
-        space_pos = state->pos;
-        while (space_pos < state->len && state->data[space_pos] != ' ')
-            space_pos++;
-
-        if (space_pos >= state->len)
+        space = memchr(data + pos, ' ', len - pos);
+        if (space == NULL)
             ereport(ERROR,
                     (errcode(ERRCODE_DATA_CORRUPTED),
                      errmsg("malformed tree entry: no space found")));
 
         /* Find the null terminator after the name */
-        null_pos = space_pos + 1;
-        while (null_pos < state->len && state->data[null_pos] != '\0')
-            null_pos++;
-
-        if (null_pos >= state->len)
+        nul = memchr(space + 1, '\0', data + len - (space + 1));
+        if (nul == NULL)
             ereport(ERROR,
                     (errcode(ERRCODE_DATA_CORRUPTED),
                      errmsg("malformed tree entry: no null terminator found")));
 
-        /* Need at least 20 bytes after the null for the OID */
-        if (null_pos + 20 >= state->len && null_pos + 21 > state->len)
+        /* Need 20 bytes after the null for the OID */
+        if (data + len - (nul + 1) < GIT_OID_RAWSZ)
             ereport(ERROR,
                     (errcode(ERRCODE_DATA_CORRUPTED),
                      errmsg("malformed tree entry: truncated OID")));
 
-        /* Extract mode string */
-        mode_len = space_pos - state->pos;
-        mode = (char *) palloc(mode_len + 1);
-        memcpy(mode, state->data + state->pos, mode_len);
-        mode[mode_len] = '\0';
+        mode_len = space - (data + pos);
+        SET_VARSIZE(mode, VARHDRSZ + mode_len);
+        memcpy(VARDATA(mode), data + pos, mode_len);
 
-        /* Extract name string */
-        name_len = null_pos - space_pos - 1;
-        name = (char *) palloc(name_len + 1);
-        memcpy(name, state->data + space_pos + 1, name_len);
-        name[name_len] = '\0';
+        name_len = nul - (space + 1);
+        SET_VARSIZE(name, VARHDRSZ + name_len);
+        memcpy(VARDATA(name), space + 1, name_len);
 
-        /* Extract 20-byte OID as bytea */
-        oid = (bytea *) palloc(VARHDRSZ + 20);
-        SET_VARSIZE(oid, VARHDRSZ + 20);
-        memcpy(VARDATA(oid), state->data + null_pos + 1, 20);
+        values[0] = PointerGetDatum(mode);
+        values[1] = PointerGetDatum(name);
+        if (oid_as_git_oid)
+            values[2] = PointerGetDatum(nul + 1);
+        else
+        {
+            memcpy(VARDATA(oid), nul + 1, GIT_OID_RAWSZ);
+            values[2] = PointerGetDatum(oid);
+        }
 
-        /* Advance past this entry */
-        state->pos = null_pos + 21;
-
-        /* Build the result tuple */
-        values[0] = CStringGetTextDatum(mode);
-        values[1] = CStringGetTextDatum(name);
-        values[2] = PointerGetDatum(oid);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
 
-        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+        /* Advance past this entry */
+        pos = (nul + 1 + GIT_OID_RAWSZ) - data;
     }
+}
+
+/*
+ * git_tree_entries_c(content bytea)
+ *   RETURNS TABLE(mode text, name text, entry_oid bytea)
+ */
+Datum
+git_tree_entries_c(PG_FUNCTION_ARGS)
+{
+    tree_entries_materialize(fcinfo, false);
+    return (Datum) 0;
+}
 
-    SRF_RETURN_DONE(funcctx);
+/*
+ * git_tree_entries_oid_c(content bytea)
+ *   RETURNS TABLE(mode text, name text, entry_oid git_oid)
+ *
+ * As git_tree_entries_c, with entry_oid as the fixed-length git_oid type.
+ */
+Datum
+git_tree_entries_oid_c(PG_FUNCTION_ARGS)
+{
+    tree_entries_materialize(fcinfo, true);
+    return (Datum) 0;
 }
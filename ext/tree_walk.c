@@ -0,0 +1,344 @@
+#include "postgres.h"
+#include "funcapi.h"
+#include "fmgr.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/tuplestore.h"
+
+#include <string.h>
+
+PG_FUNCTION_INFO_V1(git_tree_walk_c);
+
+#define GIT_OID_RAWSZ 20
+
+/* Subtrees fetched per SPI query */
+#define WALK_FETCH_BATCH 256
+
+/* A tree waiting on the walk stack */
+typedef struct {
+    char        oid[GIT_OID_RAWSZ];
+    char       *path;           /* prefix for its entries, "" or ending in '/' */
+    int         path_len;
+    int         depth;          /* depth of its entries; the root's are 0 */
+    bytea      *content;        /* NULL until fetched */
+    bool        fetched;
+} WalkTree;
+
+typedef struct {
+    WalkTree   *items;
+    int         n;
+    int         cap;
+} WalkStack;
+
+typedef struct {
+    int         repo_id;
+    const char *prefix;         /* pathspec without trailing '/', may be empty */
+    int         prefix_len;
+    int         max_depth;      /* -1 for unlimited */
+    MemoryContext ctx;          /* where stack items and contents live */
+    SPIPlanPtr  plan;
+    ReturnSetInfo *rsinfo;
+} WalkState;
+
+static void
+stack_push(WalkState *st, WalkStack *stack, const char *oid,
+           const char *path, int path_len, int depth)
+{
+    WalkTree   *t;
+
+    if (stack->n == stack->cap)
+    {
+        stack->cap = stack->cap ? stack->cap * 2 : 64;
+        stack->items = stack->items
+            ? repalloc(stack->items, sizeof(WalkTree) * stack->cap)
+            : MemoryContextAlloc(st->ctx, sizeof(WalkTree) * stack->cap);
+    }
+
+    t = &stack->items[stack->n++];
+    memcpy(t->oid, oid, GIT_OID_RAWSZ);
+    t->path = MemoryContextAlloc(st->ctx, path_len + 1);
+    memcpy(t->path, path, path_len);
+    t->path[path_len] = '\0';
+    t->path_len = path_len;
+    t->depth = depth;
+    t->content = NULL;
+    t->fetched = false;
+}
+
+/*
+ * Load the contents of the unfetched trees nearest the top of the stack
+ * with one query.  After a tree is expanded its subtrees sit together on
+ * top, so a batch is usually a set of siblings.
+ */
+static void
+fetch_batch(WalkState *st, WalkStack *stack)
+{
+    Datum       elems[WALK_FETCH_BATCH];
+    int         idx[WALK_FETCH_BATCH];
+    int         n = 0;
+    Datum       args[2];
+    int         i;
+    uint64      r;
+
+    for (i = stack->n - 1; i >= 0 && n < WALK_FETCH_BATCH; i--)
+    {
+        WalkTree   *t = &stack->items[i];
+        bytea      *b;
+
+        if (t->fetched)
+            continue;
+        b = (bytea *) palloc(VARHDRSZ + GIT_OID_RAWSZ);
+        SET_VARSIZE(b, VARHDRSZ + GIT_OID_RAWSZ);
+        memcpy(VARDATA(b), t->oid, GIT_OID_RAWSZ);
+        elems[n] = PointerGetDatum(b);
+        idx[n++] = i;
+    }
+
+    args[0] = Int32GetDatum(st->repo_id);
+    args[1] = PointerGetDatum(construct_array(elems, n, BYTEAOID, -1, false, TYPALIGN_INT));
+
+    if (SPI_execute_plan(st->plan, args, NULL, true, 0) != SPI_OK_SELECT)
+        elog(ERROR, "git_tree_walk: fetching trees failed");
+
+    /* Trees that are not stored are treated as empty, like git_ls_tree_r */
+    for (i = 0; i < n; i++)
+        stack->items[idx[i]].fetched = true;
+
+    for (r = 0; r < SPI_processed; r++)
+    {
+        HeapTuple   tup = SPI_tuptable->vals[r];
+        TupleDesc   desc = SPI_tuptable->tupdesc;
+        bool        isnull;
+        bytea      *oid = DatumGetByteaPP(SPI_getbinval(tup, desc, 1, &isnull));
+        Datum       content = SPI_getbinval(tup, desc, 2, &isnull);
+
+        if (VARSIZE_ANY_EXHDR(oid) != GIT_OID_RAWSZ)
+            continue;
+
+        /* The same tree can appear at several paths */
+        for (i = 0; i < n; i++)
+        {
+            WalkTree   *t = &stack->items[idx[i]];
+            MemoryContext old;
+
+            if (memcmp(t->oid, VARDATA_ANY(oid), GIT_OID_RAWSZ) != 0)
+                continue;
+            old = MemoryContextSwitchTo(st->ctx);
+            t->content = DatumGetByteaPCopy(content);
+            MemoryContextSwitchTo(old);
+        }
+    }
+
+    SPI_freetuptable(SPI_tuptable);
+    pfree(DatumGetPointer(args[1]));
+    for (i = 0; i < n; i++)
+        pfree(DatumGetPointer(elems[i]));
+}
+
+/* Does path (without trailing '/') lie at or under the pathspec? */
+static bool
+within_prefix(WalkState *st, const char *path, int len)
+{
+    if (st->prefix_len == 0)
+        return true;
+    if (len < st->prefix_len || memcmp(path, st->prefix, st->prefix_len) != 0)
+        return false;
+    return len == st->prefix_len || path[st->prefix_len] == '/';
+}
+
+/* Is path a directory on the way down to the pathspec? */
+static bool
+leads_to_prefix(WalkState *st, const char *path, int len)
+{
+    return len < st->prefix_len &&
+        memcmp(path, st->prefix, len) == 0 &&
+        st->prefix[len] == '/';
+}
+
+static void
+emit(WalkState *st, const char *mode, int mode_len, const char *path, int path_len,
+     const char *oid, const char *obj_type)
+{
+    Datum       values[4];
+    bool        nulls[4] = { false, false, false, false };
+    bytea      *oid_b = (bytea *) palloc(VARHDRSZ + GIT_OID_RAWSZ);
+
+    SET_VARSIZE(oid_b, VARHDRSZ + GIT_OID_RAWSZ);
+    memcpy(VARDATA(oid_b), oid, GIT_OID_RAWSZ);
+
+    values[0] = PointerGetDatum(cstring_to_text_with_len(mode, mode_len));
+    values[1] = PointerGetDatum(cstring_to_text_with_len(path, path_len));
+    values[2] = PointerGetDatum(oid_b);
+    values[3] = CStringGetTextDatum(obj_type);
+
+    tuplestore_putvalues(st->rsinfo->setResult, st->rsinfo->setDesc, values, nulls);
+
+    pfree(DatumGetPointer(values[0]));
+    pfree(DatumGetPointer(values[1]));
+    pfree(DatumGetPointer(values[3]));
+    pfree(oid_b);
+}
+
+/* Emit the entries of one tree and push the subtrees worth descending into */
+static void
+expand_tree(WalkState *st, WalkStack *stack, WalkTree *t)
+{
+    const char *data = VARDATA_ANY(t->content);
+    int         len = VARSIZE_ANY_EXHDR(t->content);
+    int         pos = 0;
+    int         first_child = stack->n;
+    int         lo;
+    int         hi;
+    char       *path = palloc(t->path_len + len + 2);
+
+    memcpy(path, t->path, t->path_len);
+
+    while (pos < len)
+    {
+        const char *space = memchr(data + pos, ' ', len - pos);
+        const char *nul;
+        const char *oid;
+        int         mode_len;
+        int         name_len;
+        int         plen;
+        bool        is_tree;
+
+        if (space == NULL ||
+            (nul = memchr(space + 1, '\0', data + len - (space + 1))) == NULL ||
+            data + len - (nul + 1) < GIT_OID_RAWSZ)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("malformed tree entry under \"%s\"", t->path)));
+
+        mode_len = space - (data + pos);
+        name_len = nul - (space + 1);
+        oid = nul + 1;
+        is_tree = mode_len == 5 && memcmp(data + pos, "40000", 5) == 0;
+
+        memcpy(path + t->path_len, space + 1, name_len);
+        plen = t->path_len + name_len;
+
+        if (within_prefix(st, path, plen))
+        {
+            const char *obj_type = is_tree ? "tree" :
+                (mode_len == 6 && memcmp(data + pos, "160000", 6) == 0) ? "commit" : "blob";
+
+            if (is_tree)
+                path[plen] = '/';
+            emit(st, data + pos, mode_len, path, plen + (is_tree ? 1 : 0), oid, obj_type);
+        }
+
+        if (is_tree &&
+            (st->max_depth < 0 || t->depth < st->max_depth) &&
+            (within_prefix(st, path, plen) || leads_to_prefix(st, path, plen)))
+        {
+            path[plen] = '/';
+            stack_push(st, stack, oid, path, plen + 1, t->depth + 1);
+        }
+
+        pos = (oid + GIT_OID_RAWSZ) - data;
+    }
+
+    pfree(path);
+
+    /* Reverse the children so the first subtree is walked first */
+    for (lo = first_child, hi = stack->n - 1; lo < hi; lo++, hi--)
+    {
+        WalkTree    tmp = stack->items[lo];
+
+        stack->items[lo] = stack->items[hi];
+        stack->items[hi] = tmp;
+    }
+}
+
+/*
+ * git_tree_walk_c(repo_id integer, tree_oid bytea,
+ *                 pathspec text DEFAULT '', max_depth integer DEFAULT NULL)
+ *   RETURNS TABLE(mode text, path text, oid bytea, obj_type text)
+ *
+ * Lists a tree recursively, with rows shaped like git_ls_tree_r's, using
+ * an explicit stack instead of recursion.  Each tree's entries are
+ * emitted together before its subtrees are walked.  With a pathspec, only
+ * entries at or under that path are returned and only the directories
+ * leading to it are read.  max_depth bounds how many levels below the
+ * root are expanded: 0 lists just the root tree.
+ */
+Datum
+git_tree_walk_c(PG_FUNCTION_ARGS)
+{
+    WalkState   st;
+    WalkStack   stack = { NULL, 0, 0 };
+    bytea      *root;
+    text       *pathspec;
+    Oid         argtypes[2] = { INT4OID, BYTEAARRAYOID };
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    /* Not strict, so that pathspec and max_depth may be NULL */
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+        return (Datum) 0;
+
+    root = PG_GETARG_BYTEA_PP(1);
+    pathspec = PG_ARGISNULL(2) ? NULL : PG_GETARG_TEXT_PP(2);
+
+    if (VARSIZE_ANY_EXHDR(root) != GIT_OID_RAWSZ)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("tree oid must be %d bytes", GIT_OID_RAWSZ)));
+
+    st.repo_id = PG_GETARG_INT32(0);
+    st.max_depth = PG_ARGISNULL(3) ? -1 : PG_GETARG_INT32(3);
+    st.ctx = CurrentMemoryContext;
+    st.rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    st.prefix = "";
+    st.prefix_len = 0;
+    if (pathspec)
+    {
+        st.prefix = VARDATA_ANY(pathspec);
+        st.prefix_len = VARSIZE_ANY_EXHDR(pathspec);
+        while (st.prefix_len > 0 && st.prefix[st.prefix_len - 1] == '/')
+            st.prefix_len--;
+    }
+
+    stack_push(&st, &stack, VARDATA_ANY(root), "", 0, 0);
+
+    SPI_connect();
+    /*
+     * Trees can come from the repository's alternates too.  Each
+     * repository is probed on its own so the scan prunes to its
+     * partition of objects.
+     */
+    st.plan = SPI_prepare("SELECT DISTINCT ON (o.oid) o.oid::bytea, o.content "
+                          "FROM unnest(git_object_repos($1)) WITH ORDINALITY AS r(id, n) "
+                          "CROSS JOIN LATERAL (SELECT oid, content FROM objects "
+                          "WHERE repo_id = r.id AND type = 2 AND oid = ANY($2)) o "
+                          "ORDER BY o.oid, r.n",
+                          2, argtypes);
+    if (st.plan == NULL)
+        elog(ERROR, "git_tree_walk: SPI_prepare failed: %s",
+             SPI_result_code_string(SPI_result));
+
+    while (stack.n > 0)
+    {
+        WalkTree    t;
+
+        if (!stack.items[stack.n - 1].fetched)
+            fetch_batch(&st, &stack);
+
+        t = stack.items[--stack.n];
+        if (t.content)
+        {
+            MemoryContext old = MemoryContextSwitchTo(st.ctx);
+
+            expand_tree(&st, &stack, &t);
+            MemoryContextSwitchTo(old);
+            pfree(t.content);
+        }
+        pfree(t.path);
+    }
+
+    SPI_finish();
+    return (Datum) 0;
+}
@@ -0,0 +1,140 @@
+-- Forks share their upstream's objects through repository_alternates
+-- instead of storing copies.  Reads fall back to the alternates (see
+-- git_object_repos); commits, tree_entries and blob_text stay per
+-- repository, so a fork gets its own rows for the objects it borrows.
+
+-- Give p_repo_id the objects in p_oids that it doesn't store but an
+-- alternate does, without storing them again: their commits,
+-- tree_entries and blob_text rows are copied from the alternate.
+-- Returns those oids, which the caller can then skip.  Ingest merges
+-- call this on each batch.
+CREATE OR REPLACE FUNCTION git_share_objects(p_repo_id integer, p_oids bytea[])
+RETURNS SETOF bytea
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_alternates integer[] := (git_object_repos(p_repo_id))[2:];
+    v_shared bytea[];
+BEGIN
+    IF cardinality(v_alternates) = 0 THEN
+        RETURN;
+    END IF;
+
+    v_shared := ARRAY(
+        SELECT DISTINCT u.oid FROM unnest(p_oids) u(oid)
+        WHERE EXISTS (SELECT 1 FROM git_object_find(v_alternates, u.oid))
+          AND NOT EXISTS (SELECT 1 FROM objects o WHERE o.repo_id = p_repo_id AND o.oid = u.oid)
+    );
+    IF cardinality(v_shared) = 0 THEN
+        RETURN;
+    END IF;
+
+    INSERT INTO commits (repo_id, commit_oid, sha, tree_oid, parent_oids,
+                         author_name, author_email, authored_at,
+                         committer_name, committer_email, committed_at, message)
+    SELECT p_repo_id, c.commit_oid, c.sha, c.tree_oid, c.parent_oids,
+           c.author_name, c.author_email, c.authored_at,
+           c.committer_name, c.committer_email, c.committed_at, c.message
+    FROM commits c
+    WHERE c.repo_id = ANY(v_alternates) AND c.commit_oid = ANY(v_shared)
+    ON CONFLICT (repo_id, commit_oid) DO NOTHING;
+
+    -- A tree's entries are the same in every repository that has it
+    INSERT INTO tree_entries (repo_id, tree_oid, mode, name, entry_oid)
+    SELECT DISTINCT p_repo_id, t.tree_oid, t.mode, t.name, t.entry_oid
+    FROM tree_entries t
+    WHERE t.repo_id = ANY(v_alternates) AND t.tree_oid = ANY(v_shared)
+      AND NOT EXISTS (
+          SELECT 1 FROM tree_entries m WHERE m.repo_id = p_repo_id AND m.tree_oid = t.tree_oid
+      );
+
+    INSERT INTO blob_text (repo_id, oid, content)
+    SELECT p_repo_id, b.oid, b.content
+    FROM blob_text b
+    WHERE b.repo_id = ANY(v_alternates) AND b.oid = ANY(v_shared)
+    ON CONFLICT (repo_id, oid) DO NOTHING;
+
+    RETURN QUERY SELECT unnest(v_shared);
+END;
+$$;
+
+-- Create p_name as a fork of p_upstream and return its id.  The fork
+-- starts with the upstream's refs and reads the upstream's objects as
+-- alternates, so only objects pushed to it later are stored for it.
+CREATE OR REPLACE FUNCTION git_fork_repository(p_upstream integer, p_name text)
+RETURNS integer
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_id integer;
+BEGIN
+    INSERT INTO repositories (name) VALUES (p_name) RETURNING id INTO v_id;
+    INSERT INTO repository_alternates (repo_id, alternate_id) VALUES (v_id, p_upstream);
+
+    INSERT INTO refs (repo_id, name, oid, symbolic)
+    SELECT v_id, r.name, r.oid, r.symbolic FROM refs r WHERE r.repo_id = p_upstream;
+
+    -- The upstream's rows already cover what it borrows in turn
+    INSERT INTO commits (repo_id, commit_oid, sha, tree_oid, parent_oids,
+                         author_name, author_email, authored_at,
+                         committer_name, committer_email, committed_at, message)
+    SELECT v_id, c.commit_oid, c.sha, c.tree_oid, c.parent_oids,
+           c.author_name, c.author_email, c.authored_at,
+           c.committer_name, c.committer_email, c.committed_at, c.message
+    FROM commits c WHERE c.repo_id = p_upstream;
+
+    INSERT INTO tree_entries (repo_id, tree_oid, mode, name, entry_oid)
+    SELECT v_id, t.tree_oid, t.mode, t.name, t.entry_oid
+    FROM tree_entries t WHERE t.repo_id = p_upstream;
+
+    INSERT INTO blob_text (repo_id, oid, content)
+    SELECT v_id, b.oid, b.content FROM blob_text b WHERE b.repo_id = p_upstream;
+
+    RETURN v_id;
+END;
+$$;
+
+-- Copy into p_repo_id every object it reads from its alternates, with
+-- its chunks, and drop the alternates, like git repack -a followed by
+-- removing objects/info/alternates.  Returns the number of objects
+-- copied.
+CREATE OR REPLACE FUNCTION git_dissociate_repository(p_repo_id integer)
+RETURNS integer
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_alternates integer[] := (git_object_repos(p_repo_id))[2:];
+    v_count integer;
+BEGIN
+    -- The insert trigger adds tree_entries for the copied trees again
+    DELETE FROM tree_entries t
+    USING objects a
+    WHERE t.repo_id = p_repo_id AND a.repo_id = ANY(v_alternates)
+      AND a.type = 2 AND a.oid = t.tree_oid
+      AND NOT EXISTS (SELECT 1 FROM objects o WHERE o.repo_id = p_repo_id AND o.oid = t.tree_oid);
+
+    -- Chunks come from the repository the object row was taken from,
+    -- as another may have split the blob differently
+    WITH src AS (
+        SELECT DISTINCT ON (a.oid) a.*
+        FROM objects a
+        WHERE a.repo_id = ANY(v_alternates)
+          AND NOT EXISTS (SELECT 1 FROM objects o WHERE o.repo_id = p_repo_id AND o.oid = a.oid)
+        ORDER BY a.oid, array_position(v_alternates, a.repo_id)
+    ),
+    copied AS (
+        INSERT INTO objects (repo_id, oid, type, size, content, base_oid, depth, chunked)
+        SELECT p_repo_id, s.oid, s.type, s.size, s.content, s.base_oid, s.depth, s.chunked
+        FROM src s
+        RETURNING 1
+    ),
+    chunks AS (
+        INSERT INTO object_chunks (repo_id, oid, chunk_no, data)
+        SELECT p_repo_id, k.oid, k.chunk_no, k.data
+        FROM src s
+        JOIN object_chunks k ON k.repo_id = s.repo_id AND k.oid = s.oid
+        WHERE s.chunked
+    )
+    SELECT count(*) INTO v_count FROM copied;
+
+    DELETE FROM repository_alternates WHERE repo_id = p_repo_id;
+    RETURN v_count;
+END;
+$$;
@@ -0,0 +1,384 @@
+-- Compute generations for the unsettled commits among p_ids, once all
+-- their parents have one.  Commits usually arrive children first (packs
+-- are written newest first), so this runs Kahn's algorithm over them in
+-- memory rather than one UPDATE per level.  Commits with a parent that
+-- isn't stored, or that is unsettled and not in p_ids, stay unsettled.
+-- Returns the ids settled.
+CREATE OR REPLACE FUNCTION git_commit_graph_settle_ids(p_ids bigint[])
+RETURNS bigint[]
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_ids bigint[];
+    v_best integer[];       -- highest parent generation seen so far
+    v_pending integer[];    -- parents still waiting for a generation
+    v_blocked boolean[];    -- has a parent that isn't stored
+    v_kid_count integer[];
+    v_kids integer[];       -- children's positions, grouped by parent
+    v_off integer[];
+    v_gen integer[];
+    v_queue integer[] := '{}';
+    v_n integer;
+    v_head integer := 1;
+    v_i integer;
+    v_k integer;
+    v_c integer;
+BEGIN
+    WITH u AS (
+        SELECT g.id, g.parent_ids, (row_number() OVER (ORDER BY g.id))::integer AS i
+        FROM commit_graph g
+        WHERE g.id = ANY(p_ids) AND g.generation IS NULL AND g.parent_ids IS NOT NULL
+    ),
+    e AS (
+        SELECT u.i AS child, pu.i AS parent, p.generation,
+               p.parent_ids IS NULL OR (pu.i IS NULL AND p.generation IS NULL) AS missing
+        FROM u
+        CROSS JOIN LATERAL unnest(u.parent_ids) AS x(pid)
+        JOIN commit_graph p ON p.id = x.pid
+        LEFT JOIN u pu ON pu.id = x.pid
+    ),
+    per AS (
+        SELECT u.i,
+               coalesce(max(e.generation), 0) AS best,
+               count(e.parent)::integer AS pending,
+               coalesce(bool_or(e.missing), false) AS blocked
+        FROM u LEFT JOIN e ON e.child = u.i
+        GROUP BY u.i
+    ),
+    kids AS (
+        SELECT u.i, count(e.child)::integer AS n
+        FROM u LEFT JOIN e ON e.parent = u.i
+        GROUP BY u.i
+    )
+    SELECT (SELECT array_agg(u.id ORDER BY u.i) FROM u),
+           (SELECT array_agg(per.best ORDER BY per.i) FROM per),
+           (SELECT array_agg(per.pending ORDER BY per.i) FROM per),
+           (SELECT array_agg(per.blocked ORDER BY per.i) FROM per),
+           (SELECT array_agg(kids.n ORDER BY kids.i) FROM kids),
+           (SELECT array_agg(e.child ORDER BY e.parent, e.child) FROM e WHERE e.parent IS NOT NULL)
+    INTO v_ids, v_best, v_pending, v_blocked, v_kid_count, v_kids;
+
+    v_n := coalesce(cardinality(v_ids), 0);
+    IF v_n = 0 THEN
+        RETURN '{}';
+    END IF;
+
+    -- v_kids[v_off[i] .. v_off[i + 1] - 1] are the children of commit i
+    v_off := array_fill(1, ARRAY[v_n + 1]);
+    FOR v_i IN 1..v_n LOOP
+        v_off[v_i + 1] := v_off[v_i] + v_kid_count[v_i];
+    END LOOP;
+
+    v_gen := array_fill(NULL::integer, ARRAY[v_n]);
+    FOR v_i IN 1..v_n LOOP
+        IF v_pending[v_i] = 0 AND NOT v_blocked[v_i] THEN
+            v_queue := array_append(v_queue, v_i);
+        END IF;
+    END LOOP;
+
+    WHILE v_head <= cardinality(v_queue) LOOP
+        v_i := v_queue[v_head];
+        v_head := v_head + 1;
+        v_gen[v_i] := v_best[v_i] + 1;
+
+        FOR v_k IN v_off[v_i]..v_off[v_i + 1] - 1 LOOP
+            v_c := v_kids[v_k];
+            v_best[v_c] := greatest(v_best[v_c], v_gen[v_i]);
+            v_pending[v_c] := v_pending[v_c] - 1;
+            IF v_pending[v_c] = 0 AND NOT v_blocked[v_c] THEN
+                v_queue := array_append(v_queue, v_c);
+            END IF;
+        END LOOP;
+    END LOOP;
+
+    UPDATE commit_graph g
+    SET generation = s.gen
+    FROM unnest(v_ids, v_gen) AS s(id, gen)
+    WHERE g.id = s.id AND s.gen IS NOT NULL;
+
+    RETURN ARRAY(SELECT v_ids[q.i] FROM unnest(v_queue) AS q(i));
+END;
+$$;
+
+-- Settle every unsettled commit of a repository.  Returns the number of
+-- commits settled.
+CREATE OR REPLACE FUNCTION git_commit_graph_settle(p_repo_id integer)
+RETURNS integer
+LANGUAGE sql AS $$
+    SELECT cardinality(git_commit_graph_settle_ids(ARRAY(
+        SELECT g.id FROM commit_graph g
+        WHERE g.repo_id = p_repo_id AND g.generation IS NULL
+    )));
+$$;
+
+-- Give new commits and their parents ids, fill in parents and dates,
+-- then settle generations.  Statement level, so an ingest batch is
+-- handled in one pass.  Only the new commits are settled, and then, if
+-- any of them were, the unsettled commits below them that were waiting
+-- on them; the rest of the repository's unsettled commits can't have
+-- changed.
+CREATE OR REPLACE FUNCTION git_commits_inserted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_settled bigint[];
+BEGIN
+    INSERT INTO commit_graph (repo_id, commit_oid)
+    SELECT DISTINCT n.repo_id, x.oid
+    FROM new_commits n,
+         LATERAL unnest(array_append(n.parent_oids, n.commit_oid)) AS x(oid)
+    ON CONFLICT (repo_id, commit_oid) DO NOTHING;
+
+    UPDATE commit_graph g
+    SET parent_ids = p.ids, committed_at = n.committed_at
+    FROM new_commits n,
+         LATERAL (
+             SELECT coalesce(array_agg(pg.id ORDER BY x.ord), '{}') AS ids
+             FROM unnest(n.parent_oids) WITH ORDINALITY AS x(oid, ord)
+             JOIN commit_graph pg ON pg.repo_id = n.repo_id AND pg.commit_oid = x.oid
+         ) p
+    WHERE g.repo_id = n.repo_id AND g.commit_oid = n.commit_oid;
+
+    v_settled := git_commit_graph_settle_ids(ARRAY(
+        SELECT g.id
+        FROM new_commits n
+        JOIN commit_graph g ON g.repo_id = n.repo_id AND g.commit_oid = n.commit_oid
+    ));
+
+    IF cardinality(v_settled) > 0 THEN
+        PERFORM git_commit_graph_settle_ids(ARRAY(
+            WITH RECURSIVE d(id) AS (
+                SELECT c.id
+                FROM unnest(v_settled) AS s(id)
+                JOIN commit_graph c ON c.parent_ids @> ARRAY[s.id] AND c.generation IS NULL
+                UNION
+                SELECT c.id
+                FROM d
+                JOIN commit_graph c ON c.parent_ids @> ARRAY[d.id] AND c.generation IS NULL
+            )
+            SELECT d.id FROM d
+        ));
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+-- A deleted commit goes back to being a placeholder, so children that
+-- point at its id stay valid if it is stored again.
+CREATE OR REPLACE FUNCTION git_commits_deleted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    UPDATE commit_graph g
+    SET parent_ids = NULL, generation = NULL, committed_at = NULL
+    FROM old_commits o
+    WHERE g.repo_id = o.repo_id AND g.commit_oid = o.commit_oid;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE OR REPLACE TRIGGER commits_inserted
+    AFTER INSERT ON commits
+    REFERENCING NEW TABLE AS new_commits
+    FOR EACH STATEMENT EXECUTE FUNCTION git_commits_inserted();
+
+CREATE OR REPLACE TRIGGER commits_deleted
+    AFTER DELETE ON commits
+    REFERENCING OLD TABLE AS old_commits
+    FOR EACH STATEMENT EXECUTE FUNCTION git_commits_deleted();
+
+-- Is p_ancestor reachable from p_descendant?  The walk never descends
+-- below the ancestor's generation.  NULL when p_descendant isn't stored.
+CREATE OR REPLACE FUNCTION git_is_ancestor(
+    p_repo_id integer,
+    p_ancestor bytea,
+    p_descendant bytea
+)
+RETURNS boolean
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    v_a_id bigint;
+    v_a_gen integer;
+    v_d_id bigint;
+    v_d_gen integer;
+BEGIN
+    SELECT g.id, g.generation INTO v_d_id, v_d_gen
+    FROM commit_graph g
+    WHERE g.repo_id = p_repo_id AND g.commit_oid = p_descendant AND g.parent_ids IS NOT NULL;
+    IF v_d_id IS NULL THEN
+        RETURN NULL;
+    END IF;
+
+    SELECT g.id, g.generation INTO v_a_id, v_a_gen
+    FROM commit_graph g
+    WHERE g.repo_id = p_repo_id AND g.commit_oid = p_ancestor;
+    IF v_a_id IS NULL THEN
+        RETURN false;
+    END IF;
+
+    IF v_a_id = v_d_id THEN
+        RETURN true;
+    END IF;
+    IF v_a_gen >= v_d_gen THEN
+        RETURN false;
+    END IF;
+
+    RETURN EXISTS (
+        WITH RECURSIVE walk(id) AS (
+            SELECT v_d_id
+            UNION
+            SELECT p.id
+            FROM walk w
+            JOIN commit_graph g ON g.id = w.id
+            CROSS JOIN LATERAL unnest(g.parent_ids) AS x(pid)
+            JOIN commit_graph p ON p.id = x.pid
+            WHERE v_a_gen IS NULL OR p.generation IS NULL OR p.generation >= v_a_gen
+        )
+        SELECT 1 FROM walk WHERE walk.id = v_a_id
+    );
+END;
+$$;
+
+-- Walk down from two commits one generation at a time, like git's
+-- paint_down_to_common.  Each commit carries flags for which side
+-- reaches it (1 for p_a, 2 for p_b); they are final once its generation
+-- comes up, since all its children have higher generations.  ahead and
+-- behind count the commits only p_a or only p_b reach.  The walk stops
+-- when every remaining commit is reached from both sides, or with
+-- p_stop_at_base at the first one, which is a best merge base.
+CREATE OR REPLACE FUNCTION git_commit_graph_paint(
+    p_repo_id integer,
+    p_a bytea,
+    p_b bytea,
+    p_stop_at_base boolean
+)
+RETURNS TABLE(ahead integer, behind integer, merge_base bytea)
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    v_a_id bigint;
+    v_a_gen integer;
+    v_b_id bigint;
+    v_b_gen integer;
+    v_ids bigint[];
+    v_flags integer[];
+    v_gens integer[];
+    v_level integer;
+BEGIN
+    SELECT g.id, g.generation INTO v_a_id, v_a_gen
+    FROM commit_graph g
+    WHERE g.repo_id = p_repo_id AND g.commit_oid = p_a AND g.parent_ids IS NOT NULL;
+    SELECT g.id, g.generation INTO v_b_id, v_b_gen
+    FROM commit_graph g
+    WHERE g.repo_id = p_repo_id AND g.commit_oid = p_b AND g.parent_ids IS NOT NULL;
+    IF v_a_id IS NULL OR v_b_id IS NULL THEN
+        RETURN;
+    END IF;
+
+    ahead := 0;
+    behind := 0;
+    IF v_a_id = v_b_id THEN
+        v_ids := ARRAY[v_a_id];
+        v_flags := ARRAY[3];
+        v_gens := ARRAY[v_a_gen];
+    ELSE
+        v_ids := ARRAY[v_a_id, v_b_id];
+        v_flags := ARRAY[1, 2];
+        v_gens := ARRAY[v_a_gen, v_b_gen];
+    END IF;
+
+    LOOP
+        EXIT WHEN coalesce(cardinality(v_ids), 0) = 0;
+        EXIT WHEN NOT p_stop_at_base AND 3 = ALL (v_flags);
+
+        IF array_position(v_gens, NULL) IS NOT NULL THEN
+            RAISE EXCEPTION 'commit graph of repository % has commits without a generation', p_repo_id;
+        END IF;
+
+        SELECT max(x.gen) INTO v_level FROM unnest(v_gens) AS x(gen);
+
+        SELECT ahead + count(*) FILTER (WHERE x.flags = 1),
+               behind + count(*) FILTER (WHERE x.flags = 2)
+        INTO ahead, behind
+        FROM unnest(v_flags, v_gens) AS x(flags, gen)
+        WHERE x.gen = v_level;
+
+        IF p_stop_at_base THEN
+            SELECT g.commit_oid INTO merge_base
+            FROM unnest(v_ids, v_flags, v_gens) AS x(id, flags, gen)
+            JOIN commit_graph g ON g.id = x.id
+            WHERE x.gen = v_level AND x.flags = 3
+            ORDER BY g.committed_at DESC, g.commit_oid
+            LIMIT 1;
+            EXIT WHEN merge_base IS NOT NULL;
+        END IF;
+
+        -- Replace this generation's commits with their parents
+        SELECT array_agg(f.id), array_agg(f.flags), array_agg(f.gen)
+        INTO v_ids, v_flags, v_gens
+        FROM (
+            SELECT s.id, bit_or(s.flags) AS flags, max(s.gen) AS gen
+            FROM (
+                SELECT x.id, x.flags, x.gen
+                FROM unnest(v_ids, v_flags, v_gens) AS x(id, flags, gen)
+                WHERE x.gen < v_level
+                UNION ALL
+                SELECT p.id, x.flags, p.generation
+                FROM unnest(v_ids, v_flags, v_gens) AS x(id, flags, gen)
+                JOIN commit_graph g ON g.id = x.id
+                CROSS JOIN LATERAL unnest(g.parent_ids) AS y(pid)
+                JOIN commit_graph p ON p.id = y.pid
+                WHERE x.gen = v_level AND p.parent_ids IS NOT NULL
+            ) s
+            GROUP BY s.id
+        ) f;
+    END LOOP;
+
+    RETURN NEXT;
+END;
+$$;
+
+-- A best common ancestor of two commits, or NULL when they have none
+CREATE OR REPLACE FUNCTION git_merge_base(p_repo_id integer, p_a bytea, p_b bytea)
+RETURNS bytea
+LANGUAGE sql STABLE AS $$
+    SELECT w.merge_base FROM git_commit_graph_paint(p_repo_id, p_a, p_b, true) w;
+$$;
+
+-- Commits reachable from p_a but not p_b (ahead) and the reverse (behind),
+-- like git rev-list --left-right --count p_a...p_b
+CREATE OR REPLACE FUNCTION git_ahead_behind(p_repo_id integer, p_a bytea, p_b bytea)
+RETURNS TABLE(ahead integer, behind integer)
+LANGUAGE sql STABLE AS $$
+    SELECT w.ahead, w.behind FROM git_commit_graph_paint(p_repo_id, p_a, p_b, false) w;
+$$;
+
+-- The commits within p_depth of p_wants, for a shallow fetch: the wants
+-- are at depth 1, their parents at 2, and so on.  boundary marks the
+-- ones at the cut whose parents are left out, which the client records
+-- in .git/shallow.  Parents the graph only has placeholders for are
+-- not returned.
+CREATE OR REPLACE FUNCTION git_commit_graph_shallow(
+    p_repo_id integer,
+    p_wants bytea[],
+    p_depth integer
+)
+RETURNS TABLE(commit_oid bytea, boundary boolean)
+LANGUAGE sql STABLE AS $$
+    WITH RECURSIVE walk(id, depth) AS (
+        SELECT g.id, 1
+        FROM commit_graph g
+        WHERE g.repo_id = p_repo_id AND g.commit_oid = ANY(p_wants)
+        UNION
+        SELECT x.pid, w.depth + 1
+        FROM walk w
+        JOIN commit_graph g ON g.id = w.id
+        CROSS JOIN LATERAL unnest(g.parent_ids) AS x(pid)
+        WHERE w.depth < p_depth
+    )
+    SELECT g.commit_oid, min(w.depth) >= p_depth AND cardinality(g.parent_ids) > 0
+    FROM walk w
+    JOIN commit_graph g ON g.id = w.id
+    WHERE g.parent_ids IS NOT NULL
+    GROUP BY g.id;
+$$;
@@ -0,0 +1,193 @@
+-- Blob content as text for the git_grep index.  NULL for blobs over
+-- 1MB, blobs with a NUL byte (git's test for binary) and blobs that are
+-- not UTF-8.
+CREATE OR REPLACE FUNCTION git_blob_text(p_content bytea)
+RETURNS text
+LANGUAGE plpgsql IMMUTABLE STRICT AS $$
+BEGIN
+    IF octet_length(p_content) > 1048576 OR position('\x00'::bytea IN p_content) > 0 THEN
+        RETURN NULL;
+    END IF;
+    RETURN convert_from(p_content, 'UTF8');
+EXCEPTION
+    WHEN character_not_in_repertoire OR untranslatable_character THEN
+        RETURN NULL;
+END;
+$$;
+
+-- Keep blob_text in step with objects.  Deltas are read through
+-- git_object_read once their base is stored, in the repository or one
+-- of its alternates.  Chunked blobs, and deltas
+-- whose base arrives in a later statement, are left for
+-- git_backfill_blob_text, since their content is not complete yet.
+CREATE OR REPLACE FUNCTION git_objects_blob_text_inserted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    INSERT INTO blob_text (repo_id, oid, content)
+    SELECT n.repo_id, n.oid, t.content
+    FROM new_objects n,
+         LATERAL (
+             SELECT git_blob_text(CASE
+                 WHEN n.base_oid IS NULL THEN n.content
+                 ELSE (SELECT r.content FROM git_object_read(n.repo_id, n.oid) r)
+             END) AS content
+         ) t
+    WHERE n.type = 3 AND NOT n.chunked AND n.size <= 1048576
+      AND (n.base_oid IS NULL OR EXISTS (
+          SELECT 1 FROM git_object_find(git_object_repos(n.repo_id), n.base_oid)
+      ))
+      AND t.content IS NOT NULL
+    ON CONFLICT (repo_id, oid) DO NOTHING;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION git_objects_blob_text_deleted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    DELETE FROM blob_text b
+    USING old_objects o
+    WHERE o.type = 3 AND b.repo_id = o.repo_id AND b.oid = o.oid;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE OR REPLACE TRIGGER objects_blob_text_inserted
+    AFTER INSERT ON objects
+    REFERENCING NEW TABLE AS new_objects
+    FOR EACH STATEMENT EXECUTE FUNCTION git_objects_blob_text_inserted();
+
+CREATE OR REPLACE TRIGGER objects_blob_text_deleted
+    AFTER DELETE ON objects
+    REFERENCING OLD TABLE AS old_objects
+    FOR EACH STATEMENT EXECUTE FUNCTION git_objects_blob_text_deleted();
+
+-- Fill blob_text from blobs stored before the trigger existed or
+-- skipped by it, for one repository or all of them.  Safe to run again.
+CREATE OR REPLACE FUNCTION git_backfill_blob_text(p_repo_id integer DEFAULT NULL)
+RETURNS void
+LANGUAGE sql AS $$
+    INSERT INTO blob_text (repo_id, oid, content)
+    SELECT o.repo_id, o.oid, t.content
+    FROM objects o,
+         LATERAL (
+             SELECT git_blob_text(r.content) AS content
+             FROM git_object_read(o.repo_id, o.oid) r
+         ) t
+    WHERE o.type = 3 AND o.size <= 1048576
+      AND (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+      AND NOT EXISTS (
+          SELECT 1 FROM blob_text b WHERE b.repo_id = o.repo_id AND b.oid = o.oid
+      )
+      AND t.content IS NOT NULL
+    ON CONFLICT (repo_id, oid) DO NOTHING;
+$$;
+
+-- The tree a revision names: a 40-digit hex oid, or a ref tried as git
+-- does (name, refs/name, refs/tags/name, refs/heads/name), following
+-- symbolic refs.  Tags and commits are peeled to their tree.  NULL if
+-- the revision does not resolve.
+CREATE OR REPLACE FUNCTION git_resolve_tree(p_repo_id integer, p_rev text)
+RETURNS bytea
+LANGUAGE plpgsql STABLE STRICT AS $$
+DECLARE
+    v_repos integer[] := git_object_repos(p_repo_id);
+    v_name text := p_rev;
+    v_names text[];
+    v_oid bytea;
+    v_symbolic text;
+    v_type smallint;
+    v_content bytea;
+    i integer;
+BEGIN
+    IF p_rev ~ '^[0-9a-f]{40}$' THEN
+        v_oid := decode(p_rev, 'hex');
+    ELSE
+        FOR i IN 1..10 LOOP
+            v_names := ARRAY[v_name, 'refs/' || v_name, 'refs/tags/' || v_name, 'refs/heads/' || v_name];
+            SELECT r.oid, r.symbolic INTO v_oid, v_symbolic
+            FROM refs r
+            WHERE r.repo_id = p_repo_id AND r.name = ANY(v_names)
+            ORDER BY array_position(v_names, r.name)
+            LIMIT 1;
+            EXIT WHEN v_symbolic IS NULL;
+            v_name := v_symbolic;
+        END LOOP;
+    END IF;
+
+    FOR i IN 1..10 LOOP
+        SELECT o.type, o.content INTO v_type, v_content
+        FROM git_object_find(v_repos, v_oid) o;
+
+        IF v_type = 2 THEN
+            RETURN v_oid;
+        ELSIF v_type = 1 THEN
+            SELECT c.tree_oid INTO v_oid FROM git_commit_parse(v_content) c;
+        ELSIF v_type = 4 THEN
+            v_oid := decode(substring(convert_from(v_content, 'UTF8') FROM '^object ([0-9a-f]{40})'), 'hex');
+        ELSE
+            RETURN NULL;
+        END IF;
+    END LOOP;
+    RETURN NULL;
+END;
+$$;
+
+-- Lines matching a regular expression in the blobs of a tree, like git
+-- grep -n.  The pg_trgm index on blob_text narrows the search to blobs
+-- that can match before the tree is walked; those are then split into
+-- lines and checked.  The pattern is a POSIX regex matched per line (^
+-- and $ anchor at line ends).  Blobs without a blob_text row (binary or
+-- over 1MB) are not searched.  Rows come in path order.
+CREATE OR REPLACE FUNCTION git_grep(
+    p_repo_id integer,
+    p_rev text,
+    p_pattern text,
+    p_ignore_case boolean DEFAULT false
+)
+RETURNS TABLE(path text, line_no integer, line text)
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    v_tree bytea := git_resolve_tree(p_repo_id, p_rev);
+    v_regex text := '(?n' || CASE WHEN p_ignore_case THEN 'i' ELSE '' END || ')' || p_pattern;
+    v_oids bytea[];
+BEGIN
+    IF v_tree IS NULL THEN
+        RAISE EXCEPTION 'unknown revision %', p_rev;
+    END IF;
+
+    v_oids := ARRAY(
+        SELECT b.oid FROM blob_text b
+        WHERE b.repo_id = p_repo_id AND b.content ~ v_regex
+    );
+    IF cardinality(v_oids) = 0 THEN
+        RETURN;
+    END IF;
+
+    RETURN QUERY
+        WITH RECURSIVE walk AS (
+            SELECT te.name AS path, te.mode, te.entry_oid AS oid
+            FROM tree_entries te
+            WHERE te.repo_id = p_repo_id AND te.tree_oid = v_tree
+            UNION ALL
+            SELECT w.path || '/' || te.name, te.mode, te.entry_oid
+            FROM walk w
+            JOIN tree_entries te ON te.repo_id = p_repo_id AND te.tree_oid = w.oid
+            WHERE w.mode = '40000'
+        )
+        SELECT w.path, l.n::integer, l.line
+        FROM walk w
+        JOIN blob_text b ON b.repo_id = p_repo_id AND b.oid = w.oid,
+             LATERAL regexp_split_to_table(
+                 CASE WHEN right(b.content, 1) = E'\n' THEN left(b.content, -1) ELSE b.content END,
+                 E'\n'
+             ) WITH ORDINALITY AS l(line, n)
+        WHERE w.mode NOT IN ('40000', '160000') AND w.oid = ANY(v_oids)
+          AND l.line ~ v_regex
+        ORDER BY w.path COLLATE "C", l.n;
+END;
+$$;
@@ -0,0 +1,128 @@
+-- Oid of the tree or blob at p_path ('a/b', no leading '/') under a
+-- tree, using tree_entries.  A path of '' is the tree itself.
+CREATE OR REPLACE FUNCTION git_tree_lookup(p_repo_id integer, p_tree_oid bytea, p_path text)
+RETURNS bytea
+LANGUAGE plpgsql STABLE STRICT AS $$
+DECLARE
+    v_oid bytea := p_tree_oid;
+    v_part text;
+BEGIN
+    FOREACH v_part IN ARRAY string_to_array(trim(both '/' from p_path), '/') LOOP
+        SELECT te.entry_oid INTO v_oid
+        FROM tree_entries te
+        WHERE te.repo_id = p_repo_id AND te.tree_oid = v_oid
+          AND te.name = v_part AND te.mode = '40000';
+        IF v_oid IS NULL THEN
+            RETURN NULL;
+        END IF;
+    END LOOP;
+    RETURN v_oid;
+END;
+$$;
+
+-- The last commit that changed each entry of the directory p_path as of
+-- p_commit, as git log -1 -- <entry> would report it.  Each entry
+-- follows its own chain of commits: from a commit to its first parent
+-- with the same entry (mode and oid), until one has no such parent.
+-- Results are memoized in last_commit_cache, and a chain stops early
+-- at any commit already cached for this directory, so after a push a
+-- listing usually only looks at the new commits.
+CREATE OR REPLACE FUNCTION git_last_commits(
+    p_repo_id integer,
+    p_commit bytea,
+    p_path text DEFAULT ''
+)
+RETURNS TABLE(name text, commit_oid bytea)
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_path text := trim(both '/' from coalesce(p_path, ''));
+    v_dir bytea;
+    -- Entries still being followed, and the commit each has reached
+    v_at bigint[];
+    v_names text[];
+    v_oids bytea[];
+    v_modes text[];
+    -- Entries resolved so far
+    v_res_names text[] := '{}';
+    v_res_commits bytea[] := '{}';
+    v_step_names text[];
+    v_step_commits bytea[];
+BEGIN
+    IF EXISTS (
+        SELECT 1 FROM last_commit_cache lc
+        WHERE lc.repo_id = p_repo_id AND lc.commit_oid = p_commit AND lc.path = v_path
+    ) THEN
+        RETURN QUERY
+            SELECT lc.name, lc.last_commit_oid
+            FROM last_commit_cache lc
+            WHERE lc.repo_id = p_repo_id AND lc.commit_oid = p_commit AND lc.path = v_path
+            ORDER BY lc.name;
+        RETURN;
+    END IF;
+
+    SELECT git_tree_lookup(p_repo_id, cm.tree_oid, v_path) INTO v_dir
+    FROM commits cm
+    WHERE cm.repo_id = p_repo_id AND cm.commit_oid = p_commit;
+    IF v_dir IS NULL THEN
+        RETURN;
+    END IF;
+
+    SELECT array_agg(g.id), array_agg(te.name), array_agg(te.entry_oid), array_agg(te.mode)
+    INTO v_at, v_names, v_oids, v_modes
+    FROM tree_entries te, commit_graph g
+    WHERE te.repo_id = p_repo_id AND te.tree_oid = v_dir
+      AND g.repo_id = p_repo_id AND g.commit_oid = p_commit;
+
+    WHILE coalesce(cardinality(v_at), 0) > 0 LOOP
+        WITH cur AS (
+            SELECT x.at, x.name, x.oid, x.mode, g.commit_oid AS here
+            FROM unnest(v_at, v_names, v_oids, v_modes) AS x(at, name, oid, mode)
+            JOIN commit_graph g ON g.id = x.at
+        ),
+        par AS MATERIALIZED (
+            SELECT c.at, y.ord, y.pid, git_tree_lookup(p_repo_id, cm.tree_oid, v_path) AS dir
+            FROM (SELECT DISTINCT cur.at FROM cur) c
+            JOIN commit_graph g ON g.id = c.at
+            CROSS JOIN LATERAL unnest(g.parent_ids) WITH ORDINALITY AS y(pid, ord)
+            JOIN commit_graph pg ON pg.id = y.pid
+            JOIN commits cm ON cm.repo_id = p_repo_id AND cm.commit_oid = pg.commit_oid
+        ),
+        step AS (
+            SELECT cur.name, cur.oid, cur.mode, cur.here,
+                   (SELECT lc.last_commit_oid
+                    FROM last_commit_cache lc
+                    WHERE lc.repo_id = p_repo_id AND lc.commit_oid = cur.here
+                      AND lc.path = v_path AND lc.name = cur.name) AS cached,
+                   (SELECT par.pid
+                    FROM par
+                    JOIN tree_entries te ON te.repo_id = p_repo_id AND te.tree_oid = par.dir
+                    WHERE par.at = cur.at AND te.name = cur.name
+                      AND te.entry_oid = cur.oid AND te.mode = cur.mode
+                    ORDER BY par.ord
+                    LIMIT 1) AS next
+            FROM cur
+        )
+        SELECT array_agg(s.name) FILTER (WHERE s.cached IS NOT NULL OR s.next IS NULL),
+               array_agg(coalesce(s.cached, s.here)) FILTER (WHERE s.cached IS NOT NULL OR s.next IS NULL),
+               array_agg(s.next) FILTER (WHERE s.cached IS NULL AND s.next IS NOT NULL),
+               array_agg(s.name) FILTER (WHERE s.cached IS NULL AND s.next IS NOT NULL),
+               array_agg(s.oid) FILTER (WHERE s.cached IS NULL AND s.next IS NOT NULL),
+               array_agg(s.mode) FILTER (WHERE s.cached IS NULL AND s.next IS NOT NULL)
+        INTO v_step_names, v_step_commits, v_at, v_names, v_oids, v_modes
+        FROM step s;
+
+        v_res_names := v_res_names || coalesce(v_step_names, '{}');
+        v_res_commits := v_res_commits || coalesce(v_step_commits, '{}');
+    END LOOP;
+
+    INSERT INTO last_commit_cache (repo_id, commit_oid, path, name, last_commit_oid)
+    SELECT p_repo_id, p_commit, v_path, r.name, r.last
+    FROM unnest(v_res_names, v_res_commits) AS r(name, last)
+    ON CONFLICT DO NOTHING;
+
+    RETURN QUERY
+        SELECT r.name, r.last
+        FROM unnest(v_res_names, v_res_commits) AS r(name, last)
+        ORDER BY r.name;
+END;
+$$;
@@ -2,7 +2,7 @@
 -- Type names: 1=commit, 2=tree, 3=blob, 4=tag
 CREATE OR REPLACE FUNCTION git_type_name(obj_type smallint)
 RETURNS text
-LANGUAGE sql IMMUTABLE STRICT AS $$
+LANGUAGE sql IMMUTABLE STRICT PARALLEL SAFE AS $$
     SELECT CASE obj_type
         WHEN 1 THEN 'commit'
         WHEN 2 THEN 'tree'
@@ -13,7 +13,7 @@ $$;
 
 CREATE OR REPLACE FUNCTION git_object_hash(obj_type smallint, content bytea)
 RETURNS bytea
-LANGUAGE sql IMMUTABLE STRICT AS $$
+LANGUAGE sql IMMUTABLE STRICT PARALLEL SAFE AS $$
     SELECT digest(
         convert_to(git_type_name(obj_type) || ' ' || octet_length(content)::text, 'UTF8')
         || '\x00'::bytea
@@ -11,28 +11,192 @@ DECLARE
 BEGIN
     v_oid := git_object_hash(p_type, p_content);
 
-    INSERT INTO objects (repo_id, oid, type, size, content)
-    VALUES (p_repo_id, v_oid, p_type, octet_length(p_content), p_content)
-    ON CONFLICT (repo_id, oid) DO NOTHING;
+    -- An object one of the repository's alternates stores is shared, not copied
+    IF NOT EXISTS (SELECT 1 FROM git_share_objects(p_repo_id, ARRAY[v_oid])) THEN
+        INSERT INTO objects (repo_id, oid, type, size, content)
+        VALUES (p_repo_id, v_oid, p_type, octet_length(p_content), p_content)
+        ON CONFLICT (repo_id, oid) DO NOTHING;
+    END IF;
 
     RETURN v_oid;
 END;
 $$;
 
--- Read a git object by exact OID
+-- Apply a git delta (the format used by OFS_DELTA/REF_DELTA pack entries)
+-- to its base.  The delta starts with the base and target sizes as
+-- little-endian base-128 varints, followed by copy and insert opcodes.
+CREATE OR REPLACE FUNCTION git_delta_apply(p_base bytea, p_delta bytea)
+RETURNS bytea
+LANGUAGE plpgsql IMMUTABLE STRICT AS $$
+DECLARE
+    v_len integer := octet_length(p_delta);
+    v_base_len integer := octet_length(p_base);
+    v_pos integer := 0;
+    v_base_size bigint := 0;
+    v_target_size bigint := 0;
+    v_shift integer;
+    v_c integer;
+    v_off bigint;
+    v_size bigint;
+    v_result bytea := '';
+BEGIN
+    v_shift := 0;
+    LOOP
+        v_c := get_byte(p_delta, v_pos);
+        v_pos := v_pos + 1;
+        v_base_size := v_base_size | ((v_c & 127)::bigint << v_shift);
+        v_shift := v_shift + 7;
+        EXIT WHEN v_c < 128;
+    END LOOP;
+
+    v_shift := 0;
+    LOOP
+        v_c := get_byte(p_delta, v_pos);
+        v_pos := v_pos + 1;
+        v_target_size := v_target_size | ((v_c & 127)::bigint << v_shift);
+        v_shift := v_shift + 7;
+        EXIT WHEN v_c < 128;
+    END LOOP;
+
+    IF v_base_size != v_base_len THEN
+        RAISE EXCEPTION 'delta base size mismatch: expected %, got %', v_base_size, v_base_len;
+    END IF;
+
+    WHILE v_pos < v_len LOOP
+        v_c := get_byte(p_delta, v_pos);
+        v_pos := v_pos + 1;
+
+        IF v_c >= 128 THEN
+            -- Copy from base: bits 0-3 select offset bytes, bits 4-6 size bytes
+            v_off := 0;
+            v_size := 0;
+            FOR i IN 0..3 LOOP
+                IF (v_c & (1 << i)) != 0 THEN
+                    v_off := v_off | (get_byte(p_delta, v_pos)::bigint << (8 * i));
+                    v_pos := v_pos + 1;
+                END IF;
+            END LOOP;
+            FOR i IN 0..2 LOOP
+                IF (v_c & (16 << i)) != 0 THEN
+                    v_size := v_size | (get_byte(p_delta, v_pos)::bigint << (8 * i));
+                    v_pos := v_pos + 1;
+                END IF;
+            END LOOP;
+            IF v_size = 0 THEN
+                v_size := 65536;
+            END IF;
+            IF v_off + v_size > v_base_len THEN
+                RAISE EXCEPTION 'corrupt delta: copy past end of base';
+            END IF;
+            v_result := v_result || substring(p_base FROM v_off::integer + 1 FOR v_size::integer);
+        ELSIF v_c > 0 THEN
+            -- Insert the next v_c literal bytes
+            IF v_pos + v_c > v_len THEN
+                RAISE EXCEPTION 'corrupt delta: insert past end of delta';
+            END IF;
+            v_result := v_result || substring(p_delta FROM v_pos + 1 FOR v_c);
+            v_pos := v_pos + v_c;
+        ELSE
+            RAISE EXCEPTION 'corrupt delta: reserved opcode 0';
+        END IF;
+    END LOOP;
+
+    IF octet_length(v_result) != v_target_size THEN
+        RAISE EXCEPTION 'corrupt delta: expected % bytes, produced %', v_target_size, octet_length(v_result);
+    END IF;
+
+    RETURN v_result;
+END;
+$$;
+
+-- The repositories whose objects p_repo_id can read: itself, then its
+-- alternates (see repository_alternates) and theirs, nearest first.
+CREATE OR REPLACE FUNCTION git_object_repos(p_repo_id integer)
+RETURNS integer[]
+LANGUAGE sql STABLE STRICT AS $$
+    WITH RECURSIVE chain(id, depth) AS (
+        SELECT p_repo_id, 0
+        UNION
+        SELECT a.alternate_id, c.depth + 1
+        FROM chain c
+        JOIN repository_alternates a ON a.repo_id = c.id
+        WHERE c.depth < 16
+    )
+    SELECT array_agg(id ORDER BY depth)
+    FROM (SELECT id, min(depth) AS depth FROM chain GROUP BY id) s;
+$$;
+
+-- The row for p_oid in the first of p_repos (a git_object_repos list)
+-- that stores it.  Each repository is probed on its own rather than
+-- with repo_id = ANY(p_repos), which can't be pruned, so every probe
+-- reads one partition of objects.
+CREATE OR REPLACE FUNCTION git_object_find(p_repos integer[], p_oid bytea)
+RETURNS TABLE(repo_id integer, oid bytea, type smallint, size integer, content bytea,
+              base_oid bytea, depth smallint, chunked boolean)
+LANGUAGE sql STABLE AS $$
+    SELECT o.repo_id, o.oid, o.type, o.size, o.content, o.base_oid, o.depth, o.chunked
+    FROM unnest(p_repos) WITH ORDINALITY AS r(id, n)
+    CROSS JOIN LATERAL (SELECT * FROM objects WHERE objects.repo_id = r.id AND objects.oid = p_oid) o
+    ORDER BY r.n
+    LIMIT 1;
+$$;
+
+-- Read a git object by exact OID, resolving delta chains.  Objects the
+-- repository doesn't store are read from its alternates.
 CREATE OR REPLACE FUNCTION git_object_read(
     p_repo_id integer,
     p_oid bytea
 )
 RETURNS TABLE(type smallint, size integer, content bytea)
-LANGUAGE sql STABLE STRICT AS $$
-    SELECT o.type, o.size, o.content
-    FROM objects o
-    WHERE o.repo_id = p_repo_id AND o.oid = p_oid;
+LANGUAGE plpgsql STABLE STRICT AS $$
+DECLARE
+    v_repos integer[] := git_object_repos(p_repo_id);
+    v_link record;
+    v_content bytea;
+BEGIN
+    -- Objects stored as deltas name their base.  Walk the chain down to
+    -- a full object, then apply the deltas back up to the one asked for.
+    -- A base can live in a different repository than its delta, and an
+    -- object stored in several is read from the nearest.
+    FOR v_link IN
+        WITH RECURSIVE chain AS (
+            SELECT o.repo_id, o.oid, o.type, o.size, o.content, o.base_oid, o.chunked, 0 AS n
+            FROM git_object_find(v_repos, p_oid) o
+            UNION ALL
+            SELECT b.repo_id, b.oid, b.type, b.size, b.content, b.base_oid, b.chunked, c.n + 1
+            FROM chain c, LATERAL git_object_find(v_repos, c.base_oid) b
+        )
+        SELECT * FROM chain ORDER BY chain.n DESC
+    LOOP
+        IF v_content IS NULL THEN
+            IF v_link.base_oid IS NOT NULL THEN
+                RAISE EXCEPTION 'missing delta base % for object %',
+                    encode(v_link.base_oid, 'hex'), encode(p_oid, 'hex');
+            END IF;
+            IF v_link.chunked THEN
+                SELECT coalesce(string_agg(k.data, ''::bytea ORDER BY k.chunk_no), ''::bytea)
+                INTO v_content
+                FROM object_chunks k
+                WHERE k.repo_id = v_link.repo_id AND k.oid = v_link.oid;
+            ELSE
+                v_content := v_link.content;
+            END IF;
+        ELSE
+            v_content := git_delta_apply(v_content, v_link.content);
+        END IF;
+        type := v_link.type;
+        size := v_link.size;
+    END LOOP;
+
+    IF v_content IS NOT NULL THEN
+        content := v_content;
+        RETURN NEXT;
+    END IF;
+END;
 $$;
 
 -- Read a git object by OID prefix (abbreviated OID)
--- Returns error if ambiguous (more than one match)
+-- Returns at most two rows; two rows means the prefix is ambiguous
 CREATE OR REPLACE FUNCTION git_object_read_prefix(
     p_repo_id integer,
     p_prefix bytea,
@@ -41,20 +205,61 @@ CREATE OR REPLACE FUNCTION git_object_read_prefix(
 RETURNS TABLE(oid bytea, type smallint, size integer, content bytea)
 LANGUAGE plpgsql STABLE AS $$
 DECLARE
-    v_count integer;
-    v_mask bytea;
-    v_prefix_bytes integer;
+    v_repos integer[] := git_object_repos(p_repo_id);
+    v_lo bytea;
+    v_hi bytea;
+    v_full integer := p_prefix_len / 2;
+    v_step integer := 1;
+    v_byte integer;
+    i integer;
 BEGIN
-    -- Full bytes to compare
-    v_prefix_bytes := p_prefix_len / 2;
+    -- Turn the prefix into a [lo, hi) range on the primary key so the
+    -- (repo_id, oid) btree serves it.  An odd trailing hex digit only
+    -- fixes the high nibble of the next byte.
+    v_lo := substring(p_prefix FROM 1 FOR v_full);
+    IF p_prefix_len % 2 = 1 THEN
+        v_lo := v_lo || set_byte('\x00'::bytea, 0, get_byte(p_prefix, v_full) & 240);
+        v_step := 16;
+    END IF;
 
-    -- Check objects whose OID starts with the given prefix bytes
-    RETURN QUERY
-    SELECT o.oid, o.type, o.size, o.content
-    FROM objects o
-    WHERE o.repo_id = p_repo_id
-      AND substring(o.oid FROM 1 FOR v_prefix_bytes) = substring(p_prefix FROM 1 FOR v_prefix_bytes);
+    -- hi is lo with its last digit incremented; trailing bytes that would
+    -- overflow are dropped.  A prefix of all f's has no upper bound.
+    i := length(v_lo) - 1;
+    WHILE i >= 0 LOOP
+        v_byte := get_byte(v_lo, i) + v_step;
+        IF v_byte < 256 THEN
+            v_hi := set_byte(substring(v_lo FROM 1 FOR i + 1), i, v_byte);
+            EXIT;
+        END IF;
+        v_step := 1;
+        i := i - 1;
+    END LOOP;
 
-    RETURN;
+    -- Two rows are enough to tell a unique match from an ambiguous one
+    IF v_hi IS NULL THEN
+        RETURN QUERY
+        SELECT m.oid, r.type, r.size, r.content
+        FROM (SELECT DISTINCT o.oid
+              FROM unnest(v_repos) AS r(id)
+              CROSS JOIN LATERAL (SELECT o.oid FROM objects o
+                                  WHERE o.repo_id = r.id AND o.oid >= v_lo
+                                  ORDER BY o.oid
+                                  LIMIT 2) o
+              ORDER BY o.oid
+              LIMIT 2) m,
+             LATERAL git_object_read(p_repo_id, m.oid) r;
+    ELSE
+        RETURN QUERY
+        SELECT m.oid, r.type, r.size, r.content
+        FROM (SELECT DISTINCT o.oid
+              FROM unnest(v_repos) AS r(id)
+              CROSS JOIN LATERAL (SELECT o.oid FROM objects o
+                                  WHERE o.repo_id = r.id AND o.oid >= v_lo AND o.oid < v_hi
+                                  ORDER BY o.oid
+                                  LIMIT 2) o
+              ORDER BY o.oid
+              LIMIT 2) m,
+             LATERAL git_object_read(p_repo_id, m.oid) r;
+    END IF;
 END;
 $$;
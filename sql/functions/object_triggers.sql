@@ -0,0 +1,79 @@
+-- Keep commits and tree_entries in step with objects.  The triggers are
+-- statement level, so a push that merges thousands of objects with one
+-- INSERT ... SELECT parses them all in one pass over the transition
+-- table.  Rows skipped by ON CONFLICT DO NOTHING are not in it.
+CREATE OR REPLACE FUNCTION git_objects_inserted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    INSERT INTO commits (repo_id, commit_oid, sha, tree_oid, parent_oids,
+                         author_name, author_email, authored_at,
+                         committer_name, committer_email, committed_at, message)
+    SELECT n.repo_id, n.oid, encode(n.oid, 'hex'), c.tree_oid, c.parent_oids,
+           c.author_name, c.author_email, to_timestamp(c.author_timestamp),
+           c.committer_name, c.committer_email, to_timestamp(c.committer_timestamp),
+           c.message
+    FROM new_objects n, LATERAL git_commit_parse(n.content) c
+    WHERE n.type = 1
+    ON CONFLICT (repo_id, commit_oid) DO NOTHING;
+
+    INSERT INTO tree_entries (repo_id, tree_oid, mode, name, entry_oid)
+    SELECT n.repo_id, n.oid, e.mode, e.name, e.entry_oid
+    FROM new_objects n, LATERAL git_tree_entries(n.content) e
+    WHERE n.type = 2;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION git_objects_deleted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    DELETE FROM commits c
+    USING old_objects o
+    WHERE o.type = 1 AND c.repo_id = o.repo_id AND c.commit_oid = o.oid;
+
+    DELETE FROM tree_entries t
+    USING old_objects o
+    WHERE o.type = 2 AND t.repo_id = o.repo_id AND t.tree_oid = o.oid;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE OR REPLACE TRIGGER objects_inserted
+    AFTER INSERT ON objects
+    REFERENCING NEW TABLE AS new_objects
+    FOR EACH STATEMENT EXECUTE FUNCTION git_objects_inserted();
+
+CREATE OR REPLACE TRIGGER objects_deleted
+    AFTER DELETE ON objects
+    REFERENCING OLD TABLE AS old_objects
+    FOR EACH STATEMENT EXECUTE FUNCTION git_objects_deleted();
+
+-- Fill commits and tree_entries from objects stored before the triggers
+-- existed, for one repository or all of them.  Safe to run again.
+CREATE OR REPLACE FUNCTION git_backfill_commits_and_trees(p_repo_id integer DEFAULT NULL)
+RETURNS void
+LANGUAGE sql AS $$
+    INSERT INTO commits (repo_id, commit_oid, sha, tree_oid, parent_oids,
+                         author_name, author_email, authored_at,
+                         committer_name, committer_email, committed_at, message)
+    SELECT o.repo_id, o.oid, encode(o.oid, 'hex'), c.tree_oid, c.parent_oids,
+           c.author_name, c.author_email, to_timestamp(c.author_timestamp),
+           c.committer_name, c.committer_email, to_timestamp(c.committer_timestamp),
+           c.message
+    FROM objects o, LATERAL git_commit_parse(o.content) c
+    WHERE o.type = 1 AND (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+    ON CONFLICT (repo_id, commit_oid) DO NOTHING;
+
+    INSERT INTO tree_entries (repo_id, tree_oid, mode, name, entry_oid)
+    SELECT o.repo_id, o.oid, e.mode, e.name, e.entry_oid
+    FROM objects o, LATERAL git_tree_entries(o.content) e
+    WHERE o.type = 2 AND (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+      AND NOT EXISTS (
+          SELECT 1 FROM tree_entries t
+          WHERE t.repo_id = o.repo_id AND t.tree_oid = o.oid
+      );
+$$;
@@ -0,0 +1,14 @@
+-- Unlink a cached pack's large object along with its row, including
+-- rows removed by deleting the repository.
+CREATE OR REPLACE FUNCTION git_pack_cache_deleted()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    PERFORM lo_unlink(OLD.pack);
+    RETURN NULL;
+END;
+$$;
+
+CREATE OR REPLACE TRIGGER pack_cache_deleted
+    AFTER DELETE ON pack_cache
+    FOR EACH ROW EXECUTE FUNCTION git_pack_cache_deleted();
@@ -1,3 +1,27 @@
+-- Advisory lock key for a ref: FNV-1a over the big-endian repo id and
+-- the UTF-8 name, the key the refdb backend's hash_refname computes, so
+-- SQL and libgit2 writers of a ref queue on the same lock.  The row
+-- lock alone doesn't cover a ref that doesn't exist yet.
+CREATE OR REPLACE FUNCTION git_ref_lock_key(p_repo_id integer, p_name text)
+RETURNS bigint
+LANGUAGE plpgsql IMMUTABLE STRICT AS $$
+DECLARE
+    v_bytes bytea := int4send(p_repo_id) || convert_to(p_name, 'UTF8');
+    v_hash numeric := 14695981039346656037;
+    v_low integer;
+BEGIN
+    FOR i IN 0 .. length(v_bytes) - 1 LOOP
+        v_low := mod(v_hash, 256)::integer;
+        v_hash := v_hash - v_low + (v_low # get_byte(v_bytes, i));
+        v_hash := mod(v_hash * 1099511628211, 18446744073709551616);
+    END LOOP;
+    IF v_hash >= 9223372036854775808 THEN
+        v_hash := v_hash - 18446744073709551616;
+    END IF;
+    RETURN v_hash::bigint;
+END;
+$$;
+
 -- Compare-and-swap ref update with optional force
 CREATE OR REPLACE FUNCTION git_ref_update(
     p_repo_id integer,
@@ -11,6 +35,8 @@ LANGUAGE plpgsql AS $$
 DECLARE
     v_current_oid bytea;
 BEGIN
+    PERFORM pg_advisory_xact_lock(git_ref_lock_key(p_repo_id, p_name));
+
     -- Lock the row if it exists
     SELECT oid INTO v_current_oid
     FROM refs
@@ -57,9 +83,157 @@ CREATE OR REPLACE FUNCTION git_ref_set_symbolic(
 RETURNS void
 LANGUAGE plpgsql AS $$
 BEGIN
+    PERFORM pg_advisory_xact_lock(git_ref_lock_key(p_repo_id, p_name));
+
     INSERT INTO refs (repo_id, name, symbolic)
     VALUES (p_repo_id, p_name, p_target)
     ON CONFLICT (repo_id, name) DO UPDATE
     SET oid = NULL, symbolic = p_target;
 END;
 $$;
+
+-- Record ref changes in ref_events.  Statement level, so a push that
+-- moves many refs in one statement is one insert.  An update is matched
+-- up by name, so a rename shows as a delete and a create; changes
+-- between a symbolic and a direct ref show as a create or a delete.
+CREATE OR REPLACE FUNCTION git_refs_changed()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    IF TG_OP = 'INSERT' THEN
+        INSERT INTO ref_events (repo_id, ref_name, old_oid, new_oid)
+        SELECT n.repo_id, n.name, NULL, n.oid
+        FROM new_refs n
+        WHERE n.oid IS NOT NULL;
+    ELSIF TG_OP = 'DELETE' THEN
+        INSERT INTO ref_events (repo_id, ref_name, old_oid, new_oid)
+        SELECT o.repo_id, o.name, o.oid, NULL
+        FROM old_refs o
+        WHERE o.oid IS NOT NULL;
+    ELSE
+        INSERT INTO ref_events (repo_id, ref_name, old_oid, new_oid)
+        SELECT coalesce(n.repo_id, o.repo_id), coalesce(n.name, o.name), o.oid, n.oid
+        FROM old_refs o
+        FULL JOIN new_refs n ON n.repo_id = o.repo_id AND n.name = o.name
+        WHERE o.oid IS DISTINCT FROM n.oid;
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE OR REPLACE TRIGGER refs_inserted
+    AFTER INSERT ON refs
+    REFERENCING NEW TABLE AS new_refs
+    FOR EACH STATEMENT EXECUTE FUNCTION git_refs_changed();
+
+CREATE OR REPLACE TRIGGER refs_updated
+    AFTER UPDATE ON refs
+    REFERENCING OLD TABLE AS old_refs NEW TABLE AS new_refs
+    FOR EACH STATEMENT EXECUTE FUNCTION git_refs_changed();
+
+CREATE OR REPLACE TRIGGER refs_deleted
+    AFTER DELETE ON refs
+    REFERENCING OLD TABLE AS old_refs
+    FOR EACH STATEMENT EXECUTE FUNCTION git_refs_changed();
+
+-- At commit, one notification on gitgres_refs per repository the
+-- transaction changed refs in, however many statements it took:
+--
+--   {"repo_id": 1, "first_id": 41, "last_id": 41, "count": 1,
+--    "ref": "refs/heads/main", "old": "<hex>", "new": "<hex>", "reflog_id": 7}
+--
+-- first_id and last_id bound the transaction's events.  The ref, oids
+-- and reflog id are only there when count is 1; otherwise read the
+-- events with git_ref_events from the last one handled.  The first event
+-- of each repository sends the notification and the rest are skipped.
+CREATE OR REPLACE FUNCTION git_ref_events_notify()
+RETURNS trigger
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_flag text := 'gitgres.ref_events_' || NEW.repo_id;
+    v_last bigint;
+    v_count bigint;
+    v_payload jsonb;
+BEGIN
+    IF current_setting(v_flag, true) = NEW.xact::text THEN
+        RETURN NULL;
+    END IF;
+    PERFORM set_config(v_flag, NEW.xact::text, true);
+
+    SELECT max(e.id), count(*) INTO v_last, v_count
+    FROM ref_events e
+    WHERE e.repo_id = NEW.repo_id AND e.id >= NEW.id AND e.xact = NEW.xact;
+
+    v_payload := jsonb_build_object('repo_id', NEW.repo_id, 'first_id', NEW.id,
+                                    'last_id', v_last, 'count', v_count);
+    IF v_count = 1 THEN
+        v_payload := v_payload || (
+            SELECT jsonb_build_object('ref', NEW.ref_name, 'old', encode(NEW.old_oid, 'hex'),
+                                      'new', encode(NEW.new_oid, 'hex'), 'reflog_id', max(r.id))
+            FROM reflog r
+            WHERE r.repo_id = NEW.repo_id AND r.ref_name = NEW.ref_name
+              AND r.created_at = NEW.created_at AND r.new_oid = NEW.new_oid
+        );
+    END IF;
+
+    PERFORM pg_notify('gitgres_refs', v_payload::text);
+    RETURN NULL;
+END;
+$$;
+
+DROP TRIGGER IF EXISTS ref_events_notify ON ref_events;
+CREATE CONSTRAINT TRIGGER ref_events_notify
+    AFTER INSERT ON ref_events
+    DEFERRABLE INITIALLY DEFERRED
+    FOR EACH ROW EXECUTE FUNCTION git_ref_events_notify();
+
+-- Ref changes after event p_after in one repository or, with a NULL
+-- p_repo_id, in all of them.  A consumer keeps the last id it handled
+-- and reads on from there after reconnecting.  reflog_id is the reflog
+-- row the same transaction wrote for the change, if any.
+--
+-- Ids are taken before commit, so they don't arrive in order.  Events
+-- come grouped by transaction id instead, and only from transactions
+-- older than every one still running (or from the caller's own), so an
+-- event can't later appear before one already returned.  If p_after has
+-- been pruned, every event still kept is returned.
+CREATE OR REPLACE FUNCTION git_ref_events(
+    p_repo_id integer,
+    p_after bigint DEFAULT 0,
+    p_limit integer DEFAULT 1000
+)
+RETURNS TABLE(id bigint, repo_id integer, ref_name text, old_oid bytea, new_oid bytea,
+              reflog_id bigint, created_at timestamptz)
+LANGUAGE sql STABLE AS $$
+    SELECT e.id, e.repo_id, e.ref_name, e.old_oid, e.new_oid, l.id, e.created_at
+    FROM ref_events e
+    LEFT JOIN LATERAL (
+        SELECT r.id
+        FROM reflog r
+        WHERE r.repo_id = e.repo_id AND r.ref_name = e.ref_name
+          AND r.created_at = e.created_at AND r.new_oid = e.new_oid
+        ORDER BY r.id DESC
+        LIMIT 1
+    ) l ON true
+    WHERE (p_repo_id IS NULL OR e.repo_id = p_repo_id)
+      AND (e.xact, e.id) > (coalesce((SELECT c.xact FROM ref_events c WHERE c.id = p_after), 0), p_after)
+      AND (e.xact < txid_snapshot_xmin(txid_current_snapshot())
+           OR e.xact = txid_current_if_assigned())
+    ORDER BY e.xact, e.id
+    LIMIT p_limit;
+$$;
+
+-- Delete events older than p_keep and return how many went.  Run it
+-- periodically, from cron or pg_cron; a consumer that falls further
+-- behind than p_keep misses events and should resync from refs.
+CREATE OR REPLACE FUNCTION git_ref_events_prune(p_keep interval DEFAULT '30 days')
+RETURNS bigint
+LANGUAGE sql AS $$
+    WITH gone AS (
+        DELETE FROM ref_events
+        WHERE created_at < now() - p_keep
+        RETURNING 1
+    )
+    SELECT count(*) FROM gone;
+$$;
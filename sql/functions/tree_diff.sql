@@ -0,0 +1,223 @@
+-- Pair up the entries of two trees by name, keeping the ones that differ.
+-- Trees are named with a trailing '/', so a blob and a tree with the same
+-- name are unrelated entries, as in git.  A NULL or unstored tree reads
+-- as empty.
+CREATE OR REPLACE FUNCTION git_tree_entry_pairs(
+    p_repo_id integer,
+    p_old_tree bytea,
+    p_new_tree bytea
+)
+RETURNS TABLE(name text, old_mode text, new_mode text, old_oid bytea, new_oid bytea)
+LANGUAGE sql STABLE AS $$
+    WITH repos(ids) AS (
+        SELECT git_object_repos(p_repo_id)
+    ),
+    o AS (
+        SELECT e.name || CASE WHEN e.mode = '40000' THEN '/' ELSE '' END AS name,
+               e.mode, e.entry_oid
+        FROM repos r,
+             LATERAL git_object_find(r.ids, p_old_tree) t,
+             LATERAL git_tree_entries(t.content) e
+        WHERE t.type = 2
+    ),
+    n AS (
+        SELECT e.name || CASE WHEN e.mode = '40000' THEN '/' ELSE '' END AS name,
+               e.mode, e.entry_oid
+        FROM repos r,
+             LATERAL git_object_find(r.ids, p_new_tree) t,
+             LATERAL git_tree_entries(t.content) e
+        WHERE t.type = 2
+    )
+    SELECT coalesce(o.name, n.name), o.mode, n.mode, o.entry_oid, n.entry_oid
+    FROM o FULL JOIN n ON n.name = o.name
+    WHERE o.entry_oid IS DISTINCT FROM n.entry_oid
+       OR o.mode IS DISTINCT FROM n.mode;
+$$;
+
+-- Similarity of two blobs as a percentage: the bytes of the lines (each
+-- with its newline) they have in common, over the size of the larger.
+CREATE OR REPLACE FUNCTION git_blob_similarity(p_old bytea, p_new bytea)
+RETURNS integer
+LANGUAGE plpgsql IMMUTABLE STRICT AS $$
+DECLARE
+    v_old bytea[] := '{}';
+    v_new bytea[] := '{}';
+    v_lines bytea[];
+    v_blob bytea;
+    v_side integer;
+    v_len integer;
+    v_start integer;
+    v_pos integer;
+    v_copied bigint;
+BEGIN
+    IF octet_length(p_old) = 0 OR octet_length(p_new) = 0 THEN
+        RETURN 0;
+    END IF;
+
+    FOR v_side IN 1..2 LOOP
+        v_blob := CASE v_side WHEN 1 THEN p_old ELSE p_new END;
+        v_len := octet_length(v_blob);
+        v_lines := '{}';
+        v_start := 1;
+        FOR v_pos IN 1..v_len LOOP
+            IF get_byte(v_blob, v_pos - 1) = 10 OR v_pos = v_len THEN
+                v_lines := array_append(v_lines, substring(v_blob FROM v_start FOR v_pos - v_start + 1));
+                v_start := v_pos + 1;
+            END IF;
+        END LOOP;
+        IF v_side = 1 THEN
+            v_old := v_lines;
+        ELSE
+            v_new := v_lines;
+        END IF;
+    END LOOP;
+
+    SELECT coalesce(sum(least(a.n, b.n) * octet_length(a.line)), 0) INTO v_copied
+    FROM (SELECT l.line, count(*) AS n FROM unnest(v_old) AS l(line) GROUP BY l.line) a
+    JOIN (SELECT l.line, count(*) AS n FROM unnest(v_new) AS l(line) GROUP BY l.line) b
+      ON b.line = a.line;
+
+    RETURN (v_copied * 100 / greatest(octet_length(p_old), octet_length(p_new)))::integer;
+END;
+$$;
+
+-- Changed files between two trees, like git diff-tree -r.  status is A,
+-- D, M, T (the kind of file changed) or R.  Only subtrees whose oids
+-- differ are read.  With p_rename_threshold (0-100), a delete and an add
+-- of the same blob become a rename with similarity 100; remaining pairs
+-- of the same kind are scored with git_blob_similarity and matched best
+-- first when they reach the threshold.  Rows come in path order, renames
+-- at their new path.
+CREATE OR REPLACE FUNCTION git_diff_trees(
+    p_repo_id integer,
+    p_old_tree bytea,
+    p_new_tree bytea,
+    p_rename_threshold integer DEFAULT NULL
+)
+RETURNS TABLE(status text, path text, old_mode text, new_mode text,
+              old_oid bytea, new_oid bytea, old_path text, similarity integer)
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    v_status text[] := '{}';
+    v_path text[] := '{}';
+    v_old_mode text[] := '{}';
+    v_new_mode text[] := '{}';
+    v_old_oid bytea[] := '{}';
+    v_new_oid bytea[] := '{}';
+    v_old_path text[] := '{}';
+    v_score integer[] := '{}';
+    v_adds integer[] := '{}';
+    v_dels integer[] := '{}';
+    v_n integer := 0;
+    v_i integer;
+    v_j integer;
+    v_row record;
+BEGIN
+    IF p_rename_threshold < 0 OR p_rename_threshold > 100 THEN
+        RAISE EXCEPTION 'rename threshold must be between 0 and 100';
+    END IF;
+
+    IF p_old_tree = p_new_tree THEN
+        RETURN;
+    END IF;
+
+    FOR v_row IN
+        WITH RECURSIVE walk(path, old_mode, new_mode, old_oid, new_oid) AS (
+            SELECT e.name, e.old_mode, e.new_mode, e.old_oid, e.new_oid
+            FROM git_tree_entry_pairs(p_repo_id, p_old_tree, p_new_tree) e
+            UNION ALL
+            SELECT w.path || e.name, e.old_mode, e.new_mode, e.old_oid, e.new_oid
+            FROM walk w, LATERAL git_tree_entry_pairs(p_repo_id, w.old_oid, w.new_oid) e
+            WHERE right(w.path, 1) = '/'
+        )
+        SELECT w.* FROM walk w
+        WHERE right(w.path, 1) <> '/'
+        ORDER BY w.path COLLATE "C"
+    LOOP
+        v_n := v_n + 1;
+        v_status[v_n] := CASE
+            WHEN v_row.old_oid IS NULL THEN 'A'
+            WHEN v_row.new_oid IS NULL THEN 'D'
+            WHEN v_row.old_mode <> v_row.new_mode
+                 AND (v_row.old_mode IN ('120000', '160000')
+                      OR v_row.new_mode IN ('120000', '160000')) THEN 'T'
+            ELSE 'M'
+        END;
+        v_path[v_n] := v_row.path;
+        v_old_mode[v_n] := v_row.old_mode;
+        v_new_mode[v_n] := v_row.new_mode;
+        v_old_oid[v_n] := v_row.old_oid;
+        v_new_oid[v_n] := v_row.new_oid;
+    END LOOP;
+
+    IF p_rename_threshold IS NOT NULL THEN
+        -- Exact renames: the first unpaired delete of the same blob
+        FOR v_i IN 1..v_n LOOP
+            CONTINUE WHEN v_status[v_i] IS DISTINCT FROM 'A' OR v_new_mode[v_i] = '160000';
+            FOR v_j IN 1..v_n LOOP
+                IF v_status[v_j] = 'D' AND v_old_mode[v_j] <> '160000'
+                   AND v_old_oid[v_j] = v_new_oid[v_i]
+                   AND (v_old_mode[v_j] = '120000') = (v_new_mode[v_i] = '120000') THEN
+                    v_status[v_i] := 'R';
+                    v_old_path[v_i] := v_path[v_j];
+                    v_old_mode[v_i] := v_old_mode[v_j];
+                    v_old_oid[v_i] := v_old_oid[v_j];
+                    v_score[v_i] := 100;
+                    v_status[v_j] := NULL;
+                    EXIT;
+                END IF;
+            END LOOP;
+        END LOOP;
+
+        FOR v_i IN 1..v_n LOOP
+            IF v_status[v_i] = 'A' AND v_new_mode[v_i] <> '160000' THEN
+                v_adds := array_append(v_adds, v_i);
+            ELSIF v_status[v_i] = 'D' AND v_old_mode[v_i] <> '160000' THEN
+                v_dels := array_append(v_dels, v_i);
+            END IF;
+        END LOOP;
+
+        -- Similar renames, best score first, skipped for very large diffs
+        IF cardinality(v_adds) > 0 AND cardinality(v_dels) > 0
+           AND cardinality(v_adds)::bigint * cardinality(v_dels) <= 1000 * 1000 THEN
+            FOR v_row IN
+                WITH a AS (
+                    SELECT x.i, v_new_mode[x.i] = '120000' AS link, r.size, r.content
+                    FROM unnest(v_adds) AS x(i), LATERAL git_object_read(p_repo_id, v_new_oid[x.i]) r
+                ),
+                d AS (
+                    SELECT x.i, v_old_mode[x.i] = '120000' AS link, r.size, r.content
+                    FROM unnest(v_dels) AS x(i), LATERAL git_object_read(p_repo_id, v_old_oid[x.i]) r
+                )
+                SELECT a.i AS add_i, d.i AS del_i, git_blob_similarity(d.content, a.content) AS score
+                FROM a JOIN d ON d.link = a.link
+                WHERE least(a.size, d.size)::bigint * 100 / greatest(a.size, d.size, 1) >= p_rename_threshold
+                ORDER BY 3 DESC, 1, 2
+            LOOP
+                CONTINUE WHEN v_row.score < p_rename_threshold
+                    OR v_status[v_row.add_i] IS DISTINCT FROM 'A'
+                    OR v_status[v_row.del_i] IS DISTINCT FROM 'D';
+                v_status[v_row.add_i] := 'R';
+                v_old_path[v_row.add_i] := v_path[v_row.del_i];
+                v_old_mode[v_row.add_i] := v_old_mode[v_row.del_i];
+                v_old_oid[v_row.add_i] := v_old_oid[v_row.del_i];
+                v_score[v_row.add_i] := v_row.score;
+                v_status[v_row.del_i] := NULL;
+            END LOOP;
+        END IF;
+    END IF;
+
+    FOR v_i IN 1..v_n LOOP
+        CONTINUE WHEN v_status[v_i] IS NULL;
+        status := v_status[v_i];
+        path := v_path[v_i];
+        old_mode := v_old_mode[v_i];
+        new_mode := v_new_mode[v_i];
+        old_oid := v_old_oid[v_i];
+        new_oid := v_new_oid[v_i];
+        old_path := v_old_path[v_i];
+        similarity := v_score[v_i];
+        RETURN NEXT;
+    END LOOP;
+END;
+$$;
@@ -49,8 +49,8 @@ DECLARE
     v_entry record;
 BEGIN
     SELECT o.content INTO v_content
-    FROM objects o
-    WHERE o.repo_id = p_repo_id AND o.oid = p_tree_oid AND o.type = 2;
+    FROM git_object_find(git_object_repos(p_repo_id), p_tree_oid) o
+    WHERE o.type = 2;
 
     IF v_content IS NULL THEN
         RETURN;
@@ -76,3 +76,54 @@ BEGIN
     END LOOP;
 END;
 $$;
+
+-- Recursive tree listing with optional path filtering.  p_pathspec limits
+-- the result to entries at or under that path and only descends into the
+-- directories leading to it.  p_max_depth bounds how many levels below the
+-- root are expanded (0 lists just the root tree).  Rows are shaped like
+-- git_ls_tree_r's: trees have a trailing '/'.
+CREATE OR REPLACE FUNCTION git_tree_walk(
+    p_repo_id integer,
+    p_tree_oid bytea,
+    p_pathspec text DEFAULT '',
+    p_max_depth integer DEFAULT NULL
+)
+RETURNS TABLE(mode text, path text, oid bytea, obj_type text)
+LANGUAGE sql STABLE AS $$
+    WITH RECURSIVE spec(s) AS (
+        SELECT rtrim(coalesce(p_pathspec, ''), '/')
+    ),
+    repos(ids) AS (
+        SELECT git_object_repos(p_repo_id)
+    ),
+    walk(mode, path, oid, obj_type, depth) AS (
+        SELECT e.mode,
+               e.name || CASE WHEN e.mode = '40000' THEN '/' ELSE '' END,
+               e.entry_oid,
+               CASE e.mode WHEN '40000' THEN 'tree' WHEN '160000' THEN 'commit' ELSE 'blob' END,
+               0
+        FROM repos r,
+             LATERAL git_object_find(r.ids, p_tree_oid) o,
+             LATERAL git_tree_entries(o.content) e
+        WHERE o.type = 2
+        UNION ALL
+        SELECT e.mode,
+               w.path || e.name || CASE WHEN e.mode = '40000' THEN '/' ELSE '' END,
+               e.entry_oid,
+               CASE e.mode WHEN '40000' THEN 'tree' WHEN '160000' THEN 'commit' ELSE 'blob' END,
+               w.depth + 1
+        FROM walk w
+        CROSS JOIN spec
+        CROSS JOIN repos r,
+        LATERAL git_object_find(r.ids, w.oid) o,
+        LATERAL git_tree_entries(o.content) e
+        WHERE w.obj_type = 'tree' AND o.type = 2
+          AND (p_max_depth IS NULL OR w.depth < p_max_depth)
+          AND (spec.s = ''
+               OR starts_with(w.path, spec.s || '/')
+               OR starts_with(spec.s || '/', w.path))
+    )
+    SELECT w.mode, w.path, w.oid, w.obj_type
+    FROM walk w, spec
+    WHERE spec.s = '' OR w.path = spec.s OR starts_with(w.path, spec.s || '/');
+$$;
@@ -0,0 +1,59 @@
+-- Integrity checks: re-hash what is stored and report the objects whose
+-- content no longer matches their oid, as git fsck does for a
+-- repository's object files.
+
+-- What is wrong with an object stored under p_oid, or NULL if nothing
+-- is.  p_content is the object's full content, NULL if it couldn't be
+-- reassembled.
+CREATE OR REPLACE FUNCTION git_object_check(p_oid bytea, p_type smallint, p_size integer, p_content bytea)
+RETURNS text
+LANGUAGE sql IMMUTABLE PARALLEL SAFE AS $$
+    SELECT CASE
+        WHEN p_content IS NULL THEN 'missing content'
+        WHEN git_type_name(p_type) IS NULL THEN 'bad type'
+        WHEN octet_length(p_content) <> p_size THEN 'size mismatch'
+        WHEN git_object_hash(p_type, p_content) <> p_oid THEN 'hash mismatch'
+    END;
+$$;
+
+-- Check every object stored for p_repo_id, or for every repository when
+-- it is NULL, returning a row per bad object.  Objects stored whole are
+-- hashed by one query, which parallel query spreads over workers and
+-- partitions (up to max_parallel_workers_per_gather).  Deltas and
+-- chunked blobs are reassembled one at a time, so one that can't be is
+-- reported rather than ending the scan.
+CREATE OR REPLACE FUNCTION git_verify_objects(p_repo_id integer DEFAULT NULL)
+RETURNS TABLE(repo_id integer, oid bytea, type smallint, problem text)
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_obj record;
+    v_content bytea;
+BEGIN
+    RETURN QUERY
+    SELECT o.repo_id, o.oid, o.type, git_object_check(o.oid, o.type, o.size, o.content)
+    FROM objects o
+    WHERE (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+      AND NOT o.chunked AND o.base_oid IS NULL
+      AND git_object_check(o.oid, o.type, o.size, o.content) IS NOT NULL;
+
+    FOR v_obj IN
+        SELECT o.repo_id, o.oid, o.type, o.size
+        FROM objects o
+        WHERE (p_repo_id IS NULL OR o.repo_id = p_repo_id)
+          AND (o.chunked OR o.base_oid IS NOT NULL)
+    LOOP
+        BEGIN
+            v_content := (SELECT r.content FROM git_object_read(v_obj.repo_id, v_obj.oid) r);
+            problem := git_object_check(v_obj.oid, v_obj.type, v_obj.size, v_content);
+        EXCEPTION WHEN others THEN
+            problem := SQLERRM;
+        END;
+        IF problem IS NOT NULL THEN
+            repo_id := v_obj.repo_id;
+            oid := v_obj.oid;
+            type := v_obj.type;
+            RETURN NEXT;
+        END IF;
+    END LOOP;
+END;
+$$;
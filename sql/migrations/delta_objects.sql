@@ -0,0 +1,30 @@
+-- Add the base_oid and depth columns that delta-stored blobs use to
+-- the objects table of a database created before them.  Run it once,
+-- with psql, before loading the current sql/functions and before
+-- partition_objects.sql, which copies these columns:
+--
+--   psql -f sql/migrations/delta_objects.sql gitgres
+--
+-- Existing rows all hold whole objects, which is what the defaults
+-- say.  base_oid takes the type of objects.oid, so this works for the
+-- plain SQL install (bytea) and for the extension (git_oid) alike.
+
+\set ON_ERROR_STOP on
+
+BEGIN;
+
+DO $$
+DECLARE
+    v_oid_type text := (
+        SELECT format_type(atttypid, atttypmod) FROM pg_attribute
+        WHERE attrelid = 'objects'::regclass AND attname = 'oid'
+    );
+BEGIN
+    EXECUTE format('ALTER TABLE objects '
+                   'ADD COLUMN IF NOT EXISTS base_oid %s, '
+                   'ADD COLUMN IF NOT EXISTS depth smallint NOT NULL DEFAULT 0',
+                   v_oid_type);
+END;
+$$;
+
+COMMIT;
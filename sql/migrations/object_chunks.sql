@@ -0,0 +1,46 @@
+-- Add chunked blob storage, objects.chunked and the object_chunks
+-- table, to a database created before it.  Run it once, with psql,
+-- after delta_objects.sql and before loading the current sql/functions
+-- and before partition_objects.sql, which copies both tables:
+--
+--   psql -f sql/migrations/object_chunks.sql gitgres
+--
+-- Existing rows all hold their content inline.  object_chunks is
+-- created unpartitioned, like objects was; partition_objects.sql
+-- converts the two together.  Its oid takes the type of objects.oid
+-- and the extension takes ownership of it, so this works for the plain
+-- SQL install and for the extension alike.
+
+\set ON_ERROR_STOP on
+
+BEGIN;
+
+DO $$
+DECLARE
+    v_oid_type text := (
+        SELECT format_type(atttypid, atttypmod) FROM pg_attribute
+        WHERE attrelid = 'objects'::regclass AND attname = 'oid'
+    );
+BEGIN
+    ALTER TABLE objects ADD COLUMN IF NOT EXISTS chunked boolean NOT NULL DEFAULT false;
+
+    IF to_regclass('object_chunks') IS NOT NULL THEN
+        RETURN;
+    END IF;
+
+    EXECUTE format('CREATE TABLE object_chunks ('
+                   '    repo_id     integer NOT NULL,'
+                   '    oid         %s NOT NULL,'
+                   '    chunk_no    integer NOT NULL,'
+                   '    data        bytea NOT NULL,'
+                   '    PRIMARY KEY (repo_id, oid, chunk_no),'
+                   '    FOREIGN KEY (repo_id, oid) REFERENCES objects (repo_id, oid) ON DELETE CASCADE'
+                   ')', v_oid_type);
+
+    IF EXISTS (SELECT 1 FROM pg_extension WHERE extname = 'gitgres') THEN
+        ALTER EXTENSION gitgres ADD TABLE object_chunks;
+    END IF;
+END;
+$$;
+
+COMMIT;
@@ -0,0 +1,162 @@
+-- Move objects and object_chunks from the old single-table layout to
+-- the hash-partitioned one in sql/schema.sql.  Load the current
+-- sql/functions first, then run this once, with psql, in a maintenance
+-- window: both tables are locked while every row is copied.  The
+-- partition count defaults to 16, as in the schema:
+--
+--   psql -v partitions=64 -f sql/migrations/partition_objects.sql gitgres
+--
+-- The copy expects the columns and tables of the current schema: run
+-- delta_objects.sql and then object_chunks.sql first on a database
+-- that predates them.
+--
+-- Triggers on objects and the materialized views over it (commits_view,
+-- tree_entries_view) are recreated from their current definitions, so
+-- this works for the plain SQL install and for the extension alike.
+-- The new tables take their column types from the old ones, so
+-- git_oid columns stay git_oid.  The parsed tables (commits, tree_entries, blob_text, commit_graph)
+-- are left alone: the copy doesn't fire the insert triggers.
+
+\set ON_ERROR_STOP on
+\if :{?partitions}
+\else
+\set partitions 16
+\endif
+
+BEGIN;
+
+SELECT set_config('gitgres.partitions', :'partitions', true);
+
+DO $$
+DECLARE
+    v_parts integer := current_setting('gitgres.partitions')::integer;
+    v_extension boolean := EXISTS (SELECT 1 FROM pg_extension WHERE extname = 'gitgres');
+    v_oid_type text := (
+        SELECT format_type(atttypid, atttypmod) FROM pg_attribute
+        WHERE attrelid = 'objects'::regclass AND attname = 'oid'
+    );
+    v_content_type text := (
+        SELECT format_type(atttypid, atttypmod) FROM pg_attribute
+        WHERE attrelid = 'objects'::regclass AND attname = 'content'
+    );
+    v_base_type text := (
+        SELECT format_type(atttypid, atttypmod) FROM pg_attribute
+        WHERE attrelid = 'objects'::regclass AND attname = 'base_oid'
+    );
+    v_triggers text[];
+    v_views record;
+    v_def text;
+BEGIN
+    IF (SELECT relkind FROM pg_class WHERE oid = 'objects'::regclass) = 'p' THEN
+        RAISE NOTICE 'objects is already partitioned';
+        RETURN;
+    END IF;
+
+    IF to_regclass('object_chunks') IS NULL OR NOT EXISTS (
+        SELECT 1 FROM pg_attribute
+        WHERE attrelid = 'objects'::regclass AND attname IN ('base_oid', 'chunked')
+        HAVING count(*) = 2
+    ) THEN
+        RAISE EXCEPTION 'objects predates delta or chunked storage'
+            USING HINT = 'Run sql/migrations/delta_objects.sql and object_chunks.sql first.';
+    END IF;
+
+    LOCK TABLE objects, object_chunks IN ACCESS EXCLUSIVE MODE;
+
+    -- Definitions to recreate on the new tables.  They name "objects",
+    -- so they are read before the old table is renamed.
+    v_triggers := ARRAY(
+        SELECT pg_get_triggerdef(t.oid)
+        FROM pg_trigger t
+        WHERE t.tgrelid = 'objects'::regclass AND NOT t.tgisinternal
+    );
+    CREATE TEMP TABLE gitgres_views ON COMMIT DROP AS
+    SELECT v.relname::text AS name,
+           pg_get_viewdef(v.oid) AS def,
+           ARRAY(SELECT pg_get_indexdef(i.indexrelid) FROM pg_index i WHERE i.indrelid = v.oid) AS indexes
+    FROM pg_class v
+    WHERE v.relkind = 'm' AND v.oid IN (
+        SELECT r.ev_class FROM pg_depend d JOIN pg_rewrite r ON r.oid = d.objid
+        WHERE d.refobjid = 'objects'::regclass
+    );
+
+    FOR v_views IN SELECT * FROM gitgres_views LOOP
+        IF v_extension THEN
+            EXECUTE format('ALTER EXTENSION gitgres DROP MATERIALIZED VIEW %I', v_views.name);
+        END IF;
+        EXECUTE format('DROP MATERIALIZED VIEW %I', v_views.name);
+    END LOOP;
+
+    IF v_extension THEN
+        ALTER EXTENSION gitgres DROP TABLE object_chunks;
+        ALTER EXTENSION gitgres DROP TABLE objects;
+    END IF;
+    ALTER TABLE object_chunks RENAME TO object_chunks_unpartitioned;
+    ALTER TABLE objects RENAME TO objects_unpartitioned;
+    ALTER INDEX object_chunks_pkey RENAME TO object_chunks_unpartitioned_pkey;
+    ALTER INDEX objects_pkey RENAME TO objects_unpartitioned_pkey;
+
+    EXECUTE format('CREATE TABLE objects ('
+                   '    repo_id     integer NOT NULL REFERENCES repositories(id),'
+                   '    oid         %s NOT NULL,'
+                   '    type        smallint NOT NULL,'
+                   '    size        integer NOT NULL,'
+                   '    content     %s NOT NULL,'
+                   '    base_oid    %s,'
+                   '    depth       smallint NOT NULL DEFAULT 0,'
+                   '    chunked     boolean NOT NULL DEFAULT false,'
+                   '    PRIMARY KEY (repo_id, oid)'
+                   ') PARTITION BY HASH (repo_id)', v_oid_type, v_content_type, v_base_type);
+
+    EXECUTE format('CREATE TABLE object_chunks ('
+                   '    repo_id     integer NOT NULL,'
+                   '    oid         %s NOT NULL,'
+                   '    chunk_no    integer NOT NULL,'
+                   '    data        bytea NOT NULL,'
+                   '    PRIMARY KEY (repo_id, oid, chunk_no),'
+                   '    FOREIGN KEY (repo_id, oid) REFERENCES objects (repo_id, oid) ON DELETE CASCADE'
+                   ') PARTITION BY HASH (repo_id)', v_oid_type);
+
+    FOR i IN 0..v_parts - 1 LOOP
+        EXECUTE format('CREATE TABLE objects_p%s PARTITION OF objects '
+                       'FOR VALUES WITH (MODULUS %s, REMAINDER %s)', i, v_parts, i);
+        EXECUTE format('CREATE TABLE object_chunks_p%s PARTITION OF object_chunks '
+                       'FOR VALUES WITH (MODULUS %s, REMAINDER %s)', i, v_parts, i);
+    END LOOP;
+
+    INSERT INTO objects (repo_id, oid, type, size, content, base_oid, depth, chunked)
+    SELECT repo_id, oid, type, size, content, base_oid, depth, chunked FROM objects_unpartitioned;
+    INSERT INTO object_chunks SELECT * FROM object_chunks_unpartitioned;
+
+    DROP TABLE object_chunks_unpartitioned;
+    DROP TABLE objects_unpartitioned;
+
+    FOREACH v_def IN ARRAY v_triggers LOOP
+        EXECUTE v_def;
+    END LOOP;
+
+    FOR v_views IN SELECT * FROM gitgres_views LOOP
+        EXECUTE format('CREATE MATERIALIZED VIEW %I AS %s', v_views.name, rtrim(v_views.def, ';'));
+        FOREACH v_def IN ARRAY v_views.indexes LOOP
+            EXECUTE v_def;
+        END LOOP;
+        IF v_extension THEN
+            EXECUTE format('ALTER EXTENSION gitgres ADD MATERIALIZED VIEW %I', v_views.name);
+        END IF;
+    END LOOP;
+
+    IF v_extension THEN
+        ALTER EXTENSION gitgres ADD TABLE objects;
+        ALTER EXTENSION gitgres ADD TABLE object_chunks;
+        FOR i IN 0..v_parts - 1 LOOP
+            EXECUTE format('ALTER EXTENSION gitgres ADD TABLE objects_p%s', i);
+            EXECUTE format('ALTER EXTENSION gitgres ADD TABLE object_chunks_p%s', i);
+        END LOOP;
+    END IF;
+END;
+$$;
+
+COMMIT;
+
+ANALYZE objects;
+ANALYZE object_chunks;
@@ -0,0 +1,21 @@
+-- Add ref_events, which the triggers on refs in
+-- sql/functions/ref_manage.sql write to, to a database created before
+-- it.  Run it once, with psql, before loading the current sql/functions:
+--
+--   psql -f sql/migrations/ref_events.sql gitgres
+--
+-- Only the plain SQL install needs this; the extension's script creates
+-- the table along with the triggers.
+
+\set ON_ERROR_STOP on
+
+CREATE TABLE IF NOT EXISTS ref_events (
+    id          bigserial PRIMARY KEY,
+    repo_id     integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    ref_name    text COLLATE "C" NOT NULL,
+    old_oid     bytea,
+    new_oid     bytea,
+    xact        bigint NOT NULL DEFAULT txid_current(),
+    created_at  timestamptz NOT NULL DEFAULT now()
+);
+CREATE INDEX IF NOT EXISTS idx_ref_events_repo ON ref_events (repo_id, xact, id);
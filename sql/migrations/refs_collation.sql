@@ -0,0 +1,36 @@
+-- Switch ref names to the "C" collation in a database created before
+-- sql/schema.sql declared them that way.  The refdb backend scans a
+-- glob's literal prefix as a range of the refs primary key, which only
+-- matches git's bytewise order under "C".  Run it once, with psql:
+--
+--   psql -f sql/migrations/refs_collation.sql gitgres
+--
+-- Changing the collation rebuilds the indexes on the column, the refs
+-- primary key among them, so refs is locked while it runs.  Columns
+-- already in "C" are left alone, and ref_events is skipped if the
+-- ref_events migration hasn't been run yet.  Works for the plain SQL
+-- install and for the extension alike.
+
+\set ON_ERROR_STOP on
+
+BEGIN;
+
+DO $$
+DECLARE
+    v_column record;
+BEGIN
+    FOR v_column IN
+        SELECT a.attrelid::regclass AS rel, a.attname AS name
+        FROM pg_attribute a
+        JOIN (VALUES ('refs', 'name'), ('ref_events', 'ref_name')) AS c(rel, col)
+          ON a.attrelid = to_regclass(c.rel) AND a.attname = c.col
+        WHERE a.attcollation <> (SELECT oid FROM pg_collation
+                                 WHERE collname = 'C' AND collnamespace = 'pg_catalog'::regnamespace)
+    LOOP
+        EXECUTE format('ALTER TABLE %s ALTER COLUMN %I TYPE text COLLATE "C"',
+            v_column.rel, v_column.name);
+    END LOOP;
+END;
+$$;
+
+COMMIT;
@@ -1,4 +1,5 @@
 CREATE EXTENSION IF NOT EXISTS pgcrypto;
+CREATE EXTENSION IF NOT EXISTS pg_trgm;
 
 CREATE TABLE repositories (
     id          serial PRIMARY KEY,
@@ -6,19 +7,155 @@ CREATE TABLE repositories (
     created_at  timestamptz NOT NULL DEFAULT now()
 );
 
+-- Repositories whose objects a repository reads as its own, like git's
+-- objects/info/alternates.  A fork names its upstream here and stores
+-- only the objects the upstream doesn't have.  Deleting an upstream
+-- fails while forks still borrow from it; git_dissociate_repository
+-- copies what a fork borrows so it stands alone.
+CREATE TABLE repository_alternates (
+    repo_id      integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    alternate_id integer NOT NULL REFERENCES repositories(id),
+    PRIMARY KEY (repo_id, alternate_id),
+    CHECK (repo_id <> alternate_id)
+);
+
+-- objects and object_chunks are hash partitioned on repo_id, so one
+-- repository's rows and index entries live in a single partition that
+-- lookups by repo_id prune to, and vacuum and reindex work a partition
+-- at a time.  The partitions are created below.
+-- sql/migrations/partition_objects.sql converts an unpartitioned install.
 CREATE TABLE objects (
     repo_id     integer NOT NULL REFERENCES repositories(id),
     oid         bytea NOT NULL,
     type        smallint NOT NULL,
     size        integer NOT NULL,
     content     bytea NOT NULL,
+    -- When base_oid is set, content is a git delta against that object
+    -- and depth is the length of the chain below it (blobs only)
+    base_oid    bytea,
+    depth       smallint NOT NULL DEFAULT 0,
+    -- Large blobs are split across object_chunks and content is empty
+    chunked     boolean NOT NULL DEFAULT false,
+    PRIMARY KEY (repo_id, oid)
+) PARTITION BY HASH (repo_id);
+
+-- Content of chunked objects, in chunk_no order
+CREATE TABLE object_chunks (
+    repo_id     integer NOT NULL,
+    oid         bytea NOT NULL,
+    chunk_no    integer NOT NULL,
+    data        bytea NOT NULL,
+    PRIMARY KEY (repo_id, oid, chunk_no),
+    FOREIGN KEY (repo_id, oid) REFERENCES objects (repo_id, oid) ON DELETE CASCADE
+) PARTITION BY HASH (repo_id);
+
+DO $$
+BEGIN
+    FOR i IN 0..15 LOOP
+        EXECUTE format('CREATE TABLE objects_p%s PARTITION OF objects '
+                       'FOR VALUES WITH (MODULUS 16, REMAINDER %s)', i, i);
+        EXECUTE format('CREATE TABLE object_chunks_p%s PARTITION OF object_chunks '
+                       'FOR VALUES WITH (MODULUS 16, REMAINDER %s)', i, i);
+    END LOOP;
+END;
+$$;
+
+-- Parsed commits and tree entries with the columns of commits_view and
+-- tree_entries_view.  Triggers on objects keep them current as objects
+-- are inserted and deleted (sql/functions/object_triggers.sql).
+CREATE TABLE commits (
+    repo_id         integer NOT NULL,
+    commit_oid      bytea NOT NULL,
+    sha             text NOT NULL,
+    tree_oid        bytea,
+    parent_oids     bytea[],
+    author_name     text,
+    author_email    text,
+    authored_at     timestamptz,
+    committer_name  text,
+    committer_email text,
+    committed_at    timestamptz,
+    message         text,
+    PRIMARY KEY (repo_id, commit_oid)
+);
+
+CREATE TABLE tree_entries (
+    repo_id     integer NOT NULL,
+    tree_oid    bytea NOT NULL,
+    mode        text NOT NULL,
+    name        text NOT NULL,
+    entry_oid   bytea NOT NULL
+);
+CREATE INDEX idx_tree_entries_oid ON tree_entries (repo_id, tree_oid);
+
+-- One row per commit with a dense id, its parents' ids, its generation
+-- (1 for a root, else one more than its highest parent) and its commit
+-- date, like git's commit-graph file.  A parent that isn't stored yet
+-- has a placeholder row with NULL parent_ids, and generations stay NULL
+-- until all of a commit's ancestors are known.  Maintained from commits
+-- by triggers (sql/functions/commit_graph.sql).
+CREATE TABLE commit_graph (
+    id           bigint GENERATED ALWAYS AS IDENTITY PRIMARY KEY,
+    repo_id      integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    commit_oid   bytea NOT NULL,
+    parent_ids   bigint[],
+    generation   integer,
+    committed_at timestamptz,
+    UNIQUE (repo_id, commit_oid)
+);
+CREATE INDEX idx_commit_graph_unsettled ON commit_graph (repo_id) WHERE generation IS NULL;
+-- Unsettled children of a commit, for settling the commits below new ones
+CREATE INDEX idx_commit_graph_unsettled_parents ON commit_graph USING gin (parent_ids)
+    WHERE generation IS NULL;
+
+-- Text of blobs for git_grep, one row per blob.  Binary blobs, blobs
+-- over 1MB and blobs that are not UTF-8 have no row.  Maintained by
+-- triggers on objects (sql/functions/grep.sql).
+CREATE TABLE blob_text (
+    repo_id     integer NOT NULL,
+    oid         bytea NOT NULL,
+    content     text NOT NULL,
     PRIMARY KEY (repo_id, oid)
 );
-CREATE INDEX idx_objects_oid ON objects (oid);
+CREATE INDEX idx_blob_text_trgm ON blob_text USING gin (content gin_trgm_ops);
+
+-- Memoized git_last_commits results: the last commit that changed each
+-- entry of a directory as of a commit.  Commits never change, so rows
+-- never go stale.  path is '' for the root tree.
+CREATE TABLE last_commit_cache (
+    repo_id         integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    commit_oid      bytea NOT NULL,
+    path            text NOT NULL,
+    name            text NOT NULL,
+    last_commit_oid bytea NOT NULL,
+    PRIMARY KEY (repo_id, commit_oid, path, name)
+);
 
+-- Ready-made packs for serving clones, built by gitgres-backend
+-- pack-cache: everything reachable from tips, packed by libgit2's
+-- packbuilder.  The pack is a large object so it can be streamed out;
+-- idx is its index.  A clone writes both out unchanged and fetches what
+-- is newer than tips on top.  Large objects outlive the rows that point
+-- at them, so a trigger unlinks the pack when its row is deleted
+-- (sql/functions/pack_cache.sql).
+CREATE TABLE pack_cache (
+    id           serial PRIMARY KEY,
+    repo_id      integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    name         text NOT NULL,
+    tips         bytea[] NOT NULL,
+    pack         oid NOT NULL,
+    idx          bytea NOT NULL,
+    object_count integer NOT NULL,
+    created_at   timestamptz NOT NULL DEFAULT now()
+);
+CREATE INDEX idx_pack_cache_repo ON pack_cache (repo_id, id);
+
+-- Ref names use the "C" collation so they sort bytewise, as git sorts
+-- them, and so the backend can scan a glob's literal prefix as a range
+-- of the primary key.
 CREATE TABLE refs (
     repo_id     integer NOT NULL REFERENCES repositories(id),
-    name        text NOT NULL,
+    name        text COLLATE "C" NOT NULL,
     oid         bytea,
     symbolic    text,
     PRIMARY KEY (repo_id, name),
@@ -38,3 +175,17 @@ CREATE TABLE reflog (
     created_at  timestamptz NOT NULL DEFAULT now()
 );
 CREATE INDEX idx_reflog_ref ON reflog (repo_id, ref_name, id);
+
+-- Every change to a direct ref, whoever made it, appended by triggers
+-- on refs (sql/functions/ref_manage.sql).  Consumers of the gitgres_refs
+-- notification channel read it with git_ref_events to catch up.
+CREATE TABLE ref_events (
+    id          bigserial PRIMARY KEY,
+    repo_id     integer NOT NULL REFERENCES repositories(id) ON DELETE CASCADE,
+    ref_name    text COLLATE "C" NOT NULL,
+    old_oid     bytea,
+    new_oid     bytea,
+    xact        bigint NOT NULL DEFAULT txid_current(),
+    created_at  timestamptz NOT NULL DEFAULT now()
+);
+CREATE INDEX idx_ref_events_repo ON ref_events (repo_id, xact, id);
@@ -0,0 +1,92 @@
+require_relative "test_helper"
+
+class AlternatesTest < GitgresTest
+  def object_count(repo_id)
+    @conn.exec_params("SELECT count(*) FROM objects WHERE repo_id = $1", [repo_id])[0]["count"].to_i
+  end
+
+  def read_object(repo_id, oid)
+    result = @conn.exec_params(
+      "SELECT type, content FROM git_object_read($1, decode($2, 'hex'))",
+      [repo_id, oid], 1
+    )
+    result.ntuples > 0 ? result[0]["content"] : nil
+  end
+
+  def test_fork_shares_upstream_objects
+    dir = create_test_repo
+    FileUtils.mkdir_p(File.join(dir, "lib"))
+    File.write(File.join(dir, "README"), "hello\n")
+    File.write(File.join(dir, "lib", "a.rb"), "puts 'hello'\n")
+    system("git", "-C", dir, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+    commit = `git -C #{dir} rev-parse HEAD`.strip
+    tree = `git -C #{dir} rev-parse HEAD^{tree}`.strip
+    blob = `git -C #{dir} rev-parse HEAD:README`.strip
+    import_repo_objects(dir)
+    @conn.exec_params(
+      "INSERT INTO refs (repo_id, name, oid) VALUES ($1, 'refs/heads/main', decode($2, 'hex'))",
+      [@repo_id, commit]
+    )
+    upstream_objects = object_count(@repo_id)
+
+    fork = @conn.exec_params("SELECT git_fork_repository($1, 'test_fork')", [@repo_id])[0]["git_fork_repository"].to_i
+    assert_equal 0, object_count(fork)
+    assert_equal commit, @conn.exec_params(
+      "SELECT encode(oid, 'hex') AS oid FROM refs WHERE repo_id = $1 AND name = 'refs/heads/main'", [fork]
+    )[0]["oid"]
+
+    # Reads and the parsed tables see the upstream's objects
+    assert_equal "hello\n", read_object(fork, blob)
+    assert_equal ["README", "lib/", "lib/a.rb"],
+      @conn.exec_params("SELECT path FROM git_tree_walk($1, decode($2, 'hex'))", [fork, tree]).map { |r| r["path"] }.sort
+    assert_equal 1, @conn.exec_params("SELECT count(*) FROM commits WHERE repo_id = $1", [fork])[0]["count"].to_i
+    assert_equal ["README:1:hello"],
+      @conn.exec_params("SELECT path || ':' || line_no || ':' || line AS l FROM git_grep($1, 'main', 'hello$')", [fork]).map { |r| r["l"] }
+
+    # Writing an object the upstream has stores nothing; a new one is the fork's own
+    @conn.exec_params("SELECT git_object_write($1, 3::smallint, $2::bytea)", [fork, { value: "hello\n", format: 1 }])
+    assert_equal 0, object_count(fork)
+    own = @conn.exec_params(
+      "SELECT encode(git_object_write($1, 3::smallint, $2::bytea), 'hex') AS oid",
+      [fork, { value: "fork only\n", format: 1 }]
+    )[0]["oid"]
+    assert_equal 1, object_count(fork)
+    assert_nil read_object(@repo_id, own)
+
+    @conn.exec("SAVEPOINT upstream_delete")
+    assert_raises(PG::ForeignKeyViolation) do
+      @conn.exec_params("DELETE FROM repositories WHERE id = $1", [@repo_id])
+    end
+    @conn.exec("ROLLBACK TO SAVEPOINT upstream_delete")
+
+    copied = @conn.exec_params("SELECT git_dissociate_repository($1)", [fork])[0]["git_dissociate_repository"].to_i
+    assert_equal upstream_objects, copied
+    assert_equal upstream_objects + 1, object_count(fork)
+    assert_equal 0, @conn.exec_params("SELECT count(*) FROM repository_alternates WHERE repo_id = $1", [fork])[0]["count"].to_i
+    assert_equal 2, @conn.exec_params(
+      "SELECT count(*) FROM tree_entries WHERE repo_id = $1 AND tree_oid = decode($2, 'hex')", [fork, tree]
+    )[0]["count"].to_i
+    assert_equal "hello\n", read_object(fork, blob)
+
+    FileUtils.rm_rf(dir)
+  end
+
+  def test_fork_delta_on_an_upstream_base_is_indexed
+    base_oid = write_object(3, "hello world\n")
+    fork = @conn.exec_params("SELECT git_fork_repository($1, 'test_fork')", [@repo_id])[0]["git_fork_repository"].to_i
+
+    # copy 11 bytes from offset 0, then insert ", again\n"; the base is only upstream
+    content = "hello world, again\n"
+    oid = git_hash_object(3, content)
+    @conn.exec_params(
+      "INSERT INTO objects (repo_id, oid, type, size, content, base_oid, depth) " \
+      "VALUES ($1, decode($2, 'hex'), 3, $3, $4::bytea, decode($5, 'hex'), 1)",
+      [fork, oid, content.bytesize, { value: [12, 19, 0x90, 11, 8].pack("C*") + ", again\n", format: 1 }, base_oid]
+    )
+
+    assert_equal [content], @conn.exec_params(
+      "SELECT content FROM blob_text WHERE repo_id = $1 AND oid = decode($2, 'hex')", [fork, oid]
+    ).map { |r| r["content"] }
+  end
+end
@@ -0,0 +1,355 @@
+require_relative "test_helper"
+require "json"
+
+class BackendTest < GitgresTest
+  def setup
+    super
+    @backend = File.expand_path("../backend/gitgres-backend", __dir__)
+    skip "gitgres-backend not built" unless File.executable?(@backend)
+
+    # The backend uses its own connections, so work outside the transaction
+    @remote_repo = "backend_test_#{$$}_#{rand(10000)}"
+    @conn.exec("COMMIT")
+  end
+
+  def teardown
+    # A fork goes before the upstream it borrows from
+    [@remote_repo, "#{@remote_repo}_upstream"].each do |name|
+      result = @conn.exec_params("SELECT id FROM repositories WHERE name = $1", [name])
+      next if result.ntuples == 0
+      rid = result[0]["id"].to_i
+      @conn.exec_params("DELETE FROM reflog WHERE repo_id = $1", [rid])
+      @conn.exec_params("DELETE FROM refs WHERE repo_id = $1", [rid])
+      @conn.exec_params("DELETE FROM objects WHERE repo_id = $1", [rid])
+      @conn.exec_params("DELETE FROM pack_cache WHERE repo_id = $1", [rid])
+      @conn.exec_params("DELETE FROM repositories WHERE id = $1", [rid])
+    end
+    @conn.close
+  end
+
+  def test_parallel_push_and_clone
+    source = create_test_repo
+    FileUtils.mkdir_p(File.join(source, "lib"))
+    20.times do |i|
+      File.write(File.join(source, "lib", "file#{i}.txt"), "content #{i}\n")
+      system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+      system("git", "-C", source, "commit", "-m", "commit #{i}", out: File::NULL, err: File::NULL)
+    end
+
+    assert system(@backend, "push", "--jobs", "4", "dbname=gitgres_test", @remote_repo, source,
+      out: File::NULL, err: File::NULL), "parallel push failed"
+
+    expected = `git -C #{source} rev-list --objects --all`.split("\n").map { |l| l.split(" ").first }.sort
+    stored = @conn.exec_params(
+      "SELECT encode(o.oid, 'hex') AS oid FROM objects o JOIN repositories r ON r.id = o.repo_id WHERE r.name = $1",
+      [@remote_repo]
+    ).map { |r| r["oid"] }.sort
+    assert_equal expected, stored
+
+    clone_dir = Dir.mktmpdir("gitgres_clone")
+    FileUtils.rm_rf(clone_dir)
+    assert system(@backend, "clone", "--jobs", "3", "dbname=gitgres_test", @remote_repo, clone_dir,
+      out: File::NULL, err: File::NULL), "parallel clone failed"
+
+    assert_equal `git -C #{source} rev-parse HEAD`, `git -C #{clone_dir} rev-parse HEAD`
+    assert system("git", "-C", clone_dir, "fsck", "--full", out: File::NULL, err: File::NULL), "clone fails fsck"
+    assert_equal 20, Dir.glob(File.join(clone_dir, "lib", "*")).size
+
+    FileUtils.rm_rf(source)
+    FileUtils.rm_rf(clone_dir)
+  end
+
+  def test_clone_from_pack_cache
+    source = create_test_repo
+    3.times do |i|
+      File.write(File.join(source, "file#{i}.txt"), "content #{i}\n")
+      system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+      system("git", "-C", source, "commit", "-m", "commit #{i}", out: File::NULL, err: File::NULL)
+    end
+    assert system(@backend, "push", "dbname=gitgres_test", @remote_repo, source,
+      out: File::NULL, err: File::NULL), "push failed"
+
+    out, status = Open3.capture2(@backend, "pack-cache", "dbname=gitgres_test", @remote_repo)
+    assert status.success?, "pack-cache failed"
+    assert_match(/Cached pack of 9 objects/, out)
+
+    cached = @conn.exec_params(
+      "SELECT p.name, p.pack FROM pack_cache p JOIN repositories r ON r.id = p.repo_id WHERE r.name = $1",
+      [@remote_repo]
+    ).to_a
+    assert_equal 1, cached.size
+
+    # Pushed after the cached pack was built, so fetched on top of it
+    File.write(File.join(source, "later.txt"), "later\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "later", out: File::NULL, err: File::NULL)
+    assert system(@backend, "push", "dbname=gitgres_test", @remote_repo, source,
+      out: File::NULL, err: File::NULL), "second push failed"
+
+    clone_dir = Dir.mktmpdir("gitgres_clone")
+    FileUtils.rm_rf(clone_dir)
+    out, status = Open3.capture2(@backend, "clone", "dbname=gitgres_test", @remote_repo, clone_dir)
+    assert status.success?, "clone failed"
+    assert_match(/Cloned 9 objects from cached pack\nCloned 3 newer objects/, out)
+    assert File.exist?(File.join(clone_dir, ".git", "objects", "pack", "pack-#{cached[0]["name"]}.idx"))
+    assert_equal `git -C #{source} rev-parse HEAD`, `git -C #{clone_dir} rev-parse HEAD`
+    assert system("git", "-C", clone_dir, "fsck", "--full", out: File::NULL, err: File::NULL), "clone fails fsck"
+
+    # A rebuild replaces the old pack and unlinks its large object
+    assert system(@backend, "pack-cache", "dbname=gitgres_test", @remote_repo,
+      out: File::NULL, err: File::NULL), "second pack-cache failed"
+    names = @conn.exec_params(
+      "SELECT p.name FROM pack_cache p JOIN repositories r ON r.id = p.repo_id WHERE r.name = $1",
+      [@remote_repo]
+    ).map { |r| r["name"] }
+    assert_equal 1, names.size
+    refute_equal cached[0]["name"], names[0]
+    assert_equal 0, @conn.exec_params(
+      "SELECT count(*) FROM pg_largeobject_metadata WHERE oid = $1", [cached[0]["pack"]]
+    )[0]["count"].to_i
+
+    FileUtils.rm_rf(source)
+    FileUtils.rm_rf(clone_dir)
+  end
+
+  def test_push_moves_no_ref_when_one_fails
+    source = create_test_repo
+    File.write(File.join(source, "file.txt"), "one\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "one", out: File::NULL, err: File::NULL)
+    assert system(@backend, "push", "dbname=gitgres_test", @remote_repo, source,
+      out: File::NULL, err: File::NULL), "first push failed"
+    before = @conn.exec_params(
+      "SELECT f.name, encode(f.oid, 'hex') AS oid FROM refs f JOIN repositories r ON r.id = f.repo_id " \
+      "WHERE r.name = $1 ORDER BY f.name", [@remote_repo]
+    ).to_a
+
+    File.write(File.join(source, "file.txt"), "two\n")
+    system("git", "-C", source, "commit", "-am", "two", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "branch", "poison", out: File::NULL, err: File::NULL)
+
+    # The database refuses one ref of the batch
+    @conn.exec(<<~SQL)
+      CREATE FUNCTION backend_test_poison() RETURNS trigger LANGUAGE plpgsql AS $$
+      BEGIN
+          IF NEW.name = 'refs/heads/poison' THEN
+              RAISE EXCEPTION 'poisoned ref';
+          END IF;
+          RETURN NEW;
+      END;
+      $$;
+      CREATE TRIGGER backend_test_poison BEFORE INSERT OR UPDATE ON refs
+          FOR EACH ROW EXECUTE FUNCTION backend_test_poison();
+    SQL
+    begin
+      _, err, status = Open3.capture3(@backend, "push", "dbname=gitgres_test", @remote_repo, source)
+    ensure
+      @conn.exec("DROP TRIGGER backend_test_poison ON refs; DROP FUNCTION backend_test_poison()")
+    end
+    refute status.success?, "push with a refused ref succeeded"
+    assert_match(/poisoned ref/, err)
+
+    after = @conn.exec_params(
+      "SELECT f.name, encode(f.oid, 'hex') AS oid FROM refs f JOIN repositories r ON r.id = f.repo_id " \
+      "WHERE r.name = $1 ORDER BY f.name", [@remote_repo]
+    ).to_a
+    assert_equal before, after
+
+    FileUtils.rm_rf(source)
+  end
+
+  def ls_refs(*glob)
+    out, status = Open3.capture2(@backend, "ls-refs", "dbname=gitgres_test", @remote_repo, *glob)
+    assert status.success?, "ls-refs failed"
+    out.split("\n").map { |l| l.split(" ").last }
+  end
+
+  def test_ls_refs_pages_through_globs
+    assert system(@backend, "init", "dbname=gitgres_test", @remote_repo,
+      out: File::NULL, err: File::NULL), "init failed"
+    rid = @conn.exec_params("SELECT id FROM repositories WHERE name = $1", [@remote_repo])[0]["id"].to_i
+
+    # More tags than two pages of the iterator hold, and branch names
+    # that are LIKE wildcards or end in a byte the keyset bound can't
+    # simply be incremented past
+    tags = (0...2500).map { |i| format("refs/tags/v%04d", i) }
+    heads = %w[refs/heads/a_b refs/heads/axb refs/heads/a%c refs/heads/abc
+               refs/heads/ÿ refs/heads/ÿ1 refs/heads/ÿ2 refs/heads/Ā]
+    @conn.exec_params(
+      "INSERT INTO refs (repo_id, name, oid) " \
+      "SELECT $1, n, decode(repeat('ab', 20), 'hex') FROM unnest(string_to_array($2, E'\\n')) AS n",
+      [rid, (tags + heads).join("\n")]
+    )
+
+    assert_equal (tags + heads).sort, ls_refs
+    assert_equal tags, ls_refs("refs/tags/*")
+    assert_equal tags[1000, 1000], ls_refs("refs/tags/v1*")
+    assert_equal %w[refs/heads/a_b], ls_refs("refs/heads/a_*")
+    assert_equal %w[refs/heads/a%c], ls_refs("refs/heads/a%*")
+    assert_equal %w[refs/heads/a%c refs/heads/abc], ls_refs("*/a?c")
+    assert_equal %w[refs/heads/ÿ refs/heads/ÿ1 refs/heads/ÿ2], ls_refs("refs/heads/ÿ*")
+    assert_equal %w[refs/heads/Ā], ls_refs("refs/heads/Ā*")
+  end
+
+  # Feed oids to cat-file; returns its output and the stats it dumped
+  def cat_file(oids, env = {})
+    stats = File.join(Dir.mktmpdir("gitgres_stats"), "stats")
+    out, status = Open3.capture2({ "GITGRES_STATS" => stats }.merge(env),
+      @backend, "cat-file", "dbname=gitgres_test", @remote_repo,
+      stdin_data: oids.map { |o| "#{o}\n" }.join, binmode: true)
+    assert status.success?, "cat-file failed"
+    dumped = File.readlines(stats).map { |l| JSON.parse(l) }.to_h { |s| [s["op"], s["calls"]] }
+    FileUtils.rm_rf(File.dirname(stats))
+    [out, dumped]
+  end
+
+  def test_object_cache_hits_and_evictions
+    source = create_test_repo
+    random = Random.new(7)
+    contents = Array.new(6) { random.bytes(1000) }
+    contents.each_with_index { |c, i| File.binwrite(File.join(source, "blob#{i}"), c) }
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "blobs", out: File::NULL, err: File::NULL)
+    assert system(@backend, "push", "dbname=gitgres_test", @remote_repo, source,
+      out: File::NULL, err: File::NULL), "push failed"
+    blobs = (0...6).map { |i| `git -C #{source} rev-parse HEAD:blob#{i}`.strip }
+    expect = ->(*idx) { idx.map { |i| "#{blobs[i]} blob 1000\n".b + contents[i] + "\n" }.join }
+
+    # libgit2 keeps no blobs in its own cache, so every read reaches ours
+    out, stats = cat_file([blobs[0], blobs[0]])
+    assert_equal expect.call(0, 0), out
+    assert_equal 1, stats["odb.cache_miss"]
+    assert_equal 1, stats["odb.cache_hit"]
+    assert_nil stats["odb.cache_evict"]
+
+    # Four blobs fill the budget, so the fifth and sixth push the oldest
+    # out; the first is then read from the database again
+    out, stats = cat_file(blobs + [blobs[0], blobs[5]], "GITGRES_CACHE_BYTES" => "4000")
+    assert_equal expect.call(0, 1, 2, 3, 4, 5, 0, 5), out
+    assert_equal 7, stats["odb.cache_miss"]
+    assert_equal 1, stats["odb.cache_hit"]
+    assert_equal 3, stats["odb.cache_evict"]
+
+    FileUtils.rm_rf(source)
+  end
+
+  def test_batched_reads_keep_input_order
+    source = create_test_repo
+    File.write(File.join(source, "README"), "upstream\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "upstream", out: File::NULL, err: File::NULL)
+    upstream = `git -C #{source} rev-list --objects --all`.split("\n").map { |l| l.split(" ").first }
+    assert system(@backend, "push", "dbname=gitgres_test", "#{@remote_repo}_upstream", source,
+      out: File::NULL, err: File::NULL), "upstream push failed"
+    @conn.exec_params(
+      "SELECT git_fork_repository(id, $2) FROM repositories WHERE name = $1",
+      ["#{@remote_repo}_upstream", @remote_repo]
+    )
+
+    # More of the fork's own objects than one pipeline holds, some of
+    # them chunked, so they take the slow path after the fast ones
+    FileUtils.mkdir_p(File.join(source, "lib"))
+    300.times { |i| File.write(File.join(source, "lib", "f#{i}"), "file #{i}\n") }
+    3.times { |i| File.write(File.join(source, "big#{i}"), "#{i}" * 500) }
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "fork", out: File::NULL, err: File::NULL)
+    assert system({ "GITGRES_CHUNK_BYTES" => "100" }, @backend, "push", "dbname=gitgres_test", @remote_repo, source,
+      out: File::NULL, err: File::NULL), "fork push failed"
+    own = `git -C #{source} rev-list --objects --all`.split("\n").map { |l| l.split(" ").first } - upstream
+
+    # Interleaved with absent oids, one of them not even hex, past one
+    # array query's worth, and with an oid asked for twice
+    random = Random.new(9)
+    absent = Array.new(900) { random.bytes(20).unpack1("H*") } + ["not-an-oid"]
+    oids = (upstream + own + absent + [own[0], upstream[0]]).shuffle(random: random)
+    input = oids.map { |o| "#{o}\n" }.join
+
+    run = lambda do |*args|
+      out, status = Open3.capture2(@backend, "cat-file", *args, "dbname=gitgres_test", @remote_repo,
+        stdin_data: input, binmode: true)
+      assert status.success?, "cat-file #{args.join(" ")} failed"
+      out
+    end
+    expected, = Open3.capture2("git", "-C", source, "cat-file", "--batch", stdin_data: input, binmode: true)
+    assert_equal expected, run.call
+    assert_equal expected, run.call("--pipeline")
+
+    check, = Open3.capture2("git", "-C", source, "cat-file", "--batch-check", stdin_data: input)
+    check = check.split("\n").zip(oids).map do |line, oid|
+      upstream.include?(oid) ? "#{line} alternate" : line
+    end
+    assert_equal check, run.call("--batch-check").split("\n")
+
+    FileUtils.rm_rf(source)
+  end
+
+  def stored_oids
+    @conn.exec_params(
+      "SELECT encode(o.oid, 'hex') AS oid FROM objects o JOIN repositories r ON r.id = o.repo_id WHERE r.name = $1",
+      [@remote_repo]
+    ).map { |r| r["oid"] }.sort
+  end
+
+  def test_import_resumes
+    source = create_test_repo
+    5.times do |i|
+      File.write(File.join(source, "file#{i}.txt"), "content #{i}\n")
+      system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+      system("git", "-C", source, "commit", "-m", "commit #{i}", out: File::NULL, err: File::NULL)
+    end
+    system("git", "-C", source, "tag", "v1", out: File::NULL, err: File::NULL)
+
+    out, status = Open3.capture2(@backend, "import", "--jobs", "2", "dbname=gitgres_test", @remote_repo, source)
+    assert status.success?, "import failed"
+    assert_match(/Imported \d+ objects\n/, out)
+
+    expected = `git -C #{source} rev-list --objects --all`.split("\n").map { |l| l.split(" ").first }.sort
+    assert_equal expected, stored_oids
+
+    # Lose the blobs, as if the first run had stopped partway
+    @conn.exec_params(
+      "DELETE FROM objects WHERE type = 3 AND repo_id = (SELECT id FROM repositories WHERE name = $1)",
+      [@remote_repo]
+    )
+    out, status = Open3.capture2(@backend, "import", "dbname=gitgres_test", @remote_repo, source)
+    assert status.success?, "resumed import failed"
+    assert_match(/Imported 5 objects \(\d+ already stored\)/, out)
+    assert_equal expected, stored_oids
+
+    refs = @conn.exec_params(
+      "SELECT f.name, encode(f.oid, 'hex') AS oid, f.symbolic FROM refs f JOIN repositories r ON r.id = f.repo_id " \
+      "WHERE r.name = $1 ORDER BY f.name COLLATE \"C\"",
+      [@remote_repo]
+    ).to_a
+    showref = `git -C #{source} show-ref`.split("\n").map { |l| l.split(" ").reverse }
+    assert_equal({ "name" => "HEAD", "oid" => nil, "symbolic" => `git -C #{source} symbolic-ref HEAD`.strip }, refs.first)
+    assert_equal showref, refs.drop(1).map { |r| [r["name"], r["oid"]] }
+
+    FileUtils.rm_rf(source)
+  end
+
+  def test_import_writes_the_reflog
+    source = create_test_repo
+    File.write(File.join(source, "file.txt"), "content\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+    head = `git -C #{source} rev-parse HEAD`.strip
+    branch = `git -C #{source} symbolic-ref HEAD`.strip
+
+    assert system(@backend, "import", "dbname=gitgres_test", @remote_repo, source,
+      out: File::NULL, err: File::NULL), "import failed"
+
+    log = @conn.exec_params(
+      "SELECT encode(l.old_oid, 'hex') AS old, encode(l.new_oid, 'hex') AS new, l.committer, l.message " \
+      "FROM reflog l JOIN repositories r ON r.id = l.repo_id WHERE r.name = $1 AND l.ref_name = $2",
+      [@remote_repo, branch]
+    ).to_a
+    assert_equal 1, log.size
+    assert_nil log[0]["old"]
+    assert_equal head, log[0]["new"]
+    assert_equal "import", log[0]["message"]
+    assert_match(/Test User <test@test.com>/, log[0]["committer"])
+
+    FileUtils.rm_rf(source)
+  end
+end
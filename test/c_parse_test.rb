@@ -0,0 +1,156 @@
+require_relative "test_helper"
+
+# The extension's C parsers must return exactly what the plpgsql ones do
+class CParseTest < GitgresExtensionTest
+  COMMIT_COLUMNS = "encode(tree_oid, 'hex') AS tree, " \
+                   "array_to_string(ARRAY(SELECT encode(p, 'hex') FROM unnest(parent_oids) AS p), ' ') AS parents, " \
+                   "author_name, author_email, author_timestamp, author_tz, " \
+                   "committer_name, committer_email, committer_timestamp, committer_tz, message"
+
+  def parse_commit(function, content)
+    @conn.exec_params("SELECT #{COMMIT_COLUMNS} FROM #{function}($1::bytea)",
+      [{ value: content, format: 1 }]).to_a
+  end
+
+  def parse_tree(function, content)
+    @conn.exec_params("SELECT mode, name, encode(entry_oid, 'hex') AS oid FROM #{function}($1::bytea)",
+      [{ value: content, format: 1 }]).to_a
+  end
+
+  def assert_same_commit(content)
+    expected = parse_commit("git_commit_parse", content)
+    assert_equal expected, parse_commit("git_commit_parse_c", content)
+    expected[0]
+  end
+
+  # The error a statement raises, rolled back to a savepoint so the
+  # test's transaction carries on
+  def error_of
+    @conn.exec("SAVEPOINT parse")
+    yield
+    nil
+  rescue PG::Error => e
+    e.class
+  ensure
+    @conn.exec("ROLLBACK TO SAVEPOINT parse")
+  end
+
+  def entry(mode, name, oid_hex)
+    "#{mode} #{name}\0".b + [oid_hex].pack("H*")
+  end
+
+  def build_fixture
+    dir = create_test_repo
+    FileUtils.mkdir_p(File.join(dir, "src", "lib"))
+    File.write(File.join(dir, "README"), "readme\n")
+    File.write(File.join(dir, "src", "lib", "util.rb"), "module Util; end\n")
+    File.write(File.join(dir, "run.sh"), "#!/bin/sh\n")
+    File.chmod(0o755, File.join(dir, "run.sh"))
+    File.write(File.join(dir, "café.txt"), "unicode name\n")
+    File.symlink("README", File.join(dir, "link"))
+    system("git", "-C", dir, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", "first\n\nwith a body", out: File::NULL, err: File::NULL)
+    first = `git -C #{dir} rev-parse HEAD`.strip
+    system("git", "-C", dir, "update-index", "--add", "--cacheinfo", "160000,#{first},vendor",
+      out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "checkout", "-q", "-b", "side")
+    File.write(File.join(dir, "side.txt"), "side\n")
+    system("git", "-C", dir, "add", "side.txt", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", "side", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "checkout", "-q", "-")
+    File.write(File.join(dir, "README"), "changed\n")
+    system("git", "-C", dir, "commit", "-am", "main", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "merge", "-q", "--no-edit", "side", out: File::NULL, err: File::NULL)
+    dir
+  end
+
+  def test_fixture_commits_and_trees_parse_the_same
+    dir = build_fixture
+    import_repo_objects(dir)
+
+    objects = @conn.exec_params(
+      "SELECT type, content FROM objects WHERE repo_id = $1 AND type IN (1, 2)", [@repo_id], 1
+    ).map { |r| [r["type"].unpack1("s>"), r["content"]] }
+    commits, trees = objects.partition { |type, _| type == 1 }
+    assert_equal 4, commits.size
+    refute_empty trees
+
+    commits.each { |_, content| assert_same_commit(content) }
+    trees.each do |_, content|
+      assert_equal parse_tree("git_tree_entries", content), parse_tree("git_tree_entries_c", content)
+    end
+
+    FileUtils.rm_rf(dir)
+  end
+
+  def test_signed_commit_with_mergetag
+    tree = "4b825dc642cb6eb9a060e54bf8d69288fbee4904"
+    parent = "aa" * 20
+    content = "tree #{tree}\n" \
+              "parent #{parent}\n" \
+              "author A U Thor <author@example.com> 1700000000 +0100\n" \
+              "committer C O Mitter <committer@example.com> 1700000100 -0500\n" \
+              "mergetag object #{"bb" * 20}\n" \
+              " type commit\n" \
+              " tag v1.0\n" \
+              " tagger T Agger <tagger@example.com> 1700000000 +0000\n" \
+              " \n" \
+              " parent #{"cc" * 20}\n" \
+              " -----BEGIN PGP SIGNATURE-----\n" \
+              " -----END PGP SIGNATURE-----\n" \
+              "gpgsig -----BEGIN PGP SIGNATURE-----\n" \
+              " \n" \
+              " author Not Me <x@example.com> 1 +0000\n" \
+              " -----END PGP SIGNATURE-----\n" \
+              "\n" \
+              "signed merge\n"
+
+    row = assert_same_commit(content)
+    assert_equal tree, row["tree"]
+    assert_equal parent, row["parents"]
+    assert_equal "author@example.com", row["author_email"]
+    assert_equal "committer@example.com", row["committer_email"]
+    assert_equal "signed merge\n", row["message"]
+  end
+
+  def test_malformed_commit_headers
+    tree = "tree #{"ab" * 20}\n"
+    [
+      tree + "author A U Thor <a@example.com>\n\nno date\n",
+      tree + "author A U Thor <a@example.com> 1700000000 +01\n\nshort zone\n",
+      tree + "committer C <c@example.com> yesterday +0100\n\nno timestamp\n",
+      tree + "committer C <c@example.com>1700000000 +0100\n\nno space\n",
+      tree + "frobnicate whatever\nencoding UTF-8\n\nunknown header\n",
+      tree + "author A <a@example.com> 1700000000 +0100",
+      "parent #{"cd" * 20}\nparent #{"ef" * 20}\n\nno tree\n",
+      "\n"
+    ].each { |content| assert_same_commit(content) }
+
+    # Bad hex fails the same way in both
+    ["tree abc\n\n", "parent #{"zz" * 20}\n\n"].each do |content|
+      sql = error_of { parse_commit("git_commit_parse", content) }
+      c = error_of { parse_commit("git_commit_parse_c", content) }
+      assert_equal PG::InvalidParameterValue, sql, content
+      assert_equal sql, c, content
+    end
+  end
+
+  def test_tree_modes_are_kept_as_written
+    oid = "12" * 20
+    content = entry("40000", "dir", oid) + entry("040000", "old", oid) +
+              entry("100755", "run", oid) + entry("120000", "link", oid) +
+              entry("160000", "sub", oid)
+
+    rows = parse_tree("git_tree_entries_c", content)
+    assert_equal parse_tree("git_tree_entries", content), rows
+    assert_equal %w[40000 040000 100755 120000 160000], rows.map { |r| r["mode"] }
+  end
+
+  def test_malformed_trees_are_rejected_by_the_c_parser
+    good = entry("100644", "a", "34" * 20)
+    [good + "100644 b", good + "100644b\0", good[0...-1]].each do |content|
+      assert_equal PG::DataCorrupted, error_of { parse_tree("git_tree_entries_c", content) },
+        content.inspect
+    end
+  end
+end
@@ -0,0 +1,69 @@
+require_relative "test_helper"
+
+class CommitGraphTest < GitgresTest
+  def commit(dir, file, message)
+    File.write(File.join(dir, file), message)
+    system("git", "-C", dir, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", message, out: File::NULL, err: File::NULL)
+    `git -C #{dir} rev-parse HEAD`.strip
+  end
+
+  # main:    c1 - c2 - c3 - merge
+  #                 \         /
+  # feature:         f1 - f2 - f3
+  def build_history(dir)
+    c = {}
+    c[:c1] = commit(dir, "a.txt", "c1")
+    c[:c2] = commit(dir, "a.txt", "c2")
+    system("git", "-C", dir, "checkout", "-q", "-b", "feature")
+    c[:f1] = commit(dir, "f.txt", "f1")
+    c[:f2] = commit(dir, "f.txt", "f2")
+    system("git", "-C", dir, "checkout", "-q", "-")
+    c[:c3] = commit(dir, "a.txt", "c3")
+    system("git", "-C", dir, "merge", "-q", "--no-edit", "feature", out: File::NULL, err: File::NULL)
+    c[:merge] = `git -C #{dir} rev-parse HEAD`.strip
+    system("git", "-C", dir, "checkout", "-q", "feature")
+    c[:f3] = commit(dir, "f.txt", "f3")
+    c
+  end
+
+  def graph_value(sql, *oids)
+    params = [@repo_id] + oids
+    placeholders = oids.each_index.map { |i| "decode($#{i + 2}, 'hex')" }.join(", ")
+    @conn.exec_params(sql.sub("ARGS", "$1, #{placeholders}"), params)
+  end
+
+  def test_generations_and_ancestry_match_git
+    dir = create_test_repo
+    c = build_history(dir)
+    import_repo_objects(dir)
+
+    gens = @conn.exec_params(
+      "SELECT encode(commit_oid, 'hex') AS oid, generation FROM commit_graph WHERE repo_id = $1",
+      [@repo_id]
+    ).to_h { |r| [r["oid"], r["generation"].to_i] }
+    # Commits are imported children first, so all but c1 were settled
+    # once their ancestors arrived
+    assert_equal 7, gens.size
+    assert gens.values.all?(&:positive?), "unsettled commits left"
+    assert_equal 1, gens[c[:c1]]
+    assert_equal 4, gens[c[:f2]]
+    assert_equal 5, gens[c[:merge]]
+
+    [[:merge, :f3], [:c3, :f2], [:c1, :c1], [:f3, :c3]].each do |a, b|
+      expected = `git -C #{dir} merge-base #{c[a]} #{c[b]}`.strip
+      actual = graph_value("SELECT encode(git_merge_base(ARGS), 'hex') AS base", c[a], c[b])[0]["base"]
+      assert_equal expected, actual, "merge-base #{a} #{b}"
+
+      ahead, behind = `git -C #{dir} rev-list --left-right --count #{c[a]}...#{c[b]}`.split.map(&:to_i)
+      row = graph_value("SELECT ahead, behind FROM git_ahead_behind(ARGS)", c[a], c[b])[0]
+      assert_equal [ahead, behind], [row["ahead"].to_i, row["behind"].to_i], "ahead/behind #{a} #{b}"
+
+      ancestor = system("git", "-C", dir, "merge-base", "--is-ancestor", c[a], c[b])
+      assert_equal ancestor ? "t" : "f",
+        graph_value("SELECT git_is_ancestor(ARGS) AS v", c[a], c[b])[0]["v"], "is-ancestor #{a} #{b}"
+    end
+
+    FileUtils.rm_rf(dir)
+  end
+end
@@ -0,0 +1,74 @@
+require_relative "test_helper"
+
+class GitOidTest < GitgresExtensionTest
+  # 2000 blob rows with pseudo-random oids, md5 spread over 20 bytes
+  def insert_objects
+    @conn.exec_params(
+      "INSERT INTO objects (repo_id, oid, type, size, content) " \
+      "SELECT $1, decode(md5(i::text) || left(md5('x' || i), 8), 'hex'), 3, 0, '' " \
+      "FROM generate_series(1, 2000) AS i",
+      [@repo_id]
+    )
+    @conn.exec("ANALYZE objects")
+    @conn.exec("SET LOCAL enable_seqscan = off")
+    @conn.exec_params("SELECT encode(oid::bytea, 'hex') AS oid FROM objects WHERE repo_id = $1", [@repo_id])
+      .map { |r| r["oid"] }
+  end
+
+  def plan(sql, params)
+    @conn.exec_params("EXPLAIN #{sql}", params).map { |r| r["QUERY PLAN"] }.join("\n")
+  end
+
+  def test_binary_send_and_recv_round_trip
+    raw = (0..19).map { |i| (i * 13 + 0x80) % 256 }.pack("C*")
+    result = @conn.exec_params("SELECT $1::git_oid AS oid", [{ value: raw, format: 1 }], 1)
+    assert_equal raw, result[0]["oid"].b
+
+    hex = raw.unpack1("H*")
+    result = @conn.exec_params("SELECT $1::git_oid::text AS oid", [{ value: raw, format: 1 }])
+    assert_equal hex, result[0]["oid"]
+
+    assert_raises(PG::InvalidBinaryRepresentation) do
+      @conn.exec_params("SELECT $1::git_oid", [{ value: raw[0, 19], format: 1 }])
+    end
+  end
+
+  def test_bytea_comparison_uses_the_index
+    oids = insert_objects
+    target = oids[1234]
+
+    sql = "SELECT encode(oid::bytea, 'hex') AS oid FROM objects WHERE repo_id = $1 AND oid = decode($2, 'hex')"
+    assert_equal [target], @conn.exec_params(sql, [@repo_id, target]).map { |r| r["oid"] }
+    assert_match(/Index (Only )?Scan/, plan(sql, [@repo_id, target]))
+    refute_match(/Filter: .*oid/, plan(sql, [@repo_id, target]))
+
+    # bytea on the left finds the commutator
+    sql = "SELECT 1 FROM objects WHERE repo_id = $1 AND decode($2, 'hex') = oid"
+    assert_equal 1, @conn.exec_params(sql, [@repo_id, target]).ntuples
+    assert_match(/Index (Only )?Scan/, plan(sql, [@repo_id, target]))
+  end
+
+  def test_prefix_match_becomes_an_index_range
+    oids = insert_objects
+    prefix = oids[42][0, 3]
+
+    sql = "SELECT encode(oid::bytea, 'hex') AS oid FROM objects WHERE repo_id = $1 AND oid ^@ $2 ORDER BY oid"
+    assert_equal oids.select { |o| o.start_with?(prefix) }.sort,
+      @conn.exec_params(sql, [@repo_id, prefix]).map { |r| r["oid"] }
+
+    explained = plan(sql.sub("$2", "'#{prefix}'"), [@repo_id])
+    assert_match(/Index Cond: .*oid >= .*oid < /, explained)
+  end
+
+  def test_sort_is_bytewise
+    oids = @conn.exec(
+      "SELECT encode(x::bytea, 'hex') AS oid " \
+      "FROM (SELECT decode(md5(i::text) || left(md5('y' || i), 8), 'hex')::git_oid AS x " \
+      "      FROM generate_series(1, 5000) AS i) s " \
+      "ORDER BY x"
+    ).map { |r| r["oid"] }
+
+    assert_equal 5000, oids.size
+    assert_equal oids.sort, oids
+  end
+end
@@ -0,0 +1,43 @@
+require_relative "test_helper"
+
+class GrepTest < GitgresTest
+  def grep(rev, pattern, ignore_case = false)
+    @conn.exec_params(
+      "SELECT path, line_no, line FROM git_grep($1, $2, $3, $4)",
+      [@repo_id, rev, pattern, ignore_case]
+    ).map { |r| "#{r["path"]}:#{r["line_no"]}:#{r["line"]}" }
+  end
+
+  def test_grep_matches_git_grep
+    dir = create_test_repo
+    FileUtils.mkdir_p(File.join(dir, "lib"))
+    File.write(File.join(dir, "README"), "Hello world\nnothing here\n")
+    File.write(File.join(dir, "lib", "a.rb"), "def hello\n  puts 'hello world'\nend\n")
+    File.write(File.join(dir, "data.bin"), "hello world\0binary")
+    system("git", "-C", dir, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+    commit = `git -C #{dir} rev-parse HEAD`.strip
+    import_repo_objects(dir)
+    @conn.exec_params(
+      "INSERT INTO refs (repo_id, name, oid) VALUES ($1, 'refs/heads/main', decode($2, 'hex'))",
+      [@repo_id, commit]
+    )
+
+    ["hello world", "^def ", "wor.d$"].each do |pattern|
+      out, = Open3.capture2("git", "-C", dir, "grep", "-n", "-I", "-E", pattern, commit)
+      expected = out.split("\n").map { |l| l.delete_prefix("#{commit}:") }
+      assert_equal expected, grep(commit, pattern), pattern
+    end
+
+    assert_equal ["README:1:Hello world", "lib/a.rb:2:  puts 'hello world'"],
+      grep("main", "hello world", true)
+    assert_empty grep("main", "no such text")
+
+    blobs = @conn.exec_params("SELECT count(*) FROM blob_text WHERE repo_id = $1", [@repo_id])[0]["count"].to_i
+    assert_equal 2, blobs
+
+    assert_raises(PG::Error) { grep("refs/heads/missing", "hello") }
+
+    FileUtils.rm_rf(dir)
+  end
+end
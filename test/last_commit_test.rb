@@ -0,0 +1,58 @@
+require_relative "test_helper"
+
+class LastCommitTest < GitgresTest
+  def commit(dir, file, message)
+    path = File.join(dir, file)
+    FileUtils.mkdir_p(File.dirname(path))
+    File.write(path, message)
+    system("git", "-C", dir, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", message, out: File::NULL, err: File::NULL)
+    `git -C #{dir} rev-parse HEAD`.strip
+  end
+
+  def last_commits(commit, path)
+    @conn.exec_params(
+      "SELECT name, encode(commit_oid, 'hex') AS oid FROM git_last_commits($1, decode($2, 'hex'), $3)",
+      [@repo_id, commit, path]
+    ).to_h { |r| [r["name"], r["oid"]] }
+  end
+
+  def git_last_commit(dir, commit, path)
+    `git -C #{dir} log -1 --format=%H #{commit} -- #{path}`.strip
+  end
+
+  def test_last_commits_match_git_log
+    dir = create_test_repo
+    commit(dir, "a.txt", "a1")
+    commit(dir, "lib/x.rb", "x1")
+    commit(dir, "b.txt", "b1")
+    system("git", "-C", dir, "checkout", "-q", "-b", "feature")
+    commit(dir, "lib/y.rb", "y1")
+    system("git", "-C", dir, "checkout", "-q", "-")
+    commit(dir, "a.txt", "a2")
+    system("git", "-C", dir, "merge", "-q", "--no-edit", "feature", out: File::NULL, err: File::NULL)
+    commit(dir, "lib/x.rb", "x2")
+    head = `git -C #{dir} rev-parse HEAD`.strip
+    import_repo_objects(dir)
+
+    { "" => %w[a.txt b.txt lib], "lib" => %w[x.rb y.rb] }.each do |path, names|
+      expected = names.to_h do |n|
+        [n, git_last_commit(dir, head, path.empty? ? n : "#{path}/#{n}")]
+      end
+      assert_equal expected, last_commits(head, path), "tree #{path.inspect}"
+    end
+
+    cached = @conn.exec_params(
+      "SELECT count(*) FROM last_commit_cache WHERE repo_id = $1 AND commit_oid = decode($2, 'hex')",
+      [@repo_id, head]
+    )[0]["count"].to_i
+    assert_equal 5, cached
+    assert_equal({ "x.rb" => git_last_commit(dir, head, "lib/x.rb"),
+                   "y.rb" => git_last_commit(dir, head, "lib/y.rb") },
+      last_commits(head, "/lib/"))
+
+    assert_empty last_commits(head, "missing")
+
+    FileUtils.rm_rf(dir)
+  end
+end
@@ -68,4 +68,104 @@ class ObjectStoreTest < GitgresTest
     )
     assert_equal "1", result[0]["type"]
   end
+
+  def insert_raw_object(oid_hex, content)
+    @conn.exec_params(
+      "INSERT INTO objects (repo_id, oid, type, size, content) VALUES ($1, decode($2, 'hex'), 3, $3, $4::bytea)",
+      [@repo_id, oid_hex, content.bytesize, { value: content, format: 1 }]
+    )
+  end
+
+  def read_prefix(prefix_hex)
+    padded = prefix_hex.ljust(prefix_hex.length + prefix_hex.length % 2, "0")
+    @conn.exec_params(
+      "SELECT encode(oid, 'hex') AS oid FROM git_object_read_prefix($1, decode($2, 'hex'), $3) ORDER BY oid",
+      [@repo_id, padded, prefix_hex.length]
+    ).map { |r| r["oid"] }
+  end
+
+  def test_read_prefix_even_length
+    oid = write_object(3, "prefix lookup")
+    assert_equal [oid], read_prefix(oid[0, 8])
+  end
+
+  def test_read_prefix_odd_length
+    insert_raw_object("ab10" + "0" * 36, "a")
+    insert_raw_object("ab2f" + "0" * 36, "b")
+    insert_raw_object("ac00" + "0" * 36, "c")
+
+    assert_equal ["ab2f" + "0" * 36], read_prefix("ab2")
+    assert_equal ["ab10" + "0" * 36], read_prefix("ab1")
+    assert_equal [], read_prefix("ab3")
+  end
+
+  def test_read_prefix_ambiguous_returns_two_rows
+    insert_raw_object("cd01" + "0" * 36, "a")
+    insert_raw_object("cd02" + "0" * 36, "b")
+    insert_raw_object("cd03" + "0" * 36, "c")
+
+    assert_equal 2, read_prefix("cd0").length
+  end
+
+  def test_read_prefix_carries_past_ff
+    insert_raw_object("abff" + "f" * 36, "a")
+    insert_raw_object("ac00" + "0" * 36, "b")
+    insert_raw_object("ffff" + "f" * 36, "c")
+
+    assert_equal ["abff" + "f" * 36], read_prefix("abf")
+    assert_equal ["abff" + "f" * 36], read_prefix("abff")
+    assert_equal ["ffff" + "f" * 36], read_prefix("fff")
+  end
+
+  def insert_delta_object(content, base_oid_hex, delta, depth)
+    oid = git_hash_object(3, content)
+    @conn.exec_params(
+      "INSERT INTO objects (repo_id, oid, type, size, content, base_oid, depth) " \
+      "VALUES ($1, decode($2, 'hex'), 3, $3, $4::bytea, decode($5, 'hex'), $6)",
+      [@repo_id, oid, content.bytesize, { value: delta, format: 1 }, base_oid_hex, depth]
+    )
+    oid
+  end
+
+  def test_read_delta_chain
+    base_oid = write_object(3, "hello world")
+    # copy 11 bytes from offset 0, then insert ", again"
+    mid_oid = insert_delta_object("hello world, again", base_oid,
+      [11, 18, 0x90, 11, 7].pack("C*") + ", again", 1)
+    top_oid = insert_delta_object("hello world, again!", mid_oid,
+      [18, 19, 0x90, 18, 1].pack("C*") + "!", 2)
+
+    result = @conn.exec_params(
+      "SELECT type, size, content FROM git_object_read($1, decode($2, 'hex'))",
+      [@repo_id, top_oid]
+    )
+    assert_equal "3", result[0]["type"]
+    assert_equal "19", result[0]["size"]
+    assert_equal "hello world, again!", @conn.unescape_bytea(result[0]["content"])
+
+    assert_equal [mid_oid], read_prefix(mid_oid[0, 10])
+  end
+
+  def test_read_chunked_object
+    content = "0123456789" * 10
+    oid = git_hash_object(3, content)
+    @conn.exec_params(
+      "INSERT INTO objects (repo_id, oid, type, size, content, chunked) VALUES ($1, decode($2, 'hex'), 3, $3, '', true)",
+      [@repo_id, oid, content.bytesize]
+    )
+    # insert out of order to check reassembly follows chunk_no
+    [2, 0, 1].each do |n|
+      @conn.exec_params(
+        "INSERT INTO object_chunks (repo_id, oid, chunk_no, data) VALUES ($1, decode($2, 'hex'), $3, $4::bytea)",
+        [@repo_id, oid, n, { value: content[n * 40, 40], format: 1 }]
+      )
+    end
+
+    result = @conn.exec_params(
+      "SELECT size, content FROM git_object_read($1, decode($2, 'hex'))",
+      [@repo_id, oid]
+    )
+    assert_equal "100", result[0]["size"]
+    assert_equal content, @conn.unescape_bytea(result[0]["content"])
+  end
 end
@@ -0,0 +1,57 @@
+require_relative "test_helper"
+
+class ObjectTriggersTest < GitgresTest
+  def test_inserted_objects_are_parsed
+    dir = create_test_repo
+    FileUtils.mkdir_p(File.join(dir, "sub"))
+    File.write(File.join(dir, "a.txt"), "a")
+    File.write(File.join(dir, "sub", "b.txt"), "b")
+    system("git", "-C", dir, "add", ".", out: File::NULL, err: File::NULL)
+    env = { "GIT_AUTHOR_DATE" => "1234567890 +0000", "GIT_COMMITTER_DATE" => "1234567890 +0000" }
+    system(env, "git", "-C", dir, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+    import_repo_objects(dir)
+
+    commit_oid = `git -C #{dir} rev-parse HEAD`.strip
+    tree_oid = `git -C #{dir} rev-parse HEAD^{tree}`.strip
+
+    result = @conn.exec_params(
+      "SELECT sha, encode(tree_oid, 'hex') AS tree_oid, author_name, extract(epoch FROM authored_at)::bigint AS authored_at " \
+      "FROM commits WHERE repo_id = $1",
+      [@repo_id]
+    )
+    assert_equal 1, result.ntuples
+    assert_equal commit_oid, result[0]["sha"]
+    assert_equal tree_oid, result[0]["tree_oid"]
+    assert_equal "Test User", result[0]["author_name"]
+    assert_equal "1234567890", result[0]["authored_at"]
+
+    names = @conn.exec_params(
+      "SELECT name FROM tree_entries WHERE repo_id = $1 AND tree_oid = decode($2, 'hex') ORDER BY name",
+      [@repo_id, tree_oid]
+    ).map { |r| r["name"] }
+    assert_equal ["a.txt", "sub"], names
+
+    @conn.exec_params("DELETE FROM objects WHERE repo_id = $1 AND type IN (1, 2)", [@repo_id])
+    assert_equal 0, @conn.exec_params("SELECT count(*) FROM commits WHERE repo_id = $1", [@repo_id])[0]["count"].to_i
+    assert_equal 0, @conn.exec_params("SELECT count(*) FROM tree_entries WHERE repo_id = $1", [@repo_id])[0]["count"].to_i
+
+    FileUtils.rm_rf(dir)
+  end
+
+  def test_backfill_fills_missing_rows
+    dir = create_test_repo
+    File.write(File.join(dir, "a.txt"), "a")
+    system("git", "-C", dir, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+    import_repo_objects(dir)
+
+    @conn.exec_params("DELETE FROM commits WHERE repo_id = $1", [@repo_id])
+    @conn.exec_params("SELECT git_backfill_commits_and_trees($1)", [@repo_id])
+    @conn.exec_params("SELECT git_backfill_commits_and_trees($1)", [@repo_id])
+
+    assert_equal 1, @conn.exec_params("SELECT count(*) FROM commits WHERE repo_id = $1", [@repo_id])[0]["count"].to_i
+    assert_equal 1, @conn.exec_params("SELECT count(*) FROM tree_entries WHERE repo_id = $1", [@repo_id])[0]["count"].to_i
+
+    FileUtils.rm_rf(dir)
+  end
+end
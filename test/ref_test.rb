@@ -92,4 +92,30 @@ class RefTest < GitgresTest
     )
     assert_equal "0", result[0]["count"]
   end
+
+  def test_ref_events_record_changes_in_order
+    a = "aa" * 20
+    b = "bb" * 20
+    @conn.exec_params("SELECT git_ref_update($1, 'refs/heads/main', decode($2, 'hex'))", [@repo_id, a])
+    @conn.exec_params("SELECT git_ref_update($1, 'refs/heads/main', decode($2, 'hex'), decode($3, 'hex'))", [@repo_id, b, a])
+    @conn.exec_params("SELECT git_ref_set_symbolic($1, 'HEAD', 'refs/heads/main')", [@repo_id])
+    @conn.exec_params("SELECT git_ref_update($1, 'refs/heads/main', NULL, NULL, true)", [@repo_id])
+
+    events = @conn.exec_params(
+      "SELECT id, ref_name, encode(old_oid, 'hex') AS old, encode(new_oid, 'hex') AS new " \
+      "FROM git_ref_events($1)", [@repo_id]
+    ).to_a
+    assert_equal [[nil, a], [a, b], [b, nil]], events.map { |e| [e["old"], e["new"]] }
+    assert_equal ["refs/heads/main"], events.map { |e| e["ref_name"] }.uniq
+
+    # Catching up from an event returns only what came after it
+    later = @conn.exec_params("SELECT id FROM git_ref_events($1, $2)", [@repo_id, events[0]["id"]])
+    assert_equal events[1..].map { |e| e["id"] }, later.map { |e| e["id"] }
+
+    # Pruning drops events past the retention period
+    @conn.exec_params("UPDATE ref_events SET created_at = now() - interval '31 days' WHERE id = $1", [events[0]["id"]])
+    assert_equal "1", @conn.exec("SELECT git_ref_events_prune()")[0]["git_ref_events_prune"]
+    kept = @conn.exec_params("SELECT id FROM git_ref_events($1)", [@repo_id])
+    assert_equal events[1..].map { |e| e["id"] }, kept.map { |e| e["id"] }
+  end
 end
@@ -1,4 +1,5 @@
 require_relative "test_helper"
+require "json"
 
 class RemoteHelperTest < GitgresTest
   def setup
@@ -132,4 +133,275 @@ class RemoteHelperTest < GitgresTest
 
     FileUtils.rm_rf(source)
   end
+
+  def remote_refs
+    @conn.exec_params(
+      "SELECT f.name, encode(f.oid, 'hex') AS oid FROM refs f JOIN repositories r ON r.id = f.repo_id " \
+      "WHERE r.name = $1 AND f.oid IS NOT NULL ORDER BY f.name",
+      [@remote_repo]
+    ).map { |r| [r["name"], r["oid"]] }
+  end
+
+  def test_atomic_push_of_many_refs
+    source = create_test_repo
+    File.write(File.join(source, "a.txt"), "first\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+    200.times { |i| system("git", "-C", source, "tag", "t#{i}", out: File::NULL, err: File::NULL) }
+    branch = `git -C #{source} symbolic-ref --short HEAD`.strip
+
+    with_helper_on_path do
+      system("git", "-C", source, "remote", "add", "pg",
+        "gitgres::dbname=gitgres_test/#{@remote_repo}",
+        out: File::NULL, err: File::NULL)
+      result = system("git", "-C", source, "push", "--atomic", "pg", branch, "--tags",
+        out: File::NULL, err: File::NULL)
+      assert result, "atomic push failed"
+
+      showref = `git -C #{source} show-ref`.split("\n").map { |l| l.split(" ").reverse }
+      assert_equal showref.sort, remote_refs
+
+      logged = @conn.exec_params(
+        "SELECT count(*) FROM reflog l JOIN repositories r ON r.id = l.repo_id " \
+        "WHERE r.name = $1 AND l.committer = 'Test User <test@test.com>' AND l.old_oid IS NULL",
+        [@remote_repo]
+      )[0]["count"].to_i
+      assert_equal 201, logged
+
+      # A non-fast-forward branch update rejects the new tag with it
+      system("git", "-C", source, "commit", "--amend", "-m", "rewritten", out: File::NULL, err: File::NULL)
+      system("git", "-C", source, "tag", "extra", out: File::NULL, err: File::NULL)
+      before = remote_refs
+      result = system("git", "-C", source, "push", "--atomic", "pg", branch, "extra",
+        out: File::NULL, err: File::NULL)
+      refute result, "atomic push with a rejected ref succeeded"
+      assert_equal before, remote_refs
+
+      # Deleting refs goes through the same batch
+      result = system("git", "-C", source, "push", "pg", ":refs/tags/t0", ":refs/tags/t1",
+        out: File::NULL, err: File::NULL)
+      assert result, "delete push failed"
+      assert_equal before.reject { |name, _| %w[refs/tags/t0 refs/tags/t1].include?(name) }, remote_refs
+    end
+
+    FileUtils.rm_rf(source)
+  end
+
+  def test_push_naming_a_ref_twice_is_refused
+    source = create_test_repo
+    File.write(File.join(source, "a.txt"), "first\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+
+    # git itself won't send two updates of one ref, so speak the helper
+    # protocol directly
+    out, status = Open3.capture2(
+      { "GIT_DIR" => File.join(source, ".git") },
+      @helper, "pg", "gitgres::dbname=gitgres_test/#{@remote_repo}",
+      stdin_data: "push HEAD:refs/heads/dup\npush +HEAD:refs/heads/dup\n\n"
+    )
+    assert status.success?, "helper failed"
+    assert_equal ["error refs/heads/dup postgres refdb: refs/heads/dup appears twice in one batch"] * 2,
+      out.split("\n").reject(&:empty?)
+    assert_empty remote_refs
+
+    FileUtils.rm_rf(source)
+  end
+
+  def test_push_waits_for_concurrent_ref_update
+    source = create_test_repo
+    File.write(File.join(source, "a.txt"), "first\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+
+    with_helper_on_path do
+      system("git", "-C", source, "remote", "add", "pg",
+        "gitgres::dbname=gitgres_test/#{@remote_repo}",
+        out: File::NULL, err: File::NULL)
+      assert system("git", "-C", source, "push", "pg", "main",
+        out: File::NULL, err: File::NULL), "git push failed"
+      first = `git -C #{source} rev-parse HEAD`.strip
+      rid = @conn.exec_params("SELECT id FROM repositories WHERE name = $1",
+        [@remote_repo])[0]["id"].to_i
+
+      File.write(File.join(source, "a.txt"), "second\n")
+      system("git", "-C", source, "commit", "-am", "second", out: File::NULL, err: File::NULL)
+      system("git", "-C", source, "branch", "topic", out: File::NULL, err: File::NULL)
+
+      # Another writer moves main and creates topic, and holds its
+      # transaction open while the push runs
+      other = PG.connect(dbname: "gitgres_test")
+      other.exec("BEGIN")
+      other.exec_params("SELECT git_ref_update($1, 'refs/heads/main', decode($2, 'hex'), decode($3, 'hex'))",
+        [rid, "ab" * 20, first])
+      other.exec_params("SELECT git_ref_update($1, 'refs/heads/topic', decode($2, 'hex'))",
+        [rid, "cd" * 20])
+
+      push = Thread.new do
+        system("git", "-C", source, "push", "pg", "main", "topic",
+          out: File::NULL, err: File::NULL)
+      end
+
+      # The push's batch queues behind the open transaction
+      waiting = 50.times.any? do
+        sleep 0.1
+        @conn.exec("SELECT count(*) FROM pg_locks WHERE NOT granted")[0]["count"].to_i > 0
+      end
+      other.exec("COMMIT")
+      other.close
+
+      refute push.value, "push overwrote a concurrent ref update"
+      assert waiting, "push did not wait for the concurrent writer"
+      assert_equal [["refs/heads/main", "ab" * 20], ["refs/heads/topic", "cd" * 20]], remote_refs
+    end
+
+    FileUtils.rm_rf(source)
+  end
+
+  def test_push_stats_count_callbacks
+    source = create_test_repo
+    File.write(File.join(source, "a.txt"), "first\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "first", out: File::NULL, err: File::NULL)
+    3.times { |i| system("git", "-C", source, "tag", "v#{i}", out: File::NULL, err: File::NULL) }
+    stats_dir = Dir.mktmpdir("gitgres_stats")
+
+    push = lambda do |name, *refs|
+      path = File.join(stats_dir, name)
+      assert system({ "GITGRES_STATS" => path }, "git", "-C", source, "push", "pg", *refs,
+        out: File::NULL, err: File::NULL), "git push #{refs.join(" ")} failed"
+      File.readlines(path).map { |l| JSON.parse(l) }.to_h { |s| [s["op"], s] }
+    end
+
+    with_helper_on_path do
+      system("git", "-C", source, "remote", "add", "pg",
+        "gitgres::dbname=gitgres_test/#{@remote_repo}",
+        out: File::NULL, err: File::NULL)
+
+      # One line per callback that ran, all from the helper
+      stats = push.call("first", "main", "--tags")
+      assert stats.keys.all? { |op| op.match?(/\A(odb|refdb)\.[a-z_]+\z/) }, stats.keys.inspect
+      assert stats.values.all? { |s| s["program"] == "git-remote-gitgres" }
+      assert stats.values.all? { |s| s["calls"] >= 1 && s["p50_us"] <= s["max_us"] }
+      assert_equal 1, stats["refdb.update_refs"]["calls"]
+      assert_equal 4, stats["refdb.update_refs"]["rows"]
+      assert_equal 4, remote_refs.size
+
+      File.write(File.join(source, "a.txt"), "second\n")
+      system("git", "-C", source, "commit", "-am", "second", out: File::NULL, err: File::NULL)
+
+      stats = push.call("second", "main")
+      assert_equal 1, stats["refdb.update_refs"]["calls"]
+      assert_equal 1, stats["refdb.update_refs"]["rows"]
+    end
+
+    FileUtils.rm_rf(stats_dir)
+    FileUtils.rm_rf(source)
+  end
+
+  def test_large_blob_roundtrip_in_chunks
+    source = create_test_repo
+    content = Random.new(42).bytes(300_000)
+    File.binwrite(File.join(source, "big.bin"), content)
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "big", out: File::NULL, err: File::NULL)
+    blob_oid = `git -C #{source} rev-parse HEAD:big.bin`.strip
+
+    old_chunk = ENV["GITGRES_CHUNK_BYTES"]
+    ENV["GITGRES_CHUNK_BYTES"] = "65536"
+    with_helper_on_path do
+      system("git", "-C", source, "remote", "add", "pg",
+        "gitgres::dbname=gitgres_test/#{@remote_repo}",
+        out: File::NULL, err: File::NULL)
+      result = system("git", "-C", source, "push", "pg", "main",
+        out: File::NULL, err: File::NULL)
+      assert result, "git push failed"
+
+      chunks = @conn.exec_params(<<~SQL, [@remote_repo, blob_oid])
+        SELECT count(*) AS n FROM object_chunks k
+        JOIN repositories r ON r.id = k.repo_id
+        WHERE r.name = $1 AND k.oid = decode($2, 'hex')
+      SQL
+      assert_equal "5", chunks[0]["n"]
+
+      clone_dir = Dir.mktmpdir("gitgres_clone")
+      FileUtils.rm_rf(clone_dir)
+      result = system("git", "clone",
+        "gitgres::dbname=gitgres_test/#{@remote_repo}", clone_dir,
+        out: File::NULL, err: File::NULL)
+      assert result, "git clone failed"
+      assert_equal content, File.binread(File.join(clone_dir, "big.bin"))
+
+      FileUtils.rm_rf(clone_dir)
+    end
+
+    FileUtils.rm_rf(source)
+  ensure
+    ENV["GITGRES_CHUNK_BYTES"] = old_chunk
+  end
+
+  def test_blobless_clone_fetches_blobs_on_checkout
+    source = create_test_repo
+    File.write(File.join(source, "a.txt"), "first\n")
+    File.write(File.join(source, "b.txt"), "second\n")
+    system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", source, "commit", "-m", "init", out: File::NULL, err: File::NULL)
+
+    with_helper_on_path do
+      url = "gitgres::dbname=gitgres_test/#{@remote_repo}"
+      system("git", "-C", source, "remote", "add", "pg", url, out: File::NULL, err: File::NULL)
+      assert system("git", "-C", source, "push", "pg", "main",
+        out: File::NULL, err: File::NULL), "git push failed"
+
+      clone_dir = Dir.mktmpdir("gitgres_clone")
+      FileUtils.rm_rf(clone_dir)
+      assert system("git", "clone", "--filter=blob:none", "--no-checkout", url, clone_dir,
+        out: File::NULL, err: File::NULL), "git clone failed"
+
+      missing = `git -C #{clone_dir} rev-list --objects --missing=print HEAD`
+        .lines.select { |l| l.start_with?("?") }
+      assert_equal 2, missing.size
+      refute_empty Dir.glob("#{clone_dir}/.git/objects/pack/*.promisor")
+
+      # Checkout fetches the missing blobs from the remote in one batch
+      assert system("git", "-C", clone_dir, "checkout", "main",
+        out: File::NULL, err: File::NULL), "git checkout failed"
+      assert_equal "first\n", File.read(File.join(clone_dir, "a.txt"))
+      assert_equal "second\n", File.read(File.join(clone_dir, "b.txt"))
+
+      FileUtils.rm_rf(clone_dir)
+    end
+
+    FileUtils.rm_rf(source)
+  end
+
+  def test_shallow_clone
+    source = create_test_repo
+    3.times do |i|
+      File.write(File.join(source, "file.txt"), "version #{i}\n")
+      system("git", "-C", source, "add", ".", out: File::NULL, err: File::NULL)
+      system("git", "-C", source, "commit", "-m", "commit #{i}", out: File::NULL, err: File::NULL)
+    end
+
+    with_helper_on_path do
+      url = "gitgres::dbname=gitgres_test/#{@remote_repo}"
+      system("git", "-C", source, "remote", "add", "pg", url, out: File::NULL, err: File::NULL)
+      assert system("git", "-C", source, "push", "pg", "main",
+        out: File::NULL, err: File::NULL), "git push failed"
+
+      clone_dir = Dir.mktmpdir("gitgres_clone")
+      FileUtils.rm_rf(clone_dir)
+      assert system("git", "clone", "--depth", "2", url, clone_dir,
+        out: File::NULL, err: File::NULL), "git clone failed"
+
+      assert_equal "2", `git -C #{clone_dir} rev-list --count HEAD`.strip
+      assert_equal `git -C #{source} rev-parse HEAD~1`.strip,
+        File.read(File.join(clone_dir, ".git", "shallow")).strip
+      assert_equal "version 2\n", File.read(File.join(clone_dir, "file.txt"))
+
+      FileUtils.rm_rf(clone_dir)
+    end
+
+    FileUtils.rm_rf(source)
+  end
 end
@@ -28,6 +28,19 @@ class SchemaTest < GitgresTest
     end
   end
 
+  def test_objects_lookups_prune_to_one_partition
+    partitions = @conn.exec("SELECT count(*) FROM pg_inherits WHERE inhparent = 'objects'::regclass")[0]["count"].to_i
+    assert_equal 16, partitions
+
+    plan = @conn.exec_params(
+      "EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) " \
+      "SELECT * FROM git_object_find(ARRAY[$1::integer], decode('aa', 'hex'))",
+      [@repo_id]
+    ).map { |r| r["QUERY PLAN"] }
+    scanned = plan.grep(/objects_p\d+/).reject { |l| l.include?("never executed") }
+    assert_equal 1, scanned.size, plan.join("\n")
+  end
+
   def test_refs_check_constraint
     # Must have exactly one of oid or symbolic
     assert_raises(PG::CheckViolation) do
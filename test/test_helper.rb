@@ -42,4 +42,42 @@ class GitgresTest < Minitest::Test
     system("git", "-C", dir, "config", "user.name", "Test User")
     dir
   end
+
+  # Copy every object reachable in a local git repo into the objects table
+  def import_repo_objects(dir)
+    `git -C #{dir} rev-list --objects --all`.strip.split("\n").each do |line|
+      oid = line.split(" ")[0]
+      type_name = `git -C #{dir} cat-file -t #{oid}`.strip
+      type_num = { "commit" => 1, "tree" => 2, "blob" => 3, "tag" => 4 }[type_name]
+      content = `git -C #{dir} cat-file #{type_name} #{oid}`
+
+      @conn.exec_params(
+        "INSERT INTO objects (repo_id, oid, type, size, content) VALUES ($1, decode($2, 'hex'), $3, $4, $5) ON CONFLICT DO NOTHING",
+        [@repo_id, oid, type_num, content.bytesize, { value: content, format: 1 }]
+      )
+    end
+  end
+end
+
+# Tests of what only the extension provides run against a separate
+# gitgres_ext_test database that `make createdb` creates the extension
+# in, and skip when it isn't installed.
+class GitgresExtensionTest < GitgresTest
+  def setup
+    @conn = PG.connect(dbname: "gitgres_ext_test")
+    unless @conn.exec("SELECT 1 FROM pg_extension WHERE extname = 'gitgres'").ntuples > 0
+      @conn.close
+      @conn = nil
+      skip "gitgres extension not installed in gitgres_ext_test"
+    end
+    @conn.exec("BEGIN")
+    result = @conn.exec("INSERT INTO repositories (name) VALUES ('test_repo') RETURNING id")
+    @repo_id = result[0]["id"].to_i
+  rescue PG::ConnectionBad
+    skip "gitgres_ext_test database not available"
+  end
+
+  def teardown
+    super if @conn
+  end
 end
@@ -0,0 +1,72 @@
+require_relative "test_helper"
+
+class TreeDiffTest < GitgresTest
+  def commit_all(dir, message)
+    system("git", "-C", dir, "add", "-A", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", message, out: File::NULL, err: File::NULL)
+    `git -C #{dir} rev-parse HEAD^{tree}`.strip
+  end
+
+  def diff_trees(old_tree, new_tree, threshold = nil)
+    @conn.exec_params(
+      "SELECT status, path, old_path, similarity FROM git_diff_trees($1, decode($2, 'hex'), decode($3, 'hex'), $4)",
+      [@repo_id, old_tree, new_tree, threshold]
+    ).to_a
+  end
+
+  def test_diff_matches_git_diff_tree
+    dir = create_test_repo
+    FileUtils.mkdir_p(File.join(dir, "lib", "deep"))
+    FileUtils.mkdir_p(File.join(dir, "same"))
+    File.write(File.join(dir, "lib", "deep", "a.txt"), "a")
+    File.write(File.join(dir, "lib", "b.txt"), "b")
+    File.write(File.join(dir, "same", "c.txt"), "c")
+    File.write(File.join(dir, "gone.txt"), "gone")
+    File.write(File.join(dir, "script"), "echo hi\n")
+    old_tree = commit_all(dir, "first")
+
+    File.write(File.join(dir, "lib", "deep", "a.txt"), "changed")
+    File.chmod(0755, File.join(dir, "script"))
+    File.delete(File.join(dir, "gone.txt"))
+    File.write(File.join(dir, "lib.txt"), "new")
+    new_tree = commit_all(dir, "second")
+    import_repo_objects(dir)
+
+    expected = `git -C #{dir} diff-tree -r --no-renames --name-status #{old_tree} #{new_tree}`
+      .strip.split("\n").map { |l| l.split("\t") }
+    actual = diff_trees(old_tree, new_tree).map { |r| [r["status"], r["path"]] }
+    assert_equal expected, actual
+
+    assert_empty diff_trees(old_tree, old_tree)
+
+    added = diff_trees(nil, old_tree).map { |r| r["status"] }.uniq
+    assert_equal ["A"], added
+
+    FileUtils.rm_rf(dir)
+  end
+
+  def test_diff_detects_renames
+    dir = create_test_repo
+    body = (1..20).map { |i| "line #{i}\n" }.join
+    File.write(File.join(dir, "moved.txt"), "moved\n")
+    File.write(File.join(dir, "edited.txt"), body)
+    old_tree = commit_all(dir, "first")
+
+    FileUtils.mkdir_p(File.join(dir, "dir"))
+    File.rename(File.join(dir, "moved.txt"), File.join(dir, "dir", "moved.txt"))
+    File.delete(File.join(dir, "edited.txt"))
+    File.write(File.join(dir, "renamed.txt"), body + "line 21\n")
+    new_tree = commit_all(dir, "second")
+    import_repo_objects(dir)
+
+    rows = diff_trees(old_tree, new_tree, 50)
+    assert_equal [["R", "dir/moved.txt", "moved.txt", "100"],
+                  ["R", "renamed.txt", "edited.txt", "94"]],
+      rows.map { |r| [r["status"], r["path"], r["old_path"], r["similarity"]] }
+
+    plain = diff_trees(old_tree, new_tree).map { |r| r["status"] }.sort
+    assert_equal ["A", "A", "D", "D"], plain
+
+    FileUtils.rm_rf(dir)
+  end
+end
@@ -95,4 +95,34 @@ class TreeParseTest < GitgresTest
 
     FileUtils.rm_rf(dir)
   end
+
+  def tree_walk_paths(tree_oid, pathspec, max_depth)
+    @conn.exec_params(
+      "SELECT path FROM git_tree_walk($1, decode($2, 'hex'), $3, $4) ORDER BY path COLLATE \"C\"",
+      [@repo_id, tree_oid, pathspec, max_depth]
+    ).map { |r| r["path"] }
+  end
+
+  def test_tree_walk_pathspec_and_depth
+    dir = create_test_repo
+    FileUtils.mkdir_p(File.join(dir, "a", "b"))
+    File.write(File.join(dir, "a", "b", "c.txt"), "c")
+    File.write(File.join(dir, "a", "d.txt"), "d")
+    File.write(File.join(dir, "ab.txt"), "ab")
+    File.write(File.join(dir, "e.txt"), "e")
+    system("git", "-C", dir, "add", ".", out: File::NULL, err: File::NULL)
+    system("git", "-C", dir, "commit", "-m", "test", out: File::NULL, err: File::NULL)
+    import_repo_objects(dir)
+    tree_oid = `git -C #{dir} rev-parse HEAD^{tree}`.strip
+
+    assert_equal ["a/", "a/b/", "a/b/c.txt", "a/d.txt", "ab.txt", "e.txt"],
+      tree_walk_paths(tree_oid, "", nil)
+    assert_equal ["a/b/", "a/b/c.txt"], tree_walk_paths(tree_oid, "a/b", nil)
+    assert_equal ["a/b/", "a/b/c.txt"], tree_walk_paths(tree_oid, "a/b/", nil)
+    assert_equal ["a/d.txt"], tree_walk_paths(tree_oid, "a/d.txt", nil)
+    assert_equal ["a/", "ab.txt", "e.txt"], tree_walk_paths(tree_oid, "", 0)
+    assert_equal ["a/", "a/b/", "a/d.txt"], tree_walk_paths(tree_oid, "a", 1)
+
+    FileUtils.rm_rf(dir)
+  end
 end
@@ -0,0 +1,69 @@
+require_relative "test_helper"
+
+class VerifyTest < GitgresTest
+  def problems(repo_id = @repo_id)
+    @conn.exec_params(
+      "SELECT encode(oid, 'hex') AS oid, problem FROM git_verify_objects($1) ORDER BY problem",
+      [repo_id]
+    ).map { |r| [r["oid"], r["problem"]] }
+  end
+
+  def test_verify_reports_corrupt_objects
+    good = write_object(3, "fine\n")
+    flipped = write_object(3, "flipped\n")
+    resized = write_object(3, "resized\n")
+    chunked = "0123456789" * 10
+    chunked_oid = git_hash_object(3, chunked)
+    @conn.exec_params(
+      "INSERT INTO objects (repo_id, oid, type, size, content, chunked) VALUES ($1, decode($2, 'hex'), 3, $3, '', true)",
+      [@repo_id, chunked_oid, chunked.bytesize]
+    )
+    [0, 1, 2].each do |n|
+      @conn.exec_params(
+        "INSERT INTO object_chunks (repo_id, oid, chunk_no, data) VALUES ($1, decode($2, 'hex'), $3, $4::bytea)",
+        [@repo_id, chunked_oid, n, { value: chunked[n * 40, 40], format: 1 }]
+      )
+    end
+    assert_equal [], problems
+
+    @conn.exec_params(
+      "UPDATE objects SET content = 'fliPped\n'::bytea WHERE repo_id = $1 AND oid = decode($2, 'hex')",
+      [@repo_id, flipped]
+    )
+    @conn.exec_params(
+      "UPDATE objects SET size = 3 WHERE repo_id = $1 AND oid = decode($2, 'hex')",
+      [@repo_id, resized]
+    )
+    @conn.exec_params(
+      "DELETE FROM object_chunks WHERE repo_id = $1 AND oid = decode($2, 'hex') AND chunk_no = 1",
+      [@repo_id, chunked_oid]
+    )
+    # A delta whose base was lost can't be reassembled, and doesn't stop the scan
+    missing_base = "ab" * 20
+    delta_oid = "cd" * 20
+    @conn.exec_params(
+      "INSERT INTO objects (repo_id, oid, type, size, content, base_oid, depth) " \
+      "VALUES ($1, decode($2, 'hex'), 3, 5, '\\x0505'::bytea, decode($3, 'hex'), 1)",
+      [@repo_id, delta_oid, missing_base]
+    )
+
+    found = problems.to_h
+    assert_equal "hash mismatch", found[flipped]
+    assert_equal "size mismatch", found[resized]
+    assert_equal "size mismatch", found[chunked_oid]
+    assert_match(/missing delta base #{missing_base}/, found[delta_oid])
+    refute found.key?(good)
+    assert_equal 4, found.size
+
+    # NULL checks every repository
+    all = @conn.exec("SELECT count(*) FROM git_verify_objects() WHERE repo_id = #{@repo_id}")[0]["count"].to_i
+    assert_equal 4, all
+  end
+
+  def test_object_hashing_is_parallel_safe
+    %w[git_object_check git_object_hash git_type_name].each do |fn|
+      parallel = @conn.exec_params("SELECT proparallel FROM pg_proc WHERE proname = $1", [fn])[0]["proparallel"]
+      assert_equal "s", parallel, "#{fn} should be parallel safe"
+    end
+  end
+end